@@ -31,10 +31,67 @@
 #include <acpi/actbl.h>
 #include <linux/efi.h>
 
+// zero-copy buffers for devices of root linux
+#include <linux/dma-buf.h>
+#include <linux/dma-mapping.h>
+#include <linux/scatterlist.h>
+#include <linux/version.h>
+
+// huge mappings of zone RAM, 6.12 added huge pfn mappings
+#include <linux/huge_mm.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 12, 0) &&                          \
+    defined(CONFIG_ARCH_SUPPORTS_PMD_PFNMAP)
+#define HVISOR_HUGE_MAP
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 17, 0)
+#define HVISOR_PFN(pfn) (pfn)
+#else
+#include <linux/pfn_t.h>
+#define HVISOR_PFN(pfn) __pfn_to_pfn_t(pfn, PFN_DEV)
+#endif
+#endif
+
+// wake sources of the virtio irq
+#include <linux/eventfd.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+
 struct virtio_bridge *virtio_bridge;
 int virtio_irq = -1;
 static struct task_struct *task = NULL;
 
+// Virtio irqs not yet read from /dev/hvisor, and its readers
+static atomic64_t virtio_irqs = ATOMIC64_INIT(0);
+static DECLARE_WAIT_QUEUE_HEAD(virtio_irq_wq);
+// The file polled for irqs. While it is open, task gets no signal.
+static struct file *irq_file = NULL;
+
+// Eventfds of HVISOR_SET_EVENTFDS, guarded by efd_lock
+struct hvisor_eventfd {
+    struct eventfd_ctx *ctx;
+    __u32 zone_id;
+    __u64 mmio_start;
+    __u64 mmio_size;
+};
+static struct hvisor_eventfd *efds = NULL;
+static int efd_num = 0;
+static struct file *efd_file = NULL; // Registered them
+static __u32 efd_rear = 0; // Requests before it were signalled
+static DEFINE_SPINLOCK(efd_lock);
+
+// RAM regions of the zones started through this module, guarded by
+// zone_ram_lock. Only buffers in them may be exported as dma-bufs.
+struct hvisor_zone_ram {
+    struct list_head list;
+    __u32 zone_id;
+    __u32 num;
+    struct {
+        __u64 start;
+        __u64 size;
+    } regions[];
+};
+static LIST_HEAD(zone_rams);
+static DEFINE_MUTEX(zone_ram_lock);
+
 // initial virtio el2 shared region
 static int hvisor_init_virtio(void) {
     int err;
@@ -841,6 +898,67 @@ static int hvisor_config_check(u64 __user *arg) {
     kfree(config);
     return err;
 }
+
+/// Forget the RAM regions of a zone that was shut down.
+static void hvisor_del_zone_ram(__u32 zone_id) {
+    struct hvisor_zone_ram *ram, *tmp;
+
+    mutex_lock(&zone_ram_lock);
+    list_for_each_entry_safe(ram, tmp, &zone_rams, list) {
+        if (ram->zone_id == zone_id) {
+            list_del(&ram->list);
+            kfree(ram);
+        }
+    }
+    mutex_unlock(&zone_ram_lock);
+}
+
+/// Note the RAM regions of a zone that was just started.
+static void hvisor_add_zone_ram(zone_config_t *config) {
+    struct hvisor_zone_ram *ram;
+    __u32 n = min_t(__u32, config->num_memory_regions,
+                    CONFIG_MAX_MEMORY_REGIONS);
+
+    ram = kzalloc(struct_size(ram, regions, n), GFP_KERNEL);
+    if (!ram) {
+        pr_err("hvisor: no memory to note the RAM of zone %u\n",
+               config->zone_id);
+        return;
+    }
+    ram->zone_id = config->zone_id;
+    for (__u32 i = 0; i < n; i++) {
+        if (config->memory_regions[i].type != MEM_TYPE_RAM)
+            continue;
+        ram->regions[ram->num].start = config->memory_regions[i].physical_start;
+        ram->regions[ram->num].size = config->memory_regions[i].size;
+        ram->num++;
+    }
+    hvisor_del_zone_ram(ram->zone_id);
+    mutex_lock(&zone_ram_lock);
+    list_add(&ram->list, &zone_rams);
+    mutex_unlock(&zone_ram_lock);
+}
+
+/// Whether [pa, pa + size) lies in a single RAM region of the zone, or of
+/// any started zone.
+static bool hvisor_in_zone_ram(__u32 zone_id, bool any_zone, phys_addr_t pa,
+                               size_t size) {
+    struct hvisor_zone_ram *ram;
+    bool found = false;
+
+    mutex_lock(&zone_ram_lock);
+    list_for_each_entry(ram, &zone_rams, list) {
+        if (!any_zone && ram->zone_id != zone_id)
+            continue;
+        for (__u32 i = 0; i < ram->num && !found; i++)
+            found = pa >= ram->regions[i].start &&
+                    pa + size >= pa &&
+                    pa + size <= ram->regions[i].start + ram->regions[i].size;
+    }
+    mutex_unlock(&zone_ram_lock);
+    return found;
+}
+
 static int hvisor_zone_start(zone_config_t __user *arg) {
     int err = 0;
     zone_config_t *zone_config = kmalloc(sizeof(zone_config_t), GFP_KERNEL);
@@ -862,6 +980,8 @@ static int hvisor_zone_start(zone_config_t __user *arg) {
 
     err = hvisor_call(HVISOR_HC_START_ZONE, __pa(zone_config),
                       sizeof(zone_config_t));
+    if (err == 0)
+        hvisor_add_zone_ram(zone_config);
     kfree(zone_config);
     return err;
 }
@@ -939,6 +1059,283 @@ static int hvisor_shm_signal(shm_args_t __user *arg) {
     return ret;
 }
 
+// A dma-buf over a physically contiguous buffer in a zone's RAM, so that a
+// device of root linux, such as the display, uses it without copies
+struct hvisor_dmabuf {
+    phys_addr_t pa;
+    size_t size;
+};
+
+static struct sg_table *hvisor_dmabuf_map(struct dma_buf_attachment *attach,
+                                          enum dma_data_direction dir) {
+    struct hvisor_dmabuf *buf = attach->dmabuf->priv;
+    struct sg_table *sgt;
+    dma_addr_t addr;
+    int err;
+
+    sgt = kzalloc(sizeof(*sgt), GFP_KERNEL);
+    if (!sgt)
+        return ERR_PTR(-ENOMEM);
+    err = sg_alloc_table(sgt, 1, GFP_KERNEL);
+    if (err) {
+        kfree(sgt);
+        return ERR_PTR(err);
+    }
+    // Zone RAM is reserved memory without struct pages, map it as a resource
+    addr = dma_map_resource(attach->dev, buf->pa, buf->size, dir,
+                            DMA_ATTR_SKIP_CPU_SYNC);
+    if (dma_mapping_error(attach->dev, addr)) {
+        sg_free_table(sgt);
+        kfree(sgt);
+        return ERR_PTR(-ENOMEM);
+    }
+    sg_dma_address(sgt->sgl) = addr;
+    sg_dma_len(sgt->sgl) = buf->size;
+    return sgt;
+}
+
+static void hvisor_dmabuf_unmap(struct dma_buf_attachment *attach,
+                                struct sg_table *sgt,
+                                enum dma_data_direction dir) {
+    dma_unmap_resource(attach->dev, sg_dma_address(sgt->sgl),
+                       sg_dma_len(sgt->sgl), dir, DMA_ATTR_SKIP_CPU_SYNC);
+    sg_free_table(sgt);
+    kfree(sgt);
+}
+
+static int hvisor_dmabuf_mmap(struct dma_buf *dmabuf,
+                              struct vm_area_struct *vma) {
+    struct hvisor_dmabuf *buf = dmabuf->priv;
+    size_t size = vma->vm_end - vma->vm_start;
+
+    if ((vma->vm_pgoff << PAGE_SHIFT) + size > buf->size)
+        return -EINVAL;
+    return remap_pfn_range(vma, vma->vm_start,
+                           (buf->pa >> PAGE_SHIFT) + vma->vm_pgoff, size,
+                           vma->vm_page_prot);
+}
+
+static void hvisor_dmabuf_release(struct dma_buf *dmabuf) {
+    kfree(dmabuf->priv);
+}
+
+static const struct dma_buf_ops hvisor_dmabuf_ops = {
+    .map_dma_buf = hvisor_dmabuf_map,
+    .unmap_dma_buf = hvisor_dmabuf_unmap,
+    .mmap = hvisor_dmabuf_mmap,
+    .release = hvisor_dmabuf_release,
+};
+
+static int hvisor_export_dmabuf(dmabuf_export_args_t __user *arg) {
+    DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
+    dmabuf_export_args_t args;
+    struct hvisor_dmabuf *buf;
+    struct dma_buf *dmabuf;
+    int fd;
+
+    if (copy_from_user(&args, arg, sizeof(dmabuf_export_args_t))) {
+        pr_err("hvisor: failed to copy from user\n");
+        return -EFAULT;
+    }
+    if (!args.size || !PAGE_ALIGNED(args.pa) || !PAGE_ALIGNED(args.size))
+        return -EINVAL;
+    if (!hvisor_in_zone_ram(args.zone_id, false, args.pa, args.size)) {
+        pr_err("hvisor: dma-buf at %#llx is not in the RAM of zone %u\n",
+               args.pa, args.zone_id);
+        return -EINVAL;
+    }
+#ifndef LOONGARCH64
+    if (!is_reserved_memory(args.pa, args.size)) {
+        pr_err("hvisor: dma-buf at %#llx is not in reserved memory\n",
+               args.pa);
+        return -EINVAL;
+    }
+#endif
+
+    buf = kzalloc(sizeof(*buf), GFP_KERNEL);
+    if (!buf)
+        return -ENOMEM;
+    buf->pa = args.pa;
+    buf->size = args.size;
+
+    exp_info.ops = &hvisor_dmabuf_ops;
+    exp_info.size = args.size;
+    exp_info.flags = O_RDWR;
+    exp_info.priv = buf;
+    dmabuf = dma_buf_export(&exp_info);
+    if (IS_ERR(dmabuf)) {
+        kfree(buf);
+        return PTR_ERR(dmabuf);
+    }
+    fd = dma_buf_fd(dmabuf, O_CLOEXEC);
+    if (fd < 0)
+        dma_buf_put(dmabuf); // Frees buf
+    return fd;
+}
+
+static void hvisor_put_eventfds(struct hvisor_eventfd *old, int num) {
+    int i;
+    for (i = 0; i < num; i++)
+        eventfd_ctx_put(old[i].ctx);
+    kfree(old);
+}
+
+// Replace the eventfds woken by the virtio irq
+static int hvisor_set_eventfds(struct file *file, eventfd_args_t __user *arg) {
+    struct hvisor_eventfd *new = NULL, *old;
+    struct hvisor_eventfd_filter *filter;
+    eventfd_args_t *args;
+    unsigned long flags;
+    int i, old_num, err = 0;
+
+    args = kmalloc(sizeof(*args), GFP_KERNEL);
+    if (!args)
+        return -ENOMEM;
+    if (copy_from_user(args, arg, sizeof(*args))) {
+        pr_err("hvisor: failed to copy from user\n");
+        err = -EFAULT;
+        goto out;
+    }
+    if (args->num > HVISOR_MAX_EVENTFDS) {
+        err = -EINVAL;
+        goto out;
+    }
+    if (args->num) {
+        new = kcalloc(args->num, sizeof(*new), GFP_KERNEL);
+        if (!new) {
+            err = -ENOMEM;
+            goto out;
+        }
+    }
+    for (i = 0; i < args->num; i++) {
+        filter = &args->filters[i];
+        new[i].ctx = eventfd_ctx_fdget(filter->fd);
+        if (IS_ERR(new[i].ctx)) {
+            err = PTR_ERR(new[i].ctx);
+            hvisor_put_eventfds(new, i);
+            goto out;
+        }
+        new[i].zone_id = filter->zone_id;
+        new[i].mmio_start = filter->mmio_start;
+        new[i].mmio_size = filter->mmio_size;
+    }
+
+    spin_lock_irqsave(&efd_lock, flags);
+    old = efds;
+    old_num = efd_num;
+    efds = new;
+    efd_num = args->num;
+    efd_file = args->num ? file : NULL;
+    efd_rear = virtio_bridge ? READ_ONCE(virtio_bridge->req_front) : 0;
+    spin_unlock_irqrestore(&efd_lock, flags);
+    hvisor_put_eventfds(old, old_num);
+    pr_info("hvisor: %u eventfds for the virtio irq\n", args->num);
+out:
+    kfree(args);
+    return err;
+}
+
+static bool hvisor_eventfd_match(struct hvisor_eventfd *efd,
+                                 volatile struct device_req *req) {
+    if (efd->zone_id != HVISOR_ANY_ZONE && efd->zone_id != req->src_zone)
+        return false;
+    return !efd->mmio_size || (req->address >= efd->mmio_start &&
+                               req->address - efd->mmio_start < efd->mmio_size);
+}
+
+// Signal the eventfds of the requests queued since the last irq. Requests
+// still waiting for their consumer were signalled already. Returns false if
+// a request matches none of them.
+static bool hvisor_signal_eventfds(void) {
+    unsigned long pending = 0;
+    bool matched = true, found;
+    __u32 front, rear;
+    int i;
+
+    spin_lock(&efd_lock);
+    if (!efd_num || !virtio_bridge) {
+        spin_unlock(&efd_lock);
+        return false;
+    }
+    front = READ_ONCE(virtio_bridge->req_front);
+    rear = READ_ONCE(virtio_bridge->req_rear);
+    smp_rmb();
+    // Skip the requests of the last irq, unless the consumer is past them
+    if (((efd_rear - front) & (MAX_REQ - 1)) <=
+        ((rear - front) & (MAX_REQ - 1)))
+        front = efd_rear;
+    efd_rear = rear;
+    for (; front != rear; front = (front + 1) & (MAX_REQ - 1)) {
+        found = false;
+        for (i = 0; i < efd_num; i++) {
+            if (hvisor_eventfd_match(&efds[i],
+                                     &virtio_bridge->req_list[front])) {
+                pending |= 1UL << i;
+                found = true;
+            }
+        }
+        matched &= found;
+    }
+    for_each_set_bit(i, &pending, HVISOR_MAX_EVENTFDS) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+        eventfd_signal(efds[i].ctx);
+#else
+        eventfd_signal(efds[i].ctx, 1);
+#endif
+    }
+    spin_unlock(&efd_lock);
+    return matched && pending;
+}
+
+static ssize_t hvisor_read(struct file *file, char __user *buf, size_t count,
+                           loff_t *ppos) {
+    __u64 irqs;
+    int err;
+
+    if (count < sizeof(irqs))
+        return -EINVAL;
+    WRITE_ONCE(irq_file, file);
+    for (;;) {
+        irqs = atomic64_xchg(&virtio_irqs, 0);
+        if (irqs)
+            break;
+        if (file->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        err = wait_event_interruptible(virtio_irq_wq,
+                                       atomic64_read(&virtio_irqs));
+        if (err)
+            return err;
+    }
+    if (copy_to_user(buf, &irqs, sizeof(irqs)))
+        return -EFAULT;
+    return sizeof(irqs);
+}
+
+static __poll_t hvisor_poll(struct file *file, poll_table *wait) {
+    WRITE_ONCE(irq_file, file);
+    poll_wait(file, &virtio_irq_wq, wait);
+    return atomic64_read(&virtio_irqs) ? EPOLLIN | EPOLLRDNORM : 0;
+}
+
+static int hvisor_release(struct inode *inode, struct file *file) {
+    struct hvisor_eventfd *old = NULL;
+    unsigned long flags;
+    int num = 0;
+
+    cmpxchg(&irq_file, file, NULL);
+    spin_lock_irqsave(&efd_lock, flags);
+    if (efd_file == file) {
+        old = efds;
+        num = efd_num;
+        efds = NULL;
+        efd_num = 0;
+        efd_file = NULL;
+    }
+    spin_unlock_irqrestore(&efd_lock, flags);
+    hvisor_put_eventfds(old, num);
+    return 0;
+}
+
 static long hvisor_ioctl(struct file *file, unsigned int ioctl,
                          unsigned long arg) {
     int err = 0;
@@ -947,11 +1344,16 @@ static long hvisor_ioctl(struct file *file, unsigned int ioctl,
         err = hvisor_init_virtio();
         task = get_current(); // get hvisor user process
         break;
+    case HVISOR_SET_EVENTFDS:
+        err = hvisor_set_eventfds(file, (eventfd_args_t __user *)arg);
+        break;
     case HVISOR_ZONE_START:
         err = hvisor_zone_start((zone_config_t __user *)arg);
         break;
     case HVISOR_ZONE_SHUTDOWN:
         err = hvisor_call(HVISOR_HC_SHUTDOWN_ZONE, arg, 0);
+        if (err == 0)
+            hvisor_del_zone_ram(arg);
         break;
     case HVISOR_ZONE_LIST:
         err = hvisor_zone_list((zone_list_args_t __user *)arg);
@@ -962,6 +1364,9 @@ static long hvisor_ioctl(struct file *file, unsigned int ioctl,
     case HVISOR_CONFIG_CHECK:
         err = hvisor_config_check((u64 __user *)arg);
         break;
+    case HVISOR_EXPORT_DMABUF:
+        err = hvisor_export_dmabuf((dmabuf_export_args_t __user *)arg);
+        break;
 #ifdef LOONGARCH64
     case HVISOR_ZONE_M_ALLOC:
         err = hvisor_m_alloc((kmalloc_info_t __user *)arg);
@@ -1012,9 +1417,53 @@ static long hvisor_ioctl(struct file *file, unsigned int ioctl,
     return err;
 }
 
+#ifdef HVISOR_HUGE_MAP
+// Map the zone RAM around a fault with an entry of 2^order pages, if the
+// virtual and physical addresses are both aligned to its size and the entry
+// lies in the RAM of a started zone.
+static vm_fault_t hvisor_huge_fault(struct vm_fault *vmf, unsigned int order) {
+    struct vm_area_struct *vma = vmf->vma;
+    unsigned long size = PAGE_SIZE << order;
+    unsigned long addr = vmf->address & ~(size - 1);
+    bool write = vmf->flags & FAULT_FLAG_WRITE;
+    unsigned long pfn;
+
+    if (addr < vma->vm_start || addr + size > vma->vm_end)
+        return VM_FAULT_FALLBACK;
+    // vm_pgoff is the physical page number
+    pfn = vma->vm_pgoff + ((addr - vma->vm_start) >> PAGE_SHIFT);
+    if (pfn & ((1UL << order) - 1))
+        return VM_FAULT_FALLBACK;
+    if (order && !hvisor_in_zone_ram(0, true, PFN_PHYS(pfn), size))
+        return VM_FAULT_FALLBACK;
+    switch (order) {
+    case 0:
+        return vmf_insert_pfn(vma, addr, pfn);
+    case PMD_ORDER:
+        return vmf_insert_pfn_pmd(vmf, HVISOR_PFN(pfn), write);
+#ifdef CONFIG_ARCH_SUPPORTS_PUD_PFNMAP
+    case PUD_ORDER:
+        return vmf_insert_pfn_pud(vmf, HVISOR_PFN(pfn), write);
+#endif
+    default:
+        return VM_FAULT_FALLBACK;
+    }
+}
+
+static vm_fault_t hvisor_fault(struct vm_fault *vmf) {
+    return hvisor_huge_fault(vmf, 0);
+}
+
+static const struct vm_operations_struct hvisor_vm_ops = {
+    .fault = hvisor_fault,
+    .huge_fault = hvisor_huge_fault,
+};
+#endif
+
 // Kernel mmap handler
 static int hvisor_map(struct file *filp, struct vm_area_struct *vma) {
     unsigned long phys;
+    bool uncached = false;
     int err;
     if (vma->vm_pgoff == 0) {
         // virtio_bridge must be aligned to one page.
@@ -1044,6 +1493,7 @@ static int hvisor_map(struct file *filp, struct vm_area_struct *vma) {
         // HyperAMP shared memory region (0xDE000000 - 0xDE402000, ~4MB)
         if (phys_addr >= 0xDE000000UL && phys_addr < 0xDE500000UL) {
             vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+            uncached = true;
             pr_info("HyperAMP shared memory mapped at PA %#lx with uncached protection (size: %#lx)\n", 
                     phys_addr, size);
             pr_info("  vm_page_prot pgprot value: %#lx (should have non-cacheable bits set)\n",
@@ -1052,9 +1502,20 @@ static int hvisor_map(struct file *filp, struct vm_area_struct *vma) {
         // HyperAMP MMIO control region: 0x6e410000
         else if (phys_addr == 0x6e410000UL) {
             vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+            uncached = true;
             pr_info("HyperAMP MMIO control region mapped at PA %#lx with uncached protection\n", phys_addr);
         }
-        
+
+#ifdef HVISOR_HUGE_MAP
+        // Zone RAM is mapped on faults, with PMD and PUD entries where the
+        // alignment allows. Private mappings need remap_pfn_range for COW.
+        if (!uncached && (vma->vm_flags & VM_SHARED)) {
+            vm_flags_set(vma, VM_IO | VM_PFNMAP | VM_DONTEXPAND |
+                                  VM_DONTDUMP | VM_HUGEPAGE);
+            vma->vm_ops = &hvisor_vm_ops;
+            return 0;
+        }
+#endif
         err = remap_pfn_range(vma, vma->vm_start, vma->vm_pgoff, size,
                               vma->vm_page_prot);
         if (err)
@@ -1069,6 +1530,13 @@ static const struct file_operations hvisor_fops = {
     .unlocked_ioctl = hvisor_ioctl,
     .compat_ioctl = hvisor_ioctl,
     .mmap = hvisor_map,
+#ifdef HVISOR_HUGE_MAP
+    // Places mappings so that huge entries fit
+    .get_unmapped_area = thp_get_unmapped_area,
+#endif
+    .read = hvisor_read,
+    .poll = hvisor_poll,
+    .release = hvisor_release,
 };
 
 static struct miscdevice hvisor_misc_dev = {
@@ -1084,6 +1552,14 @@ static irqreturn_t virtio_irq_handler(int irq, void *dev_id) {
         return IRQ_NONE;
     }
 
+    // Requests of registered eventfds wake just their workers
+    if (hvisor_signal_eventfds())
+        return IRQ_HANDLED;
+    atomic64_inc(&virtio_irqs);
+    wake_up_interruptible(&virtio_irq_wq);
+    if (READ_ONCE(irq_file))
+        return IRQ_HANDLED;
+
     memset(&info, 0, sizeof(struct siginfo));
     info.si_signo = SIGHVI;
     info.si_code = SI_QUEUE;
@@ -1181,6 +1657,13 @@ err_out:
 static void __exit hvisor_exit(void) {
     if (virtio_irq != -1)
         free_irq(virtio_irq, &hvisor_misc_dev);
+    hvisor_put_eventfds(efds, efd_num);
+    while (!list_empty(&zone_rams)) {
+        struct hvisor_zone_ram *ram =
+            list_first_entry(&zone_rams, struct hvisor_zone_ram, list);
+        list_del(&ram->list);
+        kfree(ram);
+    }
     if (virtio_bridge != NULL) {
         ClearPageReserved(virt_to_page(virtio_bridge));
         free_pages((unsigned long)virtio_bridge, 0);
@@ -1193,6 +1676,11 @@ module_init(hvisor_init);
 module_exit(hvisor_exit);
 
 MODULE_LICENSE("GPL");
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+MODULE_IMPORT_NS("DMA_BUF");
+#else
+MODULE_IMPORT_NS(DMA_BUF);
+#endif
 MODULE_AUTHOR("KouweiLee <15035660024@163.com>");
 MODULE_DESCRIPTION("The hvisor device driver");
 MODULE_VERSION("1:0.0");
\ No newline at end of file
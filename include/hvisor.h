@@ -19,6 +19,34 @@ struct kmalloc_info {
 };
 typedef struct kmalloc_info kmalloc_info_t;
 
+// for HVISOR_EXPORT_DMABUF, which returns the dma-buf fd
+struct dmabuf_export_args {
+    __u32 zone_id; // The zone whose RAM holds the buffer
+    __u32 padding;
+    __u64 pa; // Physical address of the buffer
+    __u64 size;
+};
+typedef struct dmabuf_export_args dmabuf_export_args_t;
+
+// for HVISOR_SET_EVENTFDS
+#define HVISOR_MAX_EVENTFDS 16
+#define HVISOR_ANY_ZONE 0xffffffff
+// An eventfd signalled when the virtio irq finds a request of zone_id in the
+// MMIO window. A size of 0 matches any address.
+struct hvisor_eventfd_filter {
+    __s32 fd;
+    __u32 zone_id; // HVISOR_ANY_ZONE for any zone
+    __u64 mmio_start;
+    __u64 mmio_size;
+};
+// Replaces the registered eventfds, a num of 0 removes them all
+struct eventfd_args {
+    __u32 num;
+    __u32 padding;
+    struct hvisor_eventfd_filter filters[HVISOR_MAX_EVENTFDS];
+};
+typedef struct eventfd_args eventfd_args_t;
+
 
 #define SIGHVI 10
 // receive request from el2
@@ -79,6 +107,8 @@ typedef struct ioctl_zone_list_args zone_list_args_t;
 #define HVISOR_ZONE_M_ALLOC _IOW(1, 7, kmalloc_info_t *)
 #define HVISOR_ZONE_M_FREE _IOW(1, 8, kmalloc_info_t *)
 #define HVISOR_SHM_SIGNAL _IOW(1, 10, shm_args_t *)
+#define HVISOR_EXPORT_DMABUF _IOW(1, 11, dmabuf_export_args_t *)
+#define HVISOR_SET_EVENTFDS _IOW(1, 12, eventfd_args_t *)
 
 
 // Hypercall definitions
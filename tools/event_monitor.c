@@ -16,7 +16,7 @@
 #include "event_monitor.h"
 #include "log.h"
 
-static int epoll_fd;
+static int epoll_fd = -1;
 static int events_num;
 pthread_t emonitor_tid;
 int closing;
@@ -76,6 +76,17 @@ struct hvisor_event *add_event(int fd, int epoll_type,
     }
 }
 
+int set_event_active(struct hvisor_event *hevent, bool active) {
+    struct epoll_event eevent;
+    eevent.events = active ? hevent->epoll_type : 0;
+    eevent.data.ptr = hevent;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, hevent->fd, &eevent) < 0) {
+        log_error("epoll_ctl failed, errno is %d", errno);
+        return -1;
+    }
+    return 0;
+}
+
 // Create a thread monitoring events.
 int initialize_event_monitor() {
     epoll_fd = epoll_create1(0);
@@ -10,6 +10,7 @@
  */
 #ifndef HVISOR_EVENT_H
 #define HVISOR_EVENT_H
+#include <stdbool.h>
 #include <sys/epoll.h>
 
 struct hvisor_event {
@@ -23,4 +24,6 @@ int initialize_event_monitor(void);
 void destroy_event_monitor();
 struct hvisor_event *add_event(int fd, int epoll_type,
                                void (*handler)(int, int, void *), void *param);
+// Stop watching the fd of hevent, or watch it again.
+int set_event_active(struct hvisor_event *hevent, bool active);
 #endif // HVISOR_EVENT_H
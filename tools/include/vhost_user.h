@@ -0,0 +1,140 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/**
+ * Copyright (c) 2025 Syswonder
+ *
+ * Syswonder Website:
+ *      https://www.syswonder.org
+ */
+#ifndef _HVISOR_VHOST_USER_H
+#define _HVISOR_VHOST_USER_H
+#include "event_monitor.h"
+#include "virtio.h"
+#include <linux/vhost_types.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/un.h>
+
+/*********************************************************************
+    The vhost-user protocol, as far as the daemon uses it
+ */
+enum vhost_user_request {
+    VHOST_USER_GET_FEATURES = 1,
+    VHOST_USER_SET_FEATURES = 2,
+    VHOST_USER_SET_OWNER = 3,
+    VHOST_USER_RESET_OWNER = 4,
+    VHOST_USER_SET_MEM_TABLE = 5,
+    VHOST_USER_SET_VRING_NUM = 8,
+    VHOST_USER_SET_VRING_ADDR = 9,
+    VHOST_USER_SET_VRING_BASE = 10,
+    VHOST_USER_GET_VRING_BASE = 11,
+    VHOST_USER_SET_VRING_KICK = 12,
+    VHOST_USER_SET_VRING_CALL = 13,
+    VHOST_USER_SET_VRING_ERR = 14,
+    VHOST_USER_GET_PROTOCOL_FEATURES = 15,
+    VHOST_USER_SET_PROTOCOL_FEATURES = 16,
+    VHOST_USER_GET_QUEUE_NUM = 17,
+    VHOST_USER_SET_VRING_ENABLE = 18,
+    VHOST_USER_GET_CONFIG = 24,
+    VHOST_USER_SET_CONFIG = 25,
+};
+
+#define VHOST_USER_VERSION 0x1
+#define VHOST_USER_VERSION_MASK 0x3
+#define VHOST_USER_REPLY_MASK (1 << 2)
+#define VHOST_USER_NEED_REPLY_MASK (1 << 3)
+// The message of SET_VRING_KICK and SET_VRING_CALL carries no fd
+#define VHOST_USER_VRING_NOFD_MASK (1 << 8)
+#define VHOST_USER_VRING_IDX_MASK 0xff
+
+// A virtio feature bit that is never offered to the driver
+#define VHOST_USER_F_PROTOCOL_FEATURES 30
+#define VHOST_USER_PROTOCOL_F_MQ 0
+#define VHOST_USER_PROTOCOL_F_REPLY_ACK 3
+#define VHOST_USER_PROTOCOL_F_CONFIG 9
+
+#define VHOST_USER_MAX_MEM_REGIONS 8
+#define VHOST_USER_CONFIG_SIZE 256
+
+typedef struct vhost_user_mem_region {
+    uint64_t guest_phys_addr;
+    uint64_t memory_size;
+    uint64_t userspace_addr; // Address in the frontend
+    uint64_t mmap_offset;    // Offset of the region in its fd
+} VhostUserMemRegion;
+
+typedef struct vhost_user_memory {
+    uint32_t nregions;
+    uint32_t padding;
+    VhostUserMemRegion regions[VHOST_USER_MAX_MEM_REGIONS];
+} VhostUserMemory;
+
+typedef struct vhost_user_config {
+    uint32_t offset;
+    uint32_t size;
+    uint32_t flags;
+    uint8_t region[VHOST_USER_CONFIG_SIZE];
+} VhostUserConfig;
+
+typedef struct vhost_user_msg {
+    uint32_t request;
+    uint32_t flags;
+    uint32_t size; // Of the payload
+    union {
+        uint64_t u64;
+        struct vhost_vring_state state;
+        struct vhost_vring_addr addr;
+        VhostUserMemory memory;
+        VhostUserConfig config;
+    } payload;
+} __attribute__((packed)) VhostUserMsg;
+
+#define VHOST_USER_HDR_SIZE offsetof(VhostUserMsg, payload)
+
+/*********************************************************************
+    The frontend device
+ */
+#define VHOST_USER_MAX_QUEUES 16
+#define VHOST_USER_DEFAULT_QUEUE_SIZE 256
+#define VHOST_USER_MAX_QUEUE_SIZE 1024
+// Features of the transport, those of the device are bits 0 to 23
+#define VHOST_USER_TRANSPORT_FEATURES                                          \
+    ((1ULL << VIRTIO_RING_F_INDIRECT_DESC) |                                   \
+     (1ULL << VIRTIO_RING_F_EVENT_IDX) | (1ULL << VIRTIO_F_VERSION_1))
+#define VHOST_USER_PROTOCOL_FEATURES                                           \
+    ((1ULL << VHOST_USER_PROTOCOL_F_MQ) |                                      \
+     (1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK) |                               \
+     (1ULL << VHOST_USER_PROTOCOL_F_CONFIG))
+
+// Settings of a vhost-user device specified by json
+typedef struct vhost_user_requested_state {
+    char socket[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    VirtioDeviceType device; // The device the backend implements
+    int queues;              // 0 for the default of the device
+    int queue_size;
+    // Config space for backends that don't provide it
+    uint8_t config[VHOST_USER_CONFIG_SIZE];
+    int config_len;
+} VhostUserRequestedState;
+
+typedef struct vhost_user_dev {
+    uint8_t config[VHOST_USER_CONFIG_SIZE];
+    char socket[sizeof(((VhostUserRequestedState *)0)->socket)];
+    int sock_fd;
+    uint64_t features;          // Features of the backend
+    uint64_t protocol_features; // Negotiated protocol features
+    uint32_t config_len;
+    int kick_fd[VHOST_USER_MAX_QUEUES]; // Written by the daemon on QUEUE_NOTIFY
+    int call_fd[VHOST_USER_MAX_QUEUES]; // Written by the backend
+    struct hvisor_event *call_event[VHOST_USER_MAX_QUEUES];
+    bool vring_started[VHOST_USER_MAX_QUEUES];
+    bool started;
+    // Statistics
+    uint64_t kicks, calls;
+} VhostUserDev;
+
+VhostUserDev *init_vhost_user_dev();
+int vhost_user_init(VirtIODevice *vdev, VhostUserRequestedState *req);
+int vhost_user_kick(VirtIODevice *vdev, VirtQueue *vq);
+void vhost_user_close(VirtIODevice *vdev);
+#endif /* _HVISOR_VHOST_USER_H */
@@ -47,7 +47,14 @@ typedef enum {
     VirtioTNet,
     VirtioTBlock,
     VirtioTConsole,
-    VirtioTGPU = 16
+    VirtioTBalloon = 5,
+    VirtioTGPU = 16,
+    VirtioTVsock = 19,
+    VirtioTCrypto = 20,
+    VirtioTFS = 26,
+    VirtioTPmem = 27,
+    // Not a device ID: a device served by a vhost-user backend
+    VirtioTVhostUser = 0x100
 } VirtioDeviceType;
 
 // Convert VirtioDeviceType to const char *
@@ -101,6 +108,8 @@ struct VirtQueue {
                                // the frontend driver of the backend processing
                                // progress Enabling this feature will change the
                                // flags field of the avail_ring
+    uint8_t polled; // A poller consumes the avail ring, notifications stay
+                    // suppressed
     pthread_mutex_t used_ring_lock; // Used ring lock
 };
 
@@ -125,9 +134,29 @@ struct VirtIODevice {
               // is ConsoleDev Pointer to the specific device's special config
     void (*virtio_close)(
         VirtIODevice *vdev); // Function called when closing the virtio device
-    bool activated;          // Whether the current virtio device is activated
+    // Optional. Called with true when the driver sets DRIVER_OK and with false
+    // when an activated device is reset, for backends that need the final
+    // queue layout, e.g. to hand the virtqueues over to the kernel.
+    void (*virtio_activate)(VirtIODevice *vdev, bool activate);
+    // Optional. Log the device's statistics, called on SIGUSR2.
+    void (*virtio_stats)(VirtIODevice *vdev);
+    // Optional. Handle a driver write of size bytes at offset of the config
+    // space, for devices with driver-writable config fields.
+    void (*virtio_config_write)(VirtIODevice *vdev, uint64_t offset,
+                                uint64_t value, int size);
+    // Optional. Polls the virtqueues instead of waiting for notifications.
+    struct virtio_poller *poller;
+    bool activated; // Whether the current virtio device is activated
 };
 
+// A RAM region of a zone mapped into the daemon
+typedef struct zone_mem_region {
+    uint64_t zonex_ipa; // Guest physical address in the zone
+    uint64_t size;
+    void *virt_addr;    // Address in this process
+    uint64_t zone0_ipa; // Offset of the region in /dev/hvisor
+} ZoneMemRegion;
+
 // used event idx for driver telling device when to notify driver.
 #define VQ_USED_EVENT(vq) ((vq)->avail_ring->ring[(vq)->num])
 // avail event idx for device telling driver when to notify device.
@@ -179,6 +208,18 @@ bool desc_is_writable(volatile VirtqDesc *desc_table, uint16_t idx);
 
 void *get_virt_addr(void *zonex_ipa, int zone_id);
 
+// Map size bytes of zone0_ipa as RAM of the zone at zonex_ipa, for the guest
+// buffers in it. Return the address in this process, NULL on failure.
+void *map_zone_mem(int zone_id, uint64_t zone0_ipa, uint64_t zonex_ipa,
+                   uint64_t size);
+
+/// Fill regions with the RAM regions of the zone, return the number of them
+int get_zone_mem_regions(int zone_id, ZoneMemRegion *regions, int max);
+
+/// Export size bytes of zone RAM at zonex_ipa as a dma-buf, for devices of
+/// Root Linux to use them without copies. Return the fd, -1 on failure.
+int export_zone_dmabuf(int zone_id, uint64_t zonex_ipa, uint64_t size);
+
 void virtqueue_set_avail(VirtQueue *vq);
 
 void virtqueue_set_used(VirtQueue *vq);
@@ -201,12 +242,18 @@ bool in_range(uint64_t value, uint64_t lower, uint64_t len);
 
 void virtio_inject_irq(VirtQueue *vq); // unused
 
+// Tell the driver the config space changed.
+void virtio_inject_config_irq(VirtIODevice *vdev);
+
 void virtio_finish_cfg_req(uint32_t target_cpu, uint64_t value);
 
 int virtio_handle_req(volatile struct device_req *req);
 
 void virtio_close();
 
+// Log the statistics of all devices that keep any
+void virtio_dump_stats(void);
+
 void handle_virtio_requests();
 
 void initialize_log();
@@ -0,0 +1,97 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/**
+ * Copyright (c) 2025 Syswonder
+ *
+ * Syswonder Website:
+ *      https://www.syswonder.org
+ */
+#ifndef _HVISOR_VIRTIO_BALLOON_H
+#define _HVISOR_VIRTIO_BALLOON_H
+#include "virtio.h"
+#include <linux/virtio_balloon.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/un.h>
+#include <time.h>
+
+#define BALLOON_SUPPORTED_FEATURES                                             \
+    ((1ULL << VIRTIO_F_VERSION_1) | (1ULL << VIRTIO_BALLOON_F_STATS_VQ) |      \
+     (1ULL << VIRTIO_BALLOON_F_DEFLATE_ON_OOM) |                              \
+     (1ULL << VIRTIO_BALLOON_F_FREE_PAGE_HINT) |                              \
+     (1ULL << VIRTIO_BALLOON_F_REPORTING))
+// Queues exist in this order, but those of features the driver didn't accept
+// are skipped, so the index of a queue depends on the negotiated features.
+#define BALLOON_MAX_QUEUES 5
+#define VIRTQUEUE_BALLOON_MAX_SIZE 128
+#define BALLOON_PAGE_SIZE (1ULL << VIRTIO_BALLOON_PFN_SHIFT)
+#define BALLOON_MAX_REGIONS 16
+#define BALLOON_DEFAULT_STATS_PERIOD 10
+#define BALLOON_MAX_CLIENTS 4
+#define BALLOON_CMD_LEN 64
+
+typedef enum {
+    BALLOON_QUEUE_INFLATE,
+    BALLOON_QUEUE_DEFLATE,
+    BALLOON_QUEUE_STATS,
+    BALLOON_QUEUE_FREE_PAGE,
+    BALLOON_QUEUE_REPORTING,
+    BALLOON_QUEUE_NONE,
+} BalloonQueue;
+
+typedef struct virtio_balloon_config BalloonConfig;
+
+// Settings of the balloon device specified by json
+typedef struct virtio_balloon_requested_state {
+    uint64_t target_mb; // Memory to take from the zone at start
+    int stats_period;   // Seconds between guest stats updates, 0 for none
+    // Control socket taking "target <MiB>", "hint" and "stats" commands
+    char socket[sizeof(((struct sockaddr_un *)0)->sun_path)];
+} BalloonRequestedState;
+
+// A RAM region of the zone and whether its pages can be given back to Root
+// Linux. Zone RAM mapped from reserved physical memory can't.
+typedef struct balloon_region {
+    ZoneMemRegion mem;
+    enum {
+        BALLOON_DISCARD_UNKNOWN,
+        BALLOON_DISCARD_REMOVE,   // MADV_REMOVE, punching a hole in shmem
+        BALLOON_DISCARD_DONTNEED, // MADV_DONTNEED, for anonymous memory
+        BALLOON_DISCARD_NONE,
+    } discard;
+} BalloonRegion;
+
+typedef struct virtio_balloon_dev {
+    BalloonConfig config;
+    pthread_mutex_t lock; // Protects config and everything below
+    BalloonRegion regions[BALLOON_MAX_REGIONS];
+    int nregions;
+    size_t host_page_size;
+    // The stats buffer the guest gave, returned to ask for fresh stats
+    bool stats_held;
+    uint16_t stats_idx;
+    uint64_t stats[VIRTIO_BALLOON_S_NR];
+    bool stats_valid[VIRTIO_BALLOON_S_NR];
+    struct timespec stats_time;
+    int stats_period;
+    struct timespec stats_request_time;
+    // Free page hinting in progress
+    uint32_t hint_cmd_id;
+    bool hint_running;
+    // Control socket, served by the io thread
+    char socket[sizeof(((BalloonRequestedState *)0)->socket)];
+    int listen_fd;
+    int clients[BALLOON_MAX_CLIENTS];
+    char client_buf[BALLOON_MAX_CLIENTS][BALLOON_CMD_LEN];
+    int client_len[BALLOON_MAX_CLIENTS];
+    pthread_t io_thread;
+    int wake_fd;
+    bool closing;
+    // Statistics, in bytes
+    uint64_t inflated, deflated, hinted, reported, discarded;
+} BalloonDev;
+
+BalloonDev *init_balloon_dev();
+int virtio_balloon_init(VirtIODevice *vdev, BalloonRequestedState *req);
+int virtio_balloon_notify_handler(VirtIODevice *vdev, VirtQueue *vq);
+void virtio_balloon_close(VirtIODevice *vdev);
+#endif /* _HVISOR_VIRTIO_BALLOON_H */
@@ -1,37 +1,135 @@
 // SPDX-License-Identifier: GPL-2.0-only
 /**
- * Copyright (c) 2025 Syswonder
- *
- * Syswonder Website:
- *      https://www.syswonder.org
- *
- * Authors:
- *      Guowei Li <2401213322@stu.pku.edu.cn>
- */
+ * Copyright (c) 2025 Syswonder
+ *
+ * Syswonder Website:
+ *      https://www.syswonder.org
+ *
+ * Authors:
+ *      Guowei Li <2401213322@stu.pku.edu.cn>
+ */
 #ifndef _HVISOR_VIRTIO_CONSOLE_H
 #define _HVISOR_VIRTIO_CONSOLE_H
 #include "event_monitor.h"
 #include "virtio.h"
 #include <linux/virtio_console.h>
+#include <pthread.h>
+#include <sys/un.h>
 
 #define CONSOLE_SUPPORTED_FEATURES                                             \
-    ((1ULL << VIRTIO_F_VERSION_1) | (1ULL << VIRTIO_CONSOLE_F_SIZE))
-#define CONSOLE_MAX_QUEUES 2
+    ((1ULL << VIRTIO_F_VERSION_1) | (1ULL << VIRTIO_CONSOLE_F_SIZE) |         \
+     (1ULL << VIRTIO_CONSOLE_F_MULTIPORT))
+// Port 0 is the console, the others are named ports
+#define CONSOLE_MAX_PORTS 8
+// Port 0 rx/tx, control rx/tx, then one rx/tx pair for each named port
+#define CONSOLE_MAX_QUEUES (2 * (CONSOLE_MAX_PORTS + 1))
 #define VIRTQUEUE_CONSOLE_MAX_SIZE 64
 #define CONSOLE_QUEUE_RX 0
 #define CONSOLE_QUEUE_TX 1
+#define CONSOLE_QUEUE_CTRL_RX 2
+#define CONSOLE_QUEUE_CTRL_TX 3
+#define CONSOLE_PORT_NAME_LEN 64
+// Control messages waiting for the driver's control rx buffers
+#define CONSOLE_CTRL_PENDING 64
+
+// Bytes of guest output kept for the host side, must be a power of 2
+#define CONSOLE_RING_SIZE (64 * 1024)
+// Maximum number of socket clients attached to a console
+#define CONSOLE_MAX_CLIENTS 8
+// Size of the buffers moving bytes between the ring, fds and the guest
+#define CONSOLE_IO_CHUNK 4096
+#define CONSOLE_DEFAULT_LOG_SIZE (1024 * 1024)
+#define CONSOLE_DEFAULT_LOG_FILES 3
 
 typedef struct virtio_console_config ConsoleConfig;
+
+// A named port is backed by either a Unix socket or a pair of FIFOs
+typedef struct console_port_requested_state {
+    char name[CONSOLE_PORT_NAME_LEN];
+    char socket[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    char fifo[240]; // fifo.in is read by the guest, fifo.out is written
+} ConsolePortRequestedState;
+
+// Settings of the console device specified by json
+typedef struct virtio_console_requested_state {
+    char socket[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    char log[256];     // Log file of the guest output, empty for none
+    uint64_t log_size; // The log is rotated when it reaches this size
+    int log_files;     // Number of rotated logs kept, log.1 is the newest
+    int nports;        // Number of named ports
+    ConsolePortRequestedState ports[CONSOLE_MAX_PORTS - 1];
+} ConsoleRequestedState;
+
+// A host side consumer of guest output: the pty, a socket client or the log.
+typedef struct console_sink {
+    int fd;       // -1 if unused
+    uint64_t pos; // Ring position of the next byte to write
+    bool blocked; // The fd is full, wait for POLLOUT
+} ConsoleSink;
+
+// Guest output goes into the ring once and every sink writes it from there
+// at its own pace. On the console a sink more than CONSOLE_RING_SIZE behind
+// loses the oldest bytes instead of stalling the guest. Named ports are
+// lossless: guest output stays in the tx queue until the ring has room.
+typedef struct console_port {
+    uint32_t id;
+    char name[CONSOLE_PORT_NAME_LEN];
+    bool lossless;
+    pthread_mutex_t lock; // Protects ring and head
+    uint8_t ring[CONSOLE_RING_SIZE];
+    uint64_t head; // Number of bytes ever written to the ring
+    // Console port
+    int master_fd;
+    int slave_fd; // Kept open so the master doesn't hang up
+    ConsoleSink pty;
+    ConsoleSink log;
+    char log_path[256];
+    uint64_t log_size, log_written;
+    int log_files;
+    // Socket backend
+    int listen_fd;
+    int max_clients;
+    ConsoleSink clients[CONSOLE_MAX_CLIENTS];
+    // FIFO backend
+    int fifo_in_fd;
+    ConsoleSink fifo_out;
+    // Port state
+    bool rx_ready;   // The driver added rx buffers since the last reset
+    bool ready;      // The driver sent PORT_READY
+    bool guest_open; // A guest process has the port open
+    bool host_open;  // The host side is connected, as last told the driver
+    pthread_mutex_t tx_lock;
+    bool tx_stalled; // The tx queue waits for room in the ring
+    size_t tx_need;  // Length of the chain waiting
+    uint64_t tx_bytes, rx_bytes, lost_bytes;
+} ConsolePort;
+
+typedef struct console_ctrl_msg {
+    struct virtio_console_control hdr;
+    char name[CONSOLE_PORT_NAME_LEN]; // Only for VIRTIO_CONSOLE_PORT_NAME
+} ConsoleCtrlMsg;
+
 typedef struct virtio_console_dev {
     ConsoleConfig config;
-    int master_fd;
-    int rx_ready;
-    struct hvisor_event *event;
+    bool multiport;
+    int nports;
+    ConsolePort *ports[CONSOLE_MAX_PORTS];
+    // Control messages for the driver, sent as control rx buffers come
+    pthread_mutex_t ctrl_lock;
+    bool ctrl_ready; // The driver sent DEVICE_READY
+    ConsoleCtrlMsg ctrl_pending[CONSOLE_CTRL_PENDING];
+    int ctrl_head, ctrl_count;
+    // The io thread serves all host fds of the console
+    pthread_t io_thread;
+    int wake_fd; // eventfd waking up the io thread
+    bool closing;
 } ConsoleDev;
 
 ConsoleDev *init_console_dev();
-int virtio_console_init(VirtIODevice *vdev);
+int virtio_console_init(VirtIODevice *vdev, ConsoleRequestedState *req);
 int virtio_console_rxq_notify_handler(VirtIODevice *vdev, VirtQueue *vq);
 int virtio_console_txq_notify_handler(VirtIODevice *vdev, VirtQueue *vq);
+int virtio_console_ctrl_rxq_notify_handler(VirtIODevice *vdev, VirtQueue *vq);
+int virtio_console_ctrl_txq_notify_handler(VirtIODevice *vdev, VirtQueue *vq);
 void virtio_console_close(VirtIODevice *vdev);
-#endif
\ No newline at end of file
+#endif
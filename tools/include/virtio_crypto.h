@@ -0,0 +1,83 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/**
+ * Copyright (c) 2025 Syswonder
+ *
+ * Syswonder Website:
+ *      https://www.syswonder.org
+ */
+#ifndef _HVISOR_VIRTIO_CRYPTO_H
+#define _HVISOR_VIRTIO_CRYPTO_H
+#include "virtio.h"
+#include <linux/virtio_crypto.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/queue.h>
+
+#define CRYPTO_SUPPORTED_FEATURES (1ULL << VIRTIO_F_VERSION_1)
+#define CRYPTO_MAX_DATAQUEUES 8
+// The data queues, then the control queue
+#define CRYPTO_MAX_QUEUES (CRYPTO_MAX_DATAQUEUES + 1)
+#define VIRTQUEUE_CRYPTO_MAX_SIZE 256
+#define CRYPTO_MAX_THREADS 16
+#define CRYPTO_MAX_SESSIONS 1024
+#define CRYPTO_MAX_CIPHER_KEY_LEN 64 // AES-256-XTS
+#define CRYPTO_MAX_AUTH_KEY_LEN 512
+#define CRYPTO_MAX_IV_LEN 16
+#define CRYPTO_MAX_HASH_LEN 64
+// Largest request. Ciphers and hashes are passed to the kernel in chunks,
+// an AEAD request has to fit in the socket buffer at once.
+#define CRYPTO_MAX_SIZE (4U << 20)
+#define CRYPTO_CHUNK_SIZE (64U << 10)
+#define CRYPTO_AEAD_MAX_SIZE (64U << 10)
+
+typedef struct virtio_crypto_config CryptoConfig;
+
+// Settings of the crypto device specified by json
+typedef struct virtio_crypto_requested_state {
+    int queues;  // Data queues
+    int threads; // Worker threads
+} CryptoRequestedState;
+
+// A session is a transform socket of the kernel crypto API (AF_ALG), keyed
+// when it is created, and an operation socket accepted from it
+typedef struct crypto_session {
+    uint32_t service; // VIRTIO_CRYPTO_SERVICE_*
+    uint32_t algo;
+    uint32_t digest_len; // Of hashes and MACs, the tag length of AEADs
+    int refs;            // The session table and requests using the session
+    int tfm_fd;
+    int op_fd;
+    pthread_mutex_t lock; // The operation socket does one request at a time
+} CryptoSession;
+
+// A data request waiting for a worker thread
+struct crypto_req {
+    TAILQ_ENTRY(crypto_req) link;
+    VirtQueue *vq;
+    struct iovec *iov;
+    uint16_t *flags;
+    int iovcnt;
+    uint16_t idx;
+};
+
+typedef struct virtio_crypto_dev {
+    CryptoConfig config;
+    pthread_mutex_t session_lock;
+    CryptoSession *sessions[CRYPTO_MAX_SESSIONS];
+    // Worker threads
+    pthread_t threads[CRYPTO_MAX_THREADS];
+    int nthreads;
+    pthread_mutex_t mtx;
+    pthread_cond_t cond;
+    TAILQ_HEAD(, crypto_req) procq;
+    int close;
+    // Statistics
+    uint64_t sessions_created, requests, bytes, errors;
+} CryptoDev;
+
+CryptoDev *init_crypto_dev();
+int virtio_crypto_init(VirtIODevice *vdev, CryptoRequestedState *req);
+int virtio_crypto_ctrlq_notify_handler(VirtIODevice *vdev, VirtQueue *vq);
+int virtio_crypto_dataq_notify_handler(VirtIODevice *vdev, VirtQueue *vq);
+void virtio_crypto_close(VirtIODevice *vdev);
+#endif /* _HVISOR_VIRTIO_CRYPTO_H */
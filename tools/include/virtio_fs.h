@@ -0,0 +1,110 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/**
+ * Copyright (c) 2025 Syswonder
+ *
+ * Syswonder Website:
+ *      https://www.syswonder.org
+ */
+#ifndef _HVISOR_VIRTIO_FS_H
+#define _HVISOR_VIRTIO_FS_H
+#include "virtio.h"
+#include <dirent.h>
+#include <linux/fuse.h>
+#include <linux/limits.h>
+#include <linux/virtio_fs.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+
+#define FS_SUPPORTED_FEATURES (1ULL << VIRTIO_F_VERSION_1)
+#define FS_MAX_REQUEST_QUEUES 8
+// The high priority queue (FORGET, INTERRUPT), then the request queues
+#define FS_MAX_QUEUES (1 + FS_MAX_REQUEST_QUEUES)
+#define FS_QUEUE_HIPRIO 0
+// Large enough for a 1 MiB request without indirect descriptors
+#define VIRTQUEUE_FS_MAX_SIZE 1024
+#define FS_MAX_THREADS 16
+#define FS_DEFAULT_THREADS 4
+// Largest read or write, moved straight between the file and guest memory
+#define FS_MAX_IO_SIZE (1024 * 1024)
+// Largest request without its write data: two names or a symlink target
+#define FS_MAX_IN_SIZE (3 * PATH_MAX)
+#define FS_INODE_HASH_SIZE 4096
+
+typedef struct virtio_fs_config FsConfig;
+
+// Settings of the fs device specified by json
+typedef struct virtio_fs_requested_state {
+    char tag[sizeof(((FsConfig *)0)->tag) + 1]; // Mount tag in the guest
+    char shared_dir[PATH_MAX];
+    int queues;  // Request queues
+    int threads; // Worker threads
+    // Seconds the guest may cache names, negative lookups and attributes,
+    // 0 to revalidate on every access
+    double cache_timeout;
+    bool readonly;
+} FsRequestedState;
+
+// A file or directory the guest looked up. nodeid is its index in the inode
+// table, and fd an O_PATH fd, reopened through /proc/self/fd for I/O.
+typedef struct fs_inode {
+    struct fs_inode *next; // Hash chain by dev and ino
+    uint64_t nodeid;
+    int fd;
+    dev_t dev;
+    ino_t ino;
+    uint64_t nlookup; // Lookups the guest hasn't forgotten yet
+    int refs;         // Requests using the inode right now
+} FsInode;
+
+// An open file or directory. It closes when the guest has released it and
+// no request uses it any more.
+typedef struct fs_handle {
+    int fd;
+    DIR *dir;
+    pthread_mutex_t lock; // Serializes readdir of a directory
+    int refs;             // The table's, plus requests using it right now
+} FsHandle;
+
+// A request waiting for a worker thread
+struct fs_req {
+    TAILQ_ENTRY(fs_req) link;
+    VirtQueue *vq;
+    struct iovec *iov;
+    uint16_t *flags;
+    int iovcnt;
+    uint16_t idx;
+};
+
+typedef struct virtio_fs_dev {
+    FsConfig config;
+    bool readonly;
+    double cache_timeout;
+    int proc_self_fd;
+    // Inode table, nodeid 1 is the shared directory
+    pthread_mutex_t inode_lock;
+    FsInode **inodes;
+    uint64_t ninodes;
+    FsInode *inode_hash[FS_INODE_HASH_SIZE];
+    // Open files, indexed by fh
+    pthread_mutex_t handle_lock;
+    FsHandle **handles;
+    uint64_t nhandles;
+    // Worker threads
+    pthread_t threads[FS_MAX_THREADS];
+    int nthreads;
+    pthread_mutex_t mtx;
+    pthread_cond_t cond;
+    TAILQ_HEAD(, fs_req) procq;
+    int close;
+    // Statistics, bumped atomically by the workers
+    uint64_t requests, read_bytes, write_bytes;
+} FsDev;
+
+FsDev *init_fs_dev();
+int virtio_fs_init(VirtIODevice *vdev, FsRequestedState *req);
+int virtio_fs_hiprio_notify_handler(VirtIODevice *vdev, VirtQueue *vq);
+int virtio_fs_notify_handler(VirtIODevice *vdev, VirtQueue *vq);
+void virtio_fs_close(VirtIODevice *vdev);
+#endif /* _HVISOR_VIRTIO_FS_H */
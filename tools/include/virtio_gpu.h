@@ -13,9 +13,12 @@
 #ifdef ENABLE_VIRTIO_GPU
 
 #include "bits/pthreadtypes.h"
+#include "event_monitor.h"
 #include "linux/types.h"
 #include "sys/queue.h"
 #include "virtio.h"
+#include "virtio_gpu_blit.h"
+#include "virtio_gpu_display.h"
 #include <linux/virtio_gpu.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -42,37 +45,71 @@
 // requests
 #define VIRTIO_GPU_MAX_REQUEST_BEFORE_KICK 16
 
-// Maximum number of scanouts supported by hvisor's virtio_gpu implementation
-#define HVISOR_VIRTIO_GPU_MAX_SCANOUTS 1
+// Maximum number of scanouts supported by hvisor's virtio_gpu implementation,
+// json lists them in "scanouts"
+#define HVISOR_VIRTIO_GPU_MAX_SCANOUTS 4
 
-// Maximum memory used for storing resources by a virtio gpu device
+// Maximum memory used for storing resources by a virtio gpu device, unless
+// json sets "max_hostmem"
 #define VIRTIO_GPU_MAX_HOSTMEM 536870912 // 512MB
 
+// Buckets of the resource table, resource ids are mostly sequential
+#define GPU_RESOURCE_HASH_SIZE 1024
+
+// Blob resources imported into card0 at once. Each import holds a dma-buf fd,
+// a gem handle and a drm_framebuffer, the least recently used ones that
+// aren't on screen are released beyond this.
+#define GPU_MAX_IMPORTS 32
+
+// Width and height of virtio-gpu cursors
+#define GPU_CURSOR_SIZE 64
+
+// Cursor images kept in card0 per kms scanout, so that showing a recent
+// cursor again uploads nothing
+#define GPU_CURSOR_BUFFERS 8
+
 // Supported virtio features
 // Optional VIRTIO_RING_F_INDIRECT_DESC and VIRTIO_RING_F_EVENT_IDX
+// VIRTIO_GPU_F_RESOURCE_BLOB is offered if json asks for it, and so is
+// VIRTIO_GPU_F_VIRGL when built with VIRGL=y
 // Pending support for VIRTIO_GPU_F_EDID, VIRTIO_GPU_F_RESOURCE_UUID,
-// VIRTIO_GPU_F_RESOURCE_BLOB, VIRTIO_GPU_F_VIRGL, VIRTIO_GPU_F_CONTEXT_INIT
+// VIRTIO_GPU_F_CONTEXT_INIT
 #define GPU_SUPPORTED_FEATURES                                                 \
     ((1ULL << VIRTIO_F_VERSION_1) | VIRTIO_RING_F_INDIRECT_DESC)
 
+// Framebuffers per scanout, drawn in turn and presented with page flips
+#define GPU_MAX_FRAMEBUFFERS 3
+#define GPU_DEFAULT_FRAMEBUFFERS 2
+// Index of the framebuffer on the backing of a blob resource, shown without
+// copies
+#define GPU_BLOB_FRAMEBUFFER GPU_MAX_FRAMEBUFFERS
+
+// Rectangles of a damaged region before they are merged further
+#define GPU_DAMAGE_MAX_RECTS 16
+
+// Clients of a stream display
+#define GPU_STREAM_MAX_CLIENTS 8
+
 // Default configuration for scanout[0]
 #define SCANOUT_DEFAULT_WIDTH 1280
 
 #define SCANOUT_DEFAULT_HEIGHT 800
 
-// Macro to find the minimum value
+// Macros to find the minimum and maximum values
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
 
-// Conversion between virtio_gpu_formats and drm formats
+// Conversion between virtio_gpu_formats and drm formats. virtio_gpu_formats
+// name the bytes in memory, drm formats the bits of a little-endian word.
 #define VIRTIO_GPU_FORMAT_TO_DRM_FORMAT(format)                                \
-    ((format == VIRTIO_GPU_FORMAT_X8R8G8B8_UNORM)   ? DRM_FORMAT_XRGB8888      \
-     : (format == VIRTIO_GPU_FORMAT_X8B8G8R8_UNORM) ? DRM_FORMAT_XBGR8888      \
-     : (format == VIRTIO_GPU_FORMAT_R8G8B8X8_UNORM) ? DRM_FORMAT_RGBX8888      \
-     : (format == VIRTIO_GPU_FORMAT_B8G8R8X8_UNORM) ? DRM_FORMAT_BGRX8888      \
-     : (format == VIRTIO_GPU_FORMAT_A8R8G8B8_UNORM) ? DRM_FORMAT_ARGB8888      \
-     : (format == VIRTIO_GPU_FORMAT_A8B8G8R8_UNORM) ? DRM_FORMAT_ABGR8888      \
-     : (format == VIRTIO_GPU_FORMAT_R8G8B8A8_UNORM) ? DRM_FORMAT_RGBA8888      \
-     : (format == VIRTIO_GPU_FORMAT_B8G8R8A8_UNORM) ? DRM_FORMAT_BGRA8888      \
+    ((format == VIRTIO_GPU_FORMAT_X8R8G8B8_UNORM)   ? DRM_FORMAT_BGRX8888      \
+     : (format == VIRTIO_GPU_FORMAT_X8B8G8R8_UNORM) ? DRM_FORMAT_RGBX8888      \
+     : (format == VIRTIO_GPU_FORMAT_R8G8B8X8_UNORM) ? DRM_FORMAT_XBGR8888      \
+     : (format == VIRTIO_GPU_FORMAT_B8G8R8X8_UNORM) ? DRM_FORMAT_XRGB8888      \
+     : (format == VIRTIO_GPU_FORMAT_A8R8G8B8_UNORM) ? DRM_FORMAT_BGRA8888      \
+     : (format == VIRTIO_GPU_FORMAT_A8B8G8R8_UNORM) ? DRM_FORMAT_RGBA8888      \
+     : (format == VIRTIO_GPU_FORMAT_R8G8B8A8_UNORM) ? DRM_FORMAT_ABGR8888      \
+     : (format == VIRTIO_GPU_FORMAT_B8G8R8A8_UNORM) ? DRM_FORMAT_ARGB8888      \
                                                     : 0 /* Unknown format */)
 
 /*********************************************************************
@@ -97,6 +134,31 @@ typedef struct virtio_gpu_config GPUConfig;
 typedef struct virtio_gpu_ctrl_hdr GPUControlHeader;
 typedef struct virtio_gpu_update_cursor GPUUpdateCursor;
 
+// A region as a short list of rectangles, merged as they are added
+typedef struct virtio_gpu_damage {
+    uint32_t num;
+    struct virtio_gpu_rect rects[GPU_DAMAGE_MAX_RECTS];
+} GPUDamage;
+
+// A cursor image in BGRA8888, GPU_CURSOR_SIZE square, read from a resource
+// once. It is shared by the resource, the scanouts showing it and the buffers
+// of the displays holding it, and freed with the last reference.
+typedef struct hvisor_cursor {
+    uint16_t width, height;
+    int refcount;
+    uint32_t data[];
+} HvCursor;
+
+// A card0 buffer holding a cursor image, by the kms display
+typedef struct gpu_cursor_buffer {
+    HvCursor *cursor; // Referenced, NULL if nothing was uploaded
+    uint32_t handle;  // Of the dumb buffer, 0 if not created yet
+    uint32_t pitch;
+    uint64_t size;
+    void *addr;
+    uint64_t used; // When it was last shown, the oldest one is reused
+} GPUCursorBuffer;
+
 // Resource object stored in memory during rendering (e.g., images)
 // When in use, it needs to be converted from iov to a drm_mode_create_dumb
 // object for output
@@ -112,21 +174,33 @@ typedef struct virtio_gpu_simple_resource {
     unsigned int iov_cnt;
     uint64_t hostmem;         // Size of the resource in the host
     uint32_t scanout_bitmask; // Marks which scanout the resource is used by
-    struct virtio_gpu_rect
-        transfer_rect; // In transfer_to_2d, determines which part of the image
-                       // in guest memory to flush
-    uint64_t transfer_offset;
+    GPUDamage damage; // Transferred by transfer_to_2d, not flushed yet
+    uint32_t stride;  // Bytes per row of the backing
+    uint32_t offset;  // Offset of the first row in the backing
+    // Blob resources, whose geometry is given by set_scanout_blob
+    bool blob;
+    bool contiguous;      // The backing can be imported into card0
+    uint64_t blob_addr;   // Of the backing in the zone, if contiguous
+    int dmabuf_fd;        // The backing as a dma-buf, -1 if not imported
+    uint32_t blob_handle; // The dma-buf imported into card0
+    uint32_t blob_fb_id;  // drm_framebuffer on the backing
+    // 3D resources live in virglrenderer. The rectangles flushed to a
+    // scanout are read back into shadow, which is copied like a backing.
+    bool virgl;
+    struct iovec shadow;
+    HvCursor *cursor; // Read for a cursor, dropped when the resource changes
+    // Most recently used first
     TAILQ_ENTRY(virtio_gpu_simple_resource) next;
+    struct virtio_gpu_simple_resource *hash_next;
 } GPUSimpleResource;
 
 typedef struct virtio_gpu_framebuffer {
-    // TODO: Double buffering
     uint32_t fb_id; // Framebuffer ID
-    // TODO: Format
-    // The format mainly determines how many bytes each pixel occupies
-    // The formats provided by virtio_gpu_formats are all 4 bytes per pixel
+    // The format of the resource, converted into the pixel_format of the
+    // scanout when copied. The formats provided by virtio_gpu_formats are all
+    // 4 bytes per pixel.
     uint32_t format;        // virtio_gpu_formats
-    uint32_t bytes_pp;      // Bytes per pixel
+    uint32_t bytes_pp;      // Bytes per pixel of the resource
     uint32_t width, height; // Framebuffer width and height
     uint32_t stride; // Stride refers to the number of bytes each row of the
                      // image occupies in memory, stride * height equals the
@@ -135,38 +209,119 @@ typedef struct virtio_gpu_framebuffer {
     // drm related
     uint32_t drm_dumb_size;   // Buffer size
     uint32_t drm_dumb_handle; // Handle pointing to the drm framebuffer
+    uint32_t pitch;           // Bytes per row of the drm framebuffer
     void *fb_addr;            // Virtual address of the buffer in this process
     bool enabled;             // Whether the buffer is enabled
+    GPUDamage damage;         // Changed since the buffer was last drawn
 } GPUFrameBuffer;
 
-// 32-bit RGBA
-typedef struct hvisor_cursor {
-    uint16_t width, height;
-    int hot_x, hot_y;
-    int refcount;
-    uint32_t data[];
-} HvCursor;
+// Where the frames of a scanout are shown, the "display" field of the json
+typedef enum {
+    GPU_DISPLAY_KMS,    // card0
+    GPU_DISPLAY_SHM,    // A POSIX shared memory object, see GPUShmHeader
+    GPU_DISPLAY_STREAM, // Changed tiles sent over a Unix socket
+} GPUDisplayType;
+
+typedef struct virtio_gpu_scanout GPUScanout;
+
+// A display of a scanout. The device draws each frame into one of its
+// buffers, and shows it at once or with a page flip.
+typedef struct virtio_gpu_display {
+    const char *name;
+    // Open the display and set the size of the scanout
+    int (*init)(VirtIODevice *vdev, GPUScanout *scanout);
+    void (*close)(GPUScanout *scanout);
+    // Give fb the memory of a buffer with its geometry, and take it back
+    int (*create_buffer)(GPUScanout *scanout, GPUFrameBuffer *fb);
+    void (*remove_buffer)(GPUScanout *scanout, GPUFrameBuffer *fb);
+    // Show buffer index at once, frame_damage of the scanout changed
+    void (*show)(GPUScanout *scanout, int index);
+    // Show buffer index at the next vblank, and call virtio_gpu_flip_done
+    // then. NULL if the display has no vblank.
+    int (*flip)(GPUScanout *scanout, int index);
+    void (*stats)(GPUScanout *scanout); // Optional
+    // Show cursor with its hot spot, NULL hides it, and move the top left
+    // corner of the cursor to (x, y). Optional, without them the cursor isn't
+    // shown.
+    void (*set_cursor)(GPUScanout *scanout, HvCursor *cursor, uint32_t hot_x,
+                       uint32_t hot_y);
+    void (*move_cursor)(GPUScanout *scanout, int32_t x, int32_t y);
+} GPUDisplay;
 
 // Settings related to the actual display device
 typedef struct virtio_gpu_scanout {
     uint32_t width, height;
     uint32_t x, y;
     uint32_t resource_id;
+    // The cursor as the zone last set it. Moves reach the display from the
+    // thread serving the cursor queue, images are loaded by the processing
+    // thread, which owns the resources.
     GPUUpdateCursor cursor;
-    HvCursor *current_cursor;
-    GPUFrameBuffer frame_buffer;
-    // Output card used
+    HvCursor *current_cursor;     // Shown, NULL for none
+    bool cursor_dirty;            // cursor names an image not shown yet
+    pthread_mutex_t cursor_mutex; // Of the fields above and the display's
+                                  // cursor, taken after queue_mutex
+    VirtIODevice *vdev;
+    // Drawn in turn, only the damage since a buffer was last drawn is copied
+    // into it. The one at GPU_BLOB_FRAMEBUFFER wraps the bound blob resource.
+    GPUFrameBuffer frame_buffers[GPU_MAX_FRAMEBUFFERS + 1];
+    int fb_num;
+    // Indexes in frame_buffers, -1 for none
+    int id;       // Index in the scanouts of the device
+    int front;    // Being scanned out
+    int flipping; // Shown at the next vblank
+    int ready;    // Drawn while another one was flipping, flipped next
+    // fb_id of front and flipping, the blob one may have changed since
+    uint32_t front_fb_id, flipping_fb_id;
+    bool page_flip; // false if the driver can't flip, every frame is a modeset
+    GPUPixelFormat pixel_format; // Of the device's buffers
+    // Flushes answered when their frame is on screen
+    TAILQ_HEAD(, virtio_gpu_control_cmd) present_cmds; // Not drawn yet
+    TAILQ_HEAD(, virtio_gpu_control_cmd) flip_cmds;    // Of flipping
+    TAILQ_HEAD(, virtio_gpu_control_cmd) ready_cmds;   // Of ready
+    TAILQ_HEAD(, virtio_gpu_control_cmd) done_cmds;    // On screen
+    // The worker drawing and showing the frames of the scanout, so that the
+    // processing thread never waits for a copy or a vblank
+    pthread_t present_thread;
+    bool present_stop;
+    GPUSimpleResource *present_res; // Bound, copied by the worker
+    // Copied by the worker right now without flip_mutex. Its backing and the
+    // buffers stay until the copy is done.
+    GPUSimpleResource *copy_res;
+    pthread_mutex_t flip_mutex; // Of the fields above and the buffers
+    pthread_cond_t flip_cond;   // A flip or a copy completed, or a flush came
+    const GPUDisplay *display;
+    void *display_priv;     // Private state of the display
+    GPUDamage frame_damage; // Of the frame being shown, in buffer coordinates
+    struct hvisor_event *event; // Page flip events of card0_fd
+    // Output card used, by the kms display
     int card0_fd;
     // drm related
     drmModeCrtc *crtc;
     drmModeEncoder *encoder;
     drmModeConnector *connector;
+    GPUCursorBuffer cursor_buffers[GPU_CURSOR_BUFFERS];
+    uint32_t cursor_width, cursor_height; // Of the cursor buffers of card0
+    uint64_t cursor_shows;                // Ages of the cursor buffers
+    bool cursor_failed; // The CRTC has no cursor, it isn't shown
+    // Statistics
+    uint64_t frames, flips, modesets, copied_bytes, zero_copy_frames;
+    uint64_t merged_flushes; // Flushes shown in the frame of a later one
+    uint64_t cursor_moves, cursor_updates, cursor_uploads;
 } GPUScanout;
 
 // Settings of the display device specified by json
 typedef struct virtio_gpu_requested_state {
     uint32_t width, height;
     int x, y;
+    int buffers; // Framebuffers per scanout
+    bool blob;   // Offer VIRTIO_GPU_F_RESOURCE_BLOB
+    int depth;   // Of the device's buffers, 24 (XRGB8888) or 16 (RGB565)
+    GPUDisplayType display;
+    char display_path[108]; // Shared memory object or socket, "" for default
+    uint64_t max_hostmem;   // Bytes of resources, 0 for the default
+    bool virgl;             // Offer VIRTIO_GPU_F_VIRGL
+    int scanouts_num;       // Of the device, in the first state
 } GPURequestedState;
 
 // GPU device structure
@@ -178,16 +333,44 @@ typedef struct virtio_gpu_dev {
     // TODO: Initialize requested_state
     // Requested states negotiated by these scanouts
     GPURequestedState requested_states[HVISOR_VIRTIO_GPU_MAX_SCANOUTS];
-    // Resources owned by virtio gpu
-    TAILQ_HEAD(, virtio_gpu_simple_resource) resource_list;
+    // Resources owned by virtio gpu, in the order they were last used
+    TAILQ_HEAD(virtio_gpu_resource_list, virtio_gpu_simple_resource)
+    resource_list;
+    GPUSimpleResource *resource_hash[GPU_RESOURCE_HASH_SIZE];
+    uint32_t resources;
     // Command queue for async processing by virtio gpu
     TAILQ_HEAD(, virtio_gpu_control_cmd) command_queue;
     // Number of scanouts
     int scanouts_num;
-    // Total memory occupied by the virtio device
+    // Total memory occupied by the virtio device, and its budget
     uint64_t hostmem;
+    uint64_t max_hostmem;
+    // Blob resources imported into card0
+    uint32_t imports;
+    // Statistics
+    uint64_t hostmem_failures; // Resources refused for the budget
+    uint64_t alloc_failures;   // Resources the daemon couldn't allocate
+    uint64_t import_evictions; // Imports released for newer ones
     // Enabled scanout
     int enabled_scanout_bitmask;
+    // Blob backings are imported into card0 as dma-bufs
+    bool zero_copy;
+    // Opened by the first kms scanout, shared by the others
+    int card0_fd;
+    // Fenced requests and flushes not answered yet, in the order they came.
+    // A fenced request is answered after the ones before it.
+    TAILQ_HEAD(, virtio_gpu_control_cmd) fence_cmds;
+    // 3D commands are rendered by virglrenderer on the processing thread,
+    // where its GL context is current
+    bool virgl_requested;
+    bool virgl_started; // The processing thread tried to start it
+    bool virgl;         // It runs, VIRTIO_GPU_F_VIRGL is offered
+    int virgl_poll_fd;  // Readable when fences are done, -1 if polled
+    struct hvisor_event *virgl_event;
+    uint32_t virgl_fences;   // Fenced requests the renderer works on
+    uint32_t virgl_answered; // By the last poll
+    // Statistics
+    uint64_t virgl_submits, virgl_submit_bytes, virgl_read_back_bytes;
     // async
     pthread_t gpu_thread;
     pthread_cond_t gpu_cond;
@@ -199,13 +382,24 @@ typedef struct virtio_gpu_control_cmd {
     GPUControlHeader control_header;
     struct iovec *resp_iov;    // iov to write the response
     unsigned int resp_iov_cnt; // Number of iovs
+    unsigned int req_iov_cnt;  // Readable iovs, the response follows them
     uint16_t
         resp_idx;   // Used index corresponding to the request after completion
     bool finished;  // Indicates whether the current cmd is completed after
                     // processing, if not, use no_data response uniformly
+    bool deferred;  // Answered later, once the flushed frame is on screen
+    bool ordered;   // In fence_cmds
+    bool held;      // Answered, the response waits for the ones before it
+    bool rendering; // Answered once virglrenderer passes its fence
     uint32_t error; // Error type
     uint32_t from_queue; // Queue from which the request came
+    uint32_t resp_len;   // Of the held response
+    int presents;        // Scanouts yet to show the flushed frame
     TAILQ_ENTRY(virtio_gpu_control_cmd) next; // Next cmd in the command queue
+    // In the lists of each scanout showing the flush
+    TAILQ_ENTRY(virtio_gpu_control_cmd)
+    flush_next[HVISOR_VIRTIO_GPU_MAX_SCANOUTS];
+    TAILQ_ENTRY(virtio_gpu_control_cmd) fence_next; // In fence_cmds
 } GPUCommand;
 
 /*********************************************************************
@@ -233,6 +427,9 @@ int virtio_gpu_cursor_notify_handler(VirtIODevice *vdev, VirtQueue *vq);
 int virtio_gpu_handle_single_request(VirtIODevice *vdev, VirtQueue *vq,
                                      uint32_t from);
 
+// Process a single request of cursorq, which is answered at once
+int virtio_gpu_handle_cursor_request(VirtIODevice *vdev, VirtQueue *vq);
+
 // Copy request control structure from iov
 #define VIRTIO_GPU_FILL_CMD(iov, iov_cnt, out)                                 \
     do {                                                                       \
@@ -309,7 +506,7 @@ void virtio_gpu_get_edid(VirtIODevice *vdev, GPUCommand *gcmd);
 void virtio_gpu_resource_create_2d(VirtIODevice *vdev, GPUCommand *gcmd);
 
 // Check if the given virtio gpu device has a resource with the id resource_id
-// If not, return NULL
+// If not, return NULL. The resource becomes the most recently used one.
 GPUSimpleResource *virtio_gpu_find_resource(GPUDev *gdev, uint32_t resource_id);
 
 // Check if the resource with the specified id is already bound, if so, return
@@ -320,6 +517,13 @@ GPUSimpleResource *virtio_gpu_check_resource(VirtIODevice *vdev,
                                              const char *caller,
                                              uint32_t *error);
 
+// Whether the budget of the zone has room for size more bytes of resources
+bool virtio_gpu_admit_resource(VirtIODevice *vdev, uint32_t resource_id,
+                               uint64_t size);
+
+// Add a created resource to the device
+void virtio_gpu_add_resource(GPUDev *gdev, GPUSimpleResource *res);
+
 // Calculate the memory size occupied by the resource in the host
 uint32_t calc_image_hostmem(int bits_per_pixel, uint32_t width,
                             uint32_t height);
@@ -337,19 +541,65 @@ void virtio_gpu_disable_scanout(GPUDev *gdev, int scanout_id);
 // Clear the mapping of the resource
 void virtio_gpu_cleanup_mapping(GPUDev *gdev, GPUSimpleResource *res);
 
+// Add a rectangle to a damaged region. Rectangles are merged when their
+// bounding box wastes no area, or when the region is full.
+void virtio_gpu_damage_add(GPUDamage *damage, const struct virtio_gpu_rect *r);
+// Clip r to the rectangle clip, false if nothing is left
+bool virtio_gpu_rect_clip(struct virtio_gpu_rect *r,
+                          const struct virtio_gpu_rect *clip);
+
 // Corresponding to VIRTIO_GPU_CMD_RESOURCE_FLUSH
 // Flush a resource that is linked to a scanout
 void virtio_gpu_resource_flush(VirtIODevice *vdev, GPUCommand *gcmd);
 
-// Create a drm_framebuffer for the scanout
-void virtio_gpu_create_drm_framebuffer(GPUScanout *scanout, uint32_t *error);
+// Create a buffer of the display for the scanout
+void virtio_gpu_create_framebuffer(GPUScanout *scanout, GPUFrameBuffer *fb,
+                                   uint32_t *error);
+
+// Hand the damage of a flush to the worker of the scanout, which shows it in
+// a later frame. The flush is deferred until the frame is on screen.
+void virtio_gpu_queue_flush(VirtIODevice *vdev, GPUScanout *scanout,
+                            GPUSimpleResource *res, GPUDamage *damage,
+                            GPUCommand *gcmd);
 
-// Copy the resource to the scanout's drm_framebuffer and flush
-void virtio_gpu_copy_and_flush(GPUScanout *scanout, GPUSimpleResource *res,
-                               uint32_t *error);
+// Copy the flushed damage into a back buffer and queue a page flip to it.
+// Called by the worker of the scanout with flip_mutex held, which is released
+// during the copy. The worker wakes the processing thread once flip_mutex is
+// released if this returns true.
+bool virtio_gpu_present_frame(GPUScanout *scanout);
 
-// Remove the drm_framebuffer of the scanout
-void virtio_gpu_remove_drm_framebuffer(GPUScanout *scanout);
+// Wake the processing thread, which answers the flushes on screen. Never
+// called with flip_mutex held, the thread takes it with queue_mutex held.
+void virtio_gpu_kick_handler(GPUDev *gdev);
+
+// Answer the deferred flushes whose frame is on screen, return their number
+int virtio_gpu_finish_flushes(VirtIODevice *vdev);
+
+// Called by the display once the buffer of a page flip is on screen
+void virtio_gpu_flip_done(GPUScanout *scanout);
+
+// Remove a buffer of the display of the scanout
+void virtio_gpu_remove_framebuffer(GPUScanout *scanout, GPUFrameBuffer *fb);
+
+// Corresponding to VIRTIO_GPU_CMD_UPDATE_CURSOR and VIRTIO_GPU_CMD_MOVE_CURSOR,
+// on the thread serving cursorq. A move reaches the display at once, without
+// copies, and an update is shown by virtio_gpu_load_cursors.
+void virtio_gpu_update_cursor(VirtIODevice *vdev, GPUUpdateCursor *cursor);
+
+// Show the cursor images named by updates, on the processing thread with
+// queue_mutex held
+void virtio_gpu_load_cursors(VirtIODevice *vdev);
+
+// Take and drop a reference to a cursor image, NULL is ignored
+HvCursor *virtio_gpu_cursor_get(HvCursor *cursor);
+void virtio_gpu_cursor_put(HvCursor *cursor);
+
+/*********************************************************************
+  Displays, virtio_gpu_kms.c, virtio_gpu_shm.c and virtio_gpu_stream.c
+ */
+extern const GPUDisplay virtio_gpu_kms_display;
+extern const GPUDisplay virtio_gpu_shm_display;
+extern const GPUDisplay virtio_gpu_stream_display;
 
 // Corresponding to VIRTIO_GPU_CMD_SET_SCANOUT
 // Set the display parameters of the scanout and bind the resource to the
@@ -366,6 +616,16 @@ void virtio_gpu_update_scanout(VirtIODevice *vdev, uint32_t scanout_id,
                                GPUFrameBuffer *fb, GPUSimpleResource *res,
                                struct virtio_gpu_rect *r);
 
+// Corresponding to VIRTIO_GPU_CMD_RESOURCE_CREATE_BLOB
+// Create a resource on guest memory, whose geometry is set with
+// set_scanout_blob. A contiguous backing is imported into card0 as a dma-buf.
+void virtio_gpu_resource_create_blob(VirtIODevice *vdev, GPUCommand *gcmd);
+
+// Corresponding to VIRTIO_GPU_CMD_SET_SCANOUT_BLOB
+// Bind a blob resource to the scanout, which shows the backing itself when it
+// is imported
+void virtio_gpu_set_scanout_blob(VirtIODevice *vdev, GPUCommand *gcmd);
+
 // Corresponding to VIRTIO_GPU_CMD_TRANSFER_TO_HOST_2D
 // Transfer the content in guest memory to the resource in the host
 void virtio_gpu_transfer_to_host_2d(VirtIODevice *vdev, GPUCommand *gcmd);
@@ -375,11 +635,11 @@ void virtio_gpu_transfer_to_host_2d(VirtIODevice *vdev, GPUCommand *gcmd);
 // storage)
 void virtio_gpu_resource_attach_backing(VirtIODevice *vdev, GPUCommand *gcmd);
 
-// Map guest memory to host's iov
+// Map guest memory to host's iov, addr gets the guest addresses if not NULL
 int virtio_gpu_create_mapping_iov(VirtIODevice *vdev, uint32_t nr_entries,
-                                  uint32_t offset,
-                                  GPUCommand *gcmd, /*uint64_t **addr,*/
-                                  struct iovec **iov, uint32_t *niov);
+                                  uint32_t offset, GPUCommand *gcmd,
+                                  uint64_t **addr, struct iovec **iov,
+                                  uint32_t *niov);
 
 // ! reserved
 // Clear mapping
@@ -393,11 +653,59 @@ void virtio_gpu_resource_detach_backing(VirtIODevice *vdev, GPUCommand *gcmd);
 // Process the request according to the control header
 void virtio_gpu_simple_process_cmd(GPUCommand *gcmd, VirtIODevice *vdev);
 
+#ifdef ENABLE_VIRGL
+/*********************************************************************
+  virtio_gpu_virgl.c
+ */
+// Start virglrenderer on the processing thread, and tell virtio_gpu_init
+// whether it runs
+void virtio_gpu_virgl_init(VirtIODevice *vdev);
+
+// Stop virglrenderer, on the processing thread
+void virtio_gpu_virgl_close(VirtIODevice *vdev);
+
+// Process a 3D command: contexts, 3D resources and their transfers,
+// submissions and capability sets
+void virtio_gpu_virgl_process_cmd(VirtIODevice *vdev, GPUCommand *gcmd);
+
+// Answer a fenced request once the renderer is done with the commands before
+// it
+void virtio_gpu_virgl_fence(VirtIODevice *vdev, GPUCommand *gcmd);
+
+// Answer the fenced requests the renderer is done with, return their number
+int virtio_gpu_virgl_poll(VirtIODevice *vdev);
+
+// Wait for requests with queue_mutex held, or for the fences of the renderer
+// if no fd tells when they are done
+void virtio_gpu_virgl_wait(GPUDev *gdev);
+
+// Give the renderer the backing of a 3D resource, and take it back
+void virtio_gpu_virgl_attach(GPUDev *gdev, GPUSimpleResource *res,
+                             uint32_t *error);
+void virtio_gpu_virgl_detach(GPUDev *gdev, GPUSimpleResource *res);
+
+// Destroy a 3D resource in the renderer
+void virtio_gpu_virgl_unref(GPUDev *gdev, GPUSimpleResource *res);
+
+// Corresponding to VIRTIO_GPU_CMD_TRANSFER_TO_HOST_2D of a 3D resource
+void virtio_gpu_virgl_transfer_2d(
+    GPUSimpleResource *res, struct virtio_gpu_transfer_to_host_2d *transfer_2d,
+    uint32_t *error);
+
+// Read the flushed rectangle r of a 3D resource back into its shadow
+void virtio_gpu_virgl_read_back(VirtIODevice *vdev, GPUSimpleResource *res,
+                                const struct virtio_gpu_rect *r,
+                                uint32_t *error);
+#endif
+
 /*********************************************************************
   virtio_gpu_async.c
  */
 // Processing thread
 void *virtio_gpu_handler(void *vdev);
 
+// Presentation worker of a scanout
+void *virtio_gpu_present_worker(void *scanout);
+
 #endif
 #endif /* _HVISOR_VIRTIO_GPU_H */
\ No newline at end of file
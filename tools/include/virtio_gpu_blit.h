@@ -0,0 +1,82 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/**
+ * Copyright (c) 2025 Syswonder
+ *
+ * Syswonder Website:
+ *      https://www.syswonder.org
+ */
+#ifndef _HVISOR_VIRTIO_GPU_BLIT_H
+#define _HVISOR_VIRTIO_GPU_BLIT_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+// Pixel formats of the blit kernels. Like virtio_gpu_formats they are named
+// after the order of the bytes in memory, so GPU_PIXEL_BGRX8888 is
+// DRM_FORMAT_XRGB8888. X bytes read as 0xff.
+typedef enum gpu_pixel_format {
+    GPU_PIXEL_BGRA8888,
+    GPU_PIXEL_BGRX8888,
+    GPU_PIXEL_ARGB8888,
+    GPU_PIXEL_XRGB8888,
+    GPU_PIXEL_RGBA8888,
+    GPU_PIXEL_RGBX8888,
+    GPU_PIXEL_ABGR8888,
+    GPU_PIXEL_XBGR8888,
+    GPU_PIXEL_RGB565, // Little-endian 16 bits, red in the top 5
+    GPU_PIXEL_FORMATS,
+} GPUPixelFormat;
+
+// How a 32-bit pixel is converted, per destination byte
+typedef struct gpu_blit_op {
+    bool copy;        // The formats are the same
+    uint8_t shuf[16]; // Source byte of each byte of 4 pixels, 0x80 for none
+    uint32_t fill;    // ORed into each destination pixel
+    // shuf as masks and shifts of the source pixel, for kernels without a
+    // byte shuffle
+    int terms;
+    uint32_t mask[4];
+    int shift[4]; // Left if positive
+} GPUBlitOp;
+
+// The kernels of an instruction set. n is a number of pixels.
+typedef struct gpu_blit_kernels {
+    const char *name;
+    bool (*supported)(void);
+    // 32 bits to 32 bits
+    void (*swizzle)(uint8_t *dst, const uint8_t *src, uint32_t n,
+                    const GPUBlitOp *op);
+    // 32 bits to RGB565, op moves the source into BGRX8888 first
+    void (*pack565)(uint8_t *dst, const uint8_t *src, uint32_t n,
+                    const GPUBlitOp *op);
+    // RGB565 to 32 bits, op moves BGRA8888 into the destination last
+    void (*unpack565)(uint8_t *dst, const uint8_t *src, uint32_t n,
+                      const GPUBlitOp *op);
+} GPUBlitKernels;
+
+/// Select the fastest kernels the CPU supports.
+void gpu_blit_init(void);
+/// Select the kernels of an instruction set by name, for benchmarks. Returns
+/// -1 if they are unknown or unsupported.
+int gpu_blit_use(const char *name);
+/// Name of the kernels in use.
+const char *gpu_blit_name(void);
+/// The kernels built in, NULL terminated.
+const GPUBlitKernels *const *gpu_blit_all(void);
+
+/// The blit format of a virtio_gpu_formats, -1 if it is unknown.
+int gpu_blit_virtio_format(uint32_t virtio_format);
+uint32_t gpu_blit_bytes_pp(GPUPixelFormat format);
+/// Convert n pixels.
+void gpu_blit_row(void *dst, GPUPixelFormat dst_format, const void *src,
+                  GPUPixelFormat src_format, uint32_t n);
+/// Convert a width x height rectangle starting at offset of the scattered
+/// source, whose rows are stride bytes apart. Returns the bytes written to
+/// dst, 0 if the source is too short.
+size_t gpu_blit_from_iov(void *dst, uint32_t pitch, GPUPixelFormat dst_format,
+                         const struct iovec *iov, unsigned int iov_cnt,
+                         size_t offset, uint32_t stride,
+                         GPUPixelFormat src_format, uint32_t width,
+                         uint32_t height);
+#endif /* _HVISOR_VIRTIO_GPU_BLIT_H */
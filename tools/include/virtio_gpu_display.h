@@ -0,0 +1,82 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/**
+ * Copyright (c) 2025 Syswonder
+ *
+ * Syswonder Website:
+ *      https://www.syswonder.org
+ */
+// What the headless displays of virtio-gpu share with the programs showing
+// them. Pixels are in a GPUPixelFormat of virtio_gpu_blit.h, and every field
+// is little-endian.
+#ifndef _HVISOR_VIRTIO_GPU_DISPLAY_H
+#define _HVISOR_VIRTIO_GPU_DISPLAY_H
+#include <stdint.h>
+
+/*********************************************************************
+    Shared memory display
+ */
+// A POSIX shared memory object made of a GPUShmHeader and the buffers of the
+// scanout. A reader:
+// 1. waits until generation is even, remaps the object if it grew, and reads
+//    frame, then front and the geometry;
+// 2. copies the view of buffer front, or only the damage of the frames after
+//    the last one it copied, if they are all still in the ring;
+// 3. starts over if generation or frame changed meanwhile.
+#define GPU_SHM_MAGIC 0x42465648 // "HVFB"
+#define GPU_SHM_VERSION 1
+#define GPU_SHM_MAX_BUFFERS 4
+#define GPU_SHM_DAMAGE_RING 64
+
+typedef struct gpu_shm_damage {
+    uint64_t frame; // The frame the rectangle changed in
+    uint32_t x, y, width, height;
+} GPUShmDamage;
+
+typedef struct gpu_shm_header {
+    uint32_t magic, version;
+    volatile uint32_t generation; // Odd while the layout changes
+    uint32_t format;              // GPUPixelFormat of the buffers
+    uint32_t width, height, pitch;
+    uint32_t buffers;
+    uint64_t buffer_offset[GPU_SHM_MAX_BUFFERS]; // From the start of the object
+    // Of the last frame
+    uint32_t view_x, view_y, view_width, view_height; // Shown rectangle
+    volatile uint32_t front;
+    volatile uint64_t frame; // Frames shown so far
+    // Rectangles of the last frames, in buffer coordinates. Entry i holds the
+    // i-th rectangle written, modulo GPU_SHM_DAMAGE_RING.
+    volatile uint64_t damage_head;
+    GPUShmDamage damage[GPU_SHM_DAMAGE_RING];
+} GPUShmHeader;
+
+/*********************************************************************
+    Stream display
+ */
+// Clients of the Unix socket receive a GPUStreamFrame per frame, followed by
+// its changed tiles, each a GPUStreamTile and its data. When a client
+// connects, every tile is sent again. Frames drawn while the clients are slow
+// to read are merged.
+#define GPU_STREAM_MAGIC 0x53475648 // "HVGS"
+#define GPU_STREAM_TILE 64          // Pixels per side of a tile
+
+enum gpu_stream_encoding {
+    GPU_STREAM_RAW,  // Rows of width pixels
+    GPU_STREAM_RLE,  // Runs of a uint16_t count and a pixel, in row order
+    GPU_STREAM_ZLIB, // zlib stream of the raw tile
+};
+
+typedef struct gpu_stream_frame {
+    uint32_t magic;
+    uint32_t format;        // GPUPixelFormat of the tiles
+    uint32_t width, height; // Of the display
+    uint32_t tiles;
+    uint32_t reserved;
+    uint64_t frame;
+} GPUStreamFrame;
+
+typedef struct gpu_stream_tile {
+    uint16_t x, y, width, height;
+    uint32_t encoding;
+    uint32_t length; // Bytes of data
+} GPUStreamTile;
+#endif /* _HVISOR_VIRTIO_GPU_DISPLAY_H */
@@ -12,38 +12,124 @@
 #define _HVISOR_VIRTIO_NET_H
 #include "event_monitor.h"
 #include "virtio.h"
+#include <linux/if_ether.h>
 #include <linux/virtio_net.h>
+#include <net/if.h>
+#include <pthread.h>
 
 // Queue idx for virtio net.
 #define NET_QUEUE_RX 0
 #define NET_QUEUE_TX 1
+#define NET_QUEUE_CTRL 2
 
 // Maximum number of queues for Virtio net
-#define NET_MAX_QUEUES 2
+#define NET_MAX_QUEUES 3
+// Number of queues carrying frames, the control queue follows them
+#define NET_DATA_QUEUES 2
 
 #define VIRTQUEUE_NET_MAX_SIZE 256
 // VIRTIO_RING_F_INDIRECT_DESC and VIRTIO_RING_F_EVENT_IDX are supported, for
 // some reason we cancel them.
 #define NET_SUPPORTED_FEATURES                                                 \
     ((1ULL << VIRTIO_F_VERSION_1) | (1ULL << VIRTIO_NET_F_MAC) |               \
-     (1ULL << VIRTIO_NET_F_STATUS))
+     (1ULL << VIRTIO_NET_F_STATUS) | (1ULL << VIRTIO_NET_F_CTRL_VQ) |          \
+     (1ULL << VIRTIO_NET_F_CTRL_RX) | (1ULL << VIRTIO_NET_F_CTRL_VLAN) |       \
+     (1ULL << VIRTIO_NET_F_CTRL_MAC_ADDR))
+
+// Number of MAC addresses the driver can put into the rx filter. If it sets
+// more, all unicast or all multicast frames are accepted.
+#define NET_MAC_TABLE_ENTRIES 64
+// Slots of the hash table holding the MAC table, a power of 2
+#define NET_MAC_HASH_SIZE 128
+#define NET_MAX_VLAN 4096
+// Bytes of a frame the rx filter looks at: Ethernet header and a VLAN tag
+#define NET_RX_FILTER_LEN 18
 
 typedef struct virtio_net_config NetConfig;
 typedef struct virtio_net_hdr_v1 NetHdr;
 
+// Host side data path that frames are moved to and from
+typedef enum {
+    NET_BACKEND_TAP,    // readv/writev on a tap device
+    NET_BACKEND_XDP,    // AF_XDP socket bound to a NIC queue
+    NET_BACKEND_SWITCH, // Port of a switch inside the daemon
+    NET_BACKEND_VHOST,  // vhost-net moves frames to a tap inside the kernel
+} NetBackendType;
+
+// How the tx shaper sorts frames into priority bands
+typedef enum {
+    NET_PRIO_NONE, // One band, frames leave in ring order
+    NET_PRIO_DSCP, // By the DSCP of IPv4 and IPv6 packets
+    NET_PRIO_PCP,  // By the PCP of 802.1Q tagged frames
+} NetPrioMode;
+
+// Token bucket shaping of the net device, a rate of 0 means unlimited
+typedef struct virtio_net_rate_limit {
+    uint64_t tx_rate, rx_rate;   // Bytes per second
+    uint64_t tx_burst, rx_burst; // Bytes
+    NetPrioMode prio;
+} NetRateLimit;
+
+// Settings of the net device specified by json
+typedef struct virtio_net_requested_state {
+    NetBackendType backend;
+    char ifname[IFNAMSIZ]; // Tap device name, or the NIC used by AF_XDP
+    uint32_t queue_id;     // NIC queue the AF_XDP socket is bound to
+    bool xdp_generic;      // Force the generic (skb) XDP path
+    char switch_name[32];  // Switch the port is connected to
+    uint16_t vlan;         // VLAN of the switch port, 0 means untagged
+    NetRateLimit rate_limit;
+} NetRequestedState;
+
+typedef struct virtio_net_mac_entry {
+    uint8_t mac[ETH_ALEN];
+    bool used;
+} NetMacEntry;
+
+// Frames the driver wants to receive, set through the control queue
+typedef struct virtio_net_rx_filter {
+    pthread_mutex_t lock;
+    bool promisc, allmulti, alluni, nomulti, nouni, nobcast;
+    // The driver set more MACs than NET_MAC_TABLE_ENTRIES
+    bool uni_overflow, multi_overflow;
+    int mac_count;
+    NetMacEntry macs[NET_MAC_HASH_SIZE]; // Unicast and multicast MAC table
+    uint32_t vlans[NET_MAX_VLAN / 32];   // Bitmap of VLANs accepted if tagged
+} NetRxFilter;
+
 typedef struct virtio_net_dev {
     NetConfig config;
     int tapfd;
     int rx_ready;
     struct hvisor_event *event;
+    NetBackendType backend;
+    void *backend_priv; // Private state of the backend, e.g. XdpSocket
+    NetRxFilter filter;
+    struct net_shaper *shaper; // NULL if the rate is not limited
+    // Statistics of the tap backend
+    uint64_t rx_packets, rx_bytes, tx_packets, tx_bytes;
 } NetDev;
 
 NetDev *init_net_dev(uint8_t mac[]);
 
+int open_tap(char *devname, bool vnet_hdr);
+// Write the frame of a tx descriptor chain to the tap. iov must have room for
+// one more entry to pad short frames. Return the length of the chain.
+int virtio_net_tap_xmit(NetDev *net, struct iovec *iov, int n);
+
 int virtio_net_rxq_notify_handler(VirtIODevice *vdev, VirtQueue *vq);
 int virtio_net_txq_notify_handler(VirtIODevice *vdev, VirtQueue *vq);
+int virtio_net_ctrlq_notify_handler(VirtIODevice *vdev, VirtQueue *vq);
+
+// Restore the rx filter to its state after reset: every frame is accepted.
+// Tagged frames are filtered by VLAN only if VIRTIO_NET_F_CTRL_VLAN is in
+// features.
+void virtio_net_rx_filter_reset(NetRxFilter *filter, uint64_t features);
+// Whether the driver wants the frame starting with hdr, which holds the first
+// len bytes of the frame, at most NET_RX_FILTER_LEN are looked at.
+bool virtio_net_rx_accept(NetDev *net, const uint8_t *hdr, size_t len);
 
 void virtio_net_event_handler(int fd, int epoll_type, void *param);
-int virtio_net_init(VirtIODevice *vdev, char *devname);
+int virtio_net_init(VirtIODevice *vdev, NetRequestedState *req);
 void virtio_net_close(VirtIODevice *vdev);
 #endif //_HVISOR_VIRTIO_NET_H
@@ -0,0 +1,69 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/**
+ * Copyright (c) 2025 Syswonder
+ *
+ * Syswonder Website:
+ *      https://www.syswonder.org
+ */
+#ifndef _HVISOR_VIRTIO_NET_SHAPER_H
+#define _HVISOR_VIRTIO_NET_SHAPER_H
+#include "event_monitor.h"
+#include "virtio.h"
+#include "virtio_net.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+// Number of tx priority bands, the highest band is sent first
+#define NET_SHAPER_BANDS 4
+
+typedef struct net_token_bucket {
+    uint64_t rate;  // Bytes per second, 0 means unlimited
+    uint64_t burst; // Bytes
+    // A frame may be sent while tokens is positive, and its length is taken
+    // afterwards, so tokens goes negative by at most one frame.
+    int64_t tokens;
+    uint64_t frac; // Fraction of a token not yet added, in 1e-9 tokens
+    uint64_t last_ns;
+} NetTokenBucket;
+
+// A tx descriptor chain waiting for tokens
+typedef struct net_tx_frame {
+    struct iovec *iov;
+    int n;
+    uint16_t idx;
+} NetTxFrame;
+
+typedef struct net_tx_band {
+    NetTxFrame frames[VIRTQUEUE_NET_MAX_SIZE];
+    uint16_t head, count;
+} NetTxBand;
+
+typedef struct net_shaper {
+    pthread_mutex_t lock;
+    VirtIODevice *vdev;
+    NetPrioMode prio;
+    NetTokenBucket tx, rx;
+    NetTxBand bands[NET_SHAPER_BANDS];
+    // One timer for both directions, fires at the earliest deadline
+    int timer_fd;
+    struct hvisor_event *timer_event;
+    uint64_t deadline_ns; // 0 if the timer is not armed
+    bool rx_paused;       // The tap event is off until rx tokens come back
+    // Statistics
+    uint64_t tx_deferred, rx_deferred;
+    uint64_t band_packets[NET_SHAPER_BANDS];
+} NetShaper;
+
+int net_shaper_init(VirtIODevice *vdev, NetRateLimit *limit);
+void net_shaper_close(NetDev *net);
+// Drop the frames held back, the driver is resetting the device
+void net_shaper_reset(NetDev *net);
+// Send what the tx bucket allows, hold back the rest
+int net_shaper_tx(VirtIODevice *vdev, VirtQueue *vq);
+// Whether a frame may be received now. If not, stop reading the tap until
+// there are tokens again.
+bool net_shaper_rx_admit(NetDev *net);
+void net_shaper_rx_charge(NetDev *net, size_t len);
+void net_shaper_stats(NetDev *net);
+#endif /* _HVISOR_VIRTIO_NET_SHAPER_H */
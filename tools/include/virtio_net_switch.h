@@ -0,0 +1,68 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/**
+ * Copyright (c) 2025 Syswonder
+ *
+ * Syswonder Website:
+ *      https://www.syswonder.org
+ */
+#ifndef _HVISOR_VIRTIO_NET_SWITCH_H
+#define _HVISOR_VIRTIO_NET_SWITCH_H
+#include "event_monitor.h"
+#include "virtio.h"
+#include "virtio_net.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+// Maximum number of switches in the daemon
+#define NET_SWITCH_MAX_SWITCHES 4
+// Maximum number of ports of a switch, including the uplink
+#define NET_SWITCH_MAX_PORTS 16
+// Number of entries of the MAC table, must be a power of 2
+#define NET_SWITCH_FDB_SIZE 1024
+// Number of slots probed when looking up a MAC in the MAC table
+#define NET_SWITCH_FDB_PROBE 8
+// Seconds after which a learned MAC address is forgotten
+#define NET_SWITCH_AGEING_TIME 300
+// Largest frame accepted from the uplink, including a VLAN tag
+#define NET_SWITCH_MAX_FRAME 9238
+
+struct net_switch;
+
+typedef struct net_switch_port {
+    struct net_switch *sw;
+    VirtIODevice *vdev; // Zone's net device, NULL for the uplink
+    bool in_use;
+    bool need_irq;  // Rx used ring was updated and the zone isn't kicked yet
+    uint16_t vlan;  // VLAN id of an access port, 0 means untagged
+    uint64_t rx_packets, tx_packets, dropped;
+    uint64_t filtered; // Frames the zone's rx filter didn't want
+} NetSwitchPort;
+
+typedef struct net_switch_fdb_entry {
+    uint8_t mac[6];
+    uint16_t vlan;
+    NetSwitchPort *port; // NULL if the entry is empty
+    time_t last_seen;
+} NetSwitchFdbEntry;
+
+typedef struct net_switch {
+    char name[32];
+    pthread_mutex_t lock;
+    NetSwitchPort ports[NET_SWITCH_MAX_PORTS];
+    // The uplink is a trunk port bridging the switch to a tap device. Frames
+    // of VLAN 0 are untagged on it, others carry an 802.1Q tag.
+    NetSwitchPort *uplink;
+    int uplink_fd;
+    struct hvisor_event *uplink_event;
+    uint8_t uplink_buf[NET_SWITCH_MAX_FRAME];
+    NetSwitchFdbEntry fdb[NET_SWITCH_FDB_SIZE];
+} NetSwitch;
+
+// Connect the switch named name to the tap device tap
+int net_switch_add_uplink(const char *name, char *tap);
+
+int virtio_net_switch_init(VirtIODevice *vdev, NetRequestedState *req);
+int virtio_net_switch_tx(VirtIODevice *vdev, VirtQueue *vq);
+void virtio_net_switch_close(NetDev *net);
+#endif /* _HVISOR_VIRTIO_NET_SWITCH_H */
@@ -0,0 +1,31 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/**
+ * Copyright (c) 2025 Syswonder
+ *
+ * Syswonder Website:
+ *      https://www.syswonder.org
+ */
+#ifndef _HVISOR_VIRTIO_NET_VHOST_H
+#define _HVISOR_VIRTIO_NET_VHOST_H
+#include "event_monitor.h"
+#include "virtio.h"
+#include "virtio_net.h"
+#include <stdint.h>
+
+// Maximum number of memory regions passed to VHOST_SET_MEM_TABLE
+#define VHOST_NET_MAX_MEM_REGIONS 4
+
+typedef struct vhost_net {
+    int vhost_fd;
+    int tapfd;
+    int kick_fd[NET_DATA_QUEUES]; // Written by the daemon on QUEUE_NOTIFY
+    int call_fd[NET_DATA_QUEUES]; // Written by vhost when used rings change
+    struct hvisor_event *call_event[NET_DATA_QUEUES];
+    uint64_t features; // Features supported by vhost-net
+    bool started;
+} VhostNet;
+
+int virtio_net_vhost_init(VirtIODevice *vdev, NetRequestedState *req);
+void virtio_net_vhost_activate(VirtIODevice *vdev, bool activate);
+void virtio_net_vhost_close(NetDev *net);
+#endif /* _HVISOR_VIRTIO_NET_VHOST_H */
@@ -0,0 +1,67 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/**
+ * Copyright (c) 2025 Syswonder
+ *
+ * Syswonder Website:
+ *      https://www.syswonder.org
+ */
+#ifndef _HVISOR_VIRTIO_NET_XDP_H
+#define _HVISOR_VIRTIO_NET_XDP_H
+#include "virtio.h"
+#include "virtio_net.h"
+#include <linux/if_xdp.h>
+#include <stdint.h>
+
+// Number of UMEM frames. Half of them are handed to the kernel through the
+// fill ring for rx, the other half are used for tx.
+#define XDP_NUM_FRAMES 4096
+// Each frame holds exactly one ethernet frame
+#define XDP_FRAME_SIZE 2048
+// Size of the rx, tx, fill and completion rings
+#define XDP_RING_SIZE (XDP_NUM_FRAMES / 2)
+// Maximum number of frames moved between a XSK ring and a virtqueue at a time
+#define XDP_BATCH_SIZE 64
+
+// A single producer/consumer ring shared with the kernel
+typedef struct xsk_ring {
+    uint32_t *producer;
+    uint32_t *consumer;
+    uint32_t *flags;
+    void *ring;
+    uint32_t mask;
+    uint32_t size;
+    // Local copies of producer and consumer to avoid touching shared cache
+    // lines for every frame
+    uint32_t cached_prod;
+    uint32_t cached_cons;
+    void *map;
+    size_t map_len;
+} XskRing;
+
+typedef struct xdp_socket {
+    int fd;
+    int ifindex;
+    uint32_t queue_id;
+    uint32_t attach_flags; // XDP_FLAGS_* used when attaching the program
+    int prog_fd;
+    int map_fd;
+    bool zero_copy;
+    void *umem_area;
+    XskRing fill;
+    XskRing comp;
+    XskRing rx;
+    XskRing tx;
+    // Stack of umem frames that are free for tx
+    uint64_t tx_frames[XDP_RING_SIZE];
+    uint32_t tx_frames_num;
+    uint32_t tx_outstanding; // Frames submitted to tx but not completed
+    uint64_t rx_packets, rx_dropped, rx_filtered;
+    uint64_t rx_no_buffers; // Dropped while the driver had no rx buffers
+    uint64_t tx_packets, tx_dropped;
+} XdpSocket;
+
+int virtio_net_xdp_init(VirtIODevice *vdev, NetRequestedState *req);
+int virtio_net_xdp_tx(VirtIODevice *vdev, VirtQueue *vq);
+void virtio_net_xdp_stats(NetDev *net);
+void virtio_net_xdp_close(NetDev *net);
+#endif /* _HVISOR_VIRTIO_NET_XDP_H */
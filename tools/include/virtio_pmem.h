@@ -0,0 +1,77 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/**
+ * Copyright (c) 2025 Syswonder
+ *
+ * Syswonder Website:
+ *      https://www.syswonder.org
+ */
+#ifndef _HVISOR_VIRTIO_PMEM_H
+#define _HVISOR_VIRTIO_PMEM_H
+#include "virtio.h"
+#include <linux/limits.h>
+#include <linux/virtio_pmem.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/queue.h>
+
+#define PMEM_SUPPORTED_FEATURES (1ULL << VIRTIO_F_VERSION_1)
+#define PMEM_MAX_QUEUES 1
+#define VIRTQUEUE_PMEM_MAX_SIZE 64
+#define PMEM_PAGE_SIZE 4096
+// Dirty chunks are found by comparing a hash of each chunk with the one taken
+// when it was last written to the file. The hypervisor keeps no dirty log of
+// zone RAM, so a flush reads the whole region. Chunks keep the hash table
+// small and the writes large.
+#define PMEM_CHUNK_SIZE (64ULL << 10)
+// The guest maps the region with DAX in 2 MiB subsections
+#define PMEM_ALIGN (2ULL << 20)
+
+typedef struct virtio_pmem_config PmemConfig;
+
+// Settings of the pmem device specified by json
+typedef struct virtio_pmem_requested_state {
+    char file[PATH_MAX];
+    // The region holding the file, like an entry of memory_region
+    uint64_t zone0_ipa;
+    uint64_t zonex_ipa;
+    uint64_t size;
+    // The file is never written. The zone can still change its copy in the
+    // region, stage-2 maps it as RAM.
+    bool readonly;
+} PmemRequestedState;
+
+// A flush request waiting for the flush thread
+struct pmem_req {
+    TAILQ_ENTRY(pmem_req) link;
+    VirtQueue *vq;
+    struct iovec *iov;
+    uint16_t *flags;
+    int iovcnt;
+    uint16_t idx;
+};
+
+typedef struct virtio_pmem_dev {
+    PmemConfig config;
+    char file[PATH_MAX];
+    int fd;
+    bool readonly;
+    uint64_t zone0_ipa;
+    uint8_t *region; // The region in this process
+    uint64_t nchunks;
+    uint64_t *chunk_hash; // Of the chunks as last written to the file
+    uint64_t *next_hash;  // Of the chunks being written back
+    // Flush thread
+    pthread_t flush_thread;
+    pthread_mutex_t mtx;
+    pthread_cond_t cond;
+    TAILQ_HEAD(, pmem_req) procq;
+    int close;
+    // Statistics
+    uint64_t flushes, written_bytes;
+} PmemDev;
+
+PmemDev *init_pmem_dev();
+int virtio_pmem_init(VirtIODevice *vdev, PmemRequestedState *req);
+int virtio_pmem_notify_handler(VirtIODevice *vdev, VirtQueue *vq);
+void virtio_pmem_close(VirtIODevice *vdev);
+#endif /* _HVISOR_VIRTIO_PMEM_H */
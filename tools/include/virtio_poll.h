@@ -0,0 +1,50 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/**
+ * Copyright (c) 2025 Syswonder
+ *
+ * Syswonder Website:
+ *      https://www.syswonder.org
+ */
+#ifndef _HVISOR_VIRTIO_POLL_H
+#define _HVISOR_VIRTIO_POLL_H
+#include "virtio.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Microseconds without new buffers before going back to notifications
+#define POLL_DEFAULT_IDLE_US 1000
+
+// The "poll" field of a device
+typedef struct poll_requested_state {
+    int cpu;          // CPU the poller is pinned to, -1 for any CPU
+    uint32_t idle_us; // 0 never goes back to notifications
+    uint64_t queues;  // A bit per polled virtqueue, 0 for the default ones
+} PollRequestedState;
+
+// A thread that watches the avail rings of a device in zone memory, so that
+// the guest doesn't need to kick it.
+typedef struct virtio_poller {
+    VirtIODevice *vdev;
+    PollRequestedState req;
+    pthread_t tid;
+    pthread_mutex_t mtx;
+    pthread_cond_t cond;
+    bool active;  // The driver set DRIVER_OK
+    bool polling; // Notifications of the polled queues are suppressed
+    bool kicked;  // The guest notified a polled queue
+    bool in_pass; // The poller is calling the notify handlers
+    bool close;
+    // Statistics
+    uint64_t passes, busy_passes, kicks, fallbacks;
+} VirtioPoller;
+
+int virtio_poll_init(VirtIODevice *vdev, PollRequestedState *req);
+/// Called on QUEUE_NOTIFY. Returns false if the queue isn't polled, and its
+/// notify handler should run as usual.
+bool virtio_poll_kick(VirtIODevice *vdev, uint32_t idx);
+/// Start polling when the driver sets DRIVER_OK, stop before a reset.
+void virtio_poll_activate(VirtIODevice *vdev, bool activate);
+void virtio_poll_stats(VirtIODevice *vdev);
+void virtio_poll_close(VirtIODevice *vdev);
+#endif /* _HVISOR_VIRTIO_POLL_H */
@@ -0,0 +1,107 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/**
+ * Copyright (c) 2025 Syswonder
+ *
+ * Syswonder Website:
+ *      https://www.syswonder.org
+ */
+#ifndef _HVISOR_VIRTIO_SUPERVISOR_H
+#define _HVISOR_VIRTIO_SUPERVISOR_H
+#include "hvisor.h"
+#include "safe_cjson.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Each worker hosts at least one device
+#define SUPERVISOR_MAX_WORKERS MAX_DEVS
+// Larger than the vCPUs of a zone, as MMIO writes of notifications don't wait
+#define SUPERVISOR_RING_SIZE 64
+// Seconds to wait for the workers to create their devices
+#define SUPERVISOR_START_TIMEOUT 30
+// Milliseconds a worker may leave its ring full before it is taken as hung
+// and killed. Requests of all zones wait meanwhile.
+#define SUPERVISOR_DISPATCH_TIMEOUT 1000
+// Microseconds a worker the module woke waits for the supervisor to route
+// the request, instead of sleeping again
+#define SUPERVISOR_EARLY_WAKE_US 200
+
+// Which devices share a worker process, the "isolation" field of the json
+enum supervisor_isolation {
+    ISOLATION_NONE,   // All devices in the daemon process
+    ISOLATION_ZONE,   // A worker per zone
+    ISOLATION_DEVICE, // A worker per device
+};
+
+enum supervisor_worker_state {
+    WORKER_STARTING,
+    WORKER_READY,
+    WORKER_FAILED, // Failed to start, or hung and killed
+    WORKER_DEAD,
+};
+
+// CPUs and scheduling policy of a worker, the "worker" field of a zone or a
+// device
+typedef struct supervisor_sched {
+    uint64_t cpus; // A bit per CPU, 0 for any CPU
+    int policy;    // SCHED_OTHER, SCHED_FIFO or SCHED_RR
+    int priority;
+} SupervisorSched;
+
+// MMIO requests routed to a worker. The supervisor fills it, the worker
+// empties it.
+typedef struct supervisor_ring {
+    volatile uint32_t front;
+    volatile uint32_t rear;
+    volatile uint32_t need_wakeup; // The worker sleeps on its eventfd
+    struct device_req reqs[SUPERVISOR_RING_SIZE];
+} SupervisorRing;
+
+// Memory shared by the supervisor and all workers
+typedef struct supervisor_shm {
+    pthread_mutex_t res_mutex; // Process-shared and robust, guards res list
+    volatile int state[SUPERVISOR_MAX_WORKERS];
+    SupervisorRing rings[SUPERVISOR_MAX_WORKERS];
+} SupervisorShm;
+
+typedef struct supervisor_worker {
+    int zone_id;
+    uint64_t devices;  // Indexes in the zone's "devices"
+    uint32_t switches; // Indexes in "switches" with a port in the worker
+    SupervisorSched sched;
+    pid_t pid;
+    int efd; // Wakes the worker, signalled by the supervisor and the module
+    // Statistics
+    uint64_t requests, wakeups;
+} SupervisorWorker;
+
+// The MMIO region of a device and the worker hosting it
+typedef struct supervisor_route {
+    int zone_id;
+    uint64_t base_addr, len;
+    int worker;
+} SupervisorRoute;
+
+/// Read the isolation mode of the json, ISOLATION_NONE if it has none.
+int supervisor_read_isolation(char *json_path);
+/// Plan the workers, fork them and wait until they have created their
+/// devices.
+int supervisor_start(char *json_path);
+/// Route an MMIO request to the worker hosting its device.
+int supervisor_dispatch_req(volatile struct device_req *req);
+/// Reap exited workers.
+void supervisor_reap(void);
+/// The eventfd the module signals for every request, -1 if the module has no
+/// eventfds. The supervisor waits on it instead of /dev/hvisor.
+int supervisor_irq_fd(void);
+void supervisor_dump_stats(void);
+void supervisor_close(void);
+bool supervisor_active(void);
+
+// Whether this process hosts a zone, a device or a switch uplink. Always
+// true without isolation.
+bool supervisor_owns_zone(int zone_id);
+bool supervisor_owns_device(int zone_id, int index);
+bool supervisor_owns_switch(int index);
+#endif /* _HVISOR_VIRTIO_SUPERVISOR_H */
@@ -0,0 +1,105 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/**
+ * Copyright (c) 2025 Syswonder
+ *
+ * Syswonder Website:
+ *      https://www.syswonder.org
+ */
+#ifndef _HVISOR_VIRTIO_VSOCK_H
+#define _HVISOR_VIRTIO_VSOCK_H
+#include "virtio.h"
+#include <linux/virtio_vsock.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/un.h>
+
+#define VSOCK_SUPPORTED_FEATURES (1ULL << VIRTIO_F_VERSION_1)
+#define VSOCK_MAX_QUEUES 3
+#define VIRTQUEUE_VSOCK_MAX_SIZE 128
+#define VSOCK_QUEUE_RX 0
+#define VSOCK_QUEUE_TX 1
+#define VSOCK_QUEUE_EVENT 2
+
+#define VSOCK_HOST_CID 2
+#define VSOCK_MAX_CONNS 128
+#define VSOCK_CONN_HASH_SIZE 256
+// Guest data a connection buffers for a slow socket. It is the credit the
+// guest gets, so the buffer never overflows.
+#define VSOCK_CONN_BUF_SIZE (256 * 1024)
+// Local ports of connections made by host programs
+#define VSOCK_HOST_PORT_BASE (1U << 30)
+// Control packets waiting for rx buffers
+#define VSOCK_MAX_CTRL 256
+
+typedef struct virtio_vsock_config VsockConfig;
+
+// Settings of the vsock device specified by json
+typedef struct virtio_vsock_requested_state {
+    uint64_t guest_cid;
+    // Host programs connect here, the guest connects to uds_path_<port>
+    char uds_path[sizeof(((struct sockaddr_un *)0)->sun_path) - 12];
+} VsockRequestedState;
+
+typedef enum {
+    VSOCK_CONN_HANDSHAKE,  // A host program connected, waiting for CONNECT
+    VSOCK_CONN_CONNECTING, // REQUEST sent to the guest
+    VSOCK_CONN_ESTABLISHED,
+} VsockConnState;
+
+typedef struct vsock_conn {
+    struct vsock_conn *next; // Hash chain
+    VsockConnState state;
+    int fd;
+    uint32_t local_port, peer_port;
+    // Guest to host. buf holds what the socket didn't take yet, head and
+    // tail count bytes ever added and written.
+    uint8_t *buf;
+    uint32_t buf_head, buf_tail;
+    uint32_t fwd_cnt;      // Bytes written to the socket
+    uint32_t fwd_cnt_sent; // fwd_cnt as last told the guest
+    bool credit_pending;   // A CREDIT_UPDATE is queued
+    uint32_t peer_shutdown;
+    bool shut_wr;
+    // Host to guest
+    uint32_t peer_buf_alloc, peer_fwd_cnt;
+    uint32_t rx_cnt;
+    bool readable; // The socket polled readable since the last read
+    bool eof;
+    // "CONNECT <port>\n" of a host program
+    char line[32];
+    int line_len;
+} VsockConn;
+
+typedef struct vsock_ctrl {
+    uint32_t local_port, peer_port;
+    uint16_t op;
+    uint32_t flags;
+} VsockCtrl;
+
+typedef struct virtio_vsock_dev {
+    VsockConfig config;
+    char uds_path[sizeof(((VsockRequestedState *)0)->uds_path)];
+    pthread_mutex_t lock; // Protects everything below but the io thread
+    VsockConn *conns[VSOCK_MAX_CONNS];
+    int nconns;
+    VsockConn *hash[VSOCK_CONN_HASH_SIZE];
+    VsockCtrl ctrl[VSOCK_MAX_CTRL];
+    int ctrl_head, ctrl_count;
+    uint32_t next_port;
+    bool rx_ready;
+    int listen_fd;
+    // The io thread serves the listening socket and all connections
+    pthread_t io_thread;
+    int wake_fd;
+    bool closing;
+    // Statistics
+    uint64_t tx_bytes, rx_bytes, connections, resets;
+} VsockDev;
+
+VsockDev *init_vsock_dev();
+int virtio_vsock_init(VirtIODevice *vdev, VsockRequestedState *req);
+int virtio_vsock_rxq_notify_handler(VirtIODevice *vdev, VirtQueue *vq);
+int virtio_vsock_txq_notify_handler(VirtIODevice *vdev, VirtQueue *vq);
+int virtio_vsock_evq_notify_handler(VirtIODevice *vdev, VirtQueue *vq);
+void virtio_vsock_close(VirtIODevice *vdev);
+#endif /* _HVISOR_VIRTIO_VSOCK_H */
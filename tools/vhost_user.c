@@ -0,0 +1,507 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/**
+ * Copyright (c) 2025 Syswonder
+ *
+ * Syswonder Website:
+ *      https://www.syswonder.org
+ */
+// vhost-user frontend: the virtqueues of a device are served by an external
+// backend, such as DPDK, SPDK or virtiofsd, reached over a Unix socket.
+// The zone's RAM is shared with the backend by passing it /dev/hvisor, which
+// it maps at the physical address of each region. The daemon only keeps the
+// MMIO registers and the config space, hands the rings over when the driver
+// sets DRIVER_OK, forwards QUEUE_NOTIFY through kick eventfds, and turns the
+// backend's call eventfds into interrupts for the zone.
+#define _GNU_SOURCE
+
+#include "vhost_user.h"
+#include "log.h"
+#include "virtio.h"
+#include <errno.h>
+#include <linux/virtio_blk.h>
+#include <linux/virtio_console.h>
+#include <linux/virtio_crypto.h>
+#include <linux/virtio_fs.h>
+#include <linux/virtio_net.h>
+#include <linux/virtio_vsock.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+// Seconds to wait for a reply of the backend
+#define VHOST_USER_TIMEOUT 5
+
+extern int ko_fd;
+
+VhostUserDev *init_vhost_user_dev() {
+    VhostUserDev *dev = (VhostUserDev *)calloc(1, sizeof(VhostUserDev));
+    dev->sock_fd = -1;
+    for (int i = 0; i < VHOST_USER_MAX_QUEUES; i++)
+        dev->kick_fd[i] = dev->call_fd[i] = -1;
+    return dev;
+}
+
+/*********************************************************************
+    Messages
+ */
+static int vhost_user_send(VhostUserDev *dev, VhostUserMsg *msg, int *fds,
+                           int nfds) {
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int) * VHOST_USER_MAX_MEM_REGIONS)];
+    } control;
+    struct iovec iov = {.iov_base = msg,
+                        .iov_len = VHOST_USER_HDR_SIZE + msg->size};
+    struct msghdr mh = {.msg_iov = &iov, .msg_iovlen = 1};
+    struct cmsghdr *cmsg;
+
+    msg->flags |= VHOST_USER_VERSION;
+    if (nfds > 0) {
+        memset(control.buf, 0, sizeof(control.buf));
+        mh.msg_control = control.buf;
+        mh.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+        cmsg = CMSG_FIRSTHDR(&mh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+    }
+    if (sendmsg(dev->sock_fd, &mh, MSG_NOSIGNAL) != (ssize_t)iov.iov_len) {
+        log_error("vhost-user: failed to send request %u, errno is %d",
+                  msg->request, errno);
+        return -1;
+    }
+    return 0;
+}
+
+static int vhost_user_recv(VhostUserDev *dev, VhostUserMsg *msg,
+                           uint32_t request) {
+    if (recv(dev->sock_fd, msg, VHOST_USER_HDR_SIZE, MSG_WAITALL) !=
+        VHOST_USER_HDR_SIZE) {
+        log_error("vhost-user: no reply to request %u, errno is %d", request,
+                  errno);
+        return -1;
+    }
+    if (msg->request != request || !(msg->flags & VHOST_USER_REPLY_MASK) ||
+        msg->size > sizeof(msg->payload)) {
+        log_error("vhost-user: bad reply to request %u", request);
+        return -1;
+    }
+    if (msg->size > 0 && recv(dev->sock_fd, &msg->payload, msg->size,
+                              MSG_WAITALL) != msg->size) {
+        log_error("vhost-user: short reply to request %u", request);
+        return -1;
+    }
+    return 0;
+}
+
+/// Send a request that gets no reply. The backend acks it when REPLY_ACK
+/// was negotiated.
+static int vhost_user_set(VhostUserDev *dev, VhostUserMsg *msg, int *fds,
+                          int nfds) {
+    uint32_t request = msg->request;
+    bool ack =
+        dev->protocol_features & (1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK);
+
+    if (ack)
+        msg->flags |= VHOST_USER_NEED_REPLY_MASK;
+    if (vhost_user_send(dev, msg, fds, nfds) < 0)
+        return -1;
+    if (!ack)
+        return 0;
+    if (vhost_user_recv(dev, msg, request) < 0)
+        return -1;
+    if (msg->size != sizeof(msg->payload.u64) || msg->payload.u64 != 0) {
+        log_error("vhost-user: request %u failed", request);
+        return -1;
+    }
+    return 0;
+}
+
+/// Send a request and wait for its reply, which replaces msg.
+static int vhost_user_get(VhostUserDev *dev, VhostUserMsg *msg) {
+    uint32_t request = msg->request;
+    if (vhost_user_send(dev, msg, NULL, 0) < 0)
+        return -1;
+    return vhost_user_recv(dev, msg, request);
+}
+
+static int vhost_user_get_u64(VhostUserDev *dev, uint32_t request,
+                              uint64_t *value) {
+    VhostUserMsg msg = {.request = request};
+    if (vhost_user_get(dev, &msg) < 0 || msg.size != sizeof(msg.payload.u64))
+        return -1;
+    *value = msg.payload.u64;
+    return 0;
+}
+
+static int vhost_user_set_u64(VhostUserDev *dev, uint32_t request,
+                              uint64_t value) {
+    VhostUserMsg msg = {.request = request, .size = sizeof(msg.payload.u64)};
+    msg.payload.u64 = value;
+    return vhost_user_set(dev, &msg, NULL, 0);
+}
+
+static int vhost_user_set_state(VhostUserDev *dev, uint32_t request,
+                                unsigned int index, unsigned int num) {
+    VhostUserMsg msg = {.request = request,
+                        .size = sizeof(msg.payload.state)};
+    msg.payload.state.index = index;
+    msg.payload.state.num = num;
+    return vhost_user_set(dev, &msg, NULL, 0);
+}
+
+static int vhost_user_set_vring_fd(VhostUserDev *dev, uint32_t request,
+                                   unsigned int index, int fd) {
+    VhostUserMsg msg = {.request = request, .size = sizeof(msg.payload.u64)};
+    msg.payload.u64 = index & VHOST_USER_VRING_IDX_MASK;
+    return vhost_user_set(dev, &msg, &fd, 1);
+}
+
+/*********************************************************************
+    Starting and stopping the backend
+ */
+/// Share the zone's RAM, a region of /dev/hvisor at its physical address.
+static int vhost_user_set_mem_table(VirtIODevice *vdev, VhostUserDev *dev) {
+    ZoneMemRegion regions[VHOST_USER_MAX_MEM_REGIONS];
+    int fds[VHOST_USER_MAX_MEM_REGIONS];
+    VhostUserMsg msg = {.request = VHOST_USER_SET_MEM_TABLE};
+    int n;
+
+    n = get_zone_mem_regions(vdev->zone_id, regions,
+                             VHOST_USER_MAX_MEM_REGIONS);
+    msg.size =
+        offsetof(VhostUserMemory, regions) + n * sizeof(VhostUserMemRegion);
+    msg.payload.memory.nregions = n;
+    for (int i = 0; i < n; i++) {
+        msg.payload.memory.regions[i].guest_phys_addr = regions[i].zonex_ipa;
+        msg.payload.memory.regions[i].memory_size = regions[i].size;
+        msg.payload.memory.regions[i].userspace_addr =
+            (uint64_t)regions[i].virt_addr;
+        msg.payload.memory.regions[i].mmap_offset = regions[i].zone0_ipa;
+        fds[i] = ko_fd;
+    }
+    return vhost_user_set(dev, &msg, fds, n);
+}
+
+static int vhost_user_start_vring(VhostUserDev *dev, VirtQueue *vq) {
+    unsigned int idx = vq->vq_idx;
+    VhostUserMsg msg = {.request = VHOST_USER_SET_VRING_ADDR,
+                        .size = sizeof(msg.payload.addr)};
+
+    if (vhost_user_set_state(dev, VHOST_USER_SET_VRING_NUM, idx, vq->num) <
+            0 ||
+        vhost_user_set_state(dev, VHOST_USER_SET_VRING_BASE, idx,
+                             vq->last_avail_idx) < 0)
+        return -1;
+    // Ring addresses are given in the frontend's address space
+    msg.payload.addr.index = idx;
+    msg.payload.addr.desc_user_addr = (uint64_t)vq->desc_table;
+    msg.payload.addr.avail_user_addr = (uint64_t)vq->avail_ring;
+    msg.payload.addr.used_user_addr = (uint64_t)vq->used_ring;
+    if (vhost_user_set(dev, &msg, NULL, 0) < 0 ||
+        vhost_user_set_vring_fd(dev, VHOST_USER_SET_VRING_KICK, idx,
+                                dev->kick_fd[idx]) < 0 ||
+        vhost_user_set_vring_fd(dev, VHOST_USER_SET_VRING_CALL, idx,
+                                dev->call_fd[idx]) < 0)
+        return -1;
+    // With protocol features, rings start disabled
+    if ((dev->features & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES)) &&
+        vhost_user_set_state(dev, VHOST_USER_SET_VRING_ENABLE, idx, 1) < 0)
+        return -1;
+    dev->vring_started[idx] = true;
+    return 0;
+}
+
+/// GET_VRING_BASE stops a ring.
+static void vhost_user_stop(VirtIODevice *vdev, VhostUserDev *dev) {
+    VhostUserMsg msg;
+    for (uint32_t i = 0; i < vdev->vqs_len; i++) {
+        if (!dev->vring_started[i])
+            continue;
+        memset(&msg, 0, sizeof(msg));
+        msg.request = VHOST_USER_GET_VRING_BASE;
+        msg.size = sizeof(msg.payload.state);
+        msg.payload.state.index = i;
+        if (vhost_user_get(dev, &msg) < 0)
+            log_error("vhost-user: failed to stop vring %u", i);
+        dev->vring_started[i] = false;
+    }
+    dev->started = false;
+}
+
+/// Hand the virtqueues to the backend when the driver is ready, take them
+/// back when the device is reset.
+static void vhost_user_activate(VirtIODevice *vdev, bool activate) {
+    VhostUserDev *dev = vdev->dev;
+    uint64_t features;
+
+    if (!activate) {
+        if (dev->started)
+            vhost_user_stop(vdev, dev);
+        log_info("zone %d vhost-user %s stopped", vdev->zone_id, dev->socket);
+        return;
+    }
+
+    features = vdev->regs.drv_feature & dev->features;
+    features |= dev->features & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES);
+    if (vhost_user_set_u64(dev, VHOST_USER_SET_FEATURES, features) < 0 ||
+        vhost_user_set_mem_table(vdev, dev) < 0) {
+        log_error("failed to set up vhost-user backend %s", dev->socket);
+        return;
+    }
+    for (uint32_t i = 0; i < vdev->vqs_len; i++) {
+        if (!vdev->vqs[i].ready)
+            continue;
+        if (vhost_user_start_vring(dev, &vdev->vqs[i]) < 0) {
+            log_error("failed to start vhost-user vring %u", i);
+            vhost_user_stop(vdev, dev);
+            return;
+        }
+    }
+    dev->started = true;
+    // Let the backend pick up buffers the driver added before DRIVER_OK
+    for (uint32_t i = 0; i < vdev->vqs_len; i++)
+        if (dev->vring_started[i])
+            eventfd_write(dev->kick_fd[i], 1);
+    log_info("zone %d vhost-user %s started, features %#llx", vdev->zone_id,
+             dev->socket, features);
+}
+
+int vhost_user_kick(VirtIODevice *vdev, VirtQueue *vq) {
+    VhostUserDev *dev = vdev->dev;
+    if (!dev->vring_started[vq->vq_idx])
+        return 0;
+    dev->kicks++;
+    if (eventfd_write(dev->kick_fd[vq->vq_idx], 1) < 0)
+        log_error("failed to kick vhost-user backend, errno is %d", errno);
+    return 0;
+}
+
+/// Called when the backend has updated a used ring
+static void vhost_user_call_handler(int fd, int epoll_type, void *param) {
+    VirtQueue *vq = param;
+    VhostUserDev *dev = vq->dev->dev;
+    eventfd_t cnt;
+    if (epoll_type != EPOLLIN) {
+        log_error("invalid event");
+        return;
+    }
+    if (eventfd_read(fd, &cnt) < 0)
+        return;
+    dev->calls++;
+    virtio_inject_irq(vq);
+}
+
+/*********************************************************************
+    Config space
+ */
+/// Size of the config space of a device, for GET_CONFIG.
+static uint32_t vhost_user_config_size(VirtioDeviceType type) {
+    switch (type) {
+    case VirtioTNet:
+        return sizeof(struct virtio_net_config);
+    case VirtioTBlock:
+        return sizeof(struct virtio_blk_config);
+    case VirtioTConsole:
+        return sizeof(struct virtio_console_config);
+    case VirtioTVsock:
+        return sizeof(struct virtio_vsock_config);
+    case VirtioTFS:
+        return sizeof(struct virtio_fs_config);
+    case VirtioTCrypto:
+        return sizeof(struct virtio_crypto_config);
+    default:
+        return 0;
+    }
+}
+
+static int vhost_user_get_config(VhostUserDev *dev) {
+    VhostUserMsg msg = {.request = VHOST_USER_GET_CONFIG};
+    msg.size = offsetof(VhostUserConfig, region) + dev->config_len;
+    msg.payload.config.size = dev->config_len;
+    if (vhost_user_get(dev, &msg) < 0 ||
+        msg.payload.config.size != dev->config_len)
+        return -1;
+    memcpy(dev->config, msg.payload.config.region, dev->config_len);
+    return 0;
+}
+
+/// Driver writes go to the backend, if it has a config space.
+static void vhost_user_config_write(VirtIODevice *vdev, uint64_t offset,
+                                    uint64_t value, int size) {
+    VhostUserDev *dev = vdev->dev;
+    VhostUserMsg msg = {.request = VHOST_USER_SET_CONFIG};
+
+    if (size < 0 || size > 8 || offset + size > VHOST_USER_CONFIG_SIZE)
+        return;
+    memcpy(dev->config + offset, &value, size);
+    if (!(dev->protocol_features & (1ULL << VHOST_USER_PROTOCOL_F_CONFIG)))
+        return;
+    msg.size = offsetof(VhostUserConfig, region) + size;
+    msg.payload.config.offset = offset;
+    msg.payload.config.size = size;
+    memcpy(msg.payload.config.region, &value, size);
+    if (vhost_user_set(dev, &msg, NULL, 0) < 0)
+        log_error("vhost-user: failed to write config at %#llx", offset);
+}
+
+/*********************************************************************
+    Setup
+ */
+static int vhost_user_connect(VhostUserDev *dev) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    struct timeval timeout = {.tv_sec = VHOST_USER_TIMEOUT};
+
+    dev->sock_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (dev->sock_fd < 0)
+        return -1;
+    // socket is no longer than sun_path
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", dev->socket);
+    if (connect(dev->sock_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        return -1;
+    // A stuck backend must not hang the zone's MMIO accesses for ever
+    setsockopt(dev->sock_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+               sizeof(timeout));
+    setsockopt(dev->sock_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+               sizeof(timeout));
+    return 0;
+}
+
+/// Number of virtqueues of a device when the json doesn't give it.
+static int vhost_user_default_queues(VirtioDeviceType type) {
+    switch (type) {
+    case VirtioTNet:
+    case VirtioTVsock:
+        return 3;
+    case VirtioTConsole:
+    case VirtioTFS:
+    case VirtioTCrypto:
+        return 2;
+    default:
+        return 1;
+    }
+}
+
+static void vhost_user_stats(VirtIODevice *vdev) {
+    VhostUserDev *dev = vdev->dev;
+    log_warn("zone %d vhost-user %s: %s, %llu kicks, %llu calls",
+             vdev->zone_id, dev->socket,
+             dev->started ? "started" : "stopped", dev->kicks, dev->calls);
+}
+
+int vhost_user_init(VirtIODevice *vdev, VhostUserRequestedState *req) {
+    VhostUserDev *dev = vdev->dev;
+    VhostUserMsg owner = {.request = VHOST_USER_SET_OWNER};
+    uint64_t protocol_features, max_queues;
+    int nqueues, queue_size;
+
+    vdev->virtio_close = vhost_user_close;
+    vdev->virtio_activate = vhost_user_activate;
+    vdev->virtio_stats = vhost_user_stats;
+    vdev->virtio_config_write = vhost_user_config_write;
+    if (req == NULL || req->socket[0] == '\0' || req->device == VirtioTNone ||
+        req->device == VirtioTVhostUser) {
+        log_error("vhost-user needs a socket and a device");
+        return -1;
+    }
+    // The zone sees the device the backend implements
+    vdev->type = vdev->regs.device_id = req->device;
+    if (snprintf(dev->socket, sizeof(dev->socket), "%s", req->socket) >=
+        (int)sizeof(dev->socket)) {
+        log_error("vhost-user socket %s is too long", req->socket);
+        return -1;
+    }
+    memcpy(dev->config, req->config, sizeof(dev->config));
+
+    if (vhost_user_connect(dev) < 0) {
+        log_error("failed to connect to vhost-user backend %s, errno is %d",
+                  dev->socket, errno);
+        return -1;
+    }
+    if (vhost_user_set(dev, &owner, NULL, 0) < 0 ||
+        vhost_user_get_u64(dev, VHOST_USER_GET_FEATURES, &dev->features) < 0)
+        goto err;
+    if (dev->features & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES)) {
+        if (vhost_user_get_u64(dev, VHOST_USER_GET_PROTOCOL_FEATURES,
+                               &protocol_features) < 0)
+            goto err;
+        protocol_features &= VHOST_USER_PROTOCOL_FEATURES;
+        if (vhost_user_set_u64(dev, VHOST_USER_SET_PROTOCOL_FEATURES,
+                               protocol_features) < 0)
+            goto err;
+        dev->protocol_features = protocol_features;
+    }
+
+    nqueues = req->queues > 0 ? req->queues
+                              : vhost_user_default_queues(req->device);
+    if (dev->protocol_features & (1ULL << VHOST_USER_PROTOCOL_F_MQ)) {
+        if (vhost_user_get_u64(dev, VHOST_USER_GET_QUEUE_NUM, &max_queues) < 0)
+            goto err;
+        nqueues = MIN((uint64_t)nqueues, max_queues);
+    }
+    vdev->vqs_len = MIN(MAX(nqueues, 1), VHOST_USER_MAX_QUEUES);
+    queue_size = req->queue_size > 0 ? req->queue_size
+                                     : VHOST_USER_DEFAULT_QUEUE_SIZE;
+    queue_size = MIN(queue_size, VHOST_USER_MAX_QUEUE_SIZE);
+    for (uint32_t i = 0; i < vdev->vqs_len; i++)
+        vdev->vqs[i].queue_num_max = queue_size;
+
+    dev->config_len = req->config_len > 0
+                          ? (uint32_t)req->config_len
+                          : vhost_user_config_size(req->device);
+    if ((dev->protocol_features & (1ULL << VHOST_USER_PROTOCOL_F_CONFIG)) &&
+        dev->config_len > 0 && vhost_user_get_config(dev) < 0) {
+        log_error("failed to read the config of vhost-user backend %s",
+                  dev->socket);
+        goto err;
+    }
+    // Only offer what both the transport and the backend can do
+    vdev->regs.dev_feature =
+        dev->features & (VHOST_USER_TRANSPORT_FEATURES | 0xffffffULL);
+
+    for (uint32_t i = 0; i < vdev->vqs_len; i++) {
+        dev->kick_fd[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        dev->call_fd[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (dev->kick_fd[i] < 0 || dev->call_fd[i] < 0) {
+            log_error("failed to create eventfd, errno is %d", errno);
+            return -1;
+        }
+        dev->call_event[i] = add_event(dev->call_fd[i], EPOLLIN,
+                                       vhost_user_call_handler, &vdev->vqs[i]);
+        if (dev->call_event[i] == NULL) {
+            log_error("Can't register vhost-user call event");
+            return -1;
+        }
+    }
+    log_info("vhost-user %s serves %s with %u queues of %d, features %#llx, "
+             "protocol features %#llx",
+             dev->socket, virtio_device_type_to_string(vdev->type),
+             vdev->vqs_len, queue_size, dev->features, dev->protocol_features);
+    return 0;
+err:
+    log_error("vhost-user backend %s refused the setup", dev->socket);
+    return -1;
+}
+
+void vhost_user_close(VirtIODevice *vdev) {
+    VhostUserDev *dev = vdev->dev;
+    if (dev->started && dev->sock_fd >= 0)
+        vhost_user_stop(vdev, dev);
+    for (int i = 0; i < VHOST_USER_MAX_QUEUES; i++) {
+        if (dev->kick_fd[i] >= 0)
+            close(dev->kick_fd[i]);
+        if (dev->call_fd[i] >= 0)
+            close(dev->call_fd[i]);
+        free(dev->call_event[i]);
+    }
+    if (dev->sock_fd >= 0)
+        close(dev->sock_fd);
+    free(dev);
+    free(vdev->vqs);
+    free(vdev);
+}
@@ -0,0 +1,526 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/**
+ * Copyright (c) 2025 Syswonder
+ *
+ * Syswonder Website:
+ *      https://www.syswonder.org
+ */
+// A small vhost-user-blk backend over an image file, to test the vhost-user
+// frontend of hvisor without an external backend such as SPDK.
+//
+// Usage: vhost_user_backend -s <socket> -f <image> [-q <queues>]
+//
+// It serves one frontend at a time, single threaded, and implements the
+// protocol features the frontend asks for: MQ, REPLY_ACK and CONFIG.
+#define _GNU_SOURCE
+#include "vhost_user.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <linux/virtio_blk.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SIM_SECTOR_SIZE 512
+#define SIM_MAX_SEGS 128
+#define SIM_FEATURES                                                           \
+    ((1ULL << VIRTIO_F_VERSION_1) | (1ULL << VIRTIO_BLK_F_FLUSH) |             \
+     (1ULL << VIRTIO_BLK_F_SEG_MAX) | (1ULL << VHOST_USER_F_PROTOCOL_FEATURES))
+
+struct sim_region {
+    uint64_t gpa, size, uva;
+    void *mmap_addr; // Start of the mapping
+    uint64_t mmap_size;
+    uint8_t *addr; // Where gpa is mapped
+};
+
+struct sim_vring {
+    unsigned int num;
+    uint16_t last_avail_idx;
+    struct vring_desc *desc;
+    struct vring_avail *avail;
+    struct vring_used *used;
+    int kick_fd, call_fd;
+    bool enabled;
+};
+
+static struct {
+    int img_fd;
+    uint64_t capacity; // In sectors
+    int nqueues;
+    int conn_fd;
+    uint64_t features, protocol_features;
+    struct sim_region regions[VHOST_USER_MAX_MEM_REGIONS];
+    int nregions;
+    struct sim_vring vrings[VHOST_USER_MAX_QUEUES];
+    uint64_t requests;
+} sim;
+
+/*********************************************************************
+    Memory
+ */
+static void sim_unmap_regions() {
+    for (int i = 0; i < sim.nregions; i++)
+        munmap(sim.regions[i].mmap_addr, sim.regions[i].mmap_size);
+    sim.nregions = 0;
+}
+
+static void *sim_gpa_to_va(uint64_t gpa, uint64_t len) {
+    for (int i = 0; i < sim.nregions; i++) {
+        struct sim_region *r = &sim.regions[i];
+        if (gpa >= r->gpa && gpa - r->gpa + len <= r->size)
+            return r->addr + (gpa - r->gpa);
+    }
+    return NULL;
+}
+
+/// Rings are given in the address space of the frontend
+static void *sim_uva_to_va(uint64_t uva) {
+    for (int i = 0; i < sim.nregions; i++) {
+        struct sim_region *r = &sim.regions[i];
+        if (uva >= r->uva && uva - r->uva < r->size)
+            return r->addr + (uva - r->uva);
+    }
+    return NULL;
+}
+
+static int sim_set_mem_table(VhostUserMsg *msg, int *fds, int nfds) {
+    VhostUserMemory mem;
+    long page = sysconf(_SC_PAGESIZE);
+
+    memcpy(&mem, &msg->payload.memory, sizeof(mem));
+    sim_unmap_regions();
+    if (mem.nregions > VHOST_USER_MAX_MEM_REGIONS || (int)mem.nregions != nfds)
+        return -1;
+    for (uint32_t i = 0; i < mem.nregions; i++) {
+        VhostUserMemRegion *mr = &mem.regions[i];
+        struct sim_region *r = &sim.regions[i];
+        uint64_t off = mr->mmap_offset & ~(page - 1);
+        uint64_t skip = mr->mmap_offset - off;
+
+        r->mmap_size = mr->memory_size + skip;
+        r->mmap_addr = mmap(NULL, r->mmap_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED, fds[i], off);
+        if (r->mmap_addr == MAP_FAILED) {
+            fprintf(stderr, "failed to map region %u, errno is %d\n", i,
+                    errno);
+            return -1;
+        }
+        r->addr = (uint8_t *)r->mmap_addr + skip;
+        r->gpa = mr->guest_phys_addr;
+        r->size = mr->memory_size;
+        r->uva = mr->userspace_addr;
+        sim.nregions++;
+    }
+    return 0;
+}
+
+/*********************************************************************
+    Block requests
+ */
+static void sim_notify(struct sim_vring *vr) {
+    if (vr->call_fd >= 0)
+        eventfd_write(vr->call_fd, 1);
+}
+
+static uint8_t sim_blk_rw(struct virtio_blk_outhdr *hdr, struct iovec *iov,
+                          int iovcnt, uint32_t *written) {
+    off_t off = hdr->sector * SIM_SECTOR_SIZE;
+    size_t len = 0;
+    ssize_t n;
+
+    for (int i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+    if (hdr->sector > sim.capacity ||
+        len > (sim.capacity - hdr->sector) * SIM_SECTOR_SIZE)
+        return VIRTIO_BLK_S_IOERR;
+    if (hdr->type == VIRTIO_BLK_T_IN) {
+        n = preadv(sim.img_fd, iov, iovcnt, off);
+        *written += n > 0 ? n : 0;
+    } else {
+        n = pwritev(sim.img_fd, iov, iovcnt, off);
+    }
+    return n == (ssize_t)len ? VIRTIO_BLK_S_OK : VIRTIO_BLK_S_IOERR;
+}
+
+/// Handle one chain: a header, data buffers and the status byte.
+static uint32_t sim_blk_request(struct sim_vring *vr, uint16_t head) {
+    struct iovec iov[SIM_MAX_SEGS];
+    struct virtio_blk_outhdr hdr;
+    uint32_t written = 0;
+    uint8_t *status, st;
+    uint16_t idx = head;
+    int n = 0;
+
+    for (;;) {
+        struct vring_desc *d = &vr->desc[idx];
+        void *buf;
+        if (n == SIM_MAX_SEGS || idx >= vr->num)
+            return 0;
+        buf = sim_gpa_to_va(d->addr, d->len);
+        if (buf == NULL)
+            return 0;
+        iov[n].iov_base = buf;
+        iov[n++].iov_len = d->len;
+        if (!(d->flags & VRING_DESC_F_NEXT))
+            break;
+        idx = d->next;
+    }
+    if (n < 2 || iov[0].iov_len < sizeof(hdr) || iov[n - 1].iov_len < 1)
+        return 0;
+    memcpy(&hdr, iov[0].iov_base, sizeof(hdr));
+    status = (uint8_t *)iov[n - 1].iov_base + iov[n - 1].iov_len - 1;
+    iov[n - 1].iov_len--;
+
+    switch (hdr.type) {
+    case VIRTIO_BLK_T_IN:
+    case VIRTIO_BLK_T_OUT:
+        st = sim_blk_rw(&hdr, iov + 1, n - 1, &written);
+        break;
+    case VIRTIO_BLK_T_FLUSH:
+        st = fdatasync(sim.img_fd) == 0 ? VIRTIO_BLK_S_OK : VIRTIO_BLK_S_IOERR;
+        break;
+    case VIRTIO_BLK_T_GET_ID:
+        strncpy(iov[1].iov_base, "hvisor-vhost-user",
+                MIN(iov[1].iov_len, VIRTIO_BLK_ID_BYTES));
+        written = MIN(iov[1].iov_len, VIRTIO_BLK_ID_BYTES);
+        st = VIRTIO_BLK_S_OK;
+        break;
+    default:
+        st = VIRTIO_BLK_S_UNSUPP;
+        break;
+    }
+    *status = st;
+    sim.requests++;
+    return written + 1;
+}
+
+static void sim_process_vring(struct sim_vring *vr) {
+    uint16_t avail_idx, head, used_idx;
+    uint32_t len;
+
+    if (vr->desc == NULL || !vr->enabled)
+        return;
+    avail_idx = __atomic_load_n(&vr->avail->idx, __ATOMIC_ACQUIRE);
+    while (vr->last_avail_idx != avail_idx) {
+        head = vr->avail->ring[vr->last_avail_idx % vr->num];
+        len = sim_blk_request(vr, head);
+        used_idx = vr->used->idx;
+        vr->used->ring[used_idx % vr->num].id = head;
+        vr->used->ring[used_idx % vr->num].len = len;
+        __atomic_store_n(&vr->used->idx, used_idx + 1, __ATOMIC_RELEASE);
+        vr->last_avail_idx++;
+    }
+    sim_notify(vr);
+}
+
+/*********************************************************************
+    Messages
+ */
+static int sim_recv(VhostUserMsg *msg, int *fds, int *nfds) {
+    char control[CMSG_SPACE(sizeof(int) * VHOST_USER_MAX_MEM_REGIONS)];
+    struct iovec iov = {.iov_base = msg, .iov_len = VHOST_USER_HDR_SIZE};
+    struct msghdr mh = {.msg_iov = &iov,
+                        .msg_iovlen = 1,
+                        .msg_control = control,
+                        .msg_controllen = sizeof(control)};
+    struct cmsghdr *cmsg;
+
+    *nfds = 0;
+    if (recvmsg(sim.conn_fd, &mh, MSG_WAITALL) != VHOST_USER_HDR_SIZE)
+        return -1;
+    for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            *nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * *nfds);
+        }
+    }
+    if (msg->size > sizeof(msg->payload))
+        return -1;
+    if (msg->size > 0 &&
+        recv(sim.conn_fd, &msg->payload, msg->size, MSG_WAITALL) != msg->size)
+        return -1;
+    return 0;
+}
+
+static void sim_reply(VhostUserMsg *msg) {
+    msg->flags = VHOST_USER_VERSION | VHOST_USER_REPLY_MASK;
+    send(sim.conn_fd, msg, VHOST_USER_HDR_SIZE + msg->size, MSG_NOSIGNAL);
+}
+
+static void sim_reply_u64(VhostUserMsg *msg, uint64_t value) {
+    msg->size = sizeof(msg->payload.u64);
+    msg->payload.u64 = value;
+    sim_reply(msg);
+}
+
+static void sim_get_config(VhostUserMsg *msg) {
+    struct virtio_blk_config config = {0};
+    uint32_t size = MIN(msg->payload.config.size, sizeof(config));
+
+    config.capacity = sim.capacity;
+    config.seg_max = SIM_MAX_SEGS - 2;
+    memcpy(msg->payload.config.region, &config, size);
+    msg->payload.config.size = size;
+    msg->size = offsetof(VhostUserConfig, region) + size;
+    sim_reply(msg);
+}
+
+static void sim_reset_vrings() {
+    for (int i = 0; i < VHOST_USER_MAX_QUEUES; i++) {
+        struct sim_vring *vr = &sim.vrings[i];
+        if (vr->kick_fd >= 0)
+            close(vr->kick_fd);
+        if (vr->call_fd >= 0)
+            close(vr->call_fd);
+        memset(vr, 0, sizeof(*vr));
+        vr->kick_fd = vr->call_fd = -1;
+    }
+}
+
+/// Handle a message of the frontend, -1 if the connection must be dropped.
+static int sim_handle_msg() {
+    VhostUserMsg msg;
+    int fds[VHOST_USER_MAX_MEM_REGIONS], nfds, ret = 0;
+    struct sim_vring *vr = NULL;
+    uint32_t idx;
+    bool replied = false;
+
+    memset(&msg, 0, sizeof(msg));
+    if (sim_recv(&msg, fds, &nfds) < 0)
+        return -1;
+    idx = msg.payload.state.index;
+    switch (msg.request) {
+    case VHOST_USER_SET_VRING_NUM:
+    case VHOST_USER_SET_VRING_ADDR:
+    case VHOST_USER_SET_VRING_BASE:
+    case VHOST_USER_GET_VRING_BASE:
+    case VHOST_USER_SET_VRING_ENABLE:
+        break;
+    case VHOST_USER_SET_VRING_KICK:
+    case VHOST_USER_SET_VRING_CALL:
+    case VHOST_USER_SET_VRING_ERR:
+        idx = msg.payload.u64 & VHOST_USER_VRING_IDX_MASK;
+        break;
+    default:
+        idx = 0;
+    }
+    if (idx >= (uint32_t)sim.nqueues)
+        return -1;
+    vr = &sim.vrings[idx];
+
+    switch (msg.request) {
+    case VHOST_USER_GET_FEATURES:
+        sim_reply_u64(&msg, SIM_FEATURES);
+        replied = true;
+        break;
+    case VHOST_USER_SET_FEATURES:
+        sim.features = msg.payload.u64;
+        break;
+    case VHOST_USER_SET_OWNER:
+        break;
+    case VHOST_USER_RESET_OWNER:
+        sim_reset_vrings();
+        break;
+    case VHOST_USER_GET_PROTOCOL_FEATURES:
+        sim_reply_u64(&msg, VHOST_USER_PROTOCOL_FEATURES);
+        replied = true;
+        break;
+    case VHOST_USER_SET_PROTOCOL_FEATURES:
+        sim.protocol_features = msg.payload.u64;
+        break;
+    case VHOST_USER_GET_QUEUE_NUM:
+        sim_reply_u64(&msg, sim.nqueues);
+        replied = true;
+        break;
+    case VHOST_USER_SET_MEM_TABLE:
+        ret = sim_set_mem_table(&msg, fds, nfds);
+        break;
+    case VHOST_USER_SET_VRING_NUM:
+        vr->num = msg.payload.state.num;
+        break;
+    case VHOST_USER_SET_VRING_BASE:
+        vr->last_avail_idx = msg.payload.state.num;
+        break;
+    case VHOST_USER_SET_VRING_ADDR:
+        vr->desc = sim_uva_to_va(msg.payload.addr.desc_user_addr);
+        vr->avail = sim_uva_to_va(msg.payload.addr.avail_user_addr);
+        vr->used = sim_uva_to_va(msg.payload.addr.used_user_addr);
+        if (!vr->desc || !vr->avail || !vr->used) {
+            vr->desc = NULL;
+            ret = -1;
+        }
+        break;
+    case VHOST_USER_SET_VRING_KICK:
+    case VHOST_USER_SET_VRING_CALL:
+    case VHOST_USER_SET_VRING_ERR: {
+        int *slot = msg.request == VHOST_USER_SET_VRING_KICK ? &vr->kick_fd
+                    : msg.request == VHOST_USER_SET_VRING_CALL ? &vr->call_fd
+                                                               : NULL;
+        int fd = msg.payload.u64 & VHOST_USER_VRING_NOFD_MASK ? -1
+                 : nfds > 0                                   ? fds[0]
+                                                              : -1;
+        nfds = 0;
+        if (slot == NULL) {
+            if (fd >= 0)
+                close(fd);
+            break;
+        }
+        if (*slot >= 0)
+            close(*slot);
+        *slot = fd;
+        // Without protocol features a ring starts with its kick fd
+        if (msg.request == VHOST_USER_SET_VRING_KICK &&
+            !(sim.features & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES)))
+            vr->enabled = true;
+        break;
+    }
+    case VHOST_USER_SET_VRING_ENABLE:
+        vr->enabled = msg.payload.state.num;
+        break;
+    case VHOST_USER_GET_VRING_BASE:
+        // Stops the ring
+        vr->enabled = false;
+        vr->desc = NULL;
+        msg.payload.state.num = vr->last_avail_idx;
+        msg.size = sizeof(msg.payload.state);
+        sim_reply(&msg);
+        replied = true;
+        if (vr->kick_fd >= 0)
+            close(vr->kick_fd);
+        vr->kick_fd = -1;
+        break;
+    case VHOST_USER_GET_CONFIG:
+        sim_get_config(&msg);
+        replied = true;
+        break;
+    case VHOST_USER_SET_CONFIG:
+        // Only the writeback field is writable, and it changes nothing here
+        break;
+    default:
+        fprintf(stderr, "unsupported request %u\n", msg.request);
+        ret = -1;
+        break;
+    }
+    for (int i = 0; i < nfds && msg.request == VHOST_USER_SET_MEM_TABLE; i++)
+        close(fds[i]);
+    if (!replied && (msg.flags & VHOST_USER_NEED_REPLY_MASK))
+        sim_reply_u64(&msg, ret < 0);
+    return 0;
+}
+
+static void sim_serve() {
+    struct pollfd pfds[VHOST_USER_MAX_QUEUES + 1];
+    int owner[VHOST_USER_MAX_QUEUES + 1];
+    eventfd_t cnt;
+
+    for (;;) {
+        int n = 0;
+        pfds[n].fd = sim.conn_fd;
+        pfds[n++].events = POLLIN;
+        for (int i = 0; i < sim.nqueues; i++) {
+            if (sim.vrings[i].kick_fd < 0)
+                continue;
+            owner[n] = i;
+            pfds[n].fd = sim.vrings[i].kick_fd;
+            pfds[n++].events = POLLIN;
+        }
+        if (poll(pfds, n, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        if (pfds[0].revents & (POLLHUP | POLLERR))
+            return;
+        if ((pfds[0].revents & POLLIN) && sim_handle_msg() < 0)
+            return;
+        // A message may have replaced the kick fds polled
+        if (pfds[0].revents)
+            continue;
+        for (int i = 1; i < n; i++) {
+            if (!(pfds[i].revents & POLLIN))
+                continue;
+            eventfd_read(pfds[i].fd, &cnt);
+            sim_process_vring(&sim.vrings[owner[i]]);
+        }
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s -s <socket> -f <image> [-q <queues>]\n",
+            prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    const char *socket_path = NULL, *image = NULL;
+    struct stat st;
+    int opt, listen_fd;
+
+    sim.nqueues = 1;
+    while ((opt = getopt(argc, argv, "s:f:q:")) != -1) {
+        switch (opt) {
+        case 's':
+            socket_path = optarg;
+            break;
+        case 'f':
+            image = optarg;
+            break;
+        case 'q':
+            sim.nqueues = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (socket_path == NULL || image == NULL || sim.nqueues < 1 ||
+        sim.nqueues > VHOST_USER_MAX_QUEUES)
+        usage(argv[0]);
+
+    sim.img_fd = open(image, O_RDWR);
+    if (sim.img_fd < 0 || fstat(sim.img_fd, &st) < 0) {
+        fprintf(stderr, "failed to open %s, errno is %d\n", image, errno);
+        return 1;
+    }
+    sim.capacity = st.st_size / SIM_SECTOR_SIZE;
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+    unlink(socket_path);
+    if (listen_fd < 0 ||
+        bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(listen_fd, 1) < 0) {
+        fprintf(stderr, "failed to listen on %s, errno is %d\n", socket_path,
+                errno);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    sim_reset_vrings();
+    printf("vhost-user-blk backend on %s, %llu sectors, %d queues\n",
+           socket_path, (unsigned long long)sim.capacity, sim.nqueues);
+
+    for (;;) {
+        sim.conn_fd = accept(listen_fd, NULL, NULL);
+        if (sim.conn_fd < 0)
+            continue;
+        printf("frontend connected\n");
+        sim_serve();
+        printf("frontend disconnected after %llu requests\n",
+               (unsigned long long)sim.requests);
+        close(sim.conn_fd);
+        sim_reset_vrings();
+        sim_unmap_regions();
+        sim.features = sim.protocol_features = 0;
+    }
+    return 0;
+}
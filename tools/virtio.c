@@ -17,8 +17,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <poll.h>
 #include <sys/mman.h>
 #include <sys/prctl.h>
+#include <sys/signalfd.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/uio.h>
@@ -33,12 +35,23 @@
 #include "virtio_console.h"
 #include "virtio_gpu.h"
 #include "virtio_net.h"
+#include "virtio_net_switch.h"
+#include "virtio_vsock.h"
+#include "virtio_fs.h"
+#include "virtio_balloon.h"
+#include "virtio_pmem.h"
+#include "virtio_poll.h"
+#include "virtio_crypto.h"
+#include "vhost_user.h"
+#include "virtio_supervisor.h"
 
 /// hvisor kernel module fd
 int ko_fd;
 volatile struct virtio_bridge *virtio_bridge;
 
 pthread_mutex_t RES_MUTEX = PTHREAD_MUTEX_INITIALIZER;
+// Guards the res list, shared by all processes in supervisor mode
+pthread_mutex_t *res_mutex = &RES_MUTEX;
 VirtIODevice *vdevs[MAX_DEVS];
 int vdevs_num;
 
@@ -65,6 +78,18 @@ const char *virtio_device_type_to_string(VirtioDeviceType type) {
         return "virtio-console";
     case VirtioTGPU:
         return "virtio-gpu";
+    case VirtioTVsock:
+        return "virtio-vsock";
+    case VirtioTFS:
+        return "virtio-fs";
+    case VirtioTBalloon:
+        return "virtio-balloon";
+    case VirtioTPmem:
+        return "virtio-pmem";
+    case VirtioTCrypto:
+        return "virtio-crypto";
+    case VirtioTVhostUser:
+        return "vhost-user";
     default:
         return "unknown";
     }
@@ -179,19 +204,25 @@ VirtIODevice *create_virtio_device(VirtioDeviceType dev_type, uint32_t zone_id,
         vdev->regs.dev_feature = NET_SUPPORTED_FEATURES;
         vdev->dev = init_net_dev(arg0);
         init_virtio_queue(vdev, dev_type);
-        is_err = virtio_net_init(vdev, (char *)arg1);
+        is_err = virtio_net_init(vdev, (NetRequestedState *)arg1);
+        free(arg1);
         break;
 
     case VirtioTConsole:
         vdev->regs.dev_feature = CONSOLE_SUPPORTED_FEATURES;
         vdev->dev = init_console_dev();
         init_virtio_queue(vdev, dev_type);
-        is_err = virtio_console_init(vdev);
+        is_err = virtio_console_init(vdev, (ConsoleRequestedState *)arg0);
+        free(arg0);
         break;
 
     case VirtioTGPU:
 #ifdef ENABLE_VIRTIO_GPU
         vdev->regs.dev_feature = GPU_SUPPORTED_FEATURES;
+        if (((GPURequestedState *)arg0)->blob)
+            vdev->regs.dev_feature |= 1ULL << VIRTIO_GPU_F_RESOURCE_BLOB;
+        if (((GPURequestedState *)arg0)->virgl)
+            vdev->regs.dev_feature |= 1ULL << VIRTIO_GPU_F_VIRGL;
         vdev->dev = init_gpu_dev((GPURequestedState *)arg0);
         free(arg0);
         init_virtio_queue(vdev, dev_type);
@@ -202,6 +233,54 @@ VirtIODevice *create_virtio_device(VirtioDeviceType dev_type, uint32_t zone_id,
 #endif
         break;
 
+    case VirtioTVsock:
+        vdev->regs.dev_feature = VSOCK_SUPPORTED_FEATURES;
+        vdev->dev = init_vsock_dev();
+        init_virtio_queue(vdev, dev_type);
+        is_err = virtio_vsock_init(vdev, (VsockRequestedState *)arg0);
+        free(arg0);
+        break;
+
+    case VirtioTFS:
+        vdev->regs.dev_feature = FS_SUPPORTED_FEATURES;
+        vdev->dev = init_fs_dev();
+        init_virtio_queue(vdev, dev_type);
+        is_err = virtio_fs_init(vdev, (FsRequestedState *)arg0);
+        free(arg0);
+        break;
+
+    case VirtioTBalloon:
+        vdev->regs.dev_feature = BALLOON_SUPPORTED_FEATURES;
+        vdev->dev = init_balloon_dev();
+        init_virtio_queue(vdev, dev_type);
+        is_err = virtio_balloon_init(vdev, (BalloonRequestedState *)arg0);
+        free(arg0);
+        break;
+
+    case VirtioTPmem:
+        vdev->regs.dev_feature = PMEM_SUPPORTED_FEATURES;
+        vdev->dev = init_pmem_dev();
+        init_virtio_queue(vdev, dev_type);
+        is_err = virtio_pmem_init(vdev, (PmemRequestedState *)arg0);
+        free(arg0);
+        break;
+
+    case VirtioTCrypto:
+        vdev->regs.dev_feature = CRYPTO_SUPPORTED_FEATURES;
+        vdev->dev = init_crypto_dev();
+        init_virtio_queue(vdev, dev_type);
+        is_err = virtio_crypto_init(vdev, (CryptoRequestedState *)arg0);
+        free(arg0);
+        break;
+
+    case VirtioTVhostUser:
+        // Features, queues and the device ID come from the backend
+        vdev->dev = init_vhost_user_dev();
+        init_virtio_queue(vdev, dev_type);
+        is_err = vhost_user_init(vdev, (VhostUserRequestedState *)arg0);
+        free(arg0);
+        break;
+
     default:
         log_error("unsupported virtio device type");
         goto err;
@@ -253,12 +332,13 @@ void init_virtio_queue(VirtIODevice *vdev, VirtioDeviceType type) {
         vdev->vqs_len = NET_MAX_QUEUES;
         vqs = malloc(sizeof(VirtQueue) * NET_MAX_QUEUES);
         for (int i = 0; i < NET_MAX_QUEUES; ++i) {
-            virtqueue_reset(vqs, i);
+            virtqueue_reset(&vqs[i], i);
             vqs[i].queue_num_max = VIRTQUEUE_NET_MAX_SIZE;
             vqs[i].dev = vdev;
         }
         vqs[NET_QUEUE_RX].notify_handler = virtio_net_rxq_notify_handler;
         vqs[NET_QUEUE_TX].notify_handler = virtio_net_txq_notify_handler;
+        vqs[NET_QUEUE_CTRL].notify_handler = virtio_net_ctrlq_notify_handler;
         vdev->vqs = vqs;
         break;
 
@@ -266,14 +346,19 @@ void init_virtio_queue(VirtIODevice *vdev, VirtioDeviceType type) {
         vdev->vqs_len = CONSOLE_MAX_QUEUES;
         vqs = malloc(sizeof(VirtQueue) * CONSOLE_MAX_QUEUES);
         for (int i = 0; i < CONSOLE_MAX_QUEUES; ++i) {
-            virtqueue_reset(vqs, i);
+            virtqueue_reset(&vqs[i], i);
             vqs[i].queue_num_max = VIRTQUEUE_CONSOLE_MAX_SIZE;
             vqs[i].dev = vdev;
         }
-        vqs[CONSOLE_QUEUE_RX].notify_handler =
-            virtio_console_rxq_notify_handler;
-        vqs[CONSOLE_QUEUE_TX].notify_handler =
-            virtio_console_txq_notify_handler;
+        // Even queues take input of a port, odd queues output, except for
+        // the control queues
+        for (int i = 0; i < CONSOLE_MAX_QUEUES; ++i)
+            vqs[i].notify_handler = (i & 1) ? virtio_console_txq_notify_handler
+                                            : virtio_console_rxq_notify_handler;
+        vqs[CONSOLE_QUEUE_CTRL_RX].notify_handler =
+            virtio_console_ctrl_rxq_notify_handler;
+        vqs[CONSOLE_QUEUE_CTRL_TX].notify_handler =
+            virtio_console_ctrl_txq_notify_handler;
         vdev->vqs = vqs;
         break;
 
@@ -282,7 +367,7 @@ void init_virtio_queue(VirtIODevice *vdev, VirtioDeviceType type) {
         vdev->vqs_len = GPU_MAX_QUEUES;
         vqs = malloc(sizeof(VirtQueue) * GPU_MAX_QUEUES);
         for (int i = 0; i < GPU_MAX_QUEUES; ++i) {
-            virtqueue_reset(vqs, i);
+            virtqueue_reset(&vqs[i], i);
             vqs[i].queue_num_max = VIRTQUEUE_GPU_MAX_SIZE;
             vqs[i].dev = vdev;
         }
@@ -294,6 +379,83 @@ void init_virtio_queue(VirtIODevice *vdev, VirtioDeviceType type) {
 #endif
         break;
 
+    case VirtioTVsock:
+        vdev->vqs_len = VSOCK_MAX_QUEUES;
+        vqs = malloc(sizeof(VirtQueue) * VSOCK_MAX_QUEUES);
+        for (int i = 0; i < VSOCK_MAX_QUEUES; ++i) {
+            virtqueue_reset(&vqs[i], i);
+            vqs[i].queue_num_max = VIRTQUEUE_VSOCK_MAX_SIZE;
+            vqs[i].dev = vdev;
+        }
+        vqs[VSOCK_QUEUE_RX].notify_handler = virtio_vsock_rxq_notify_handler;
+        vqs[VSOCK_QUEUE_TX].notify_handler = virtio_vsock_txq_notify_handler;
+        vqs[VSOCK_QUEUE_EVENT].notify_handler =
+            virtio_vsock_evq_notify_handler;
+        vdev->vqs = vqs;
+        break;
+
+    case VirtioTFS:
+        vdev->vqs_len = FS_MAX_QUEUES;
+        vqs = malloc(sizeof(VirtQueue) * FS_MAX_QUEUES);
+        for (int i = 0; i < FS_MAX_QUEUES; ++i) {
+            virtqueue_reset(&vqs[i], i);
+            vqs[i].queue_num_max = VIRTQUEUE_FS_MAX_SIZE;
+            vqs[i].dev = vdev;
+            vqs[i].notify_handler = virtio_fs_notify_handler;
+        }
+        vqs[FS_QUEUE_HIPRIO].notify_handler = virtio_fs_hiprio_notify_handler;
+        vdev->vqs = vqs;
+        break;
+
+    case VirtioTBalloon:
+        vdev->vqs_len = BALLOON_MAX_QUEUES;
+        vqs = malloc(sizeof(VirtQueue) * BALLOON_MAX_QUEUES);
+        for (int i = 0; i < BALLOON_MAX_QUEUES; ++i) {
+            virtqueue_reset(&vqs[i], i);
+            vqs[i].queue_num_max = VIRTQUEUE_BALLOON_MAX_SIZE;
+            vqs[i].dev = vdev;
+            vqs[i].notify_handler = virtio_balloon_notify_handler;
+        }
+        vdev->vqs = vqs;
+        break;
+
+    case VirtioTPmem:
+        vdev->vqs_len = PMEM_MAX_QUEUES;
+        vqs = malloc(sizeof(VirtQueue) * PMEM_MAX_QUEUES);
+        virtqueue_reset(&vqs[0], 0);
+        vqs[0].queue_num_max = VIRTQUEUE_PMEM_MAX_SIZE;
+        vqs[0].notify_handler = virtio_pmem_notify_handler;
+        vqs[0].dev = vdev;
+        vdev->vqs = vqs;
+        break;
+
+    case VirtioTCrypto:
+        // The control queue is placed after the data queues in use by
+        // virtio_crypto_init
+        vdev->vqs_len = CRYPTO_MAX_QUEUES;
+        vqs = malloc(sizeof(VirtQueue) * CRYPTO_MAX_QUEUES);
+        for (int i = 0; i < CRYPTO_MAX_QUEUES; ++i) {
+            virtqueue_reset(&vqs[i], i);
+            vqs[i].queue_num_max = VIRTQUEUE_CRYPTO_MAX_SIZE;
+            vqs[i].dev = vdev;
+            vqs[i].notify_handler = virtio_crypto_dataq_notify_handler;
+        }
+        vdev->vqs = vqs;
+        break;
+
+    case VirtioTVhostUser:
+        // vhost_user_init keeps the queues the backend serves
+        vdev->vqs_len = VHOST_USER_MAX_QUEUES;
+        vqs = malloc(sizeof(VirtQueue) * VHOST_USER_MAX_QUEUES);
+        for (int i = 0; i < VHOST_USER_MAX_QUEUES; ++i) {
+            virtqueue_reset(&vqs[i], i);
+            vqs[i].queue_num_max = VHOST_USER_DEFAULT_QUEUE_SIZE;
+            vqs[i].dev = vdev;
+            vqs[i].notify_handler = vhost_user_kick;
+        }
+        vdev->vqs = vqs;
+        break;
+
     default:
         break;
     }
@@ -309,6 +471,10 @@ void init_mmio_regs(VirtMmioRegs *regs, VirtioDeviceType type) {
 void virtio_dev_reset(VirtIODevice *vdev) {
     // When driver read first 4 encoded messages, it will reset dev.
     log_trace("virtio dev reset");
+    if (vdev->activated && vdev->poller)
+        virtio_poll_activate(vdev, false);
+    if (vdev->activated && vdev->virtio_activate)
+        vdev->virtio_activate(vdev, false);
     vdev->regs.status = 0;
     vdev->regs.interrupt_status = 0;
     vdev->regs.interrupt_count = 0;
@@ -362,6 +528,93 @@ void *get_virt_addr(void *zonex_ipa, int zone_id) {
            zone_mem[zone_id][ram_idx][ZONEX_IPA] + zonex_ipa;
 }
 
+/// Take the page faults of a zone's RAM now rather than on the first request
+/// touching each page. The kernel module maps it on faults, with huge pages
+/// where it can; MAP_POPULATE and mlock skip such pfn mappings. The module
+/// only uses huge pages for the RAM of started zones, so this waits for the
+/// first device of the zone to be activated.
+static void prefault_zone_mem(int zone_id) {
+    static bool prefaulted[MAX_ZONES];
+    uint64_t page_size = sysconf(_SC_PAGESIZE);
+    volatile uint8_t *addr;
+
+    if (prefaulted[zone_id])
+        return;
+    prefaulted[zone_id] = true;
+    for (int i = 0; i < MAX_RAMS; i++) {
+        addr = (volatile uint8_t *)zone_mem[zone_id][i][VIRT_ADDR];
+        for (uint64_t off = 0; off < zone_mem[zone_id][i][MEM_SIZE];
+             off += page_size)
+            (void)addr[off];
+    }
+}
+
+void *map_zone_mem(int zone_id, uint64_t zone0_ipa, uint64_t zonex_ipa,
+                   uint64_t size) {
+    void *virt_addr;
+    int i;
+    for (i = 0; i < MAX_RAMS; i++)
+        if (zone_mem[zone_id][i][MEM_SIZE] == 0)
+            break;
+    if (i == MAX_RAMS) {
+        log_error("Exceed maximum memory region number of zone %d", zone_id);
+        return NULL;
+    }
+    // Map from zone0_ipa
+    virt_addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, ko_fd,
+                     (off_t)zone0_ipa);
+    if (virt_addr == MAP_FAILED) {
+        log_error("mmap failed");
+        return NULL;
+    }
+    zone_mem[zone_id][i][VIRT_ADDR] = (unsigned long long)virt_addr;
+    zone_mem[zone_id][i][ZONE0_IPA] = zone0_ipa;
+    zone_mem[zone_id][i][ZONEX_IPA] = zonex_ipa;
+    zone_mem[zone_id][i][MEM_SIZE] = size;
+    return virt_addr;
+}
+
+int get_zone_mem_regions(int zone_id, ZoneMemRegion *regions, int max) {
+    int n = 0;
+    for (int i = 0; i < MAX_RAMS && n < max; i++) {
+        if (zone_mem[zone_id][i][MEM_SIZE] == 0)
+            continue;
+        regions[n].zonex_ipa = zone_mem[zone_id][i][ZONEX_IPA];
+        regions[n].size = zone_mem[zone_id][i][MEM_SIZE];
+        regions[n].virt_addr = (void *)zone_mem[zone_id][i][VIRT_ADDR];
+        regions[n].zone0_ipa = zone_mem[zone_id][i][ZONE0_IPA];
+        n++;
+    }
+    return n;
+}
+
+int export_zone_dmabuf(int zone_id, uint64_t zonex_ipa, uint64_t size) {
+    dmabuf_export_args_t args;
+    int i, fd;
+
+    i = get_zone_ram_index((void *)zonex_ipa, zone_id);
+    if (i < 0)
+        return -1;
+    if (zonex_ipa + size > zone_mem[zone_id][i][ZONEX_IPA] +
+                               zone_mem[zone_id][i][MEM_SIZE]) {
+        log_error("zone %d buffer %#llx + %#llx crosses a RAM region",
+                  zone_id, zonex_ipa, size);
+        return -1;
+    }
+    args.zone_id = zone_id;
+    args.pa = zone_mem[zone_id][i][ZONE0_IPA] + zonex_ipa -
+              zone_mem[zone_id][i][ZONEX_IPA];
+    args.size = size;
+    fd = ioctl(ko_fd, HVISOR_EXPORT_DMABUF, &args);
+    if (fd < 0) {
+        log_warn("failed to export zone %d buffer %#llx as a dma-buf, errno "
+                 "is %d",
+                 zone_id, zonex_ipa, errno);
+        return -1;
+    }
+    return fd;
+}
+
 // When virtio device is processing virtqueue, driver adding an elem to
 // virtqueue is no need to notify device.
 void virtqueue_disable_notify(VirtQueue *vq) {
@@ -374,6 +627,9 @@ void virtqueue_disable_notify(VirtQueue *vq) {
 }
 
 void virtqueue_enable_notify(VirtQueue *vq) {
+    // The poller keeps notifications suppressed until it goes idle
+    if (vq->polled)
+        return;
     if (vq->event_idx_enabled) {
         VQ_AVAIL_EVENT(vq) = vq->avail_ring->idx;
     } else {
@@ -713,6 +969,10 @@ void virtio_mmio_write(VirtIODevice *vdev, uint64_t offset, uint64_t value,
 
     if (offset >= VIRTIO_MMIO_CONFIG) {
         offset -= VIRTIO_MMIO_CONFIG;
+        if (vdev->virtio_config_write) {
+            vdev->virtio_config_write(vdev, offset, value, size);
+            return;
+        }
         log_error("virtio_mmio_write: can't write config space");
         return;
     }
@@ -787,7 +1047,8 @@ void virtio_mmio_write(VirtIODevice *vdev, uint64_t offset, uint64_t value,
         if (value < vdev->vqs_len) {
             log_trace("queue notify ready, handler addr is %#x",
                       vqs[value].notify_handler);
-            vqs[value].notify_handler(vdev, &vqs[value]);
+            if (!vdev->poller || !virtio_poll_kick(vdev, value))
+                vqs[value].notify_handler(vdev, &vqs[value]);
         }
 
         log_debug("****** zone %d %s queue notify end ******", vdev->zone_id,
@@ -814,6 +1075,13 @@ void virtio_mmio_write(VirtIODevice *vdev, uint64_t offset, uint64_t value,
         regs->status = value;
         if (regs->status == 0) {
             virtio_dev_reset(vdev);
+        } else if ((value & VIRTIO_CONFIG_S_DRIVER_OK) && !vdev->activated) {
+            vdev->activated = true;
+            prefault_zone_mem(vdev->zone_id);
+            if (vdev->virtio_activate)
+                vdev->virtio_activate(vdev, true);
+            if (vdev->poller)
+                virtio_poll_activate(vdev, true);
         }
         break;
     case VIRTIO_MMIO_QUEUE_DESC_LOW:
@@ -869,6 +1137,30 @@ inline bool in_range(uint64_t value, uint64_t lower, uint64_t len) {
     return ((value >= lower) && (value < (lower + len)));
 }
 
+// Add the device's irq to the res list and notify hypervisor through ioctl.
+// status is ORed in, so a pending config change isn't lost to a vring irq.
+static void virtio_push_irq(VirtIODevice *vdev, uint32_t status) {
+    volatile struct device_res *res;
+    while (is_queue_full(virtio_bridge->res_front, virtio_bridge->res_rear,
+                         MAX_REQ))
+        ;
+    // A supervisor worker may have died holding it. res_rear only moves
+    // once its entry is written, so the list is still consistent.
+    if (pthread_mutex_lock(res_mutex) == EOWNERDEAD)
+        pthread_mutex_consistent(res_mutex);
+    unsigned int res_rear = virtio_bridge->res_rear;
+    res = &virtio_bridge->res_list[res_rear];
+    res->irq_id = vdev->irq_id;
+    res->target_zone = vdev->zone_id;
+    write_barrier();
+    virtio_bridge->res_rear = (res_rear + 1) & (MAX_REQ - 1);
+    write_barrier();
+    vdev->regs.interrupt_status |= status;
+    vdev->regs.interrupt_count++;
+    pthread_mutex_unlock(res_mutex);
+    ioctl(ko_fd, HVISOR_FINISH_REQ);
+}
+
 // Inject irq_id to target zone. It will add to res list, and notify hypervisor
 // through ioctl.
 void virtio_inject_irq(VirtQueue *vq) {
@@ -893,24 +1185,17 @@ void virtio_inject_irq(VirtQueue *vq) {
             return;
         }
     }
-    volatile struct device_res *res;
-    while (is_queue_full(virtio_bridge->res_front, virtio_bridge->res_rear,
-                         MAX_REQ))
-        ;
-    pthread_mutex_lock(&RES_MUTEX);
-    unsigned int res_rear = virtio_bridge->res_rear;
-    res = &virtio_bridge->res_list[res_rear];
-    res->irq_id = vq->dev->irq_id;
-    res->target_zone = vq->dev->zone_id;
-    write_barrier();
-    virtio_bridge->res_rear = (res_rear + 1) & (MAX_REQ - 1);
-    write_barrier();
-    vq->dev->regs.interrupt_status = VIRTIO_MMIO_INT_VRING;
-    vq->dev->regs.interrupt_count++;
-    pthread_mutex_unlock(&RES_MUTEX);
+    virtio_push_irq(vq->dev, VIRTIO_MMIO_INT_VRING);
     log_debug("inject irq to device %s, vq is %d",
               virtio_device_type_to_string(vq->dev->type), vq->vq_idx);
-    ioctl(ko_fd, HVISOR_FINISH_REQ);
+}
+
+void virtio_inject_config_irq(VirtIODevice *vdev) {
+    vdev->regs.generation++;
+    write_barrier();
+    virtio_push_irq(vdev, VIRTIO_MMIO_INT_CONFIG);
+    log_debug("inject config irq to device %s",
+              virtio_device_type_to_string(vdev->type));
 }
 
 void virtio_finish_cfg_req(uint32_t target_cpu, uint64_t value) {
@@ -965,9 +1250,17 @@ int virtio_handle_req(volatile struct device_req *req) {
 
 void virtio_close() {
     log_warn("virtio devices will be closed");
-    destroy_event_monitor();
-    for (int i = 0; i < vdevs_num; i++)
-        vdevs[i]->virtio_close(vdevs[i]);
+    if (supervisor_active()) {
+        // The devices are in the workers
+        supervisor_close();
+    } else {
+        destroy_event_monitor();
+        for (int i = 0; i < vdevs_num; i++) {
+            if (vdevs[i]->poller)
+                virtio_poll_close(vdevs[i]);
+            vdevs[i]->virtio_close(vdevs[i]);
+        }
+    }
     close(ko_fd);
     munmap((void *)virtio_bridge, MMAP_SIZE);
     for (int i = 0; i < MAX_ZONES; i++) {
@@ -981,9 +1274,72 @@ void virtio_close() {
     log_warn("virtio daemon exit successfully");
 }
 
+void virtio_dump_stats(void) {
+    for (int i = 0; i < vdevs_num; i++) {
+        if (vdevs[i]->virtio_stats)
+            vdevs[i]->virtio_stats(vdevs[i]);
+        if (vdevs[i]->poller)
+            virtio_poll_stats(vdevs[i]);
+    }
+}
+
+/// Poll /dev/hvisor for the virtio irq and a signalfd for the other signals
+/// of wait_set. Leaves pfds[1].fd at -1 if the kernel module only sends
+/// SIGHVI.
+static void virtio_wait_init(sigset_t *wait_set, struct pollfd *pfds) {
+    sigset_t mask = *wait_set;
+    uint64_t irqs;
+
+    // The supervisor's eventfd takes the irqs when the workers have theirs
+    pfds[0].fd = supervisor_irq_fd() >= 0 ? supervisor_irq_fd() : ko_fd;
+    pfds[0].events = POLLIN;
+    pfds[1].events = POLLIN;
+    sigdelset(&mask, SIGHVI);
+    pfds[1].fd = signalfd(-1, &mask, SFD_CLOEXEC);
+    if (pfds[1].fd < 0) {
+        log_error("failed to create signalfd, errno is %d", errno);
+        return;
+    }
+    // The module stops sending SIGHVI once read. Older modules have no read
+    // and fail with EINVAL.
+    fcntl(ko_fd, F_SETFL, fcntl(ko_fd, F_GETFL) | O_NONBLOCK);
+    if (read(ko_fd, &irqs, sizeof(irqs)) < 0 && errno != EAGAIN) {
+        log_info("hvisor module can't be polled, waiting for SIGHVI");
+        close(pfds[1].fd);
+        pfds[1].fd = -1;
+    }
+}
+
+/// Sleep until the virtio irq or a signal of wait_set, SIGHVI for the irq.
+static int virtio_wait(sigset_t *wait_set, struct pollfd *pfds) {
+    struct signalfd_siginfo info;
+    uint64_t irqs;
+    int sig;
+
+    if (pfds[1].fd < 0) {
+        sigwait(wait_set, &sig);
+        return sig;
+    }
+    for (;;) {
+        if (poll(pfds, 2, -1) < 0) {
+            if (errno != EINTR)
+                log_error("poll of hvisor failed, errno is %d", errno);
+            continue;
+        }
+        if ((pfds[1].revents & POLLIN) &&
+            read(pfds[1].fd, &info, sizeof(info)) == sizeof(info))
+            return info.ssi_signo;
+        if (pfds[0].revents & POLLIN) {
+            read(pfds[0].fd, &irqs, sizeof(irqs));
+            return SIGHVI;
+        }
+    }
+}
+
 void handle_virtio_requests() {
     int sig;
     sigset_t wait_set;
+    struct pollfd pfds[2];
     struct timespec timeout;
     unsigned int req_front = virtio_bridge->req_front;
     volatile struct device_req *req;
@@ -992,6 +1348,10 @@ void handle_virtio_requests() {
     sigemptyset(&wait_set);
     sigaddset(&wait_set, SIGHVI);
     sigaddset(&wait_set, SIGTERM);
+    sigaddset(&wait_set, SIGUSR2);
+    if (supervisor_active())
+        sigaddset(&wait_set, SIGCHLD);
+    virtio_wait_init(&wait_set, pfds);
     virtio_bridge->need_wakeup = 1;
 
     int signal_count = 0, proc_count = 0;
@@ -1000,11 +1360,22 @@ void handle_virtio_requests() {
 #ifndef LOONGARCH64
         log_warn("signal_count is %d, proc_count is %d", signal_count,
                  proc_count);
-        sigwait(&wait_set, &sig); // change to no signal irq
+        sig = virtio_wait(&wait_set, pfds);
         signal_count++;
         if (sig == SIGTERM) {
             virtio_close();
+            if (pfds[1].fd >= 0)
+                close(pfds[1].fd);
             break;
+        } else if (sig == SIGUSR2) {
+            if (supervisor_active())
+                supervisor_dump_stats();
+            else
+                virtio_dump_stats();
+            continue;
+        } else if (sig == SIGCHLD) {
+            supervisor_reap();
+            continue;
         } else if (sig != SIGHVI) {
             log_error("unknown signal %d", sig);
             continue;
@@ -1016,7 +1387,10 @@ void handle_virtio_requests() {
                 proc_count++;
                 req = &virtio_bridge->req_list[req_front];
                 virtio_bridge->need_wakeup = 0;
-                virtio_handle_req(req);
+                if (supervisor_active())
+                    supervisor_dispatch_req(req);
+                else
+                    virtio_handle_req(req);
                 req_front = (req_front + 1) & (MAX_REQ - 1);
                 virtio_bridge->req_front = req_front;
                 write_barrier();
@@ -1092,8 +1466,6 @@ int virtio_init() {
         goto unmap;
     }
 
-    // Initialize event_monitor used by console and net devices
-    initialize_event_monitor();
     log_info("hvisor init okay!");
     return 0;
 unmap:
@@ -1101,6 +1473,69 @@ unmap:
     return -1;
 }
 
+/// Copy the string of a json item, such as a path, to dst of size bytes.
+/// -1 if the item is missing, not a string or doesn't fit.
+static int json_copy_string(cJSON *item, char *dst, size_t size) {
+    if (!item)
+        return -1;
+    if (!cJSON_IsString(item) ||
+        snprintf(dst, size, "%s", item->valuestring) >= (int)size) {
+        log_error("'%s' must be a string shorter than %zu bytes", item->string,
+                  size);
+        return -1;
+    }
+    return 0;
+}
+
+#ifdef ENABLE_VIRTIO_GPU
+/// Size and display of a virtio-gpu scanout, the fields json leaves out are
+/// kept. -1 if the display is unknown or the path doesn't fit.
+static int gpu_scanout_from_json(cJSON *json, GPURequestedState *state) {
+    cJSON *item = NULL;
+
+    if ((item = cJSON_GetObjectItem(json, "width")))
+        state->width = item->valueint;
+    if ((item = cJSON_GetObjectItem(json, "height")))
+        state->height = item->valueint;
+    // Where frames are shown: card0, shared memory or a socket
+    if ((item = cJSON_GetObjectItem(json, "display"))) {
+        if (!strcmp(item->valuestring, "kms")) {
+            state->display = GPU_DISPLAY_KMS;
+        } else if (!strcmp(item->valuestring, "shm")) {
+            state->display = GPU_DISPLAY_SHM;
+        } else if (!strcmp(item->valuestring, "stream")) {
+            state->display = GPU_DISPLAY_STREAM;
+        } else {
+            log_error("virtio-gpu display %s is unknown", item->valuestring);
+            return -1;
+        }
+    }
+    if ((item = cJSON_GetObjectItem(json, "display_path")) &&
+        json_copy_string(item, state->display_path,
+                         sizeof(state->display_path)) < 0)
+        return -1;
+    return 0;
+}
+#endif
+
+/// Device type of a type field in json, VirtioTNone if it is unknown.
+static VirtioDeviceType virtio_device_type_from_string(const char *type) {
+    static const struct {
+        const char *name;
+        VirtioDeviceType type;
+    } types[] = {
+        {"blk", VirtioTBlock},      {"net", VirtioTNet},
+        {"console", VirtioTConsole}, {"gpu", VirtioTGPU},
+        {"vsock", VirtioTVsock},    {"fs", VirtioTFS},
+        {"balloon", VirtioTBalloon}, {"pmem", VirtioTPmem},
+        {"crypto", VirtioTCrypto},  {"vhost-user", VirtioTVhostUser},
+    };
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+        if (strcmp(type, types[i].name) == 0)
+            return types[i].type;
+    return VirtioTNone;
+}
+
 int create_virtio_device_from_json(cJSON *device_json, int zone_id) {
     VirtioDeviceType dev_type = VirtioTNone;
     uint64_t base_addr = 0, len = 0;
@@ -1113,18 +1548,12 @@ int create_virtio_device_from_json(cJSON *device_json, int zone_id) {
 
     // Get device type
     char *type = SAFE_CJSON_GET_OBJECT_ITEM(device_json, "type")->valuestring;
-    void *arg0, *arg1;
+    void *arg0 = NULL, *arg1 = NULL;
+    uint8_t mac[6];
 
     // Match the device type field in json
-    if (strcmp(type, "blk") == 0) {
-        dev_type = VirtioTBlock;
-    } else if (strcmp(type, "net") == 0) {
-        dev_type = VirtioTNet;
-    } else if (strcmp(type, "console") == 0) {
-        dev_type = VirtioTConsole;
-    } else if (strcmp(type, "gpu") == 0) {
-        dev_type = VirtioTGPU;
-    } else {
+    dev_type = virtio_device_type_from_string(type);
+    if (dev_type == VirtioTNone) {
         log_error("unknown device type %s", type);
         return -1;
     }
@@ -1137,6 +1566,35 @@ int create_virtio_device_from_json(cJSON *device_json, int zone_id) {
                   NULL, 16);
     irq_id = SAFE_CJSON_GET_OBJECT_ITEM(device_json, "irq")->valueint;
 
+    // Polled mode: a pinned thread watches the avail rings instead of waiting
+    // for the guest to kick the device
+    PollRequestedState poll_req = {.cpu = -1, .idle_us = POLL_DEFAULT_IDLE_US};
+    cJSON *poll_json = cJSON_GetObjectItem(device_json, "poll");
+    if (poll_json) {
+        cJSON *item = cJSON_GetObjectItem(device_json, "backend");
+        if (dev_type == VirtioTVhostUser ||
+            (dev_type == VirtioTNet && item &&
+             strcmp(item->valuestring, "vhost") == 0)) {
+            log_error("vhost backends consume the virtqueues themselves, "
+                      "they can't be polled");
+            return -1;
+        }
+        if ((item = cJSON_GetObjectItem(poll_json, "cpu")))
+            poll_req.cpu = item->valueint;
+        if ((item = cJSON_GetObjectItem(poll_json, "idle_us")))
+            poll_req.idle_us = item->valuedouble;
+        cJSON *queues_json = cJSON_GetObjectItem(poll_json, "queues");
+        int nqueues = queues_json ? cJSON_GetArraySize(queues_json) : 0;
+        for (int i = 0; i < nqueues; i++) {
+            int idx = cJSON_GetArrayItem(queues_json, i)->valueint;
+            if (idx < 0 || idx >= 64) {
+                log_error("invalid polled queue %d", idx);
+                return -1;
+            }
+            poll_req.queues |= 1ULL << idx;
+        }
+    }
+
     // Handle other fields according to the device type
     if (dev_type == VirtioTBlock) {
         // virtio-blk
@@ -1144,29 +1602,184 @@ int create_virtio_device_from_json(cJSON *device_json, int zone_id) {
         arg0 = img, arg1 = NULL;
     } else if (dev_type == VirtioTNet) {
         // virtio-net
-        char *tap = SAFE_CJSON_GET_OBJECT_ITEM(device_json, "tap")->valuestring;
+        NetRequestedState *requested_state =
+            calloc(1, sizeof(NetRequestedState));
+        cJSON *backend_json = cJSON_GetObjectItem(device_json, "backend");
+        char *backend = backend_json ? backend_json->valuestring : "tap";
+        char *ifname;
+        if (strcmp(backend, "tap") == 0 || strcmp(backend, "vhost") == 0) {
+            // vhost: the kernel moves frames between the zone and the tap
+            requested_state->backend =
+                backend[0] == 't' ? NET_BACKEND_TAP : NET_BACKEND_VHOST;
+            ifname =
+                SAFE_CJSON_GET_OBJECT_ITEM(device_json, "tap")->valuestring;
+        } else if (strcmp(backend, "xdp") == 0) {
+            // AF_XDP: "ifname" is the NIC (or veth) and "queue" its rx queue
+            requested_state->backend = NET_BACKEND_XDP;
+            ifname =
+                SAFE_CJSON_GET_OBJECT_ITEM(device_json, "ifname")->valuestring;
+            cJSON *queue_json = cJSON_GetObjectItem(device_json, "queue");
+            requested_state->queue_id = queue_json ? queue_json->valueint : 0;
+            cJSON *mode_json = cJSON_GetObjectItem(device_json, "xdp_mode");
+            requested_state->xdp_generic =
+                mode_json && strcmp(mode_json->valuestring, "generic") == 0;
+        } else if (strcmp(backend, "switch") == 0) {
+            // A port of the in-daemon switch, the uplink is set in "switches"
+            requested_state->backend = NET_BACKEND_SWITCH;
+            ifname = "";
+            strncpy(requested_state->switch_name,
+                    SAFE_CJSON_GET_OBJECT_ITEM(device_json, "switch")
+                        ->valuestring,
+                    sizeof(requested_state->switch_name) - 1);
+            cJSON *vlan_json = cJSON_GetObjectItem(device_json, "vlan");
+            requested_state->vlan = vlan_json ? vlan_json->valueint : 0;
+        } else {
+            log_error("unknown net backend %s", backend);
+            free(requested_state);
+            return -1;
+        }
+        strncpy(requested_state->ifname, ifname, IFNAMSIZ - 1);
+        // Token bucket shaping, rates are in Mbit/s and bursts in bytes
+        cJSON *limit_json = cJSON_GetObjectItem(device_json, "rate_limit");
+        if (limit_json) {
+            NetRateLimit *limit = &requested_state->rate_limit;
+            cJSON *item;
+            if ((item = cJSON_GetObjectItem(limit_json, "tx_mbps")))
+                limit->tx_rate = item->valuedouble * 125000;
+            if ((item = cJSON_GetObjectItem(limit_json, "tx_burst")))
+                limit->tx_burst = item->valuedouble;
+            if ((item = cJSON_GetObjectItem(limit_json, "rx_mbps")))
+                limit->rx_rate = item->valuedouble * 125000;
+            if ((item = cJSON_GetObjectItem(limit_json, "rx_burst")))
+                limit->rx_burst = item->valuedouble;
+            if ((item = cJSON_GetObjectItem(limit_json, "priority"))) {
+                if (strcmp(item->valuestring, "dscp") == 0)
+                    limit->prio = NET_PRIO_DSCP;
+                else if (strcmp(item->valuestring, "pcp") == 0)
+                    limit->prio = NET_PRIO_PCP;
+            }
+        }
         cJSON *mac_json = SAFE_CJSON_GET_OBJECT_ITEM(device_json, "mac");
-        uint8_t mac[6];
         for (int i = 0; i < 6; i++) {
             mac[i] = strtoul(
                 SAFE_CJSON_GET_ARRAY_ITEM(mac_json, i)->valuestring, NULL, 16);
         }
-        arg0 = mac, arg1 = tap;
+        arg0 = mac, arg1 = requested_state;
     } else if (dev_type == VirtioTConsole) {
-        // virtio-console
-        arg0 = arg1 = NULL;
+        // virtio-console: guest output can also go to socket clients and to a
+        // rotated log file
+        ConsoleRequestedState *requested_state =
+            calloc(1, sizeof(ConsoleRequestedState));
+        cJSON *item;
+        int err = 0;
+        if ((item = cJSON_GetObjectItem(device_json, "socket")))
+            err = json_copy_string(item, requested_state->socket,
+                                   sizeof(requested_state->socket));
+        if (!err && (item = cJSON_GetObjectItem(device_json, "log")))
+            err = json_copy_string(item, requested_state->log,
+                                   sizeof(requested_state->log));
+        if (err) {
+            free(requested_state);
+            return -1;
+        }
+        item = cJSON_GetObjectItem(device_json, "log_size");
+        requested_state->log_size = item ? item->valuedouble : 0;
+        item = cJSON_GetObjectItem(device_json, "log_files");
+        requested_state->log_files =
+            item ? item->valueint : CONSOLE_DEFAULT_LOG_FILES;
+        // Named ports for other host-guest channels, each one backed by a
+        // Unix socket or a pair of FIFOs
+        cJSON *ports_json = cJSON_GetObjectItem(device_json, "ports");
+        int nports = ports_json ? cJSON_GetArraySize(ports_json) : 0;
+        if (nports > CONSOLE_MAX_PORTS - 1) {
+            log_error("virtio-console supports at most %d named ports",
+                      CONSOLE_MAX_PORTS - 1);
+            free(requested_state);
+            return -1;
+        }
+        for (int i = 0; i < nports; i++) {
+            cJSON *port_json = cJSON_GetArrayItem(ports_json, i);
+            ConsolePortRequestedState *port = &requested_state->ports[i];
+            err = json_copy_string(
+                SAFE_CJSON_GET_OBJECT_ITEM(port_json, "name"), port->name,
+                sizeof(port->name));
+            if (!err && (item = cJSON_GetObjectItem(port_json, "socket")))
+                err = json_copy_string(item, port->socket,
+                                       sizeof(port->socket));
+            if (!err && (item = cJSON_GetObjectItem(port_json, "fifo")))
+                err = json_copy_string(item, port->fifo, sizeof(port->fifo));
+            if (err) {
+                free(requested_state);
+                return -1;
+            }
+        }
+        requested_state->nports = nports;
+        arg0 = requested_state, arg1 = NULL;
     } else if (dev_type == VirtioTGPU) {
 // virtio-gpu
 #ifdef ENABLE_VIRTIO_GPU
-        // TODO: Add display device settings
-        GPURequestedState *requested_state = NULL;
-        requested_state =
-            (GPURequestedState *)malloc(sizeof(GPURequestedState));
-        memset(requested_state, 0, sizeof(GPURequestedState));
+        // One state per scanout, the first one also holds the settings of
+        // the device
+        GPURequestedState *requested_state =
+            calloc(HVISOR_VIRTIO_GPU_MAX_SCANOUTS, sizeof(GPURequestedState));
         requested_state->width =
             SAFE_CJSON_GET_OBJECT_ITEM(device_json, "width")->valueint;
         requested_state->height =
             SAFE_CJSON_GET_OBJECT_ITEM(device_json, "height")->valueint;
+        // Framebuffers presented in turn, 2 or 3
+        cJSON *buffers_json = cJSON_GetObjectItem(device_json, "buffers");
+        requested_state->buffers =
+            buffers_json ? buffers_json->valueint : GPU_DEFAULT_FRAMEBUFFERS;
+        // Blob resources, scanned out without copies when possible
+        cJSON *blob_json = cJSON_GetObjectItem(device_json, "blob");
+        requested_state->blob = blob_json && cJSON_IsTrue(blob_json);
+        // 3D commands rendered by virglrenderer on the CPU
+        cJSON *virgl_json = cJSON_GetObjectItem(device_json, "virgl");
+        requested_state->virgl = virgl_json && cJSON_IsTrue(virgl_json);
+#ifndef ENABLE_VIRGL
+        if (requested_state->virgl) {
+            log_error("virtio-gpu virgl is not enabled, please add VIRGL=y in "
+                      "make cmd");
+            free(requested_state);
+            return -1;
+        }
+#endif
+        // Pixels of the device's buffers, guest formats are converted
+        cJSON *depth_json = cJSON_GetObjectItem(device_json, "depth");
+        requested_state->depth = depth_json ? depth_json->valueint : 24;
+        if (gpu_scanout_from_json(device_json, requested_state) < 0) {
+            free(requested_state);
+            return -1;
+        }
+        // Budget of the zone's resources, in MiB
+        cJSON *hostmem_json = cJSON_GetObjectItem(device_json, "max_hostmem");
+        if (hostmem_json) {
+            requested_state->max_hostmem =
+                (uint64_t)hostmem_json->valueint << 20;
+        }
+        // Heads of the device, each drawn by a worker of its own. They take
+        // the size and display of the device unless they set their own.
+        cJSON *scanouts_json = cJSON_GetObjectItem(device_json, "scanouts");
+        int nscanouts = scanouts_json ? cJSON_GetArraySize(scanouts_json) : 1;
+        if (nscanouts < 1 || nscanouts > HVISOR_VIRTIO_GPU_MAX_SCANOUTS) {
+            log_error("virtio-gpu supports 1 to %d scanouts, not %d",
+                      HVISOR_VIRTIO_GPU_MAX_SCANOUTS, nscanouts);
+            free(requested_state);
+            return -1;
+        }
+        // Other scanouts get shared memory objects or sockets of their own
+        for (int i = 1; i < nscanouts; i++) {
+            requested_state[i] = requested_state[0];
+            requested_state[i].display_path[0] = '\0';
+        }
+        for (int i = 0; scanouts_json && i < nscanouts; i++) {
+            if (gpu_scanout_from_json(cJSON_GetArrayItem(scanouts_json, i),
+                                      &requested_state[i]) < 0) {
+                free(requested_state);
+                return -1;
+            }
+        }
+        requested_state->scanouts_num = nscanouts;
         arg0 = requested_state;
         arg1 = NULL;
 #else
@@ -1174,17 +1787,143 @@ int create_virtio_device_from_json(cJSON *device_json, int zone_id) {
             "virtio-gpu is not enabled, please add VIRTIO_GPU=y in make cmd");
         return -1;
 #endif
+    } else if (dev_type == VirtioTVsock) {
+        // virtio-vsock: the guest's host side is a set of Unix sockets
+        VsockRequestedState *requested_state =
+            calloc(1, sizeof(VsockRequestedState));
+        cJSON *uds_path = SAFE_CJSON_GET_OBJECT_ITEM(device_json, "uds_path");
+        requested_state->guest_cid =
+            SAFE_CJSON_GET_OBJECT_ITEM(device_json, "guest_cid")->valuedouble;
+        if (json_copy_string(uds_path, requested_state->uds_path,
+                             sizeof(requested_state->uds_path)) < 0) {
+            free(requested_state);
+            return -1;
+        }
+        arg0 = requested_state, arg1 = NULL;
+    } else if (dev_type == VirtioTFS) {
+        // virtio-fs: a host directory the guest mounts by its tag
+        FsRequestedState *requested_state = calloc(1, sizeof(FsRequestedState));
+        cJSON *tag = SAFE_CJSON_GET_OBJECT_ITEM(device_json, "tag");
+        cJSON *dir = SAFE_CJSON_GET_OBJECT_ITEM(device_json, "shared_dir");
+        cJSON *item;
+        if (json_copy_string(tag, requested_state->tag,
+                             sizeof(requested_state->tag)) < 0 ||
+            json_copy_string(dir, requested_state->shared_dir,
+                             sizeof(requested_state->shared_dir)) < 0) {
+            free(requested_state);
+            return -1;
+        }
+        item = cJSON_GetObjectItem(device_json, "queues");
+        requested_state->queues = item ? item->valueint : 1;
+        item = cJSON_GetObjectItem(device_json, "threads");
+        requested_state->threads = item ? item->valueint : FS_DEFAULT_THREADS;
+        item = cJSON_GetObjectItem(device_json, "cache_timeout");
+        requested_state->cache_timeout = item ? item->valuedouble : 1.0;
+        item = cJSON_GetObjectItem(device_json, "readonly");
+        requested_state->readonly = item && cJSON_IsTrue(item);
+        arg0 = requested_state, arg1 = NULL;
+    } else if (dev_type == VirtioTBalloon) {
+        // virtio-balloon: memory the zone gives up goes back to Root Linux
+        BalloonRequestedState *requested_state =
+            calloc(1, sizeof(BalloonRequestedState));
+        cJSON *item;
+        item = cJSON_GetObjectItem(device_json, "target_mb");
+        requested_state->target_mb = item ? item->valuedouble : 0;
+        item = cJSON_GetObjectItem(device_json, "stats_period");
+        requested_state->stats_period =
+            item ? item->valueint : BALLOON_DEFAULT_STATS_PERIOD;
+        item = cJSON_GetObjectItem(device_json, "socket");
+        if (item && json_copy_string(item, requested_state->socket,
+                                     sizeof(requested_state->socket)) < 0) {
+            free(requested_state);
+            return -1;
+        }
+        arg0 = requested_state, arg1 = NULL;
+    } else if (dev_type == VirtioTPmem) {
+        // virtio-pmem: a file in a region of its own, given like an entry of
+        // memory_region
+        PmemRequestedState *requested_state =
+            calloc(1, sizeof(PmemRequestedState));
+        cJSON *item = SAFE_CJSON_GET_OBJECT_ITEM(device_json, "file");
+        if (json_copy_string(item, requested_state->file,
+                             sizeof(requested_state->file)) < 0) {
+            free(requested_state);
+            return -1;
+        }
+        requested_state->zone0_ipa = strtoull(
+            SAFE_CJSON_GET_OBJECT_ITEM(device_json, "zone0_ipa")->valuestring,
+            NULL, 16);
+        requested_state->zonex_ipa = strtoull(
+            SAFE_CJSON_GET_OBJECT_ITEM(device_json, "zonex_ipa")->valuestring,
+            NULL, 16);
+        requested_state->size = strtoull(
+            SAFE_CJSON_GET_OBJECT_ITEM(device_json, "size")->valuestring, NULL,
+            16);
+        item = cJSON_GetObjectItem(device_json, "readonly");
+        requested_state->readonly = item && cJSON_IsTrue(item);
+        arg0 = requested_state, arg1 = NULL;
+    } else if (dev_type == VirtioTCrypto) {
+        // virtio-crypto: the kernel crypto API of Root Linux
+        CryptoRequestedState *requested_state =
+            calloc(1, sizeof(CryptoRequestedState));
+        cJSON *item;
+        item = cJSON_GetObjectItem(device_json, "queues");
+        requested_state->queues = item ? item->valueint : 1;
+        item = cJSON_GetObjectItem(device_json, "threads");
+        requested_state->threads = item ? item->valueint : 2;
+        arg0 = requested_state, arg1 = NULL;
+    } else if (dev_type == VirtioTVhostUser) {
+        // vhost-user: an external backend serves the virtqueues
+        VhostUserRequestedState *requested_state =
+            calloc(1, sizeof(VhostUserRequestedState));
+        cJSON *item = SAFE_CJSON_GET_OBJECT_ITEM(device_json, "socket");
+        if (json_copy_string(item, requested_state->socket,
+                             sizeof(requested_state->socket)) < 0) {
+            free(requested_state);
+            return -1;
+        }
+        item = SAFE_CJSON_GET_OBJECT_ITEM(device_json, "device");
+        if (!cJSON_IsString(item)) {
+            log_error("vhost-user needs the type of its device");
+            free(requested_state);
+            return -1;
+        }
+        requested_state->device = virtio_device_type_from_string(
+            item->valuestring);
+        item = cJSON_GetObjectItem(device_json, "queues");
+        requested_state->queues = item ? item->valueint : 0;
+        item = cJSON_GetObjectItem(device_json, "queue_size");
+        requested_state->queue_size = item ? item->valueint : 0;
+        // Config space as a hex string, for backends without GET_CONFIG
+        item = cJSON_GetObjectItem(device_json, "config");
+        if (item && cJSON_IsString(item)) {
+            const char *hex = item->valuestring;
+            int n = 0;
+            while (n < VHOST_USER_CONFIG_SIZE &&
+                   sscanf(hex + 2 * n, "%2hhx", &requested_state->config[n]) ==
+                       1)
+                n++;
+            requested_state->config_len = n;
+        }
+        arg0 = requested_state, arg1 = NULL;
     }
 
     // Check for missing fields
-    if (base_addr == 0 || len == 0 || irq_id == 0) {
+    if (base_addr == 0 || len == 0 || irq_id == 0 || arg0 == NULL) {
         log_error("missing arguments");
         return -1;
     }
 
     // Create virtio_device
-    if (!create_virtio_device(dev_type, zone_id, base_addr, len, irq_id, arg0,
-                              arg1)) {
+    VirtIODevice *vdev = create_virtio_device(dev_type, zone_id, base_addr,
+                                              len, irq_id, arg0, arg1);
+    if (!vdev) {
+        return -1;
+    }
+    if (poll_json && virtio_poll_init(vdev, &poll_req) < 0) {
+        // The device was just added last, drop it again
+        vdevs[--vdevs_num] = NULL;
+        vdev->virtio_close(vdev);
         return -1;
     }
 
@@ -1195,7 +1934,7 @@ int virtio_start_from_json(char *json_path) {
     char *buffer = NULL;
     u_int64_t file_size;
     int zone_id, num_devices = 0, err = 0, num_zones = 0;
-    void *zone0_ipa, *zonex_ipa, *virt_addr;
+    void *zone0_ipa, *zonex_ipa;
     unsigned long long mem_size;
     buffer = read_file(json_path, &file_size);
     buffer[file_size] = '\0';
@@ -1210,6 +1949,24 @@ int virtio_start_from_json(char *json_path) {
         goto err_out;
     }
 
+    // Uplinks of the in-daemon switches connecting zones' net devices
+    cJSON *switches_json = cJSON_GetObjectItem(root, "switches");
+    for (int i = 0; i < cJSON_GetArraySize(switches_json); i++) {
+        cJSON *switch_json = SAFE_CJSON_GET_ARRAY_ITEM(switches_json, i);
+        cJSON *uplink_json = cJSON_GetObjectItem(switch_json, "uplink");
+        if (uplink_json == NULL)
+            continue;
+        if (!supervisor_owns_switch(i))
+            continue;
+        err = net_switch_add_uplink(
+            SAFE_CJSON_GET_OBJECT_ITEM(switch_json, "name")->valuestring,
+            uplink_json->valuestring);
+        if (err) {
+            log_error("create switch uplink failed");
+            goto err_out;
+        }
+    }
+
     // Match zone information
     for (int i = 0; i < num_zones; i++) {
         cJSON *zone_json = SAFE_CJSON_GET_ARRAY_ITEM(zones_json, i);
@@ -1223,6 +1980,9 @@ int virtio_start_from_json(char *json_path) {
             err = -1;
             goto err_out;
         }
+        // A worker only maps the zones it serves
+        if (!supervisor_owns_zone(zone_id))
+            continue;
         int num_mems = SAFE_CJSON_GET_ARRAY_SIZE(memory_region_json);
 
         // Memory regions
@@ -1244,23 +2004,18 @@ int virtio_start_from_json(char *json_path) {
                 log_error("Invalid memory size");
                 continue;
             }
-            // Map from zone0_ipa
-            virt_addr = mmap(NULL, mem_size, PROT_READ | PROT_WRITE, MAP_SHARED,
-                             ko_fd, (off_t)zone0_ipa);
-            if (virt_addr == (void *)-1) {
-                log_error("mmap failed");
+            if (map_zone_mem(zone_id, (uint64_t)zone0_ipa,
+                             (uint64_t)zonex_ipa, mem_size) == NULL) {
                 err = -1;
                 goto err_out;
             }
-            zone_mem[zone_id][j][VIRT_ADDR] = virt_addr;
-            zone_mem[zone_id][j][ZONE0_IPA] = zone0_ipa;
-            zone_mem[zone_id][j][ZONEX_IPA] = zonex_ipa;
-            zone_mem[zone_id][j][MEM_SIZE] = mem_size;
         }
 
         num_devices = SAFE_CJSON_GET_ARRAY_SIZE(devices_json);
         for (int j = 0; j < num_devices; j++) {
             cJSON *device = SAFE_CJSON_GET_ARRAY_ITEM(devices_json, j);
+            if (!supervisor_owns_device(zone_id, j))
+                continue;
             err = create_virtio_device_from_json(device, zone_id);
             if (err) {
                 log_error("create virtio device failed");
@@ -1281,8 +2036,19 @@ int virtio_start(int argc, char *argv[]) {
     if (err)
         return -1;
 
-    err = virtio_start_from_json(
-        argv[3]); // Start virtio devices based on virtio_cfg_*.json
+    // With isolation, devices are started in workers forked by the
+    // supervisor
+    err = supervisor_read_isolation(argv[3]);
+    if (err < 0)
+        goto err_out;
+    if (supervisor_active()) {
+        err = supervisor_start(argv[3]);
+    } else {
+        // Initialize event_monitor used by console and net devices
+        initialize_event_monitor();
+        err = virtio_start_from_json(
+            argv[3]); // Start virtio devices based on virtio_cfg_*.json
+    }
     if (err)
         goto err_out;
 
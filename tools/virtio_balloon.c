@@ -0,0 +1,658 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/**
+ * Copyright (c) 2025 Syswonder
+ *
+ * Syswonder Website:
+ *      https://www.syswonder.org
+ */
+// virtio-balloon: takes memory from a zone on request and learns about the
+// zone's free memory through free page hints and free page reporting. Pages
+// the zone gives up are discarded from the daemon's mapping of zone RAM when
+// that mapping is backed by pageable memory, so Root Linux gets them back.
+#define _GNU_SOURCE
+
+#include "virtio_balloon.h"
+#include "log.h"
+#include "virtio.h"
+#include <errno.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static const char *balloon_stat_names[] = VIRTIO_BALLOON_S_NAMES;
+
+BalloonDev *init_balloon_dev() {
+    BalloonDev *dev = (BalloonDev *)calloc(1, sizeof(BalloonDev));
+    pthread_mutex_init(&dev->lock, NULL);
+    dev->listen_fd = -1;
+    dev->wake_fd = -1;
+    for (int i = 0; i < BALLOON_MAX_CLIENTS; i++)
+        dev->clients[i] = -1;
+    return dev;
+}
+
+static inline void balloon_wake(BalloonDev *dev) {
+    if (dev->wake_fd >= 0)
+        eventfd_write(dev->wake_fd, 1);
+}
+
+/// Which queue vq is, given the features the driver accepted.
+static BalloonQueue balloon_queue(VirtIODevice *vdev, VirtQueue *vq) {
+    static const int features[] = {
+        -1,
+        -1,
+        VIRTIO_BALLOON_F_STATS_VQ,
+        VIRTIO_BALLOON_F_FREE_PAGE_HINT,
+        VIRTIO_BALLOON_F_REPORTING,
+    };
+    uint64_t idx = 0;
+    for (int q = 0; q < BALLOON_MAX_QUEUES; q++) {
+        if (features[q] >= 0 &&
+            !(vdev->regs.drv_feature & (1ULL << features[q])))
+            continue;
+        if (idx++ == vq->vq_idx)
+            return q;
+    }
+    return BALLOON_QUEUE_NONE;
+}
+
+static VirtQueue *balloon_find_queue(VirtIODevice *vdev, BalloonQueue queue) {
+    for (uint32_t i = 0; i < vdev->vqs_len; i++)
+        if (balloon_queue(vdev, &vdev->vqs[i]) == queue)
+            return &vdev->vqs[i];
+    return NULL;
+}
+
+static inline bool balloon_has_feature(VirtIODevice *vdev, int feature) {
+    return vdev->regs.drv_feature & (1ULL << feature);
+}
+
+/*********************************************************************
+    Discarding zone memory
+ */
+static BalloonRegion *balloon_region_of_ipa(BalloonDev *dev, uint64_t ipa) {
+    for (int i = 0; i < dev->nregions; i++) {
+        BalloonRegion *r = &dev->regions[i];
+        if (ipa >= r->mem.zonex_ipa && ipa - r->mem.zonex_ipa < r->mem.size)
+            return r;
+    }
+    return NULL;
+}
+
+static BalloonRegion *balloon_region_of_hva(BalloonDev *dev, void *hva) {
+    for (int i = 0; i < dev->nregions; i++) {
+        BalloonRegion *r = &dev->regions[i];
+        if ((uintptr_t)hva >= (uintptr_t)r->mem.virt_addr &&
+            (uintptr_t)hva - (uintptr_t)r->mem.virt_addr < r->mem.size)
+            return r;
+    }
+    return NULL;
+}
+
+/// Give the host pages wholly inside [hva, hva + len) of region r back to
+/// Root Linux, and return how many bytes were given back. The first call
+/// on a region finds out which madvise its memory supports.
+static uint64_t balloon_discard(BalloonDev *dev, BalloonRegion *r, void *hva,
+                                uint64_t len) {
+    uintptr_t start = (uintptr_t)hva, end;
+    uintptr_t region_end = (uintptr_t)r->mem.virt_addr + r->mem.size;
+
+    end = MIN(start + len, region_end);
+    start = roundup(start, dev->host_page_size);
+    end -= end % dev->host_page_size;
+    if (start >= end)
+        return 0;
+
+    switch (r->discard) {
+    case BALLOON_DISCARD_UNKNOWN:
+        if (madvise((void *)start, end - start, MADV_REMOVE) == 0) {
+            r->discard = BALLOON_DISCARD_REMOVE;
+        } else if (madvise((void *)start, end - start, MADV_DONTNEED) == 0) {
+            r->discard = BALLOON_DISCARD_DONTNEED;
+        } else {
+            r->discard = BALLOON_DISCARD_NONE;
+            log_warn("zone RAM at %#llx can't be given back to Root Linux, "
+                     "errno is %d; the balloon only accounts for it",
+                     (unsigned long long)r->mem.zonex_ipa, errno);
+            return 0;
+        }
+        break;
+    case BALLOON_DISCARD_REMOVE:
+    case BALLOON_DISCARD_DONTNEED:
+        if (madvise((void *)start, end - start,
+                    r->discard == BALLOON_DISCARD_REMOVE ? MADV_REMOVE
+                                                         : MADV_DONTNEED)) {
+            log_error("Failed to discard zone RAM, errno is %d", errno);
+            return 0;
+        }
+        break;
+    default:
+        return 0;
+    }
+    dev->discarded += end - start;
+    return end - start;
+}
+
+/// Discard the guest pages in [ipa, ipa + len), which may span regions.
+static void balloon_discard_ipa(BalloonDev *dev, uint64_t ipa, uint64_t len) {
+    BalloonRegion *r;
+    uint64_t chunk;
+    while (len > 0 && (r = balloon_region_of_ipa(dev, ipa))) {
+        chunk = MIN(len, r->mem.zonex_ipa + r->mem.size - ipa);
+        balloon_discard(dev, r,
+                        (uint8_t *)r->mem.virt_addr +
+                            (ipa - r->mem.zonex_ipa),
+                        chunk);
+        ipa += chunk;
+        len -= chunk;
+    }
+    if (len > 0)
+        log_error("balloon: page %#llx isn't zone RAM",
+                  (unsigned long long)ipa);
+}
+
+/// Discard the guest buffers of a hint or report, which are the free pages.
+static void balloon_discard_iov(BalloonDev *dev, struct iovec *iov, int n) {
+    BalloonRegion *r;
+    for (int i = 0; i < n; i++) {
+        r = balloon_region_of_hva(dev, iov[i].iov_base);
+        if (r)
+            balloon_discard(dev, r, iov[i].iov_base, iov[i].iov_len);
+    }
+}
+
+/*********************************************************************
+    Queues
+ */
+/// Inflate and deflate buffers are arrays of 4 KiB page frame numbers.
+/// Runs of consecutive frames are discarded at once.
+static void balloon_handle_pfns(BalloonDev *dev, struct iovec *iov, int n,
+                                bool inflate) {
+    uint64_t start = 0, count = 0, pfn, pages = 0;
+    uint32_t *pfns;
+
+    for (int i = 0; i < n; i++) {
+        pfns = iov[i].iov_base;
+        for (size_t j = 0; j < iov[i].iov_len / sizeof(uint32_t); j++) {
+            pfn = pfns[j];
+            pages++;
+            if (!inflate)
+                continue;
+            if (count > 0 && pfn == start + count) {
+                count++;
+                continue;
+            }
+            if (count > 0)
+                balloon_discard_ipa(dev, start << VIRTIO_BALLOON_PFN_SHIFT,
+                                    count * BALLOON_PAGE_SIZE);
+            start = pfn;
+            count = 1;
+        }
+    }
+    if (count > 0)
+        balloon_discard_ipa(dev, start << VIRTIO_BALLOON_PFN_SHIFT,
+                            count * BALLOON_PAGE_SIZE);
+    // Deflated pages need nothing, the guest touching them faults them in
+    if (inflate)
+        dev->inflated += pages * BALLOON_PAGE_SIZE;
+    else
+        dev->deflated += pages * BALLOON_PAGE_SIZE;
+}
+
+/// The guest keeps one stats buffer in the queue. The device holds it and
+/// gives it back when it wants fresher stats.
+static void balloon_handle_stats(BalloonDev *dev, VirtQueue *vq, uint16_t idx,
+                                 struct iovec *iov, int n) {
+    struct virtio_balloon_stat stat;
+    uint8_t *buf;
+    size_t len;
+
+    for (int i = 0; i < n; i++) {
+        buf = iov[i].iov_base;
+        len = iov[i].iov_len;
+        for (size_t off = 0; off + sizeof(stat) <= len; off += sizeof(stat)) {
+            memcpy(&stat, buf + off, sizeof(stat));
+            if (stat.tag >= VIRTIO_BALLOON_S_NR)
+                continue;
+            dev->stats[stat.tag] = stat.val;
+            dev->stats_valid[stat.tag] = true;
+        }
+    }
+    // A second buffer is the driver restarting, return the old one
+    if (dev->stats_held) {
+        update_used_ring(vq, dev->stats_idx, 0);
+        virtio_inject_irq(vq);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &dev->stats_time);
+    dev->stats_held = true;
+    dev->stats_idx = idx;
+    balloon_wake(dev);
+}
+
+/// A hint run is bracketed by the command id the device asked for and
+/// VIRTIO_BALLOON_CMD_ID_STOP, and the buffers in between are free pages.
+/// The guest holds on to them until the device says
+/// VIRTIO_BALLOON_CMD_ID_DONE, so they can be discarded meanwhile.
+static void balloon_handle_hint(VirtIODevice *vdev, struct iovec *iov, int n,
+                                uint16_t *flags) {
+    BalloonDev *dev = vdev->dev;
+    uint32_t cmd_id;
+
+    if (!(flags[0] & VRING_DESC_F_WRITE)) {
+        if (iov[0].iov_len < sizeof(cmd_id))
+            return;
+        memcpy(&cmd_id, iov[0].iov_base, sizeof(cmd_id));
+        if (cmd_id == VIRTIO_BALLOON_CMD_ID_STOP && dev->hint_running) {
+            dev->hint_running = false;
+            dev->config.free_page_hint_cmd_id = VIRTIO_BALLOON_CMD_ID_DONE;
+            virtio_inject_config_irq(vdev);
+            log_info("balloon: zone %d hinted %llu MiB free", vdev->zone_id,
+                     (unsigned long long)(dev->hinted >> 20));
+        }
+        return;
+    }
+    if (!dev->hint_running)
+        return;
+    for (int i = 0; i < n; i++)
+        dev->hinted += iov[i].iov_len;
+    balloon_discard_iov(dev, iov, n);
+}
+
+int virtio_balloon_notify_handler(VirtIODevice *vdev, VirtQueue *vq) {
+    BalloonDev *dev = vdev->dev;
+    BalloonQueue queue = balloon_queue(vdev, vq);
+    struct iovec *iov = NULL;
+    uint16_t *flags = NULL;
+    uint16_t idx;
+    int n;
+
+    pthread_mutex_lock(&dev->lock);
+    while (!virtqueue_is_empty(vq)) {
+        virtqueue_disable_notify(vq);
+        while (!virtqueue_is_empty(vq)) {
+            n = process_descriptor_chain(vq, &idx, &iov, &flags, 0, true);
+            if (n < 1)
+                break;
+            switch (queue) {
+            case BALLOON_QUEUE_INFLATE:
+            case BALLOON_QUEUE_DEFLATE:
+                balloon_handle_pfns(dev, iov, n,
+                                    queue == BALLOON_QUEUE_INFLATE);
+                break;
+            case BALLOON_QUEUE_STATS:
+                balloon_handle_stats(dev, vq, idx, iov, n);
+                free(iov);
+                free(flags);
+                continue;
+            case BALLOON_QUEUE_FREE_PAGE:
+                balloon_handle_hint(vdev, iov, n, flags);
+                break;
+            case BALLOON_QUEUE_REPORTING:
+                for (int i = 0; i < n; i++)
+                    dev->reported += iov[i].iov_len;
+                balloon_discard_iov(dev, iov, n);
+                break;
+            default:
+                log_error("balloon: request on unknown queue %llu",
+                          (unsigned long long)vq->vq_idx);
+                break;
+            }
+            update_used_ring(vq, idx, 0);
+            free(iov);
+            free(flags);
+        }
+        virtqueue_enable_notify(vq);
+    }
+    virtio_inject_irq(vq);
+    pthread_mutex_unlock(&dev->lock);
+    return 0;
+}
+
+/*********************************************************************
+    Control
+ */
+/// Set the balloon size the zone should reach. Called with dev->lock held.
+static void balloon_set_target(VirtIODevice *vdev, uint64_t bytes) {
+    BalloonDev *dev = vdev->dev;
+    uint64_t total = 0;
+    for (int i = 0; i < dev->nregions; i++)
+        total += dev->regions[i].mem.size;
+    if (total > 0 && bytes > total)
+        bytes = total;
+    dev->config.num_pages = bytes / BALLOON_PAGE_SIZE;
+    log_info("balloon: zone %d target %llu MiB", vdev->zone_id,
+             (unsigned long long)(bytes >> 20));
+    if (vdev->activated)
+        virtio_inject_config_irq(vdev);
+}
+
+/// Start a free page hint run. Called with dev->lock held.
+static int balloon_start_hint(VirtIODevice *vdev) {
+    BalloonDev *dev = vdev->dev;
+    if (!vdev->activated ||
+        !balloon_has_feature(vdev, VIRTIO_BALLOON_F_FREE_PAGE_HINT))
+        return -1;
+    // Ids below 2 are STOP and DONE
+    if (++dev->hint_cmd_id <= VIRTIO_BALLOON_CMD_ID_DONE)
+        dev->hint_cmd_id = VIRTIO_BALLOON_CMD_ID_DONE + 1;
+    dev->config.free_page_hint_cmd_id = dev->hint_cmd_id;
+    dev->hint_running = true;
+    virtio_inject_config_irq(vdev);
+    return 0;
+}
+
+/// Return the stats buffer so the guest refills it. Called with dev->lock
+/// held.
+static void balloon_request_stats(VirtIODevice *vdev) {
+    BalloonDev *dev = vdev->dev;
+    VirtQueue *vq = balloon_find_queue(vdev, BALLOON_QUEUE_STATS);
+    clock_gettime(CLOCK_MONOTONIC, &dev->stats_request_time);
+    if (!dev->stats_held || vq == NULL)
+        return;
+    dev->stats_held = false;
+    update_used_ring(vq, dev->stats_idx, 0);
+    virtio_inject_irq(vq);
+}
+
+static inline double balloon_elapsed(const struct timespec *since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) +
+           (now.tv_nsec - since->tv_nsec) / 1e9;
+}
+
+static int balloon_format_stats(BalloonDev *dev, char *buf, size_t size) {
+    int len;
+    len = snprintf(buf, size,
+                   "target %llu\nactual %llu\ninflated %llu\ndeflated %llu\n"
+                   "hinted %llu\nreported %llu\ndiscarded %llu\n",
+                   (unsigned long long)dev->config.num_pages *
+                       BALLOON_PAGE_SIZE,
+                   (unsigned long long)dev->config.actual * BALLOON_PAGE_SIZE,
+                   (unsigned long long)dev->inflated,
+                   (unsigned long long)dev->deflated,
+                   (unsigned long long)dev->hinted,
+                   (unsigned long long)dev->reported,
+                   (unsigned long long)dev->discarded);
+    if (dev->stats_time.tv_sec || dev->stats_time.tv_nsec)
+        len += snprintf(buf + len, size - len, "stats-age %.1f\n",
+                        balloon_elapsed(&dev->stats_time));
+    for (int i = 0; i < VIRTIO_BALLOON_S_NR && (size_t)len < size; i++)
+        if (dev->stats_valid[i])
+            len += snprintf(buf + len, size - len, "%s %llu\n",
+                            balloon_stat_names[i],
+                            (unsigned long long)dev->stats[i]);
+    return MIN((size_t)len, size - 1);
+}
+
+/// Run one command line of a control client: "target <MiB>", "hint" or
+/// "stats".
+static void balloon_command(VirtIODevice *vdev, int fd, char *line) {
+    BalloonDev *dev = vdev->dev;
+    char reply[1024];
+    unsigned long long mb;
+    int len = 0;
+
+    pthread_mutex_lock(&dev->lock);
+    if (sscanf(line, "target %llu", &mb) == 1) {
+        balloon_set_target(vdev, mb << 20);
+        len = snprintf(reply, sizeof(reply), "OK\n");
+    } else if (strcmp(line, "hint") == 0) {
+        len = snprintf(reply, sizeof(reply),
+                       balloon_start_hint(vdev) ? "ERR not supported\n"
+                                                : "OK\n");
+    } else if (strcmp(line, "stats") == 0) {
+        len = balloon_format_stats(dev, reply, sizeof(reply) - 4);
+        len += snprintf(reply + len, sizeof(reply) - len, "OK\n");
+    } else {
+        len = snprintf(reply, sizeof(reply), "ERR unknown command\n");
+    }
+    pthread_mutex_unlock(&dev->lock);
+    if (write(fd, reply, len) < 0)
+        log_debug("balloon control client went away");
+}
+
+static void balloon_client_read(VirtIODevice *vdev, int i) {
+    BalloonDev *dev = vdev->dev;
+    char *buf = dev->client_buf[i], *nl;
+    ssize_t n;
+
+    n = read(dev->clients[i], buf + dev->client_len[i],
+             BALLOON_CMD_LEN - 1 - dev->client_len[i]);
+    if (n <= 0) {
+        if (n < 0 && (errno == EAGAIN || errno == EINTR))
+            return;
+        close(dev->clients[i]);
+        dev->clients[i] = -1;
+        return;
+    }
+    dev->client_len[i] += n;
+    buf[dev->client_len[i]] = '\0';
+    while ((nl = strchr(buf, '\n'))) {
+        *nl = '\0';
+        if (nl > buf && nl[-1] == '\r')
+            nl[-1] = '\0';
+        balloon_command(vdev, dev->clients[i], buf);
+        dev->client_len[i] -= nl + 1 - buf;
+        memmove(buf, nl + 1, dev->client_len[i] + 1);
+    }
+    // A line too long to be a command
+    if (dev->client_len[i] == BALLOON_CMD_LEN - 1)
+        dev->client_len[i] = 0;
+}
+
+static void balloon_accept(BalloonDev *dev) {
+    int fd = accept4(dev->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0)
+        return;
+    for (int i = 0; i < BALLOON_MAX_CLIENTS; i++) {
+        if (dev->clients[i] < 0) {
+            dev->clients[i] = fd;
+            dev->client_len[i] = 0;
+            return;
+        }
+    }
+    log_warn("balloon: too many control clients");
+    close(fd);
+}
+
+/// Serves the control socket and asks the guest for stats every
+/// stats_period seconds.
+static void *balloon_io_thread(void *param) {
+    VirtIODevice *vdev = param;
+    BalloonDev *dev = vdev->dev;
+    struct pollfd fds[2 + BALLOON_MAX_CLIENTS];
+    int client_of[2 + BALLOON_MAX_CLIENTS];
+    int nfds, timeout;
+    eventfd_t cnt;
+    double left;
+
+    while (!dev->closing) {
+        timeout = -1;
+        pthread_mutex_lock(&dev->lock);
+        if (dev->stats_held && dev->stats_period > 0) {
+            left = dev->stats_period -
+                   balloon_elapsed(&dev->stats_request_time);
+            if (left <= 0) {
+                balloon_request_stats(vdev);
+            } else {
+                timeout = (int)(left * 1000) + 1;
+            }
+        }
+        pthread_mutex_unlock(&dev->lock);
+
+        nfds = 0;
+        fds[nfds].fd = dev->wake_fd;
+        fds[nfds].events = POLLIN;
+        client_of[nfds++] = -1;
+        if (dev->listen_fd >= 0) {
+            fds[nfds].fd = dev->listen_fd;
+            fds[nfds].events = POLLIN;
+            client_of[nfds++] = -1;
+        }
+        for (int i = 0; i < BALLOON_MAX_CLIENTS; i++) {
+            if (dev->clients[i] < 0)
+                continue;
+            fds[nfds].fd = dev->clients[i];
+            fds[nfds].events = POLLIN;
+            client_of[nfds++] = i;
+        }
+        if (poll(fds, nfds, timeout) < 0) {
+            if (errno != EINTR)
+                log_error("balloon poll failed, errno is %d", errno);
+            continue;
+        }
+        for (int i = 0; i < nfds; i++) {
+            if (fds[i].revents == 0)
+                continue;
+            if (fds[i].fd == dev->wake_fd)
+                eventfd_read(dev->wake_fd, &cnt);
+            else if (client_of[i] < 0)
+                balloon_accept(dev);
+            else
+                balloon_client_read(vdev, client_of[i]);
+        }
+    }
+    return NULL;
+}
+
+static int balloon_listen(BalloonDev *dev) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    // socket is no longer than sun_path
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", dev->socket);
+    unlink(dev->socket);
+    dev->listen_fd =
+        socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (dev->listen_fd < 0 ||
+        bind(dev->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(dev->listen_fd, BALLOON_MAX_CLIENTS) < 0) {
+        log_error("Failed to listen on balloon socket %s, errno is %d",
+                  dev->socket, errno);
+        return -1;
+    }
+    return 0;
+}
+
+/*********************************************************************
+    Setup
+ */
+static void virtio_balloon_activate(VirtIODevice *vdev, bool activate) {
+    BalloonDev *dev = vdev->dev;
+    pthread_mutex_lock(&dev->lock);
+    // A reset drops the buffers the device held, and the balloon is empty
+    // again for the next driver
+    if (!activate) {
+        dev->stats_held = false;
+        dev->hint_running = false;
+        dev->config.free_page_hint_cmd_id = VIRTIO_BALLOON_CMD_ID_STOP;
+        dev->config.actual = 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &dev->stats_request_time);
+    pthread_mutex_unlock(&dev->lock);
+    balloon_wake(dev);
+}
+
+static void virtio_balloon_config_write(VirtIODevice *vdev, uint64_t offset,
+                                        uint64_t value, int size) {
+    BalloonDev *dev = vdev->dev;
+    if (size != 4)
+        return;
+    pthread_mutex_lock(&dev->lock);
+    switch (offset) {
+    case offsetof(BalloonConfig, actual):
+        if (dev->config.actual != value)
+            log_info("balloon: zone %d gave up %llu MiB", vdev->zone_id,
+                     (unsigned long long)(value * BALLOON_PAGE_SIZE >> 20));
+        dev->config.actual = value;
+        break;
+    case offsetof(BalloonConfig, poison_val):
+        dev->config.poison_val = value;
+        break;
+    default:
+        log_error("balloon: write to read-only config at %#llx",
+                  (unsigned long long)offset);
+        break;
+    }
+    pthread_mutex_unlock(&dev->lock);
+}
+
+static void virtio_balloon_stats(VirtIODevice *vdev) {
+    BalloonDev *dev = vdev->dev;
+    char buf[1024], *p, *line;
+    pthread_mutex_lock(&dev->lock);
+    balloon_format_stats(dev, buf, sizeof(buf));
+    pthread_mutex_unlock(&dev->lock);
+    log_warn("zone %d virtio balloon:", vdev->zone_id);
+    for (line = strtok_r(buf, "\n", &p); line; line = strtok_r(NULL, "\n", &p))
+        log_warn("  %s", line);
+}
+
+int virtio_balloon_init(VirtIODevice *vdev, BalloonRequestedState *req) {
+    BalloonDev *dev = vdev->dev;
+    ZoneMemRegion regions[BALLOON_MAX_REGIONS];
+
+    vdev->virtio_close = virtio_balloon_close;
+    vdev->virtio_activate = virtio_balloon_activate;
+    vdev->virtio_stats = virtio_balloon_stats;
+    vdev->virtio_config_write = virtio_balloon_config_write;
+
+    dev->host_page_size = sysconf(_SC_PAGESIZE);
+    // Zone RAM is mapped before the zone's devices are created
+    dev->nregions =
+        get_zone_mem_regions(vdev->zone_id, regions, BALLOON_MAX_REGIONS);
+    for (int i = 0; i < dev->nregions; i++)
+        dev->regions[i].mem = regions[i];
+    if (dev->nregions == 0)
+        log_warn("balloon: zone %d has no RAM mapped", vdev->zone_id);
+
+    dev->stats_period = req ? req->stats_period : BALLOON_DEFAULT_STATS_PERIOD;
+    if (req && req->target_mb)
+        balloon_set_target(vdev, req->target_mb << 20);
+    dev->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (dev->wake_fd < 0) {
+        log_error("Failed to create eventfd, errno is %d", errno);
+        return -1;
+    }
+    if (req && req->socket[0]) {
+        if (snprintf(dev->socket, sizeof(dev->socket), "%s", req->socket) >=
+            (int)sizeof(dev->socket)) {
+            log_error("balloon socket %s is too long", req->socket);
+            return -1;
+        }
+        if (balloon_listen(dev) < 0)
+            return -1;
+    }
+    if (pthread_create(&dev->io_thread, NULL, balloon_io_thread, vdev)) {
+        log_error("Failed to create balloon io thread");
+        return -1;
+    }
+    return 0;
+}
+
+void virtio_balloon_close(VirtIODevice *vdev) {
+    BalloonDev *dev = vdev->dev;
+    if (dev->io_thread) {
+        dev->closing = true;
+        balloon_wake(dev);
+        pthread_join(dev->io_thread, NULL);
+    }
+    for (int i = 0; i < BALLOON_MAX_CLIENTS; i++)
+        if (dev->clients[i] >= 0)
+            close(dev->clients[i]);
+    if (dev->listen_fd >= 0) {
+        close(dev->listen_fd);
+        unlink(dev->socket);
+    }
+    if (dev->wake_fd >= 0)
+        close(dev->wake_fd);
+    free(dev);
+    free(vdev->vqs);
+    free(vdev);
+}
@@ -132,6 +132,8 @@ BlkDev *init_blk_dev(VirtIODevice *vdev) {
     pthread_mutex_init(&dev->mtx, NULL);
     pthread_cond_init(&dev->cond, NULL);
     TAILQ_INIT(&dev->procq);
+    // The thread reads vdev->dev as soon as it runs
+    vdev->dev = dev;
     pthread_create(&dev->tid, NULL, blkproc_thread, vdev);
     return dev;
 }
@@ -1,13 +1,13 @@
 // SPDX-License-Identifier: GPL-2.0-only
 /**
- * Copyright (c) 2025 Syswonder
- *
- * Syswonder Website:
- *      https://www.syswonder.org
- *
- * Authors:
- *      Guowei Li <2401213322@stu.pku.edu.cn>
- */
+ * Copyright (c) 2025 Syswonder
+ *
+ * Syswonder Website:
+ *      https://www.syswonder.org
+ *
+ * Authors:
+ *      Guowei Li <2401213322@stu.pku.edu.cn>
+ */
 #define _GNU_SOURCE
 
 #include "virtio_console.h"
@@ -15,206 +15,870 @@
 #include "virtio.h"
 #include <errno.h>
 #include <fcntl.h>
-#include <math.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <termios.h>
+#include <unistd.h>
 
-static uint8_t trashbuf[1024];
+// The wake fd, then the pty or a FIFO pair, the listening socket and the
+// clients of each port
+#define CONSOLE_MAX_POLLFDS (1 + CONSOLE_MAX_PORTS * (2 + CONSOLE_MAX_CLIENTS))
+
+// What a polled fd is to the io thread
+enum console_fd_kind {
+    CONSOLE_FD_WAKE,
+    CONSOLE_FD_LISTEN,
+    CONSOLE_FD_PTY,
+    CONSOLE_FD_FIFO_IN,
+    CONSOLE_FD_FIFO_OUT,
+    CONSOLE_FD_CLIENT,
+};
+
+typedef struct console_pollfd {
+    enum console_fd_kind kind;
+    ConsolePort *port;
+    ConsoleSink *sink;
+} ConsolePollFd;
+
+static ConsolePort *console_port_alloc(uint32_t id) {
+    ConsolePort *port = (ConsolePort *)calloc(1, sizeof(ConsolePort));
+    port->id = id;
+    pthread_mutex_init(&port->lock, NULL);
+    pthread_mutex_init(&port->tx_lock, NULL);
+    port->master_fd = port->slave_fd = port->listen_fd = -1;
+    port->fifo_in_fd = -1;
+    port->pty.fd = port->log.fd = port->fifo_out.fd = -1;
+    port->max_clients = CONSOLE_MAX_CLIENTS;
+    for (int i = 0; i < CONSOLE_MAX_CLIENTS; i++)
+        port->clients[i].fd = -1;
+    return port;
+}
 
 ConsoleDev *init_console_dev() {
-    ConsoleDev *dev = (ConsoleDev *)malloc(sizeof(ConsoleDev));
+    ConsoleDev *dev = (ConsoleDev *)calloc(1, sizeof(ConsoleDev));
     dev->config.cols = 80;
     dev->config.rows = 25;
-    dev->master_fd = -1;
-    dev->rx_ready = -1;
-    dev->event = NULL;
+    dev->config.max_nr_ports = 1;
+    dev->wake_fd = -1;
+    pthread_mutex_init(&dev->ctrl_lock, NULL);
+    dev->ports[0] = console_port_alloc(0);
+    dev->nports = 1;
     return dev;
 }
 
-static void virtio_console_event_handler(int fd, int epoll_type, void *param) {
-    // log_debug("%s", __func__);
-    VirtIODevice *vdev = (VirtIODevice *)param;
-    ConsoleDev *dev = (ConsoleDev *)vdev->dev;
-    VirtQueue *vq = &vdev->vqs[CONSOLE_QUEUE_RX];
-    int n;
-    ssize_t len;
-    struct iovec *iov = NULL;
-    uint16_t idx;
+static inline void console_wake(ConsoleDev *dev) {
+    eventfd_write(dev->wake_fd, 1);
+}
 
-    if (epoll_type != EPOLLIN || fd != dev->master_fd) {
-        log_error("Invalid console event");
-        return;
-    }
-    if (dev->master_fd <= 0 || vdev->type != VirtioTConsole) {
-        log_error("console event handler should not be called");
+static inline bool console_multiport(VirtIODevice *vdev) {
+    return vdev->regs.drv_feature & (1ULL << VIRTIO_CONSOLE_F_MULTIPORT);
+}
+
+/// Port 0 uses queues 0 and 1, port n > 0 uses 2n + 2 and 2n + 3.
+static inline uint32_t port_rxq(ConsolePort *port) {
+    return port->id == 0 ? CONSOLE_QUEUE_RX : 2 * port->id + 2;
+}
+
+static inline ConsolePort *vq_port(ConsoleDev *dev, VirtQueue *vq) {
+    uint32_t id = vq->vq_idx < 2 ? 0 : vq->vq_idx / 2 - 1;
+    return id < (uint32_t)dev->nports ? dev->ports[id] : NULL;
+}
+
+/*********************************************************************
+    Control queues
+ */
+/// Queue a message for the driver. The caller holds ctrl_lock.
+static void console_ctrl_queue(ConsoleDev *dev, uint32_t id, uint16_t event,
+                               uint16_t value, const char *name) {
+    ConsoleCtrlMsg *msg;
+    if (dev->ctrl_count == CONSOLE_CTRL_PENDING) {
+        log_warn("console control queue full, event %d of port %u dropped",
+                 event, id);
         return;
     }
-    if (dev->rx_ready <= 0) {
-        read(dev->master_fd, trashbuf, sizeof(trashbuf));
-        return;
+    msg = &dev->ctrl_pending[(dev->ctrl_head + dev->ctrl_count++) %
+                             CONSOLE_CTRL_PENDING];
+    msg->hdr.id = id;
+    msg->hdr.event = event;
+    msg->hdr.value = value;
+    snprintf(msg->name, sizeof(msg->name), "%s", name ? name : "");
+}
+
+/// Copy pending messages into the driver's control rx buffers.
+static void console_ctrl_flush(VirtIODevice *vdev) {
+    ConsoleDev *dev = vdev->dev;
+    VirtQueue *vq = &vdev->vqs[CONSOLE_QUEUE_CTRL_RX];
+    struct iovec *iov = NULL;
+    ConsoleCtrlMsg *msg;
+    size_t len, off, chunk;
+    uint16_t idx;
+    int i, n;
+    bool used = false;
+
+    pthread_mutex_lock(&dev->ctrl_lock);
+    while (dev->ctrl_ready && dev->ctrl_count > 0 &&
+           !virtqueue_is_empty(vq)) {
+        n = process_descriptor_chain(vq, &idx, &iov, NULL, 0, false);
+        if (n < 1)
+            break;
+        msg = &dev->ctrl_pending[dev->ctrl_head];
+        // The name follows the header, terminated by a NUL
+        len = sizeof(msg->hdr);
+        if (msg->hdr.event == VIRTIO_CONSOLE_PORT_NAME)
+            len += strlen(msg->name) + 1;
+        for (i = 0, off = 0; i < n && off < len; i++) {
+            chunk = MIN(len - off, iov[i].iov_len);
+            memcpy(iov[i].iov_base, (uint8_t *)msg + off, chunk);
+            off += chunk;
+        }
+        update_used_ring(vq, idx, off);
+        free(iov);
+        dev->ctrl_head = (dev->ctrl_head + 1) % CONSOLE_CTRL_PENDING;
+        dev->ctrl_count--;
+        used = true;
     }
-    if (virtqueue_is_empty(vq)) {
-        read(dev->master_fd, trashbuf, sizeof(trashbuf));
+    pthread_mutex_unlock(&dev->ctrl_lock);
+    if (used)
         virtio_inject_irq(vq);
-        return;
+}
+
+static bool port_host_connected(ConsolePort *port) {
+    if (port->master_fd >= 0 || port->fifo_in_fd >= 0)
+        return true;
+    for (int i = 0; i < port->max_clients; i++)
+        if (port->clients[i].fd >= 0)
+            return true;
+    return false;
+}
+
+/// Tell the driver when a client connects to or leaves a port.
+static void port_update_host_open(VirtIODevice *vdev, ConsolePort *port) {
+    ConsoleDev *dev = vdev->dev;
+    bool open;
+
+    pthread_mutex_lock(&dev->ctrl_lock);
+    open = port_host_connected(port);
+    if (open != port->host_open) {
+        port->host_open = open;
+        if (port->ready)
+            console_ctrl_queue(dev, port->id, VIRTIO_CONSOLE_PORT_OPEN, open,
+                               NULL);
     }
+    pthread_mutex_unlock(&dev->ctrl_lock);
+    console_ctrl_flush(vdev);
+}
 
-    while (!virtqueue_is_empty(vq)) {
-        n = process_descriptor_chain(vq, &idx, &iov, NULL, 0, false);
-        if (n < 1) {
-            log_error("process_descriptor_chain failed");
+/// Handle a message from the driver. The caller holds ctrl_lock.
+static void console_ctrl_handle(ConsoleDev *dev,
+                                const struct virtio_console_control *msg) {
+    ConsolePort *port =
+        msg->id < (uint32_t)dev->nports ? dev->ports[msg->id] : NULL;
+
+    switch (msg->event) {
+    case VIRTIO_CONSOLE_DEVICE_READY:
+        if (msg->value != 1) {
+            log_error("driver failed to set up the console");
             break;
         }
-        len = readv(dev->master_fd, iov, n);
-        if (len > 0) {
-            for (int i = 0; i < len; i++) {
-                log_printf("%c", *(char *)&iov->iov_base[i]);
-            }
-            log_printf("] vq->last_avail_idx is %d\n", vq->last_avail_idx);
+        dev->ctrl_ready = true;
+        for (int i = 0; i < dev->nports; i++)
+            console_ctrl_queue(dev, i, VIRTIO_CONSOLE_PORT_ADD, 1, NULL);
+        break;
+    case VIRTIO_CONSOLE_PORT_READY:
+        if (port == NULL || msg->value != 1) {
+            log_warn("driver failed to add console port %u", msg->id);
+            break;
         }
-        if (len < 0 && errno == EWOULDBLOCK) {
-            log_debug("no more bytes");
-            vq->last_avail_idx--;
+        // Tell the new port what it is and whether the host side is there
+        port->ready = true;
+        if (port->id == 0)
+            console_ctrl_queue(dev, 0, VIRTIO_CONSOLE_CONSOLE_PORT, 1, NULL);
+        if (port->name[0])
+            console_ctrl_queue(dev, port->id, VIRTIO_CONSOLE_PORT_NAME, 1,
+                               port->name);
+        port->host_open = port_host_connected(port);
+        if (port->host_open)
+            console_ctrl_queue(dev, port->id, VIRTIO_CONSOLE_PORT_OPEN, 1,
+                               NULL);
+        break;
+    case VIRTIO_CONSOLE_PORT_OPEN:
+        if (port == NULL)
+            break;
+        port->guest_open = msg->value;
+        log_info("console port %u %s by the guest", port->id,
+                 msg->value ? "opened" : "closed");
+        break;
+    default:
+        log_warn("unsupported console control event %d", msg->event);
+        break;
+    }
+}
+
+int virtio_console_ctrl_rxq_notify_handler(VirtIODevice *vdev, VirtQueue *vq) {
+    (void)vq;
+    console_ctrl_flush(vdev);
+    return 0;
+}
+
+int virtio_console_ctrl_txq_notify_handler(VirtIODevice *vdev, VirtQueue *vq) {
+    ConsoleDev *dev = vdev->dev;
+    struct virtio_console_control msg;
+    struct iovec *iov = NULL;
+    size_t off, chunk;
+    uint16_t idx;
+    int i, n;
+
+    while (!virtqueue_is_empty(vq)) {
+        virtqueue_disable_notify(vq);
+        while (!virtqueue_is_empty(vq)) {
+            n = process_descriptor_chain(vq, &idx, &iov, NULL, 0, false);
+            if (n < 1)
+                break;
+            for (i = 0, off = 0; i < n && off < sizeof(msg); i++) {
+                chunk = MIN(sizeof(msg) - off, iov[i].iov_len);
+                memcpy((uint8_t *)&msg + off, iov[i].iov_base, chunk);
+                off += chunk;
+            }
+            if (off == sizeof(msg)) {
+                pthread_mutex_lock(&dev->ctrl_lock);
+                console_ctrl_handle(dev, &msg);
+                pthread_mutex_unlock(&dev->ctrl_lock);
+            } else {
+                log_error("short console control message");
+            }
+            update_used_ring(vq, idx, 0);
             free(iov);
+        }
+        virtqueue_enable_notify(vq);
+    }
+    virtio_inject_irq(vq);
+    console_ctrl_flush(vdev);
+    // A port may have been opened, let the io thread poll its input
+    console_wake(dev);
+    return 0;
+}
+
+/*********************************************************************
+    Guest output
+ */
+/// Append guest output to the ring. Never blocks on the host side.
+static void port_ring_write(ConsolePort *port, const struct iovec *iov,
+                            int n) {
+    size_t off, chunk, len;
+    pthread_mutex_lock(&port->lock);
+    for (int i = 0; i < n; i++) {
+        const uint8_t *src = iov[i].iov_base;
+        len = iov[i].iov_len;
+        // Only the last CONSOLE_RING_SIZE bytes can be kept anyway
+        if (len > CONSOLE_RING_SIZE) {
+            src += len - CONSOLE_RING_SIZE;
+            port->head += len - CONSOLE_RING_SIZE;
+            len = CONSOLE_RING_SIZE;
+        }
+        while (len > 0) {
+            off = port->head & (CONSOLE_RING_SIZE - 1);
+            chunk = MIN(len, CONSOLE_RING_SIZE - off);
+            memcpy(port->ring + off, src, chunk);
+            port->head += chunk;
+            src += chunk;
+            len -= chunk;
+        }
+        port->tx_bytes += iov[i].iov_len;
+    }
+    pthread_mutex_unlock(&port->lock);
+}
+
+/// Bytes that fit into the ring without overwriting output a sink hasn't
+/// written yet.
+static size_t port_ring_space(ConsolePort *port) {
+    uint64_t tail;
+    size_t space;
+    pthread_mutex_lock(&port->lock);
+    tail = port->head;
+    if (port->fifo_out.fd >= 0)
+        tail = MIN(tail, port->fifo_out.pos);
+    for (int i = 0; i < port->max_clients; i++)
+        if (port->clients[i].fd >= 0)
+            tail = MIN(tail, port->clients[i].pos);
+    space = CONSOLE_RING_SIZE - MIN(port->head - tail, CONSOLE_RING_SIZE);
+    pthread_mutex_unlock(&port->lock);
+    return space;
+}
+
+/// Copy at most len bytes after sink->pos out of the ring. A sink that fell
+/// more than the ring size behind skips the bytes that were overwritten.
+static size_t port_ring_read(ConsolePort *port, ConsoleSink *sink,
+                             uint8_t *buf, size_t len) {
+    size_t off, chunk, done = 0;
+    pthread_mutex_lock(&port->lock);
+    if (port->head - sink->pos > CONSOLE_RING_SIZE) {
+        port->lost_bytes += port->head - sink->pos - CONSOLE_RING_SIZE;
+        sink->pos = port->head - CONSOLE_RING_SIZE;
+    }
+    len = MIN(len, port->head - sink->pos);
+    while (done < len) {
+        off = (sink->pos + done) & (CONSOLE_RING_SIZE - 1);
+        chunk = MIN(len - done, CONSOLE_RING_SIZE - off);
+        memcpy(buf + done, port->ring + off, chunk);
+        done += chunk;
+    }
+    pthread_mutex_unlock(&port->lock);
+    return done;
+}
+
+static void port_log_rotate(ConsolePort *port) {
+    // Room for the path, a dot and any int
+    char from[sizeof(port->log_path) + 12], to[sizeof(port->log_path) + 12];
+    close(port->log.fd);
+    for (int i = port->log_files - 1; i >= 1; i--) {
+        snprintf(from, sizeof(from), "%s.%d", port->log_path, i);
+        snprintf(to, sizeof(to), "%s.%d", port->log_path, i + 1);
+        rename(from, to);
+    }
+    snprintf(to, sizeof(to), "%s.1", port->log_path);
+    if (port->log_files > 0)
+        rename(port->log_path, to);
+    port->log.fd = open(port->log_path,
+                        O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+                        0644);
+    if (port->log.fd < 0)
+        log_error("failed to reopen console log %s, errno is %d",
+                  port->log_path, errno);
+    port->log_written = 0;
+}
+
+/// Write what the sink hasn't seen yet. Return -1 if the fd is broken.
+static int sink_flush(ConsolePort *port, ConsoleSink *sink) {
+    uint8_t buf[CONSOLE_IO_CHUNK];
+    size_t len;
+    ssize_t written;
+
+    sink->blocked = false;
+    while ((len = port_ring_read(port, sink, buf, sizeof(buf))) > 0) {
+        written = write(sink->fd, buf, len);
+        if (written < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                sink->blocked = true;
+                return 0;
+            }
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        sink->pos += written;
+        if (sink == &port->log) {
+            port->log_written += written;
+            if (port->log_written >= port->log_size) {
+                port_log_rotate(port);
+                if (port->log.fd < 0)
+                    return 0;
+            }
+        }
+        if ((size_t)written < len) {
+            sink->blocked = true;
+            return 0;
+        }
+    }
+    return 0;
+}
+
+static void sink_close(ConsoleSink *sink) {
+    close(sink->fd);
+    sink->fd = -1;
+    sink->blocked = false;
+}
+
+static void port_flush(VirtIODevice *vdev, ConsolePort *port) {
+    bool closed = false;
+    if (port->pty.fd >= 0 && !port->pty.blocked)
+        sink_flush(port, &port->pty);
+    if (port->fifo_out.fd >= 0 && !port->fifo_out.blocked)
+        sink_flush(port, &port->fifo_out);
+    if (port->log.fd >= 0)
+        sink_flush(port, &port->log);
+    for (int i = 0; i < port->max_clients; i++) {
+        ConsoleSink *client = &port->clients[i];
+        if (client->fd >= 0 && !client->blocked &&
+            sink_flush(port, client) < 0) {
+            log_info("console client %d disconnected", client->fd);
+            sink_close(client);
+            closed = true;
+        }
+    }
+    if (closed)
+        port_update_host_open(vdev, port);
+}
+
+/// Take one chain from the tx queue. A lossless port leaves the chain in the
+/// queue if the ring has no room for it. Return false if nothing was taken.
+static bool port_tx_one(ConsolePort *port, VirtQueue *vq) {
+    struct iovec *iov = NULL;
+    size_t len = 0;
+    uint16_t idx;
+    int i, n;
+
+    n = process_descriptor_chain(vq, &idx, &iov, NULL, 0, false);
+    if (n < 1)
+        return false;
+    for (i = 0; i < n; i++)
+        len += iov[i].iov_len;
+    // A chain larger than the ring could never fit, it is cut instead
+    if (port->lossless && len <= CONSOLE_RING_SIZE &&
+        port_ring_space(port) < len) {
+        vq->last_avail_idx--;
+        port->tx_need = len;
+        port->tx_stalled = true;
+        free(iov);
+        return false;
+    }
+    port_ring_write(port, iov, n);
+    update_used_ring(vq, idx, 0);
+    free(iov);
+    return true;
+}
+
+/// Move guest output of a port into its ring. Called by the tx notify
+/// handler, and by the io thread when a stalled port has room again.
+static void port_tx(VirtIODevice *vdev, ConsolePort *port) {
+    ConsoleDev *dev = vdev->dev;
+    VirtQueue *vq = &vdev->vqs[port_rxq(port) + 1];
+    bool used = false;
+
+    pthread_mutex_lock(&port->tx_lock);
+    port->tx_stalled = false;
+    while (!port->tx_stalled && !virtqueue_is_empty(vq)) {
+        virtqueue_disable_notify(vq);
+        while (!virtqueue_is_empty(vq) && port_tx_one(port, vq))
+            used = true;
+        // A stalled port gets no kicks, the io thread resumes it
+        if (!port->tx_stalled)
+            virtqueue_enable_notify(vq);
+    }
+    pthread_mutex_unlock(&port->tx_lock);
+    // One wake up for the whole batch, the io thread writes it out. A stall
+    // wakes it too, in case the sinks caught up in the meantime.
+    if (used || port->tx_stalled)
+        console_wake(dev);
+    if (used)
+        virtio_inject_irq(vq);
+}
+
+/*********************************************************************
+    Guest input
+ */
+static inline bool console_rx_writable(VirtIODevice *vdev, ConsolePort *port) {
+    // Without multiport the console is always open. Otherwise the driver
+    // drops input of ports no guest process has open.
+    return port->rx_ready && (port->guest_open || !console_multiport(vdev)) &&
+           !virtqueue_is_empty(&vdev->vqs[port_rxq(port)]);
+}
+
+/// Read from fd into the guest's rx buffers. The fds are only polled while
+/// the guest has buffers, so input waits in the kernel instead of being
+/// dropped. Return -1 on end of file or error.
+static int console_rx_from(VirtIODevice *vdev, ConsolePort *port, int fd) {
+    VirtQueue *vq = &vdev->vqs[port_rxq(port)];
+    struct iovec *iov = NULL;
+    uint16_t idx;
+    ssize_t len;
+    int n, ret = 0;
+    bool used = false;
+
+    while (console_rx_writable(vdev, port)) {
+        n = process_descriptor_chain(vq, &idx, &iov, NULL, 0, false);
+        if (n < 1)
             break;
-        } else if (len < 0) {
-            log_trace("Failed to read from console, errno is %d", errno);
+        len = readv(fd, iov, n);
+        if (len <= 0) {
             vq->last_avail_idx--;
             free(iov);
+            if (len == 0 || (errno != EAGAIN && errno != EWOULDBLOCK &&
+                             errno != EINTR))
+                ret = -1;
             break;
         }
         update_used_ring(vq, idx, len);
         free(iov);
+        port->rx_bytes += len;
+        used = true;
     }
-    virtio_inject_irq(vq);
-    return;
+    if (used)
+        virtio_inject_irq(vq);
+    return ret;
 }
 
-int virtio_console_init(VirtIODevice *vdev) {
-    ConsoleDev *dev = (ConsoleDev *)vdev->dev;
-    int master_fd, slave_fd;
-    char *slave_name;
+static void port_accept(VirtIODevice *vdev, ConsolePort *port) {
+    int fd = accept4(port->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0)
+        return;
+    for (int i = 0; i < port->max_clients; i++) {
+        if (port->clients[i].fd < 0) {
+            port->clients[i].fd = fd;
+            port->clients[i].blocked = false;
+            // New clients see output from now on
+            pthread_mutex_lock(&port->lock);
+            port->clients[i].pos = port->head;
+            pthread_mutex_unlock(&port->lock);
+            log_info("console client %d connected to port %u", fd, port->id);
+            port_update_host_open(vdev, port);
+            return;
+        }
+    }
+    log_warn("too many clients on console port %u, connection refused",
+             port->id);
+    close(fd);
+}
+
+/*********************************************************************
+    Io thread
+ */
+static inline void console_poll_add(struct pollfd *fds, ConsolePollFd *slots,
+                                    int *nfds, int fd, short events,
+                                    enum console_fd_kind kind,
+                                    ConsolePort *port, ConsoleSink *sink) {
+    fds[*nfds].fd = fd;
+    fds[*nfds].events = events;
+    fds[*nfds].revents = 0;
+    slots[*nfds].kind = kind;
+    slots[*nfds].port = port;
+    slots[*nfds].sink = sink;
+    (*nfds)++;
+}
+
+static void *console_io_thread(void *param) {
+    VirtIODevice *vdev = param;
+    ConsoleDev *dev = vdev->dev;
+    struct pollfd fds[CONSOLE_MAX_POLLFDS];
+    ConsolePollFd slots[CONSOLE_MAX_POLLFDS];
+    ConsolePort *port;
+    ConsoleSink *sink;
+    short input, revents;
+    int nfds, i;
+    eventfd_t cnt;
+
+    while (!dev->closing) {
+        nfds = 0;
+        console_poll_add(fds, slots, &nfds, dev->wake_fd, POLLIN,
+                         CONSOLE_FD_WAKE, NULL, NULL);
+        for (int p = 0; p < dev->nports; p++) {
+            port = dev->ports[p];
+            port_flush(vdev, port);
+            if (port->tx_stalled && port_ring_space(port) >= port->tx_need)
+                port_tx(vdev, port);
+
+            input = console_rx_writable(vdev, port) ? POLLIN : 0;
+            if (port->listen_fd >= 0)
+                console_poll_add(fds, slots, &nfds, port->listen_fd, POLLIN,
+                                 CONSOLE_FD_LISTEN, port, NULL);
+            if (port->master_fd >= 0)
+                console_poll_add(fds, slots, &nfds, port->master_fd,
+                                 input | (port->pty.blocked ? POLLOUT : 0),
+                                 CONSOLE_FD_PTY, port, &port->pty);
+            if (port->fifo_in_fd >= 0 && input)
+                console_poll_add(fds, slots, &nfds, port->fifo_in_fd, POLLIN,
+                                 CONSOLE_FD_FIFO_IN, port, NULL);
+            if (port->fifo_out.fd >= 0 && port->fifo_out.blocked)
+                console_poll_add(fds, slots, &nfds, port->fifo_out.fd, POLLOUT,
+                                 CONSOLE_FD_FIFO_OUT, port, &port->fifo_out);
+            for (i = 0; i < port->max_clients; i++) {
+                sink = &port->clients[i];
+                if (sink->fd >= 0)
+                    console_poll_add(fds, slots, &nfds, sink->fd,
+                                     input | (sink->blocked ? POLLOUT : 0),
+                                     CONSOLE_FD_CLIENT, port, sink);
+            }
+        }
+
+        if (poll(fds, nfds, -1) < 0) {
+            if (errno != EINTR)
+                log_error("console poll failed, errno is %d", errno);
+            continue;
+        }
+        for (i = 0; i < nfds; i++) {
+            port = slots[i].port;
+            sink = slots[i].sink;
+            revents = fds[i].revents;
+            if (revents == 0)
+                continue;
+            if (sink && (revents & POLLOUT))
+                sink->blocked = false;
+            switch (slots[i].kind) {
+            case CONSOLE_FD_WAKE:
+                eventfd_read(dev->wake_fd, &cnt);
+                break;
+            case CONSOLE_FD_LISTEN:
+                port_accept(vdev, port);
+                break;
+            case CONSOLE_FD_PTY:
+            case CONSOLE_FD_FIFO_IN:
+                if (revents & POLLIN)
+                    console_rx_from(vdev, port, fds[i].fd);
+                break;
+            case CONSOLE_FD_FIFO_OUT:
+                break;
+            case CONSOLE_FD_CLIENT:
+                // A client that hung up is read to the end if the guest can
+                // take input, and closed right away otherwise.
+                if ((revents & POLLERR) ||
+                    ((revents & POLLHUP) && !(fds[i].events & POLLIN)) ||
+                    ((revents & (POLLIN | POLLHUP)) &&
+                     console_rx_from(vdev, port, fds[i].fd) < 0)) {
+                    log_info("console client %d disconnected", sink->fd);
+                    sink_close(sink);
+                    port_update_host_open(vdev, port);
+                }
+                break;
+            }
+        }
+    }
+    for (int p = 0; p < dev->nports; p++)
+        port_flush(vdev, dev->ports[p]);
+    return NULL;
+}
+
+/*********************************************************************
+    Setup
+ */
+static int port_open_pty(ConsolePort *port) {
     struct termios term_io;
+    char *slave_name;
 
-    master_fd = posix_openpt(O_RDWR | O_NOCTTY);
-    if (master_fd < 0) {
+    port->master_fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (port->master_fd < 0) {
         log_error("Failed to open master pty, errno is %d", errno);
+        return -1;
     }
-    if (grantpt(master_fd) < 0) {
-        log_error("Failed to grant pty, errno is %d", errno);
-    }
-    if (unlockpt(master_fd) < 0) {
+    if (grantpt(port->master_fd) < 0 || unlockpt(port->master_fd) < 0) {
         log_error("Failed to unlock pty, errno is %d", errno);
+        return -1;
     }
-    dev->master_fd = master_fd;
-
-    slave_name = ptsname(master_fd);
+    slave_name = ptsname(port->master_fd);
     if (slave_name == NULL) {
         log_error("Failed to get slave name, errno is %d", errno);
+        return -1;
     }
     log_info("char device redirected to %s", slave_name);
     // Disable line discipline to prevent the TTY
     // from echoing the characters sent from the master back to the master.
-    slave_fd = open(slave_name, O_RDWR);
-    tcgetattr(slave_fd, &term_io);
+    // The slave stays open, otherwise the master reports a hang up until a
+    // user opens the slave.
+    port->slave_fd = open(slave_name, O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (port->slave_fd < 0) {
+        log_error("Failed to open slave pty, errno is %d", errno);
+        return -1;
+    }
+    tcgetattr(port->slave_fd, &term_io);
     cfmakeraw(&term_io);
-    tcsetattr(slave_fd, TCSAFLUSH, &term_io);
-    close(slave_fd);
+    tcsetattr(port->slave_fd, TCSAFLUSH, &term_io);
 
-    if (set_nonblocking(dev->master_fd) < 0) {
-        dev->master_fd = -1;
-        close(dev->master_fd);
-        log_error("Failed to set nonblocking mode, fd closed!");
+    if (set_nonblocking(port->master_fd) < 0)
+        return -1;
+    port->pty.fd = port->master_fd;
+    return 0;
+}
+
+static int port_open_socket(ConsolePort *port, const char *path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path) >=
+        (int)sizeof(addr.sun_path)) {
+        log_error("console socket path %s is too long", path);
+        return -1;
+    }
+    unlink(path);
+    port->listen_fd =
+        socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (port->listen_fd < 0 ||
+        bind(port->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(port->listen_fd, port->max_clients) < 0) {
+        log_error("Failed to listen on console socket %s, errno is %d", path,
+                  errno);
+        return -1;
     }
+    log_info("console port %u listening on %s", port->id, path);
+    return 0;
+}
 
-    dev->event =
-        add_event(dev->master_fd, EPOLLIN, virtio_console_event_handler, vdev);
+/// The guest reads path.in and writes path.out. Both are opened read-write,
+/// so opening doesn't wait for the other end and readers and writers may
+/// come and go without a hang up.
+static int port_open_fifo(ConsolePort *port, const char *path) {
+    char in[sizeof(((ConsolePortRequestedState *)0)->fifo) + 4];
+    char out[sizeof(in) + 1];
 
-    if (dev->event == NULL) {
-        log_error("Can't register console event");
-        close(master_fd);
-        dev->master_fd = -1;
+    snprintf(in, sizeof(in), "%s.in", path);
+    snprintf(out, sizeof(out), "%s.out", path);
+    if ((mkfifo(in, 0600) < 0 && errno != EEXIST) ||
+        (mkfifo(out, 0600) < 0 && errno != EEXIST)) {
+        log_error("Failed to create console fifos %s, errno is %d", path,
+                  errno);
         return -1;
     }
-
-    vdev->virtio_close = virtio_console_close;
+    port->fifo_in_fd = open(in, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    port->fifo_out.fd = open(out, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (port->fifo_in_fd < 0 || port->fifo_out.fd < 0) {
+        log_error("Failed to open console fifos %s, errno is %d", path,
+                  errno);
+        return -1;
+    }
+    log_info("console port %u uses fifos %s and %s", port->id, in, out);
     return 0;
 }
 
-int virtio_console_rxq_notify_handler(VirtIODevice *vdev, VirtQueue *vq) {
-    log_debug("%s", __func__);
-    ConsoleDev *dev = (ConsoleDev *)vdev->dev;
-    if (dev->rx_ready <= 0) {
-        dev->rx_ready = 1;
-        virtqueue_disable_notify(vq);
+static int port_open_log(ConsolePort *port, ConsoleRequestedState *req) {
+    if (snprintf(port->log_path, sizeof(port->log_path), "%s", req->log) >=
+        (int)sizeof(port->log_path)) {
+        log_error("console log path %s is too long", req->log);
+        return -1;
+    }
+    port->log_size = req->log_size ? req->log_size : CONSOLE_DEFAULT_LOG_SIZE;
+    port->log_files = req->log_files;
+    port->log.fd = open(port->log_path,
+                        O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (port->log.fd < 0) {
+        log_error("Failed to open console log %s, errno is %d", req->log,
+                  errno);
+        return -1;
     }
+    port->log_written = lseek(port->log.fd, 0, SEEK_END);
     return 0;
 }
 
-static void virtq_tx_handle_one_request(ConsoleDev *dev, VirtQueue *vq) {
-    int n;
-    uint16_t idx;
-    ssize_t len;
-    struct iovec *iov = NULL;
-    static int count = 0;
-    count++;
-    if (dev->master_fd <= 0) {
-        log_error("Console master fd is not ready");
+static int console_add_port(ConsoleDev *dev, ConsolePortRequestedState *req) {
+    ConsolePort *port = console_port_alloc(dev->nports);
+    dev->ports[dev->nports++] = port;
+    snprintf(port->name, sizeof(port->name), "%s", req->name);
+    // A named port is a byte stream to one program, not a shared console
+    port->lossless = true;
+    port->max_clients = 1;
+    if (req->socket[0])
+        return port_open_socket(port, req->socket);
+    if (req->fifo[0])
+        return port_open_fifo(port, req->fifo);
+    log_error("console port %s needs a socket or a fifo", req->name);
+    return -1;
+}
+
+/// The driver set DRIVER_OK, or the device is reset.
+static void virtio_console_activate(VirtIODevice *vdev, bool activate) {
+    ConsoleDev *dev = vdev->dev;
+    ConsolePort *port;
+    if (activate)
         return;
+    pthread_mutex_lock(&dev->ctrl_lock);
+    dev->ctrl_ready = false;
+    dev->ctrl_head = dev->ctrl_count = 0;
+    for (int i = 0; i < dev->nports; i++) {
+        port = dev->ports[i];
+        pthread_mutex_lock(&port->tx_lock);
+        port->rx_ready = port->ready = false;
+        port->guest_open = port->host_open = false;
+        port->tx_stalled = false;
+        pthread_mutex_unlock(&port->tx_lock);
     }
+    pthread_mutex_unlock(&dev->ctrl_lock);
+}
 
-    n = process_descriptor_chain(vq, &idx, &iov, NULL, 0, false);
-    // if (count % 100 == 0) {
-    //     log_info("console txq: n is %d, data is ", n);
-    //     for (int i=0; i<iov->iov_len; i++)
-    //         log_printf("%c", *(char*)&iov->iov_base[i]);
-    //     log_printf("\n");
-    // }
-
-    for (int i = 0; i < n; i++) {
-        log_printf("RAW:[");
-        for (int j = 0; j < iov[i].iov_len; j++) {
-            char x = *(char *)&iov[i].iov_base[j];
-            if (x == '\t' || x == '\n' || x == '\r') {
-                x = ' ';
-            }
-            log_printf("%c", x);
-        }
-        log_printf("]\n");
+static void virtio_console_stats(VirtIODevice *vdev) {
+    ConsoleDev *dev = vdev->dev;
+    ConsolePort *port;
+    for (int i = 0; i < dev->nports; i++) {
+        port = dev->ports[i];
+        log_warn("zone %d virtio console port %u%s%s: tx %llu bytes, rx %llu "
+                 "bytes, lost %llu bytes%s",
+                 vdev->zone_id, port->id, port->name[0] ? " " : "",
+                 port->name, port->tx_bytes, port->rx_bytes,
+                 port->lost_bytes, port->tx_stalled ? ", tx stalled" : "");
     }
+}
 
-    if (n < 1) {
-        return;
-    }
+int virtio_console_init(VirtIODevice *vdev, ConsoleRequestedState *req) {
+    ConsoleDev *dev = (ConsoleDev *)vdev->dev;
+    ConsolePort *port = dev->ports[0];
 
-    len = writev(dev->master_fd, iov, n);
-    if (len < 0) {
-        log_error("Failed to write to console, errno is %d", errno);
+    vdev->virtio_close = virtio_console_close;
+    vdev->virtio_activate = virtio_console_activate;
+    vdev->virtio_stats = virtio_console_stats;
+    dev->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (dev->wake_fd < 0) {
+        log_error("Failed to create eventfd, errno is %d", errno);
+        return -1;
     }
-    update_used_ring(vq, idx, 0);
-    free(iov);
+    if (port_open_pty(port) < 0)
+        return -1;
+    if (req && req->socket[0] && port_open_socket(port, req->socket) < 0)
+        return -1;
+    if (req && req->log[0] && port_open_log(port, req) < 0)
+        return -1;
+    for (int i = 0; req && i < req->nports; i++)
+        if (console_add_port(dev, &req->ports[i]) < 0)
+            return -1;
+    // A single console doesn't need the control queues
+    dev->config.max_nr_ports = dev->nports;
+    if (dev->nports == 1)
+        vdev->regs.dev_feature &= ~(1ULL << VIRTIO_CONSOLE_F_MULTIPORT);
+    if (pthread_create(&dev->io_thread, NULL, console_io_thread, vdev)) {
+        log_error("Failed to create console io thread");
+        return -1;
+    }
+    return 0;
+}
+
+int virtio_console_rxq_notify_handler(VirtIODevice *vdev, VirtQueue *vq) {
+    ConsoleDev *dev = (ConsoleDev *)vdev->dev;
+    ConsolePort *port = vq_port(dev, vq);
+    if (port == NULL)
+        return 0;
+    // The driver has new rx buffers, input can be read again
+    port->rx_ready = true;
+    console_wake(dev);
+    return 0;
 }
 
 int virtio_console_txq_notify_handler(VirtIODevice *vdev, VirtQueue *vq) {
-    log_debug("%s", __func__);
-    while (!virtqueue_is_empty(vq)) {
-        virtqueue_disable_notify(vq);
-        while (!virtqueue_is_empty(vq)) {
-            virtq_tx_handle_one_request(vdev->dev, vq);
-        }
-        virtqueue_enable_notify(vq);
-    }
-    virtio_inject_irq(vq);
+    ConsolePort *port = vq_port(vdev->dev, vq);
+    if (port)
+        port_tx(vdev, port);
     return 0;
 }
 
+static void console_port_free(ConsolePort *port) {
+    for (int i = 0; i < port->max_clients; i++)
+        if (port->clients[i].fd >= 0)
+            close(port->clients[i].fd);
+    if (port->listen_fd >= 0)
+        close(port->listen_fd);
+    if (port->fifo_in_fd >= 0)
+        close(port->fifo_in_fd);
+    if (port->fifo_out.fd >= 0)
+        close(port->fifo_out.fd);
+    if (port->log.fd >= 0)
+        close(port->log.fd);
+    if (port->slave_fd >= 0)
+        close(port->slave_fd);
+    if (port->master_fd >= 0)
+        close(port->master_fd);
+    free(port);
+}
+
 void virtio_console_close(VirtIODevice *vdev) {
     ConsoleDev *dev = vdev->dev;
-    close(dev->master_fd);
-    free(dev->event);
+    if (dev->io_thread) {
+        dev->closing = true;
+        console_wake(dev);
+        pthread_join(dev->io_thread, NULL);
+    }
+    for (int i = 0; i < dev->nports; i++)
+        console_port_free(dev->ports[i]);
+    if (dev->wake_fd >= 0)
+        close(dev->wake_fd);
     free(dev);
     free(vdev->vqs);
     free(vdev);
-}
\ No newline at end of file
+}
@@ -0,0 +1,901 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/**
+ * Copyright (c) 2025 Syswonder
+ *
+ * Syswonder Website:
+ *      https://www.syswonder.org
+ */
+// virtio-crypto: symmetric ciphers, hashes, MACs and AEADs for a zone,
+// computed by the kernel crypto API of Root Linux through AF_ALG sockets.
+// The kernel picks its fastest implementation of each algorithm, such as
+// the ARMv8 Crypto Extensions and NEON on arm64 or AES-NI and SHA-NI on x86,
+// and falls back to its generic C code, so the daemon carries no cipher code
+// of its own. Only the algorithms the kernel has are advertised. Data moves
+// between the guest's buffers and the kernel without a copy in the daemon.
+#define _GNU_SOURCE
+
+#include "virtio_crypto.h"
+#include "log.h"
+#include "virtio.h"
+#include <errno.h>
+#include <linux/if_alg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#ifndef SOL_ALG
+#define SOL_ALG 279
+#endif
+
+#define CRYPTO_HDR_SIZE sizeof(struct virtio_crypto_op_data_req)
+#define CRYPTO_TAG_LEN 16
+
+typedef struct crypto_alg {
+    uint32_t service;
+    uint32_t algo;
+    const char *type; // Type of the AF_ALG socket
+    const char *name; // Name in the kernel crypto API
+    uint32_t digest_len;
+} CryptoAlg;
+
+static const CryptoAlg crypto_algs[] = {
+    {VIRTIO_CRYPTO_SERVICE_CIPHER, VIRTIO_CRYPTO_CIPHER_AES_ECB, "skcipher",
+     "ecb(aes)", 0},
+    {VIRTIO_CRYPTO_SERVICE_CIPHER, VIRTIO_CRYPTO_CIPHER_AES_CBC, "skcipher",
+     "cbc(aes)", 0},
+    {VIRTIO_CRYPTO_SERVICE_CIPHER, VIRTIO_CRYPTO_CIPHER_AES_CTR, "skcipher",
+     "ctr(aes)", 0},
+    {VIRTIO_CRYPTO_SERVICE_CIPHER, VIRTIO_CRYPTO_CIPHER_AES_XTS, "skcipher",
+     "xts(aes)", 0},
+    {VIRTIO_CRYPTO_SERVICE_HASH, VIRTIO_CRYPTO_HASH_SHA1, "hash", "sha1", 20},
+    {VIRTIO_CRYPTO_SERVICE_HASH, VIRTIO_CRYPTO_HASH_SHA_224, "hash", "sha224",
+     28},
+    {VIRTIO_CRYPTO_SERVICE_HASH, VIRTIO_CRYPTO_HASH_SHA_256, "hash", "sha256",
+     32},
+    {VIRTIO_CRYPTO_SERVICE_HASH, VIRTIO_CRYPTO_HASH_SHA_384, "hash", "sha384",
+     48},
+    {VIRTIO_CRYPTO_SERVICE_HASH, VIRTIO_CRYPTO_HASH_SHA_512, "hash", "sha512",
+     64},
+    {VIRTIO_CRYPTO_SERVICE_MAC, VIRTIO_CRYPTO_MAC_HMAC_SHA1, "hash",
+     "hmac(sha1)", 20},
+    {VIRTIO_CRYPTO_SERVICE_MAC, VIRTIO_CRYPTO_MAC_HMAC_SHA_224, "hash",
+     "hmac(sha224)", 28},
+    {VIRTIO_CRYPTO_SERVICE_MAC, VIRTIO_CRYPTO_MAC_HMAC_SHA_256, "hash",
+     "hmac(sha256)", 32},
+    {VIRTIO_CRYPTO_SERVICE_MAC, VIRTIO_CRYPTO_MAC_HMAC_SHA_384, "hash",
+     "hmac(sha384)", 48},
+    {VIRTIO_CRYPTO_SERVICE_MAC, VIRTIO_CRYPTO_MAC_HMAC_SHA_512, "hash",
+     "hmac(sha512)", 64},
+    {VIRTIO_CRYPTO_SERVICE_MAC, VIRTIO_CRYPTO_MAC_CMAC_AES, "hash",
+     "cmac(aes)", 16},
+    {VIRTIO_CRYPTO_SERVICE_AEAD, VIRTIO_CRYPTO_AEAD_GCM, "aead", "gcm(aes)",
+     CRYPTO_TAG_LEN},
+    {VIRTIO_CRYPTO_SERVICE_AEAD, VIRTIO_CRYPTO_AEAD_CCM, "aead", "ccm(aes)",
+     CRYPTO_TAG_LEN},
+    {VIRTIO_CRYPTO_SERVICE_AEAD, VIRTIO_CRYPTO_AEAD_CHACHA20_POLY1305, "aead",
+     "rfc7539(chacha20,poly1305)", CRYPTO_TAG_LEN},
+};
+
+CryptoDev *init_crypto_dev() {
+    CryptoDev *dev = (CryptoDev *)calloc(1, sizeof(CryptoDev));
+    pthread_mutex_init(&dev->session_lock, NULL);
+    pthread_mutex_init(&dev->mtx, NULL);
+    pthread_cond_init(&dev->cond, NULL);
+    TAILQ_INIT(&dev->procq);
+    return dev;
+}
+
+/*********************************************************************
+    Guest buffers
+ */
+/// Copy len bytes at offset off of the iovec into buf.
+static size_t crypto_iov_to_buf(const struct iovec *iov, int n, size_t off,
+                                void *buf, size_t len) {
+    size_t done = 0, chunk;
+    for (int i = 0; i < n && done < len; i++) {
+        if (off >= iov[i].iov_len) {
+            off -= iov[i].iov_len;
+            continue;
+        }
+        chunk = MIN(len - done, iov[i].iov_len - off);
+        memcpy((uint8_t *)buf + done, (uint8_t *)iov[i].iov_base + off, chunk);
+        done += chunk;
+        off = 0;
+    }
+    return done;
+}
+
+static size_t crypto_iov_from_buf(const struct iovec *iov, int n, size_t off,
+                                  const void *buf, size_t len) {
+    size_t done = 0, chunk;
+    for (int i = 0; i < n && done < len; i++) {
+        if (off >= iov[i].iov_len) {
+            off -= iov[i].iov_len;
+            continue;
+        }
+        chunk = MIN(len - done, iov[i].iov_len - off);
+        memcpy((uint8_t *)iov[i].iov_base + off, (const uint8_t *)buf + done,
+               chunk);
+        done += chunk;
+        off = 0;
+    }
+    return done;
+}
+
+/// Make out describe at most len bytes of iov after its first off bytes.
+static int crypto_iov_slice(const struct iovec *iov, int n, size_t off,
+                            size_t len, struct iovec *out) {
+    int m = 0;
+    for (int i = 0; i < n && len > 0; i++) {
+        if (off >= iov[i].iov_len) {
+            off -= iov[i].iov_len;
+            continue;
+        }
+        out[m].iov_base = (uint8_t *)iov[i].iov_base + off;
+        out[m].iov_len = MIN(len, iov[i].iov_len - off);
+        len -= out[m].iov_len;
+        off = 0;
+        m++;
+    }
+    return m;
+}
+
+static inline size_t crypto_iov_len(const struct iovec *iov, int n) {
+    size_t len = 0;
+    for (int i = 0; i < n; i++)
+        len += iov[i].iov_len;
+    return len;
+}
+
+/*********************************************************************
+    Algorithms and sessions
+ */
+/// The word of the config telling whether alg is supported.
+static uint32_t *crypto_alg_mask(CryptoConfig *config, const CryptoAlg *alg) {
+    switch (alg->service) {
+    case VIRTIO_CRYPTO_SERVICE_CIPHER:
+        return alg->algo < 32 ? &config->cipher_algo_l : &config->cipher_algo_h;
+    case VIRTIO_CRYPTO_SERVICE_HASH:
+        return &config->hash_algo;
+    case VIRTIO_CRYPTO_SERVICE_MAC:
+        return alg->algo < 32 ? &config->mac_algo_l : &config->mac_algo_h;
+    default:
+        return &config->aead_algo;
+    }
+}
+
+static const CryptoAlg *crypto_alg_find(CryptoDev *dev, uint32_t service,
+                                        uint32_t algo) {
+    const CryptoAlg *alg;
+    for (size_t i = 0; i < sizeof(crypto_algs) / sizeof(crypto_algs[0]); i++) {
+        alg = &crypto_algs[i];
+        if (alg->service == service && alg->algo == algo)
+            return *crypto_alg_mask(&dev->config, alg) & (1U << (algo % 32))
+                       ? alg
+                       : NULL;
+    }
+    return NULL;
+}
+
+/// Open a transform socket of alg.
+static int crypto_alg_socket(const CryptoAlg *alg) {
+    struct sockaddr_alg sa = {.salg_family = AF_ALG};
+    int fd, err;
+
+    fd = socket(AF_ALG, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    strncpy((char *)sa.salg_type, alg->type, sizeof(sa.salg_type) - 1);
+    strncpy((char *)sa.salg_name, alg->name, sizeof(sa.salg_name) - 1);
+    if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+        err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+/// Advertise the algorithms the kernel has.
+static void crypto_probe(CryptoDev *dev) {
+    CryptoConfig *config = &dev->config;
+    const CryptoAlg *alg;
+    int fd;
+
+    for (size_t i = 0; i < sizeof(crypto_algs) / sizeof(crypto_algs[0]); i++) {
+        alg = &crypto_algs[i];
+        fd = crypto_alg_socket(alg);
+        if (fd < 0) {
+            log_info("virtio-crypto: %s is not available, errno is %d",
+                     alg->name, errno);
+            continue;
+        }
+        close(fd);
+        *crypto_alg_mask(config, alg) |= 1U << (alg->algo % 32);
+        config->crypto_services |= 1U << alg->service;
+    }
+}
+
+static void session_free(CryptoSession *s) {
+    if (s->op_fd >= 0)
+        close(s->op_fd);
+    if (s->tfm_fd >= 0)
+        close(s->tfm_fd);
+    pthread_mutex_destroy(&s->lock);
+    free(s);
+}
+
+/// Take a reference to session id of service.
+static CryptoSession *session_get(CryptoDev *dev, uint64_t id,
+                                  uint32_t service) {
+    CryptoSession *s = NULL;
+    pthread_mutex_lock(&dev->session_lock);
+    if (id < CRYPTO_MAX_SESSIONS && dev->sessions[id] &&
+        dev->sessions[id]->service == service) {
+        s = dev->sessions[id];
+        s->refs++;
+    }
+    pthread_mutex_unlock(&dev->session_lock);
+    return s;
+}
+
+static void session_put(CryptoDev *dev, CryptoSession *s) {
+    bool last;
+    pthread_mutex_lock(&dev->session_lock);
+    last = --s->refs == 0;
+    pthread_mutex_unlock(&dev->session_lock);
+    if (last)
+        session_free(s);
+}
+
+/// Drop session id of service, once the requests using it are done.
+static uint8_t session_destroy(CryptoDev *dev, uint64_t id, uint32_t service) {
+    CryptoSession *s = session_get(dev, id, service);
+    if (s == NULL)
+        return VIRTIO_CRYPTO_INVSESS;
+    pthread_mutex_lock(&dev->session_lock);
+    if (dev->sessions[id] == s) {
+        dev->sessions[id] = NULL;
+        s->refs--;
+    }
+    pthread_mutex_unlock(&dev->session_lock);
+    session_put(dev, s);
+    return VIRTIO_CRYPTO_OK;
+}
+
+/// A failed operation may leave data queued in the operation socket, so
+/// start over with a new one.
+static void session_reset(CryptoSession *s) {
+    close(s->op_fd);
+    s->op_fd = accept4(s->tfm_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (s->op_fd < 0)
+        log_error("virtio-crypto: failed to reset a session, errno is %d",
+                  errno);
+}
+
+/// Create a session keyed with key. Return a VIRTIO_CRYPTO_* status.
+static uint8_t session_create(CryptoDev *dev, uint32_t service, uint32_t algo,
+                              const void *key, uint32_t keylen,
+                              uint32_t digest_len, uint64_t *id) {
+    const CryptoAlg *alg = crypto_alg_find(dev, service, algo);
+    CryptoSession *s;
+    uint64_t i;
+
+    if (alg == NULL) {
+        log_warn("virtio-crypto: service %u algorithm %u is not supported",
+                 service, algo);
+        return VIRTIO_CRYPTO_NOTSUPP;
+    }
+    // A digest of 0 bytes asks for the full one
+    if (digest_len == 0)
+        digest_len = alg->digest_len;
+    if (digest_len > alg->digest_len)
+        return VIRTIO_CRYPTO_ERR;
+
+    s = (CryptoSession *)calloc(1, sizeof(CryptoSession));
+    s->service = service;
+    s->algo = algo;
+    s->digest_len = digest_len;
+    s->refs = 1;
+    s->op_fd = -1;
+    pthread_mutex_init(&s->lock, NULL);
+    s->tfm_fd = crypto_alg_socket(alg);
+    if (s->tfm_fd < 0 ||
+        (keylen > 0 &&
+         setsockopt(s->tfm_fd, SOL_ALG, ALG_SET_KEY, key, keylen) < 0) ||
+        (service == VIRTIO_CRYPTO_SERVICE_AEAD &&
+         setsockopt(s->tfm_fd, SOL_ALG, ALG_SET_AEAD_AUTHSIZE, NULL,
+                    digest_len) < 0) ||
+        (s->op_fd = accept4(s->tfm_fd, NULL, NULL, SOCK_CLOEXEC)) < 0) {
+        log_warn("virtio-crypto: failed to create a %s session, errno is %d",
+                 alg->name, errno);
+        session_free(s);
+        return VIRTIO_CRYPTO_ERR;
+    }
+
+    pthread_mutex_lock(&dev->session_lock);
+    for (i = 0; i < CRYPTO_MAX_SESSIONS && dev->sessions[i]; i++)
+        ;
+    if (i < CRYPTO_MAX_SESSIONS) {
+        dev->sessions[i] = s;
+        dev->sessions_created++;
+    }
+    pthread_mutex_unlock(&dev->session_lock);
+    if (i == CRYPTO_MAX_SESSIONS) {
+        session_free(s);
+        return VIRTIO_CRYPTO_NOSPC;
+    }
+    log_debug("virtio-crypto: session %llu is %s", (unsigned long long)i,
+              alg->name);
+    *id = i;
+    return VIRTIO_CRYPTO_OK;
+}
+
+/*********************************************************************
+    Control queue
+ */
+/// Serve a request of the control queue. Return the bytes written to it.
+static size_t crypto_handle_ctrl(CryptoDev *dev, struct iovec *iov,
+                                 uint16_t *flags, int n) {
+    struct virtio_crypto_op_ctrl_req req;
+    struct virtio_crypto_session_input input = {.status = VIRTIO_CRYPTO_ERR};
+    uint8_t key[CRYPTO_MAX_AUTH_KEY_LEN], status;
+    uint32_t keylen = 0, algo = 0, digest_len = 0, service;
+    uint64_t id = 0;
+    struct iovec *out;
+    int in_cnt, out_cnt;
+
+    for (in_cnt = 0; in_cnt < n; in_cnt++)
+        if (flags[in_cnt] & VRING_DESC_F_WRITE)
+            break;
+    out = iov + in_cnt;
+    out_cnt = n - in_cnt;
+    if (crypto_iov_to_buf(iov, in_cnt, 0, &req, sizeof(req)) != sizeof(req)) {
+        log_error("virtio-crypto control request without header");
+        return 0;
+    }
+    service = req.header.opcode >> 8;
+
+    switch (req.header.opcode) {
+    case VIRTIO_CRYPTO_CIPHER_CREATE_SESSION:
+        if (req.u.sym_create_session.op_type != VIRTIO_CRYPTO_SYM_OP_CIPHER) {
+            // Chaining a cipher with a MAC isn't supported
+            input.status = VIRTIO_CRYPTO_NOTSUPP;
+            goto reply;
+        }
+        algo = req.u.sym_create_session.u.cipher.para.algo;
+        keylen = req.u.sym_create_session.u.cipher.para.keylen;
+        if (keylen > CRYPTO_MAX_CIPHER_KEY_LEN)
+            goto reply;
+        break;
+    case VIRTIO_CRYPTO_HASH_CREATE_SESSION:
+        algo = req.u.hash_create_session.para.algo;
+        digest_len = req.u.hash_create_session.para.hash_result_len;
+        break;
+    case VIRTIO_CRYPTO_MAC_CREATE_SESSION:
+        algo = req.u.mac_create_session.para.algo;
+        digest_len = req.u.mac_create_session.para.hash_result_len;
+        keylen = req.u.mac_create_session.para.auth_key_len;
+        if (keylen > CRYPTO_MAX_AUTH_KEY_LEN)
+            goto reply;
+        break;
+    case VIRTIO_CRYPTO_AEAD_CREATE_SESSION:
+        algo = req.u.aead_create_session.para.algo;
+        digest_len = req.u.aead_create_session.para.hash_result_len;
+        keylen = req.u.aead_create_session.para.key_len;
+        if (keylen > CRYPTO_MAX_CIPHER_KEY_LEN)
+            goto reply;
+        break;
+    case VIRTIO_CRYPTO_CIPHER_DESTROY_SESSION:
+    case VIRTIO_CRYPTO_HASH_DESTROY_SESSION:
+    case VIRTIO_CRYPTO_MAC_DESTROY_SESSION:
+    case VIRTIO_CRYPTO_AEAD_DESTROY_SESSION:
+        // The reply is a single status byte
+        status =
+            session_destroy(dev, req.u.destroy_session.session_id, service);
+        return crypto_iov_from_buf(out, out_cnt, 0, &status, 1);
+    default:
+        log_warn("virtio-crypto control opcode %#x is not supported",
+                 req.header.opcode);
+        input.status = VIRTIO_CRYPTO_NOTSUPP;
+        goto reply;
+    }
+
+    // The key follows the request
+    if (crypto_iov_to_buf(iov, in_cnt, sizeof(req), key, keylen) == keylen)
+        input.status = session_create(dev, service, algo, key, keylen,
+                                      digest_len, &id);
+    input.session_id = id;
+    explicit_bzero(key, sizeof(key));
+reply:
+    return crypto_iov_from_buf(out, out_cnt, 0, &input, sizeof(input));
+}
+
+int virtio_crypto_ctrlq_notify_handler(VirtIODevice *vdev, VirtQueue *vq) {
+    CryptoDev *dev = vdev->dev;
+    struct iovec *iov = NULL;
+    uint16_t *flags = NULL;
+    uint16_t idx;
+    size_t len;
+    int n;
+
+    while (!virtqueue_is_empty(vq)) {
+        virtqueue_disable_notify(vq);
+        while (!virtqueue_is_empty(vq)) {
+            n = process_descriptor_chain(vq, &idx, &iov, &flags, 0, true);
+            if (n < 1)
+                break;
+            len = crypto_handle_ctrl(dev, iov, flags, n);
+            update_used_ring(vq, idx, len);
+            free(iov);
+            free(flags);
+        }
+        virtqueue_enable_notify(vq);
+    }
+    virtio_inject_irq(vq);
+    return 0;
+}
+
+/*********************************************************************
+    Data queues
+ */
+// A data request being served, with the readable and writable parts of its
+// descriptor chain
+typedef struct crypto_call {
+    CryptoSession *s;
+    const struct iovec *in_iov, *out_iov;
+    int in_cnt, out_cnt;
+    size_t in_len, out_len;
+    struct iovec *slice; // Room for a part of the chain and a buffer
+} CryptoCall;
+
+static uint8_t crypto_errno_status(int err) {
+    return err == EBADMSG ? VIRTIO_CRYPTO_BADMSG : VIRTIO_CRYPTO_ERR;
+}
+
+/// Fill buf with the control messages of a cipher or AEAD operation. The
+/// associated data length is only given when assoclen isn't negative.
+static size_t crypto_cmsg(void *buf, size_t size, uint32_t op,
+                          const uint8_t *iv, uint32_t iv_len, long assoclen) {
+    struct msghdr msg = {.msg_control = buf, .msg_controllen = size};
+    struct cmsghdr *cmsg;
+    struct af_alg_iv *alg_iv;
+    size_t len;
+
+    memset(buf, 0, size);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_ALG;
+    cmsg->cmsg_type = ALG_SET_OP;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(uint32_t));
+    *(uint32_t *)CMSG_DATA(cmsg) =
+        op == VIRTIO_CRYPTO_OP_ENCRYPT ? ALG_OP_ENCRYPT : ALG_OP_DECRYPT;
+    len = CMSG_SPACE(sizeof(uint32_t));
+    if (iv_len > 0) {
+        cmsg = CMSG_NXTHDR(&msg, cmsg);
+        cmsg->cmsg_level = SOL_ALG;
+        cmsg->cmsg_type = ALG_SET_IV;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(*alg_iv) + iv_len);
+        alg_iv = (struct af_alg_iv *)CMSG_DATA(cmsg);
+        alg_iv->ivlen = iv_len;
+        memcpy(alg_iv->iv, iv, iv_len);
+        len += CMSG_SPACE(sizeof(*alg_iv) + iv_len);
+    }
+    if (assoclen >= 0) {
+        cmsg = CMSG_NXTHDR(&msg, cmsg);
+        cmsg->cmsg_level = SOL_ALG;
+        cmsg->cmsg_type = ALG_SET_AEAD_ASSOCLEN;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint32_t));
+        *(uint32_t *)CMSG_DATA(cmsg) = assoclen;
+        len += CMSG_SPACE(sizeof(uint32_t));
+    }
+    return len;
+}
+
+/// Pass len readable bytes of the chain at off to the operation socket.
+static int crypto_send(CryptoCall *call, size_t off, size_t len, void *control,
+                       size_t control_len, int flags) {
+    struct msghdr msg = {.msg_iov = call->slice,
+                         .msg_control = control_len ? control : NULL,
+                         .msg_controllen = control_len};
+    ssize_t ret;
+
+    msg.msg_iovlen =
+        crypto_iov_slice(call->in_iov, call->in_cnt, off, len, call->slice);
+    ret = sendmsg(call->s->op_fd, &msg, flags);
+    if (ret >= 0 && (size_t)ret != len)
+        errno = EIO;
+    return (size_t)ret == len ? 0 : -1;
+}
+
+/// Read the result into len writable bytes of the chain at off, after
+/// skip bytes that go to buf.
+static int crypto_recv(CryptoCall *call, void *buf, size_t skip, size_t off,
+                       size_t len) {
+    int n = 0;
+    ssize_t ret;
+
+    if (skip > 0) {
+        call->slice[0].iov_base = buf;
+        call->slice[0].iov_len = skip;
+        n = 1;
+    }
+    n += crypto_iov_slice(call->out_iov, call->out_cnt, off, len,
+                          call->slice + n);
+    ret = readv(call->s->op_fd, call->slice, n);
+    if (ret >= 0 && (size_t)ret != skip + len)
+        errno = EIO;
+    return (size_t)ret == skip + len ? 0 : -1;
+}
+
+/// Encrypt or decrypt the source data into the destination, a chunk at a
+/// time. The kernel carries the IV from one chunk to the next.
+static uint8_t crypto_do_cipher(CryptoCall *call,
+                                const struct virtio_crypto_sym_data_req *req,
+                                uint32_t op) {
+    const struct virtio_crypto_cipher_para *para = &req->u.cipher.para;
+    union {
+        struct cmsghdr align;
+        uint8_t buf[CMSG_SPACE(sizeof(uint32_t)) +
+                    CMSG_SPACE(sizeof(struct af_alg_iv) + CRYPTO_MAX_IV_LEN)];
+    } control;
+    uint8_t iv[CRYPTO_MAX_IV_LEN];
+    size_t off, chunk, control_len = 0;
+
+    if (req->op_type != VIRTIO_CRYPTO_SYM_OP_CIPHER)
+        return VIRTIO_CRYPTO_NOTSUPP;
+    if (para->iv_len > CRYPTO_MAX_IV_LEN ||
+        para->src_data_len != para->dst_data_len ||
+        para->src_data_len > CRYPTO_MAX_SIZE ||
+        CRYPTO_HDR_SIZE + para->iv_len + para->src_data_len > call->in_len ||
+        para->dst_data_len >= call->out_len)
+        return VIRTIO_CRYPTO_ERR;
+    crypto_iov_to_buf(call->in_iov, call->in_cnt, CRYPTO_HDR_SIZE, iv,
+                      para->iv_len);
+
+    for (off = 0; off < para->src_data_len; off += chunk) {
+        chunk = MIN(para->src_data_len - off, CRYPTO_CHUNK_SIZE);
+        if (off == 0)
+            control_len = crypto_cmsg(control.buf, sizeof(control.buf), op, iv,
+                                      para->iv_len, -1);
+        if (crypto_send(call, CRYPTO_HDR_SIZE + para->iv_len + off, chunk,
+                        control.buf, off == 0 ? control_len : 0,
+                        off + chunk < para->src_data_len ? MSG_MORE : 0) ||
+            crypto_recv(call, NULL, 0, off, chunk))
+            return crypto_errno_status(errno);
+    }
+    return VIRTIO_CRYPTO_OK;
+}
+
+/// Hash or MAC the source data, a chunk at a time.
+static uint8_t crypto_do_hash(CryptoCall *call,
+                              const struct virtio_crypto_hash_para *para) {
+    uint8_t digest[CRYPTO_MAX_HASH_LEN];
+    size_t off, chunk;
+    ssize_t len;
+
+    if (para->hash_result_len > call->s->digest_len ||
+        para->src_data_len > CRYPTO_MAX_SIZE ||
+        CRYPTO_HDR_SIZE + para->src_data_len > call->in_len ||
+        para->hash_result_len >= call->out_len)
+        return VIRTIO_CRYPTO_ERR;
+    for (off = 0; off < para->src_data_len; off += chunk) {
+        chunk = MIN(para->src_data_len - off, CRYPTO_CHUNK_SIZE);
+        if (crypto_send(call, CRYPTO_HDR_SIZE + off, chunk, NULL, 0, MSG_MORE))
+            return crypto_errno_status(errno);
+    }
+    // Reading finishes the hash
+    len = read(call->s->op_fd, digest, sizeof(digest));
+    if (len < 0)
+        return crypto_errno_status(errno);
+    if ((size_t)len < para->hash_result_len)
+        return VIRTIO_CRYPTO_ERR;
+    crypto_iov_from_buf(call->out_iov, call->out_cnt, 0, digest,
+                        para->hash_result_len);
+    return VIRTIO_CRYPTO_OK;
+}
+
+/// Seal or open the source data. Encrypting appends the tag to the
+/// ciphertext in the destination, decrypting takes the ciphertext followed
+/// by its tag as the source and fails with BADMSG if the tag doesn't match.
+static uint8_t crypto_do_aead(CryptoCall *call,
+                              const struct virtio_crypto_aead_para *para,
+                              uint32_t op) {
+    union {
+        struct cmsghdr align;
+        uint8_t buf[CMSG_SPACE(sizeof(uint32_t)) * 2 +
+                    CMSG_SPACE(sizeof(struct af_alg_iv) + CRYPTO_MAX_IV_LEN)];
+    } control;
+    uint32_t tag_len = call->s->digest_len, iv_len = para->iv_len, dst_len;
+    uint8_t iv[CRYPTO_MAX_IV_LEN] = {0}, *aad = NULL;
+    size_t control_len;
+    uint8_t status = VIRTIO_CRYPTO_OK;
+
+    if (op == VIRTIO_CRYPTO_OP_ENCRYPT)
+        dst_len = para->src_data_len + tag_len;
+    else if (para->src_data_len >= tag_len)
+        dst_len = para->src_data_len - tag_len;
+    else
+        return VIRTIO_CRYPTO_ERR;
+    // The kernel takes an AEAD request in one go
+    if (para->aad_len > CRYPTO_AEAD_MAX_SIZE ||
+        para->src_data_len > CRYPTO_AEAD_MAX_SIZE ||
+        para->aad_len + para->src_data_len > CRYPTO_AEAD_MAX_SIZE)
+        return VIRTIO_CRYPTO_NOTSUPP;
+    if (para->iv_len > CRYPTO_MAX_IV_LEN || para->dst_data_len != dst_len ||
+        CRYPTO_HDR_SIZE + para->iv_len + para->aad_len + para->src_data_len >
+            call->in_len ||
+        dst_len >= call->out_len)
+        return VIRTIO_CRYPTO_ERR;
+    crypto_iov_to_buf(call->in_iov, call->in_cnt, CRYPTO_HDR_SIZE, iv, iv_len);
+    if (call->s->algo == VIRTIO_CRYPTO_AEAD_CCM) {
+        // The kernel wants the nonce in a counter block with its length
+        if (iv_len < 7 || iv_len > 13)
+            return VIRTIO_CRYPTO_ERR;
+        memmove(iv + 1, iv, iv_len);
+        iv[0] = 14 - iv_len;
+        memset(iv + 1 + iv_len, 0, CRYPTO_MAX_IV_LEN - 1 - iv_len);
+        iv_len = CRYPTO_MAX_IV_LEN;
+    } else if (iv_len != 12) {
+        // GCM with a pre-computed counter block isn't supported
+        return VIRTIO_CRYPTO_NOTSUPP;
+    }
+
+    // The result starts with a copy of the associated data, which isn't
+    // returned to the guest
+    if (para->aad_len > 0)
+        aad = malloc(para->aad_len);
+    control_len = crypto_cmsg(control.buf, sizeof(control.buf), op, iv, iv_len,
+                              para->aad_len);
+    if (crypto_send(call, CRYPTO_HDR_SIZE + para->iv_len,
+                    para->aad_len + para->src_data_len, control.buf,
+                    control_len, 0) ||
+        crypto_recv(call, aad, para->aad_len, 0, dst_len))
+        status = crypto_errno_status(errno);
+    free(aad);
+    return status;
+}
+
+/// Serve a request of a data queue. Its status goes in the last writable
+/// byte of the chain. Return that status, the source length in bytes and
+/// the length of the writable part.
+static uint8_t crypto_handle_request(CryptoDev *dev, struct crypto_req *req,
+                                     size_t *bytes, size_t *written) {
+    struct virtio_crypto_op_data_req hdr;
+    CryptoCall call = {0};
+    uint8_t status = VIRTIO_CRYPTO_ERR;
+    int i;
+
+    for (i = 0; i < req->iovcnt; i++)
+        if (req->flags[i] & VRING_DESC_F_WRITE)
+            break;
+    call.in_iov = req->iov;
+    call.in_cnt = i;
+    call.out_iov = req->iov + i;
+    call.out_cnt = req->iovcnt - i;
+    call.in_len = crypto_iov_len(call.in_iov, call.in_cnt);
+    call.out_len = crypto_iov_len(call.out_iov, call.out_cnt);
+    *bytes = 0;
+    *written = call.out_len;
+    if (call.out_len == 0) {
+        log_error("virtio-crypto request without room for a status");
+        return status;
+    }
+    if (crypto_iov_to_buf(call.in_iov, call.in_cnt, 0, &hdr, sizeof(hdr)) !=
+        sizeof(hdr)) {
+        log_error("virtio-crypto request without header");
+        goto reply;
+    }
+    call.s = session_get(dev, hdr.header.session_id, hdr.header.opcode >> 8);
+    if (call.s == NULL) {
+        status = VIRTIO_CRYPTO_INVSESS;
+        goto reply;
+    }
+    call.slice = malloc((req->iovcnt + 1) * sizeof(struct iovec));
+
+    pthread_mutex_lock(&call.s->lock);
+    switch (hdr.header.opcode) {
+    case VIRTIO_CRYPTO_CIPHER_ENCRYPT:
+    case VIRTIO_CRYPTO_CIPHER_DECRYPT:
+        status = crypto_do_cipher(&call, &hdr.u.sym_req,
+                                  hdr.header.opcode ==
+                                          VIRTIO_CRYPTO_CIPHER_ENCRYPT
+                                      ? VIRTIO_CRYPTO_OP_ENCRYPT
+                                      : VIRTIO_CRYPTO_OP_DECRYPT);
+        *bytes = hdr.u.sym_req.u.cipher.para.src_data_len;
+        break;
+    case VIRTIO_CRYPTO_HASH:
+        status = crypto_do_hash(&call, &hdr.u.hash_req.para);
+        *bytes = hdr.u.hash_req.para.src_data_len;
+        break;
+    case VIRTIO_CRYPTO_MAC:
+        status = crypto_do_hash(&call, &hdr.u.mac_req.para.hash);
+        *bytes = hdr.u.mac_req.para.hash.src_data_len;
+        break;
+    case VIRTIO_CRYPTO_AEAD_ENCRYPT:
+    case VIRTIO_CRYPTO_AEAD_DECRYPT:
+        status = crypto_do_aead(&call, &hdr.u.aead_req.para,
+                                hdr.header.opcode == VIRTIO_CRYPTO_AEAD_ENCRYPT
+                                    ? VIRTIO_CRYPTO_OP_ENCRYPT
+                                    : VIRTIO_CRYPTO_OP_DECRYPT);
+        *bytes = hdr.u.aead_req.para.src_data_len;
+        break;
+    default:
+        status = VIRTIO_CRYPTO_NOTSUPP;
+        break;
+    }
+    if (status != VIRTIO_CRYPTO_OK && status != VIRTIO_CRYPTO_NOTSUPP)
+        session_reset(call.s);
+    pthread_mutex_unlock(&call.s->lock);
+    free(call.slice);
+    session_put(dev, call.s);
+reply:
+    crypto_iov_from_buf(call.out_iov, call.out_cnt, call.out_len - 1, &status,
+                        1);
+    return status;
+}
+
+static void *crypto_worker(void *param) {
+    VirtIODevice *vdev = param;
+    CryptoDev *dev = vdev->dev;
+    struct crypto_req *req;
+    uint8_t status;
+    size_t bytes, written;
+    bool idle;
+
+    for (;;) {
+        pthread_mutex_lock(&dev->mtx);
+        while (TAILQ_EMPTY(&dev->procq) && !dev->close)
+            pthread_cond_wait(&dev->cond, &dev->mtx);
+        if (dev->close) {
+            pthread_mutex_unlock(&dev->mtx);
+            break;
+        }
+        req = TAILQ_FIRST(&dev->procq);
+        TAILQ_REMOVE(&dev->procq, req, link);
+        pthread_mutex_unlock(&dev->mtx);
+
+        status = crypto_handle_request(dev, req, &bytes, &written);
+        pthread_mutex_lock(&dev->mtx);
+        dev->requests++;
+        if (status == VIRTIO_CRYPTO_OK)
+            dev->bytes += bytes;
+        else
+            dev->errors++;
+        idle = TAILQ_EMPTY(&dev->procq);
+        pthread_mutex_unlock(&dev->mtx);
+        // Workers finish requests of the same queue concurrently. One
+        // interrupt once the queue runs dry.
+        pthread_mutex_lock(&req->vq->used_ring_lock);
+        update_used_ring(req->vq, req->idx, written);
+        if (idle)
+            virtio_inject_irq(req->vq);
+        pthread_mutex_unlock(&req->vq->used_ring_lock);
+        free(req->iov);
+        free(req->flags);
+        free(req);
+    }
+    return NULL;
+}
+
+int virtio_crypto_dataq_notify_handler(VirtIODevice *vdev, VirtQueue *vq) {
+    CryptoDev *dev = vdev->dev;
+    struct crypto_req *req;
+    int n;
+
+    while (!virtqueue_is_empty(vq)) {
+        virtqueue_disable_notify(vq);
+        while (!virtqueue_is_empty(vq)) {
+            req = (struct crypto_req *)calloc(1, sizeof(struct crypto_req));
+            n = process_descriptor_chain(vq, &req->idx, &req->iov,
+                                         &req->flags, 0, true);
+            if (n < 1) {
+                free(req);
+                break;
+            }
+            req->vq = vq;
+            req->iovcnt = n;
+            pthread_mutex_lock(&dev->mtx);
+            TAILQ_INSERT_TAIL(&dev->procq, req, link);
+            pthread_cond_signal(&dev->cond);
+            pthread_mutex_unlock(&dev->mtx);
+        }
+        virtqueue_enable_notify(vq);
+    }
+    return 0;
+}
+
+/*********************************************************************
+    Setup
+ */
+static void crypto_drop_sessions(CryptoDev *dev) {
+    CryptoSession *s;
+    for (uint64_t i = 0; i < CRYPTO_MAX_SESSIONS; i++) {
+        pthread_mutex_lock(&dev->session_lock);
+        s = dev->sessions[i];
+        dev->sessions[i] = NULL;
+        pthread_mutex_unlock(&dev->session_lock);
+        if (s)
+            session_put(dev, s);
+    }
+}
+
+/// Sessions don't survive a reset of the device.
+static void virtio_crypto_activate(VirtIODevice *vdev, bool activate) {
+    if (!activate)
+        crypto_drop_sessions(vdev->dev);
+}
+
+static void virtio_crypto_stats(VirtIODevice *vdev) {
+    CryptoDev *dev = vdev->dev;
+    uint64_t sessions = 0;
+    pthread_mutex_lock(&dev->session_lock);
+    for (uint64_t i = 0; i < CRYPTO_MAX_SESSIONS; i++)
+        sessions += dev->sessions[i] != NULL;
+    pthread_mutex_unlock(&dev->session_lock);
+    pthread_mutex_lock(&dev->mtx);
+    log_warn("zone %d virtio crypto: %llu sessions open, %llu created, "
+             "%llu requests, %llu bytes, %llu errors",
+             vdev->zone_id, sessions, dev->sessions_created, dev->requests,
+             dev->bytes, dev->errors);
+    pthread_mutex_unlock(&dev->mtx);
+}
+
+int virtio_crypto_init(VirtIODevice *vdev, CryptoRequestedState *req) {
+    CryptoDev *dev = vdev->dev;
+    CryptoConfig *config = &dev->config;
+
+    vdev->virtio_close = virtio_crypto_close;
+    vdev->virtio_activate = virtio_crypto_activate;
+    vdev->virtio_stats = virtio_crypto_stats;
+    // The control queue follows the data queues
+    config->max_dataqueues =
+        MIN(MAX(req ? req->queues : 0, 1), CRYPTO_MAX_DATAQUEUES);
+    vdev->vqs_len = config->max_dataqueues + 1;
+    vdev->vqs[config->max_dataqueues].notify_handler =
+        virtio_crypto_ctrlq_notify_handler;
+    crypto_probe(dev);
+    if (config->crypto_services == 0)
+        log_warn("virtio-crypto: the kernel crypto API offers no algorithm, "
+                 "is CONFIG_CRYPTO_USER_API enabled?");
+    config->status = VIRTIO_CRYPTO_S_HW_READY;
+    config->max_cipher_key_len = CRYPTO_MAX_CIPHER_KEY_LEN;
+    config->max_auth_key_len = CRYPTO_MAX_AUTH_KEY_LEN;
+    config->max_size = CRYPTO_MAX_SIZE;
+
+    dev->nthreads = MIN(MAX(req ? req->threads : 0, 1), CRYPTO_MAX_THREADS);
+    for (int i = 0; i < dev->nthreads; i++) {
+        if (pthread_create(&dev->threads[i], NULL, crypto_worker, vdev)) {
+            log_error("Failed to create virtio-crypto worker thread");
+            dev->nthreads = i;
+            return -1;
+        }
+    }
+    log_info("virtio-crypto with %u data queues, %d threads, services %#x",
+             config->max_dataqueues, dev->nthreads, config->crypto_services);
+    return 0;
+}
+
+void virtio_crypto_close(VirtIODevice *vdev) {
+    CryptoDev *dev = vdev->dev;
+    struct crypto_req *req;
+
+    pthread_mutex_lock(&dev->mtx);
+    dev->close = 1;
+    pthread_cond_broadcast(&dev->cond);
+    pthread_mutex_unlock(&dev->mtx);
+    for (int i = 0; i < dev->nthreads; i++)
+        pthread_join(dev->threads[i], NULL);
+    while ((req = TAILQ_FIRST(&dev->procq))) {
+        TAILQ_REMOVE(&dev->procq, req, link);
+        free(req->iov);
+        free(req->flags);
+        free(req);
+    }
+    crypto_drop_sessions(dev);
+    free(dev);
+    free(vdev->vqs);
+    free(vdev);
+}
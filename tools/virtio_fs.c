@@ -0,0 +1,1322 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/**
+ * Copyright (c) 2025 Syswonder
+ *
+ * Syswonder Website:
+ *      https://www.syswonder.org
+ */
+// virtio-fs: a host directory shared with a zone over the FUSE protocol.
+// Every inode the guest looked up is held by an O_PATH fd, and names are
+// only resolved relative to such fds, one component at a time, so the guest
+// can't reach beyond the shared directory. Requests are served by a pool of
+// worker threads; reads and writes move data between the file and the
+// guest's buffers without a copy.
+#define _GNU_SOURCE
+
+#include "virtio_fs.h"
+#include "log.h"
+#include "virtio.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/fsuid.h>
+#include <sys/param.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+
+#define FS_ROOT_ID FUSE_ROOT_ID
+
+FsDev *init_fs_dev() {
+    FsDev *dev = (FsDev *)calloc(1, sizeof(FsDev));
+    dev->proc_self_fd = -1;
+    pthread_mutex_init(&dev->inode_lock, NULL);
+    pthread_mutex_init(&dev->handle_lock, NULL);
+    pthread_mutex_init(&dev->mtx, NULL);
+    pthread_cond_init(&dev->cond, NULL);
+    TAILQ_INIT(&dev->procq);
+    return dev;
+}
+
+/*********************************************************************
+    Guest buffers
+ */
+/// Copy len bytes at offset off of the iovec into buf.
+static size_t fs_iov_to_buf(const struct iovec *iov, int n, size_t off,
+                            void *buf, size_t len) {
+    size_t done = 0, chunk;
+    for (int i = 0; i < n && done < len; i++) {
+        if (off >= iov[i].iov_len) {
+            off -= iov[i].iov_len;
+            continue;
+        }
+        chunk = MIN(len - done, iov[i].iov_len - off);
+        memcpy((uint8_t *)buf + done, (uint8_t *)iov[i].iov_base + off, chunk);
+        done += chunk;
+        off = 0;
+    }
+    return done;
+}
+
+static size_t fs_iov_from_buf(const struct iovec *iov, int n, size_t off,
+                              const void *buf, size_t len) {
+    size_t done = 0, chunk;
+    for (int i = 0; i < n && done < len; i++) {
+        if (off >= iov[i].iov_len) {
+            off -= iov[i].iov_len;
+            continue;
+        }
+        chunk = MIN(len - done, iov[i].iov_len - off);
+        memcpy((uint8_t *)iov[i].iov_base + off, (const uint8_t *)buf + done,
+               chunk);
+        done += chunk;
+        off = 0;
+    }
+    return done;
+}
+
+/// Make out describe at most len bytes of iov after its first off bytes.
+static int fs_iov_slice(const struct iovec *iov, int n, size_t off, size_t len,
+                        struct iovec *out) {
+    int m = 0;
+    for (int i = 0; i < n && len > 0; i++) {
+        if (off >= iov[i].iov_len) {
+            off -= iov[i].iov_len;
+            continue;
+        }
+        out[m].iov_base = (uint8_t *)iov[i].iov_base + off;
+        out[m].iov_len = MIN(len, iov[i].iov_len - off);
+        len -= out[m].iov_len;
+        off = 0;
+        m++;
+    }
+    return m;
+}
+
+static inline size_t fs_iov_len(const struct iovec *iov, int n) {
+    size_t len = 0;
+    for (int i = 0; i < n; i++)
+        len += iov[i].iov_len;
+    return len;
+}
+
+/*********************************************************************
+    Inode and handle tables
+ */
+static inline uint32_t inode_hash(dev_t dev, ino_t ino) {
+    return (uint32_t)((ino * 2654435761u) ^ dev) & (FS_INODE_HASH_SIZE - 1);
+}
+
+static void inode_free_locked(FsDev *dev, FsInode *inode) {
+    FsInode **p = &dev->inode_hash[inode_hash(inode->dev, inode->ino)];
+    while (*p != inode)
+        p = &(*p)->next;
+    *p = inode->next;
+    dev->inodes[inode->nodeid] = NULL;
+    close(inode->fd);
+    free(inode);
+}
+
+/// Take a reference on an inode for the duration of a request.
+static FsInode *inode_get(FsDev *dev, uint64_t nodeid) {
+    FsInode *inode = NULL;
+    pthread_mutex_lock(&dev->inode_lock);
+    if (nodeid < dev->ninodes && dev->inodes[nodeid]) {
+        inode = dev->inodes[nodeid];
+        inode->refs++;
+    }
+    pthread_mutex_unlock(&dev->inode_lock);
+    return inode;
+}
+
+static void inode_put(FsDev *dev, FsInode *inode) {
+    if (inode == NULL)
+        return;
+    pthread_mutex_lock(&dev->inode_lock);
+    if (--inode->refs == 0 && inode->nlookup == 0)
+        inode_free_locked(dev, inode);
+    pthread_mutex_unlock(&dev->inode_lock);
+}
+
+/// Count a lookup of the file behind fd. A file already in the table keeps
+/// its nodeid and fd closes. Return the nodeid, 0 if out of memory.
+static uint64_t inode_add(FsDev *dev, int fd, const struct stat *st) {
+    uint32_t h = inode_hash(st->st_dev, st->st_ino);
+    FsInode *inode, **table;
+    uint64_t nodeid, n;
+
+    pthread_mutex_lock(&dev->inode_lock);
+    for (inode = dev->inode_hash[h]; inode; inode = inode->next) {
+        if (inode->dev == st->st_dev && inode->ino == st->st_ino) {
+            inode->nlookup++;
+            nodeid = inode->nodeid;
+            pthread_mutex_unlock(&dev->inode_lock);
+            close(fd);
+            return nodeid;
+        }
+    }
+    // Slot 0 is never used, FUSE takes nodeid 0 as a negative entry
+    for (nodeid = FS_ROOT_ID; nodeid < dev->ninodes; nodeid++)
+        if (dev->inodes[nodeid] == NULL)
+            break;
+    if (nodeid >= dev->ninodes) {
+        n = dev->ninodes ? dev->ninodes * 2 : 1024;
+        table = realloc(dev->inodes, n * sizeof(FsInode *));
+        if (table == NULL) {
+            pthread_mutex_unlock(&dev->inode_lock);
+            close(fd);
+            return 0;
+        }
+        memset(table + dev->ninodes, 0,
+               (n - dev->ninodes) * sizeof(FsInode *));
+        dev->inodes = table;
+        dev->ninodes = n;
+    }
+    inode = (FsInode *)calloc(1, sizeof(FsInode));
+    inode->nodeid = nodeid;
+    inode->fd = fd;
+    inode->dev = st->st_dev;
+    inode->ino = st->st_ino;
+    inode->nlookup = 1;
+    inode->next = dev->inode_hash[h];
+    dev->inode_hash[h] = inode;
+    dev->inodes[nodeid] = inode;
+    pthread_mutex_unlock(&dev->inode_lock);
+    return nodeid;
+}
+
+static void inode_forget(FsDev *dev, uint64_t nodeid, uint64_t nlookup) {
+    FsInode *inode;
+    // The shared directory is never forgotten
+    if (nodeid == FS_ROOT_ID)
+        return;
+    pthread_mutex_lock(&dev->inode_lock);
+    if (nodeid < dev->ninodes && (inode = dev->inodes[nodeid])) {
+        inode->nlookup -= MIN(nlookup, inode->nlookup);
+        if (inode->nlookup == 0 && inode->refs == 0)
+            inode_free_locked(dev, inode);
+    }
+    pthread_mutex_unlock(&dev->inode_lock);
+}
+
+static uint64_t handle_add(FsDev *dev, int fd, DIR *dir) {
+    FsHandle *handle, **table;
+    uint64_t fh, n;
+
+    pthread_mutex_lock(&dev->handle_lock);
+    for (fh = 0; fh < dev->nhandles; fh++)
+        if (dev->handles[fh] == NULL)
+            break;
+    if (fh == dev->nhandles) {
+        n = dev->nhandles ? dev->nhandles * 2 : 256;
+        table = realloc(dev->handles, n * sizeof(FsHandle *));
+        if (table == NULL) {
+            pthread_mutex_unlock(&dev->handle_lock);
+            return UINT64_MAX;
+        }
+        memset(table + dev->nhandles, 0,
+               (n - dev->nhandles) * sizeof(FsHandle *));
+        dev->handles = table;
+        dev->nhandles = n;
+    }
+    handle = (FsHandle *)calloc(1, sizeof(FsHandle));
+    handle->fd = fd;
+    handle->dir = dir;
+    handle->refs = 1;
+    pthread_mutex_init(&handle->lock, NULL);
+    dev->handles[fh] = handle;
+    pthread_mutex_unlock(&dev->handle_lock);
+    return fh;
+}
+
+/// Take a reference on a handle for the duration of a request. The guest
+/// may release it meanwhile from another worker.
+static FsHandle *handle_get(FsDev *dev, uint64_t fh) {
+    FsHandle *handle = NULL;
+    pthread_mutex_lock(&dev->handle_lock);
+    if (fh < dev->nhandles && dev->handles[fh]) {
+        handle = dev->handles[fh];
+        handle->refs++;
+    }
+    pthread_mutex_unlock(&dev->handle_lock);
+    return handle;
+}
+
+static void handle_put(FsDev *dev, FsHandle *handle) {
+    bool last;
+    if (handle == NULL)
+        return;
+    pthread_mutex_lock(&dev->handle_lock);
+    last = --handle->refs == 0;
+    pthread_mutex_unlock(&dev->handle_lock);
+    if (!last)
+        return;
+    if (handle->dir)
+        closedir(handle->dir);
+    else
+        close(handle->fd);
+    pthread_mutex_destroy(&handle->lock);
+    free(handle);
+}
+
+/// Drop the table's reference, the handle closes with its last request.
+static void handle_release(FsDev *dev, uint64_t fh) {
+    FsHandle *handle = NULL;
+    pthread_mutex_lock(&dev->handle_lock);
+    if (fh < dev->nhandles) {
+        handle = dev->handles[fh];
+        dev->handles[fh] = NULL;
+    }
+    pthread_mutex_unlock(&dev->handle_lock);
+    handle_put(dev, handle);
+}
+
+/*********************************************************************
+    Helpers
+ */
+/// Open the file behind an O_PATH fd for I/O.
+static int fs_reopen(FsDev *dev, FsInode *inode, int flags) {
+    char name[16];
+    snprintf(name, sizeof(name), "%d", inode->fd);
+    return openat(dev->proc_self_fd, name, flags | O_CLOEXEC);
+}
+
+static inline int fs_stat(FsInode *inode, struct stat *st) {
+    return fstatat(inode->fd, "", st, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW);
+}
+
+/// A name must be a single component inside its directory.
+static bool fs_name_ok(const char *name) {
+    return name[0] != '\0' && strchr(name, '/') == NULL &&
+           strcmp(name, ".") != 0 && strcmp(name, "..") != 0;
+}
+
+static void fs_fill_attr(struct fuse_attr *attr, const struct stat *st) {
+    memset(attr, 0, sizeof(*attr));
+    attr->ino = st->st_ino;
+    attr->size = st->st_size;
+    attr->blocks = st->st_blocks;
+    attr->atime = st->st_atim.tv_sec;
+    attr->mtime = st->st_mtim.tv_sec;
+    attr->ctime = st->st_ctim.tv_sec;
+    attr->atimensec = st->st_atim.tv_nsec;
+    attr->mtimensec = st->st_mtim.tv_nsec;
+    attr->ctimensec = st->st_ctim.tv_nsec;
+    attr->mode = st->st_mode;
+    attr->nlink = st->st_nlink;
+    attr->uid = st->st_uid;
+    attr->gid = st->st_gid;
+    attr->rdev = st->st_rdev;
+    attr->blksize = st->st_blksize;
+}
+
+static inline void fs_timeout(FsDev *dev, uint64_t *sec, uint32_t *nsec) {
+    *sec = (uint64_t)dev->cache_timeout;
+    *nsec = (uint32_t)((dev->cache_timeout - *sec) * 1e9);
+}
+
+/// Look name up in parent and fill an entry. A missing name becomes a
+/// negative entry the guest may cache, if caching is on.
+static int fs_lookup(FsDev *dev, FsInode *parent, const char *name,
+                     struct fuse_entry_out *entry) {
+    struct stat st;
+    int fd;
+
+    memset(entry, 0, sizeof(*entry));
+    fs_timeout(dev, &entry->entry_valid, &entry->entry_valid_nsec);
+    fs_timeout(dev, &entry->attr_valid, &entry->attr_valid_nsec);
+    if (!fs_name_ok(name))
+        return -EINVAL;
+    fd = openat(parent->fd, name, O_PATH | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno == ENOENT && dev->cache_timeout > 0)
+            return 0;
+        return -errno;
+    }
+    if (fstatat(fd, "", &st, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) < 0) {
+        close(fd);
+        return -errno;
+    }
+    entry->nodeid = inode_add(dev, fd, &st);
+    if (entry->nodeid == 0)
+        return -ENOMEM;
+    fs_fill_attr(&entry->attr, &st);
+    return 0;
+}
+
+/// Files are created with the guest caller's uid and gid.
+static void fs_set_creds(const struct fuse_in_header *in) {
+    if (geteuid() != 0)
+        return;
+    setfsgid(in->gid);
+    setfsuid(in->uid);
+}
+
+static void fs_restore_creds(void) {
+    if (geteuid() != 0)
+        return;
+    setfsuid(0);
+    setfsgid(0);
+}
+
+/*********************************************************************
+    Requests
+ */
+// A request being served. The readable buffers hold the fuse_in_header and
+// the arguments, copied to in, and the data of a write. The writable buffers
+// take the fuse_out_header and the reply.
+typedef struct fs_call {
+    FsDev *dev;
+    struct fuse_in_header *hdr;
+    const uint8_t *arg; // Arguments after the header
+    size_t arg_len;
+    struct iovec *in_iov, *out_iov;
+    int in_cnt, out_cnt;
+    size_t out_len; // Size of the writable buffers
+    size_t reply_len;
+} FsCall;
+
+/// Write the reply header, the reply body follows it.
+static void fs_reply(FsCall *call, int error, const void *body, size_t len) {
+    struct fuse_out_header out = {
+        .len = sizeof(out) + (error ? 0 : len),
+        .error = error,
+        .unique = call->hdr->unique,
+    };
+    if (call->out_len < out.len) {
+        log_error("virtio-fs reply of %zu bytes doesn't fit", (size_t)out.len);
+        out.len = sizeof(out);
+        out.error = -EIO;
+    }
+    fs_iov_from_buf(call->out_iov, call->out_cnt, 0, &out, sizeof(out));
+    if (out.error == 0 && len > 0 && body)
+        fs_iov_from_buf(call->out_iov, call->out_cnt, sizeof(out), body, len);
+    call->reply_len = out.len;
+}
+
+#define FS_ARG(call, type)                                                     \
+    ((call)->arg_len >= sizeof(type) ? (const type *)(call)->arg : NULL)
+
+/// The NUL terminated name at offset off of the arguments.
+static const char *fs_arg_name(FsCall *call, size_t off) {
+    if (off >= call->arg_len ||
+        memchr(call->arg + off, '\0', call->arg_len - off) == NULL)
+        return NULL;
+    return (const char *)call->arg + off;
+}
+
+static void fs_do_init(FsCall *call) {
+    const struct fuse_init_in *in = FS_ARG(call, struct fuse_init_in);
+    struct fuse_init_out out = {0};
+    uint32_t want = FUSE_ASYNC_READ | FUSE_BIG_WRITES | FUSE_ATOMIC_O_TRUNC |
+                    FUSE_AUTO_INVAL_DATA | FUSE_ASYNC_DIO |
+                    FUSE_PARALLEL_DIROPS | FUSE_MAX_PAGES;
+
+    // struct fuse_init_in grew over time, only the first fields are needed
+    if (call->arg_len < offsetof(struct fuse_init_in, flags2) ||
+        in->major != FUSE_KERNEL_VERSION) {
+        fs_reply(call, -EPROTO, NULL, 0);
+        return;
+    }
+    out.major = FUSE_KERNEL_VERSION;
+    out.minor = MIN(in->minor, FUSE_KERNEL_MINOR_VERSION);
+    out.max_readahead = in->max_readahead;
+    out.flags = in->flags & want;
+    out.max_background = 64;
+    out.congestion_threshold = 48;
+    out.max_write = FS_MAX_IO_SIZE;
+    out.time_gran = 1;
+    out.max_pages = FS_MAX_IO_SIZE / 4096;
+    log_info("virtio-fs: FUSE %u.%u, flags %#x", in->major, out.minor,
+             out.flags);
+    fs_reply(call, 0, &out, sizeof(out));
+}
+
+static void fs_do_lookup(FsCall *call, FsInode *inode) {
+    struct fuse_entry_out entry;
+    const char *name = fs_arg_name(call, 0);
+    int err = name ? fs_lookup(call->dev, inode, name, &entry) : -EINVAL;
+    fs_reply(call, err, &entry, sizeof(entry));
+}
+
+static void fs_reply_attr(FsCall *call, int fd) {
+    struct fuse_attr_out out = {0};
+    struct stat st;
+    int err = 0;
+    if (fstatat(fd, "", &st, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) < 0)
+        err = -errno;
+    fs_timeout(call->dev, &out.attr_valid, &out.attr_valid_nsec);
+    fs_fill_attr(&out.attr, &st);
+    fs_reply(call, err, &out, sizeof(out));
+}
+
+static void fs_do_getattr(FsCall *call, FsInode *inode) {
+    fs_reply_attr(call, inode->fd);
+}
+
+static void fs_do_setattr(FsCall *call, FsInode *inode) {
+    const struct fuse_setattr_in *in = FS_ARG(call, struct fuse_setattr_in);
+    FsDev *dev = call->dev;
+    FsHandle *handle = NULL;
+    struct timespec ts[2];
+    char name[16];
+    int fd, err = 0;
+
+    if (in == NULL) {
+        fs_reply(call, -EINVAL, NULL, 0);
+        return;
+    }
+    if (in->valid & FATTR_FH)
+        handle = handle_get(dev, in->fh);
+    snprintf(name, sizeof(name), "%d", inode->fd);
+
+    if ((in->valid & FATTR_MODE) &&
+        (handle ? fchmod(handle->fd, in->mode)
+                : fchmodat(dev->proc_self_fd, name, in->mode, 0)) < 0)
+        goto err;
+    if ((in->valid & (FATTR_UID | FATTR_GID)) &&
+        fchownat(inode->fd, "",
+                 (in->valid & FATTR_UID) ? in->uid : (uid_t)-1,
+                 (in->valid & FATTR_GID) ? in->gid : (gid_t)-1,
+                 AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) < 0)
+        goto err;
+    if (in->valid & FATTR_SIZE) {
+        if (handle) {
+            if (ftruncate(handle->fd, in->size) < 0)
+                goto err;
+        } else {
+            fd = fs_reopen(dev, inode, O_WRONLY);
+            if (fd < 0)
+                goto err;
+            err = ftruncate(fd, in->size) < 0 ? -errno : 0;
+            close(fd);
+            if (err)
+                goto out;
+        }
+    }
+    if (in->valid & (FATTR_ATIME | FATTR_MTIME)) {
+        ts[0].tv_sec = in->atime;
+        ts[0].tv_nsec = in->atimensec;
+        ts[1].tv_sec = in->mtime;
+        ts[1].tv_nsec = in->mtimensec;
+        if (!(in->valid & FATTR_ATIME))
+            ts[0].tv_nsec = UTIME_OMIT;
+        else if (in->valid & FATTR_ATIME_NOW)
+            ts[0].tv_nsec = UTIME_NOW;
+        if (!(in->valid & FATTR_MTIME))
+            ts[1].tv_nsec = UTIME_OMIT;
+        else if (in->valid & FATTR_MTIME_NOW)
+            ts[1].tv_nsec = UTIME_NOW;
+        if ((handle ? futimens(handle->fd, ts)
+                    : utimensat(dev->proc_self_fd, name, ts, 0)) < 0)
+            goto err;
+    }
+    fs_reply_attr(call, inode->fd);
+    handle_put(dev, handle);
+    return;
+err:
+    err = -errno;
+out:
+    fs_reply(call, err, NULL, 0);
+    handle_put(dev, handle);
+}
+
+static void fs_do_readlink(FsCall *call, FsInode *inode) {
+    char buf[PATH_MAX];
+    ssize_t len = readlinkat(inode->fd, "", buf, sizeof(buf));
+    if (len < 0)
+        fs_reply(call, -errno, NULL, 0);
+    else
+        fs_reply(call, 0, buf, len);
+}
+
+/// Reply to a request that created name in parent.
+static void fs_reply_created(FsCall *call, FsInode *parent, const char *name,
+                             int err) {
+    struct fuse_entry_out entry;
+    if (err == 0) {
+        err = fs_lookup(call->dev, parent, name, &entry);
+        if (err == 0 && entry.nodeid == 0)
+            err = -ENOENT;
+    }
+    fs_reply(call, err, &entry, sizeof(entry));
+}
+
+static void fs_do_mknod(FsCall *call, FsInode *parent) {
+    const struct fuse_mknod_in *in = FS_ARG(call, struct fuse_mknod_in);
+    const char *name = fs_arg_name(call, sizeof(*in));
+    int err;
+    if (in == NULL || name == NULL || !fs_name_ok(name)) {
+        fs_reply(call, -EINVAL, NULL, 0);
+        return;
+    }
+    fs_set_creds(call->hdr);
+    err = mknodat(parent->fd, name, in->mode, in->rdev) < 0 ? -errno : 0;
+    fs_restore_creds();
+    fs_reply_created(call, parent, name, err);
+}
+
+static void fs_do_mkdir(FsCall *call, FsInode *parent) {
+    const struct fuse_mkdir_in *in = FS_ARG(call, struct fuse_mkdir_in);
+    const char *name = fs_arg_name(call, sizeof(*in));
+    int err;
+    if (in == NULL || name == NULL || !fs_name_ok(name)) {
+        fs_reply(call, -EINVAL, NULL, 0);
+        return;
+    }
+    fs_set_creds(call->hdr);
+    err = mkdirat(parent->fd, name, in->mode) < 0 ? -errno : 0;
+    fs_restore_creds();
+    fs_reply_created(call, parent, name, err);
+}
+
+static void fs_do_symlink(FsCall *call, FsInode *parent) {
+    const char *name = fs_arg_name(call, 0);
+    const char *target = name ? fs_arg_name(call, strlen(name) + 1) : NULL;
+    int err;
+    if (target == NULL || !fs_name_ok(name)) {
+        fs_reply(call, -EINVAL, NULL, 0);
+        return;
+    }
+    fs_set_creds(call->hdr);
+    err = symlinkat(target, parent->fd, name) < 0 ? -errno : 0;
+    fs_restore_creds();
+    fs_reply_created(call, parent, name, err);
+}
+
+static void fs_do_link(FsCall *call, FsInode *parent) {
+    const struct fuse_link_in *in = FS_ARG(call, struct fuse_link_in);
+    const char *name = fs_arg_name(call, sizeof(*in));
+    FsInode *old;
+    char procname[16];
+    int err;
+    if (in == NULL || name == NULL || !fs_name_ok(name)) {
+        fs_reply(call, -EINVAL, NULL, 0);
+        return;
+    }
+    old = inode_get(call->dev, in->oldnodeid);
+    if (old == NULL) {
+        fs_reply(call, -ENOENT, NULL, 0);
+        return;
+    }
+    snprintf(procname, sizeof(procname), "%d", old->fd);
+    err = linkat(call->dev->proc_self_fd, procname, parent->fd, name,
+                 AT_SYMLINK_FOLLOW) < 0
+              ? -errno
+              : 0;
+    inode_put(call->dev, old);
+    fs_reply_created(call, parent, name, err);
+}
+
+static void fs_do_unlink(FsCall *call, FsInode *parent, int flags) {
+    const char *name = fs_arg_name(call, 0);
+    int err;
+    if (name == NULL || !fs_name_ok(name))
+        err = -EINVAL;
+    else
+        err = unlinkat(parent->fd, name, flags) < 0 ? -errno : 0;
+    fs_reply(call, err, NULL, 0);
+}
+
+static void fs_do_rename(FsCall *call, FsInode *parent, uint64_t newdir,
+                         uint32_t flags, size_t off) {
+    const char *name = fs_arg_name(call, off);
+    const char *newname = name ? fs_arg_name(call, off + strlen(name) + 1)
+                               : NULL;
+    FsInode *newparent;
+    int err;
+
+    if (newname == NULL || !fs_name_ok(name) || !fs_name_ok(newname)) {
+        fs_reply(call, -EINVAL, NULL, 0);
+        return;
+    }
+    newparent = inode_get(call->dev, newdir);
+    if (newparent == NULL) {
+        fs_reply(call, -ENOENT, NULL, 0);
+        return;
+    }
+    err = renameat2(parent->fd, name, newparent->fd, newname, flags) < 0
+              ? -errno
+              : 0;
+    inode_put(call->dev, newparent);
+    fs_reply(call, err, NULL, 0);
+}
+
+static void fs_reply_open(FsCall *call, int fd, DIR *dir,
+                          struct fuse_entry_out *entry) {
+    struct {
+        struct fuse_entry_out entry;
+        struct fuse_open_out open;
+    } out = {0};
+    uint64_t fh = handle_add(call->dev, fd, dir);
+
+    if (fh == UINT64_MAX) {
+        if (dir)
+            closedir(dir);
+        else
+            close(fd);
+        fs_reply(call, -ENOMEM, NULL, 0);
+        return;
+    }
+    out.open.fh = fh;
+    if (entry) {
+        out.entry = *entry;
+        fs_reply(call, 0, &out, sizeof(out));
+    } else {
+        fs_reply(call, 0, &out.open, sizeof(out.open));
+    }
+}
+
+static void fs_do_open(FsCall *call, FsInode *inode) {
+    const struct fuse_open_in *in = FS_ARG(call, struct fuse_open_in);
+    int fd, flags;
+    if (in == NULL) {
+        fs_reply(call, -EINVAL, NULL, 0);
+        return;
+    }
+    flags = in->flags & ~(O_CREAT | O_EXCL | O_NOCTTY | O_NOFOLLOW);
+    if (call->dev->readonly && (flags & O_ACCMODE) != O_RDONLY) {
+        fs_reply(call, -EROFS, NULL, 0);
+        return;
+    }
+    fd = fs_reopen(call->dev, inode, flags);
+    if (fd < 0)
+        fs_reply(call, -errno, NULL, 0);
+    else
+        fs_reply_open(call, fd, NULL, NULL);
+}
+
+static void fs_do_create(FsCall *call, FsInode *parent) {
+    const struct fuse_create_in *in = FS_ARG(call, struct fuse_create_in);
+    const char *name = fs_arg_name(call, sizeof(*in));
+    struct fuse_entry_out entry;
+    int fd, err;
+
+    if (in == NULL || name == NULL || !fs_name_ok(name)) {
+        fs_reply(call, -EINVAL, NULL, 0);
+        return;
+    }
+    fs_set_creds(call->hdr);
+    fd = openat(parent->fd, name,
+                (in->flags | O_CREAT | O_CLOEXEC) & ~(O_NOCTTY | O_NOFOLLOW),
+                in->mode);
+    err = fd < 0 ? -errno : 0;
+    fs_restore_creds();
+    if (err == 0) {
+        err = fs_lookup(call->dev, parent, name, &entry);
+        if (err == 0 && entry.nodeid == 0)
+            err = -ENOENT;
+    }
+    if (err) {
+        if (fd >= 0)
+            close(fd);
+        fs_reply(call, err, NULL, 0);
+        return;
+    }
+    fs_reply_open(call, fd, NULL, &entry);
+}
+
+/// Read straight into the writable buffers after the reply header.
+static void fs_do_read(FsCall *call) {
+    const struct fuse_read_in *in = FS_ARG(call, struct fuse_read_in);
+    struct fuse_out_header out;
+    FsHandle *handle = in ? handle_get(call->dev, in->fh) : NULL;
+    struct iovec data[call->out_cnt];
+    size_t size;
+    ssize_t len;
+    int m;
+
+    if (handle == NULL) {
+        fs_reply(call, -EBADF, NULL, 0);
+        return;
+    }
+    size = MIN(in->size, call->out_len - sizeof(out));
+    size = MIN(size, FS_MAX_IO_SIZE);
+    m = fs_iov_slice(call->out_iov, call->out_cnt, sizeof(out), size, data);
+    len = m > 0 ? preadv(handle->fd, data, m, in->offset) : 0;
+    if (len < 0) {
+        fs_reply(call, -errno, NULL, 0);
+        goto put;
+    }
+    __atomic_fetch_add(&call->dev->read_bytes, len, __ATOMIC_RELAXED);
+    out.len = sizeof(out) + len;
+    out.error = 0;
+    out.unique = call->hdr->unique;
+    fs_iov_from_buf(call->out_iov, call->out_cnt, 0, &out, sizeof(out));
+    call->reply_len = out.len;
+put:
+    handle_put(call->dev, handle);
+}
+
+/// Write straight from the readable buffers after the arguments.
+static void fs_do_write(FsCall *call) {
+    const struct fuse_write_in *in = FS_ARG(call, struct fuse_write_in);
+    FsHandle *handle = in ? handle_get(call->dev, in->fh) : NULL;
+    struct iovec data[call->in_cnt];
+    struct fuse_write_out out = {0};
+    ssize_t len;
+    int m;
+
+    if (handle == NULL) {
+        fs_reply(call, -EBADF, NULL, 0);
+        return;
+    }
+    m = fs_iov_slice(call->in_iov, call->in_cnt,
+                     sizeof(struct fuse_in_header) + sizeof(*in), in->size,
+                     data);
+    len = m > 0 ? pwritev(handle->fd, data, m, in->offset) : 0;
+    if (len < 0) {
+        fs_reply(call, -errno, NULL, 0);
+        goto put;
+    }
+    __atomic_fetch_add(&call->dev->write_bytes, len, __ATOMIC_RELAXED);
+    out.size = len;
+    fs_reply(call, 0, &out, sizeof(out));
+put:
+    handle_put(call->dev, handle);
+}
+
+static void fs_do_statfs(FsCall *call, FsInode *inode) {
+    struct fuse_statfs_out out = {0};
+    struct statvfs st;
+    if (fstatvfs(inode->fd, &st) < 0) {
+        fs_reply(call, -errno, NULL, 0);
+        return;
+    }
+    out.st.blocks = st.f_blocks;
+    out.st.bfree = st.f_bfree;
+    out.st.bavail = st.f_bavail;
+    out.st.files = st.f_files;
+    out.st.ffree = st.f_ffree;
+    out.st.bsize = st.f_bsize;
+    out.st.namelen = st.f_namemax;
+    out.st.frsize = st.f_frsize;
+    fs_reply(call, 0, &out, sizeof(out));
+}
+
+static void fs_do_release(FsCall *call) {
+    const struct fuse_release_in *in = FS_ARG(call, struct fuse_release_in);
+    if (in)
+        handle_release(call->dev, in->fh);
+    fs_reply(call, 0, NULL, 0);
+}
+
+static void fs_do_fsync(FsCall *call) {
+    const struct fuse_fsync_in *in = FS_ARG(call, struct fuse_fsync_in);
+    FsHandle *handle = in ? handle_get(call->dev, in->fh) : NULL;
+    int ret;
+    if (handle == NULL) {
+        fs_reply(call, -EBADF, NULL, 0);
+        return;
+    }
+    ret = (in->fsync_flags & 1) ? fdatasync(handle->fd) : fsync(handle->fd);
+    fs_reply(call, ret < 0 ? -errno : 0, NULL, 0);
+    handle_put(call->dev, handle);
+}
+
+static void fs_do_opendir(FsCall *call, FsInode *inode) {
+    DIR *dir;
+    int fd = fs_reopen(call->dev, inode, O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        fs_reply(call, -errno, NULL, 0);
+        return;
+    }
+    dir = fdopendir(fd);
+    if (dir == NULL) {
+        close(fd);
+        fs_reply(call, -errno, NULL, 0);
+        return;
+    }
+    fs_reply_open(call, fd, dir, NULL);
+}
+
+/// Entries carry the offset of the entry after them, which is where the
+/// next READDIR starts.
+static void fs_do_readdir(FsCall *call) {
+    const struct fuse_read_in *in = FS_ARG(call, struct fuse_read_in);
+    FsHandle *handle = in ? handle_get(call->dev, in->fh) : NULL;
+    struct fuse_dirent *dirent;
+    struct dirent *entry;
+    size_t size, len = 0, reclen, namelen;
+    uint8_t *buf;
+    long pos;
+
+    if (handle == NULL || handle->dir == NULL) {
+        handle_put(call->dev, handle);
+        fs_reply(call, -EBADF, NULL, 0);
+        return;
+    }
+    size = MIN(in->size, call->out_len - sizeof(struct fuse_out_header));
+    size = MIN(size, FS_MAX_IO_SIZE);
+    buf = calloc(1, size);
+
+    pthread_mutex_lock(&handle->lock);
+    if (in->offset == 0)
+        rewinddir(handle->dir);
+    else
+        seekdir(handle->dir, in->offset);
+    for (;;) {
+        pos = telldir(handle->dir);
+        errno = 0;
+        entry = readdir(handle->dir);
+        if (entry == NULL)
+            break;
+        namelen = strlen(entry->d_name);
+        reclen = FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET + namelen);
+        if (len + reclen > size) {
+            seekdir(handle->dir, pos);
+            break;
+        }
+        dirent = (struct fuse_dirent *)(buf + len);
+        dirent->ino = entry->d_ino;
+        dirent->off = telldir(handle->dir);
+        dirent->namelen = namelen;
+        dirent->type = entry->d_type;
+        memcpy(dirent->name, entry->d_name, namelen);
+        len += reclen;
+    }
+    pthread_mutex_unlock(&handle->lock);
+    if (entry == NULL && errno != 0 && len == 0)
+        fs_reply(call, -errno, NULL, 0);
+    else
+        fs_reply(call, 0, buf, len);
+    free(buf);
+    handle_put(call->dev, handle);
+}
+
+static void fs_do_lseek(FsCall *call) {
+    const struct fuse_lseek_in *in = FS_ARG(call, struct fuse_lseek_in);
+    FsHandle *handle = in ? handle_get(call->dev, in->fh) : NULL;
+    struct fuse_lseek_out out;
+    off_t off;
+    if (handle == NULL) {
+        fs_reply(call, -EBADF, NULL, 0);
+        return;
+    }
+    off = lseek(handle->fd, in->offset, in->whence);
+    out.offset = off;
+    fs_reply(call, off < 0 ? -errno : 0, &out, sizeof(out));
+    handle_put(call->dev, handle);
+}
+
+static void fs_do_fallocate(FsCall *call) {
+    const struct fuse_fallocate_in *in =
+        FS_ARG(call, struct fuse_fallocate_in);
+    FsHandle *handle = in ? handle_get(call->dev, in->fh) : NULL;
+    int ret;
+    if (handle == NULL) {
+        fs_reply(call, -EBADF, NULL, 0);
+        return;
+    }
+    ret = fallocate(handle->fd, in->mode, in->offset, in->length);
+    fs_reply(call, ret < 0 ? -errno : 0, NULL, 0);
+    handle_put(call->dev, handle);
+}
+
+static bool fs_opcode_writes(uint32_t opcode) {
+    switch (opcode) {
+    case FUSE_SETATTR:
+    case FUSE_MKNOD:
+    case FUSE_MKDIR:
+    case FUSE_SYMLINK:
+    case FUSE_LINK:
+    case FUSE_UNLINK:
+    case FUSE_RMDIR:
+    case FUSE_RENAME:
+    case FUSE_RENAME2:
+    case FUSE_CREATE:
+    case FUSE_WRITE:
+    case FUSE_FALLOCATE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void fs_dispatch(FsCall *call) {
+    FsDev *dev = call->dev;
+    uint32_t opcode = call->hdr->opcode;
+    FsInode *inode = NULL;
+
+    switch (opcode) {
+    case FUSE_INIT:
+        fs_do_init(call);
+        return;
+    case FUSE_DESTROY:
+        fs_reply(call, 0, NULL, 0);
+        return;
+    case FUSE_READ:
+        fs_do_read(call);
+        return;
+    case FUSE_WRITE:
+        if (dev->readonly)
+            break;
+        fs_do_write(call);
+        return;
+    case FUSE_RELEASE:
+    case FUSE_RELEASEDIR:
+        fs_do_release(call);
+        return;
+    case FUSE_FSYNC:
+    case FUSE_FSYNCDIR:
+        fs_do_fsync(call);
+        return;
+    case FUSE_FLUSH:
+        fs_reply(call, 0, NULL, 0);
+        return;
+    case FUSE_READDIR:
+        fs_do_readdir(call);
+        return;
+    case FUSE_LSEEK:
+        fs_do_lseek(call);
+        return;
+    case FUSE_FALLOCATE:
+        if (dev->readonly)
+            break;
+        fs_do_fallocate(call);
+        return;
+    default:
+        break;
+    }
+    if (dev->readonly && fs_opcode_writes(opcode)) {
+        fs_reply(call, -EROFS, NULL, 0);
+        return;
+    }
+
+    // The rest works on the inode of the header
+    inode = inode_get(dev, call->hdr->nodeid);
+    if (inode == NULL) {
+        fs_reply(call, -ENOENT, NULL, 0);
+        return;
+    }
+    switch (opcode) {
+    case FUSE_LOOKUP:
+        fs_do_lookup(call, inode);
+        break;
+    case FUSE_GETATTR:
+        fs_do_getattr(call, inode);
+        break;
+    case FUSE_SETATTR:
+        fs_do_setattr(call, inode);
+        break;
+    case FUSE_READLINK:
+        fs_do_readlink(call, inode);
+        break;
+    case FUSE_MKNOD:
+        fs_do_mknod(call, inode);
+        break;
+    case FUSE_MKDIR:
+        fs_do_mkdir(call, inode);
+        break;
+    case FUSE_SYMLINK:
+        fs_do_symlink(call, inode);
+        break;
+    case FUSE_LINK:
+        fs_do_link(call, inode);
+        break;
+    case FUSE_UNLINK:
+        fs_do_unlink(call, inode, 0);
+        break;
+    case FUSE_RMDIR:
+        fs_do_unlink(call, inode, AT_REMOVEDIR);
+        break;
+    case FUSE_RENAME: {
+        const struct fuse_rename_in *in = FS_ARG(call, struct fuse_rename_in);
+        if (in)
+            fs_do_rename(call, inode, in->newdir, 0, sizeof(*in));
+        else
+            fs_reply(call, -EINVAL, NULL, 0);
+        break;
+    }
+    case FUSE_RENAME2: {
+        const struct fuse_rename2_in *in =
+            FS_ARG(call, struct fuse_rename2_in);
+        if (in)
+            fs_do_rename(call, inode, in->newdir, in->flags, sizeof(*in));
+        else
+            fs_reply(call, -EINVAL, NULL, 0);
+        break;
+    }
+    case FUSE_OPEN:
+        fs_do_open(call, inode);
+        break;
+    case FUSE_CREATE:
+        fs_do_create(call, inode);
+        break;
+    case FUSE_OPENDIR:
+        fs_do_opendir(call, inode);
+        break;
+    case FUSE_STATFS:
+        fs_do_statfs(call, inode);
+        break;
+    default:
+        // The guest stops sending what isn't implemented, e.g. xattrs
+        fs_reply(call, -ENOSYS, NULL, 0);
+        break;
+    }
+    inode_put(dev, inode);
+}
+
+/// Serve one descriptor chain. Return the number of bytes written to it.
+static size_t fs_handle_request(FsDev *dev, struct fs_req *req) {
+    struct fuse_in_header hdr;
+    FsCall call = {.dev = dev, .hdr = &hdr};
+    uint8_t *arg = NULL;
+    size_t in_len;
+    int i;
+
+    // Readable buffers come first
+    for (i = 0; i < req->iovcnt; i++)
+        if (req->flags[i] & VRING_DESC_F_WRITE)
+            break;
+    call.in_iov = req->iov;
+    call.in_cnt = i;
+    call.out_iov = req->iov + i;
+    call.out_cnt = req->iovcnt - i;
+    call.out_len = fs_iov_len(call.out_iov, call.out_cnt);
+    in_len = fs_iov_len(call.in_iov, call.in_cnt);
+
+    if (fs_iov_to_buf(call.in_iov, call.in_cnt, 0, &hdr, sizeof(hdr)) !=
+        sizeof(hdr)) {
+        log_error("virtio-fs request without header");
+        return 0;
+    }
+    // Write data stays in guest memory, only the arguments are copied
+    call.arg_len = MIN(in_len, hdr.len) - sizeof(hdr);
+    if (hdr.opcode == FUSE_WRITE)
+        call.arg_len = MIN(call.arg_len, sizeof(struct fuse_write_in));
+    if (call.arg_len > FS_MAX_IN_SIZE) {
+        fs_reply(&call, -EINVAL, NULL, 0);
+        return call.reply_len;
+    }
+    arg = malloc(call.arg_len + 1);
+    fs_iov_to_buf(call.in_iov, call.in_cnt, sizeof(hdr), arg, call.arg_len);
+    arg[call.arg_len] = '\0';
+    call.arg = arg;
+
+    log_debug("virtio-fs opcode %u nodeid %llu", hdr.opcode,
+              (unsigned long long)hdr.nodeid);
+    __atomic_fetch_add(&dev->requests, 1, __ATOMIC_RELAXED);
+    if (call.out_len < sizeof(struct fuse_out_header))
+        log_error("virtio-fs request %u without room for a reply",
+                  hdr.opcode);
+    else
+        fs_dispatch(&call);
+    free(arg);
+    return call.reply_len;
+}
+
+/*********************************************************************
+    Queues and worker threads
+ */
+static void *fs_worker(void *param) {
+    VirtIODevice *vdev = param;
+    FsDev *dev = vdev->dev;
+    struct fs_req *req;
+    size_t len;
+    bool idle;
+
+    for (;;) {
+        pthread_mutex_lock(&dev->mtx);
+        while (TAILQ_EMPTY(&dev->procq) && !dev->close)
+            pthread_cond_wait(&dev->cond, &dev->mtx);
+        if (dev->close) {
+            pthread_mutex_unlock(&dev->mtx);
+            break;
+        }
+        req = TAILQ_FIRST(&dev->procq);
+        TAILQ_REMOVE(&dev->procq, req, link);
+        pthread_mutex_unlock(&dev->mtx);
+
+        len = fs_handle_request(dev, req);
+        pthread_mutex_lock(&dev->mtx);
+        idle = TAILQ_EMPTY(&dev->procq);
+        pthread_mutex_unlock(&dev->mtx);
+        // Workers finish requests of the same queue concurrently. One
+        // interrupt once the queue runs dry.
+        pthread_mutex_lock(&req->vq->used_ring_lock);
+        update_used_ring(req->vq, req->idx, len);
+        if (idle)
+            virtio_inject_irq(req->vq);
+        pthread_mutex_unlock(&req->vq->used_ring_lock);
+        free(req->iov);
+        free(req->flags);
+        free(req);
+    }
+    return NULL;
+}
+
+int virtio_fs_notify_handler(VirtIODevice *vdev, VirtQueue *vq) {
+    FsDev *dev = vdev->dev;
+    struct fs_req *req;
+    int n;
+
+    while (!virtqueue_is_empty(vq)) {
+        virtqueue_disable_notify(vq);
+        while (!virtqueue_is_empty(vq)) {
+            req = (struct fs_req *)calloc(1, sizeof(struct fs_req));
+            n = process_descriptor_chain(vq, &req->idx, &req->iov,
+                                         &req->flags, 0, true);
+            if (n < 1) {
+                free(req);
+                break;
+            }
+            req->vq = vq;
+            req->iovcnt = n;
+            pthread_mutex_lock(&dev->mtx);
+            TAILQ_INSERT_TAIL(&dev->procq, req, link);
+            pthread_cond_signal(&dev->cond);
+            pthread_mutex_unlock(&dev->mtx);
+        }
+        virtqueue_enable_notify(vq);
+    }
+    return 0;
+}
+
+/// FORGET and BATCH_FORGET come on the high priority queue and have no
+/// reply. INTERRUPT is ignored, requests are never long.
+int virtio_fs_hiprio_notify_handler(VirtIODevice *vdev, VirtQueue *vq) {
+    FsDev *dev = vdev->dev;
+    struct fuse_in_header hdr;
+    struct fuse_forget_in forget;
+    struct fuse_batch_forget_in batch;
+    struct fuse_forget_one one;
+    struct iovec *iov = NULL;
+    size_t off;
+    uint16_t idx;
+    int n;
+
+    while (!virtqueue_is_empty(vq)) {
+        virtqueue_disable_notify(vq);
+        while (!virtqueue_is_empty(vq)) {
+            n = process_descriptor_chain(vq, &idx, &iov, NULL, 0, false);
+            if (n < 1)
+                break;
+            off = fs_iov_to_buf(iov, n, 0, &hdr, sizeof(hdr));
+            if (off == sizeof(hdr) && hdr.opcode == FUSE_FORGET &&
+                fs_iov_to_buf(iov, n, off, &forget, sizeof(forget)) ==
+                    sizeof(forget)) {
+                inode_forget(dev, hdr.nodeid, forget.nlookup);
+            } else if (off == sizeof(hdr) && hdr.opcode == FUSE_BATCH_FORGET &&
+                       fs_iov_to_buf(iov, n, off, &batch, sizeof(batch)) ==
+                           sizeof(batch)) {
+                off += sizeof(batch);
+                for (uint32_t i = 0; i < batch.count; i++, off += sizeof(one)) {
+                    if (fs_iov_to_buf(iov, n, off, &one, sizeof(one)) !=
+                        sizeof(one))
+                        break;
+                    inode_forget(dev, one.nodeid, one.nlookup);
+                }
+            }
+            update_used_ring(vq, idx, 0);
+            free(iov);
+        }
+        virtqueue_enable_notify(vq);
+    }
+    virtio_inject_irq(vq);
+    return 0;
+}
+
+/*********************************************************************
+    Setup
+ */
+static void virtio_fs_stats(VirtIODevice *vdev) {
+    FsDev *dev = vdev->dev;
+    uint64_t inodes = 0, handles = 0;
+    pthread_mutex_lock(&dev->inode_lock);
+    for (uint64_t i = 0; i < dev->ninodes; i++)
+        inodes += dev->inodes[i] != NULL;
+    pthread_mutex_unlock(&dev->inode_lock);
+    pthread_mutex_lock(&dev->handle_lock);
+    for (uint64_t i = 0; i < dev->nhandles; i++)
+        handles += dev->handles[i] != NULL;
+    pthread_mutex_unlock(&dev->handle_lock);
+    log_warn("zone %d virtio fs %.36s: %llu requests, read %llu bytes, "
+             "written %llu bytes, %llu inodes, %llu open files",
+             vdev->zone_id, dev->config.tag,
+             __atomic_load_n(&dev->requests, __ATOMIC_RELAXED),
+             __atomic_load_n(&dev->read_bytes, __ATOMIC_RELAXED),
+             __atomic_load_n(&dev->write_bytes, __ATOMIC_RELAXED), inodes,
+             handles);
+}
+
+int virtio_fs_init(VirtIODevice *vdev, FsRequestedState *req) {
+    FsDev *dev = vdev->dev;
+    struct stat st;
+    int fd;
+
+    vdev->virtio_close = virtio_fs_close;
+    vdev->virtio_stats = virtio_fs_stats;
+    if (req == NULL || req->tag[0] == '\0' || req->shared_dir[0] == '\0') {
+        log_error("virtio-fs needs a tag and a shared_dir");
+        return -1;
+    }
+    memcpy(dev->config.tag, req->tag, strnlen(req->tag, sizeof(req->tag)));
+    dev->config.num_request_queues =
+        MIN(MAX(req->queues, 1), FS_MAX_REQUEST_QUEUES);
+    dev->readonly = req->readonly;
+    dev->cache_timeout = MAX(req->cache_timeout, 0);
+
+    dev->proc_self_fd = open("/proc/self/fd", O_PATH | O_CLOEXEC);
+    if (dev->proc_self_fd < 0) {
+        log_error("Failed to open /proc/self/fd, errno is %d", errno);
+        return -1;
+    }
+    fd = open(req->shared_dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        log_error("Failed to open shared dir %s, errno is %d",
+                  req->shared_dir, errno);
+        return -1;
+    }
+    if (inode_add(dev, fd, &st) != FS_ROOT_ID)
+        return -1;
+
+    dev->nthreads = MIN(MAX(req->threads, 1), FS_MAX_THREADS);
+    for (int i = 0; i < dev->nthreads; i++) {
+        if (pthread_create(&dev->threads[i], NULL, fs_worker, vdev)) {
+            log_error("Failed to create virtio-fs worker thread");
+            dev->nthreads = i;
+            return -1;
+        }
+    }
+    log_info("virtio-fs %s shares %s with %d request queues, %d threads",
+             req->tag, req->shared_dir, dev->config.num_request_queues,
+             dev->nthreads);
+    return 0;
+}
+
+void virtio_fs_close(VirtIODevice *vdev) {
+    FsDev *dev = vdev->dev;
+    struct fs_req *req;
+
+    pthread_mutex_lock(&dev->mtx);
+    dev->close = 1;
+    pthread_cond_broadcast(&dev->cond);
+    pthread_mutex_unlock(&dev->mtx);
+    for (int i = 0; i < dev->nthreads; i++)
+        pthread_join(dev->threads[i], NULL);
+    while ((req = TAILQ_FIRST(&dev->procq))) {
+        TAILQ_REMOVE(&dev->procq, req, link);
+        free(req->iov);
+        free(req->flags);
+        free(req);
+    }
+    for (uint64_t i = 0; i < dev->nhandles; i++)
+        if (dev->handles[i])
+            handle_release(dev, i);
+    for (uint64_t i = 0; i < dev->ninodes; i++) {
+        if (dev->inodes[i]) {
+            close(dev->inodes[i]->fd);
+            free(dev->inodes[i]);
+        }
+    }
+    free(dev->handles);
+    free(dev->inodes);
+    if (dev->proc_self_fd >= 0)
+        close(dev->proc_self_fd);
+    free(dev);
+    free(vdev->vqs);
+    free(vdev);
+}
@@ -18,34 +18,69 @@
 #include <drm/drm.h>
 #include <drm/drm_fourcc.h>
 #include <drm/drm_mode.h>
+#include <errno.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <time.h>
+#include <unistd.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
 void virtio_gpu_ctrl_response(VirtIODevice *vdev, GPUCommand *gcmd,
                               GPUControlHeader *resp, size_t resp_len) {
     log_debug("sending response");
+    GPUDev *gdev = vdev->dev;
     // Since the header of each response structure is GPUControlHeader, its
     // address is the address of the response structure
 
-    // The first descriptor corresponding to iov[0] is always read-only, so
-    // start from the second one
-    size_t s = buf_to_iov(&gcmd->resp_iov[1], gcmd->resp_iov_cnt - 1, 0, resp,
+    // A fenced request is answered with the same fence
+    if (gcmd->control_header.flags & VIRTIO_GPU_FLAG_FENCE) {
+        resp->flags |= VIRTIO_GPU_FLAG_FENCE;
+        resp->fence_id = gcmd->control_header.fence_id;
+        resp->ctx_id = gcmd->control_header.ctx_id;
+    }
+
+    // The descriptors of the request are read-only, the response goes into
+    // the ones after them
+    size_t s = buf_to_iov(&gcmd->resp_iov[gcmd->req_iov_cnt],
+                          gcmd->resp_iov_cnt - gcmd->req_iov_cnt, 0, resp,
                           resp_len);
 
     if (s != resp_len) {
         log_error("%s cannot copy buffer to iov with correct size", __func__);
         // Continue to return, let the front end handle it
     }
+    gcmd->finished = true;
+
+    // The driver takes a fence as done with all fences before it, so a fenced
+    // request waits for the fenced requests and flushes before it
+    if (gcmd->ordered) {
+        if ((gcmd->control_header.flags & VIRTIO_GPU_FLAG_FENCE) &&
+            TAILQ_FIRST(&gdev->fence_cmds) != gcmd) {
+            gcmd->held = true;
+            gcmd->resp_len = resp_len;
+            return;
+        }
+        TAILQ_REMOVE(&gdev->fence_cmds, gcmd, fence_next);
+        gcmd->ordered = false;
+    }
 
     update_used_ring(&vdev->vqs[gcmd->from_queue], gcmd->resp_idx, resp_len);
 
-    gcmd->finished = true;
+    // Answer the fenced requests that were waiting for this one
+    while (!TAILQ_EMPTY(&gdev->fence_cmds) &&
+           TAILQ_FIRST(&gdev->fence_cmds)->held) {
+        gcmd = TAILQ_FIRST(&gdev->fence_cmds);
+        TAILQ_REMOVE(&gdev->fence_cmds, gcmd, fence_next);
+        update_used_ring(&vdev->vqs[gcmd->from_queue], gcmd->resp_idx,
+                         gcmd->resp_len);
+        free(gcmd->resp_iov);
+        free(gcmd);
+    }
 }
 
 void virtio_gpu_ctrl_response_nodata(VirtIODevice *vdev, GPUCommand *gcmd,
@@ -90,6 +125,32 @@ void virtio_gpu_get_edid(VirtIODevice *vdev, GPUCommand *gcmd) {
     // TODO: Implement this function
 }
 
+bool virtio_gpu_admit_resource(VirtIODevice *vdev, uint32_t resource_id,
+                               uint64_t size) {
+    GPUDev *gdev = vdev->dev;
+
+    if (size == 0 || size + gdev->hostmem >= gdev->max_hostmem) {
+        log_error("virtio gpu for zone %d out of hostmem when trying to create "
+                  "resource %d of %llu bytes, %llu of %llu bytes are used",
+                  vdev->zone_id, resource_id, size, gdev->hostmem,
+                  gdev->max_hostmem);
+        gdev->hostmem_failures++;
+        return false;
+    }
+    return true;
+}
+
+void virtio_gpu_add_resource(GPUDev *gdev, GPUSimpleResource *res) {
+    GPUSimpleResource **bucket =
+        &gdev->resource_hash[res->resource_id % GPU_RESOURCE_HASH_SIZE];
+
+    res->hash_next = *bucket;
+    *bucket = res;
+    TAILQ_INSERT_HEAD(&gdev->resource_list, res, next);
+    gdev->hostmem += res->hostmem;
+    gdev->resources++;
+}
+
 void virtio_gpu_resource_create_2d(VirtIODevice *vdev, GPUCommand *gcmd) {
     log_debug("entering %s", __func__);
 
@@ -115,9 +176,23 @@ void virtio_gpu_resource_create_2d(VirtIODevice *vdev, GPUCommand *gcmd) {
         return;
     }
 
+    // Every format is converted when it is copied into the device's buffers
+    if (gpu_blit_virtio_format(create_2d.format) < 0) {
+        log_error("%s trying to create resource %d with unknown format %d",
+                  __func__, create_2d.resource_id, create_2d.format);
+        gcmd->error = VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER;
+        return;
+    }
+
     // Otherwise, create a new resource
     res = calloc(1, sizeof(GPUSimpleResource));
-    memset(res, 0, sizeof(GPUSimpleResource));
+    if (!res) {
+        log_error("%s cannot allocate resource %d", __func__,
+                  create_2d.resource_id);
+        gdev->alloc_failures++;
+        gcmd->error = VIRTIO_GPU_RESP_ERR_OUT_OF_MEMORY;
+        return;
+    }
 
     res->width = create_2d.width;
     res->height = create_2d.height;
@@ -126,21 +201,20 @@ void virtio_gpu_resource_create_2d(VirtIODevice *vdev, GPUCommand *gcmd) {
     res->scanout_bitmask = 0;
     res->iov = NULL;
     res->iov_cnt = 0;
+    res->dmabuf_fd = -1;
 
     // Calculate the memory size occupied by the resource
     // By default, only formats with 4 bytes per pixel are supported
     res->hostmem = calc_image_hostmem(32, create_2d.width, create_2d.height);
-    if (res->hostmem + gdev->hostmem >= VIRTIO_GPU_MAX_HOSTMEM) {
-        log_error("virtio gpu for zone %d out of hostmem when trying to create "
-                  "resource %d",
-                  vdev->zone_id, create_2d.resource_id);
+    res->stride = calc_image_hostmem(32, create_2d.width, 1);
+    if (!virtio_gpu_admit_resource(vdev, res->resource_id, res->hostmem)) {
         free(res);
+        gcmd->error = VIRTIO_GPU_RESP_ERR_OUT_OF_MEMORY;
         return;
     }
 
     // If memory is sufficient, add the resource to the virtio gpu management
-    TAILQ_INSERT_HEAD(&gdev->resource_list, res, next);
-    gdev->hostmem += res->hostmem;
+    virtio_gpu_add_resource(gdev, res);
 
     log_debug("add a resource %d to gpu dev of zone %d, width: %d height: %d "
               "format: %d mem: %d bytes host-hostmem: %d bytes",
@@ -148,15 +222,233 @@ void virtio_gpu_resource_create_2d(VirtIODevice *vdev, GPUCommand *gcmd) {
               res->format, res->hostmem, gdev->hostmem);
 }
 
+// Whether the backing of a blob resource is contiguous in the RAM of the
+// zone, so that card0 can scan it out directly. Otherwise the resource is
+// copied into the device's buffers like a 2D one.
+static void virtio_gpu_check_blob(GPUSimpleResource *res, uint64_t *addrs) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    uint64_t size = 0;
+
+    for (uint32_t i = 0; i < res->iov_cnt; ++i) {
+        if (addrs[i] != addrs[0] + size) {
+            log_debug("%s found resource %d is scattered", __func__,
+                      res->resource_id);
+            return;
+        }
+        size += res->iov[i].iov_len;
+    }
+    if (addrs[0] % page_size) {
+        log_debug("%s found resource %d is not page aligned", __func__,
+                  res->resource_id);
+        return;
+    }
+    res->contiguous = true;
+    res->blob_addr = addrs[0];
+}
+
+// Release the drm_framebuffer on the backing of a blob resource
+static void virtio_gpu_remove_blob_framebuffer(GPUDev *gdev,
+                                               GPUSimpleResource *res) {
+    if (res->blob_fb_id) {
+        drmModeRmFB(gdev->card0_fd, res->blob_fb_id);
+        res->blob_fb_id = 0;
+    }
+}
+
+// Whether card0 scans out the backing of a blob resource, or will at the
+// next vblank
+static bool virtio_gpu_blob_shown(GPUDev *gdev, GPUSimpleResource *res) {
+    bool shown = false;
+
+    if (!res->blob_fb_id) {
+        return false;
+    }
+    for (int i = 0; i < gdev->scanouts_num; ++i) {
+        GPUScanout *scanout = &gdev->scanouts[i];
+        pthread_mutex_lock(&scanout->flip_mutex);
+        shown |= scanout->front_fb_id == res->blob_fb_id ||
+                 scanout->flipping_fb_id == res->blob_fb_id;
+        pthread_mutex_unlock(&scanout->flip_mutex);
+    }
+    return shown;
+}
+
+// Release the import of a blob resource into card0
+static void virtio_gpu_release_import(GPUDev *gdev, GPUSimpleResource *res) {
+    virtio_gpu_remove_blob_framebuffer(gdev, res);
+    if (res->blob_handle) {
+        struct drm_gem_close gem_close = {.handle = res->blob_handle};
+        drmIoctl(gdev->card0_fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
+        res->blob_handle = 0;
+        gdev->imports--;
+    }
+    if (res->dmabuf_fd >= 0) {
+        close(res->dmabuf_fd);
+        res->dmabuf_fd = -1;
+    }
+}
+
+// Make room for an import, by releasing the least recently used one that
+// isn't on screen. The resource is imported again if it is scanned out again.
+static void virtio_gpu_evict_import(GPUDev *gdev) {
+    GPUSimpleResource *res = NULL;
+
+    TAILQ_FOREACH_REVERSE(res, &gdev->resource_list, virtio_gpu_resource_list,
+                          next) {
+        if (res->blob_handle && !res->scanout_bitmask &&
+            !virtio_gpu_blob_shown(gdev, res)) {
+            log_debug("%s releases the import of resource %d", __func__,
+                      res->resource_id);
+            virtio_gpu_release_import(gdev, res);
+            gdev->import_evictions++;
+            return;
+        }
+    }
+}
+
+// Import the contiguous backing of a blob resource into card0 as a dma-buf,
+// when it is first scanned out
+static void virtio_gpu_import_blob(VirtIODevice *vdev, GPUSimpleResource *res) {
+    GPUDev *gdev = vdev->dev;
+    long page_size = sysconf(_SC_PAGESIZE);
+    uint64_t size = 0;
+
+    for (uint32_t i = 0; i < res->iov_cnt; ++i) {
+        size += res->iov[i].iov_len;
+    }
+    if (gdev->imports >= GPU_MAX_IMPORTS) {
+        virtio_gpu_evict_import(gdev);
+    }
+
+    res->dmabuf_fd = export_zone_dmabuf(vdev->zone_id, res->blob_addr,
+                                        _ALIGN_UP(size, page_size));
+    if (res->dmabuf_fd < 0) {
+        // Copied from now on
+        res->contiguous = false;
+        return;
+    }
+    if (drmPrimeFDToHandle(gdev->card0_fd, res->dmabuf_fd,
+                           &res->blob_handle) < 0) {
+        log_warn("%s card0 cannot import dma-bufs, errno is %d, blob "
+                 "resources are copied",
+                 __func__, errno);
+        close(res->dmabuf_fd);
+        res->dmabuf_fd = -1;
+        res->blob_handle = 0;
+        gdev->zero_copy = false;
+        return;
+    }
+    gdev->imports++;
+    log_debug("%s imported resource %d at %#llx + %#llx with handle %d",
+              __func__, res->resource_id, res->blob_addr, size,
+              res->blob_handle);
+}
+
+void virtio_gpu_resource_create_blob(VirtIODevice *vdev, GPUCommand *gcmd) {
+    log_debug("entering %s", __func__);
+
+    GPUSimpleResource *res = NULL;
+    GPUDev *gdev = vdev->dev;
+    struct virtio_gpu_resource_create_blob create_blob;
+    uint64_t *addrs = NULL;
+    uint64_t backing = 0;
+
+    VIRTIO_GPU_FILL_CMD(gcmd->resp_iov, gcmd->resp_iov_cnt, create_blob);
+
+    if (!(vdev->regs.drv_feature & (1ULL << VIRTIO_GPU_F_RESOURCE_BLOB))) {
+        log_error("%s found blob resources are not negotiated", __func__);
+        gcmd->error = VIRTIO_GPU_RESP_ERR_UNSPEC;
+        return;
+    }
+
+    if (create_blob.resource_id == 0) {
+        log_error("%s trying to create blob resource with id 0", __func__);
+        gcmd->error = VIRTIO_GPU_RESP_ERR_INVALID_RESOURCE_ID;
+        return;
+    }
+
+    if (virtio_gpu_find_resource(gdev, create_blob.resource_id)) {
+        log_error("%s trying to create an existing resource with id %d",
+                  __func__, create_blob.resource_id);
+        gcmd->error = VIRTIO_GPU_RESP_ERR_INVALID_RESOURCE_ID;
+        return;
+    }
+
+    // Blobs can only live in guest memory, the renderer doesn't export any
+    if (create_blob.blob_mem != VIRTIO_GPU_BLOB_MEM_GUEST) {
+        log_error("%s found unsupported blob_mem %d", __func__,
+                  create_blob.blob_mem);
+        gcmd->error = VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER;
+        return;
+    }
+
+    if (!virtio_gpu_admit_resource(vdev, create_blob.resource_id,
+                                   create_blob.size)) {
+        gcmd->error = VIRTIO_GPU_RESP_ERR_OUT_OF_MEMORY;
+        return;
+    }
+
+    res = calloc(1, sizeof(GPUSimpleResource));
+    if (!res) {
+        log_error("%s cannot allocate resource %d", __func__,
+                  create_blob.resource_id);
+        gdev->alloc_failures++;
+        gcmd->error = VIRTIO_GPU_RESP_ERR_OUT_OF_MEMORY;
+        return;
+    }
+    res->resource_id = create_blob.resource_id;
+    res->blob = true;
+    res->hostmem = create_blob.size;
+    res->dmabuf_fd = -1;
+
+    if (virtio_gpu_create_mapping_iov(vdev, create_blob.nr_entries,
+                                      sizeof(create_blob), gcmd, &addrs,
+                                      &res->iov, &res->iov_cnt) != 0) {
+        log_error("%s failed to map guest memory to iov", __func__);
+        free(res);
+        gcmd->error = VIRTIO_GPU_RESP_ERR_UNSPEC;
+        return;
+    }
+    for (uint32_t i = 0; i < res->iov_cnt; ++i) {
+        backing += res->iov[i].iov_len;
+    }
+    if (backing < create_blob.size) {
+        log_error("%s found blob resource %d has %llu bytes of backing for "
+                  "%llu bytes",
+                  __func__, create_blob.resource_id, backing, create_blob.size);
+        free(addrs);
+        free(res->iov);
+        free(res);
+        gcmd->error = VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER;
+        return;
+    }
+
+    if (gdev->zero_copy) {
+        virtio_gpu_check_blob(res, addrs);
+    }
+    free(addrs);
+
+    virtio_gpu_add_resource(gdev, res);
+
+    log_debug("add a blob resource %d to gpu dev of zone %d, size: %d, "
+              "%s",
+              res->resource_id, vdev->zone_id, res->hostmem,
+              res->contiguous ? "contiguous" : "scattered");
+}
+
 GPUSimpleResource *virtio_gpu_find_resource(GPUDev *gdev,
                                             uint32_t resource_id) {
-    GPUSimpleResource *temp_res = NULL;
-    TAILQ_FOREACH(temp_res, &gdev->resource_list, next) {
-        if (temp_res->resource_id == resource_id) {
-            return temp_res;
-        }
+    GPUSimpleResource *temp_res =
+        gdev->resource_hash[resource_id % GPU_RESOURCE_HASH_SIZE];
+
+    while (temp_res && temp_res->resource_id != resource_id) {
+        temp_res = temp_res->hash_next;
+    }
+    if (temp_res && temp_res != TAILQ_FIRST(&gdev->resource_list)) {
+        TAILQ_REMOVE(&gdev->resource_list, temp_res, next);
+        TAILQ_INSERT_HEAD(&gdev->resource_list, temp_res, next);
     }
-    return NULL;
+    return temp_res;
 }
 
 GPUSimpleResource *virtio_gpu_check_resource(VirtIODevice *vdev,
@@ -175,7 +467,8 @@ GPUSimpleResource *virtio_gpu_check_resource(VirtIODevice *vdev,
         return NULL;
     }
 
-    if (!res->iov || res->hostmem <= 0) {
+    // The renderer holds the pixels of 3D resources
+    if (!res->virgl && (!res->iov || res->hostmem <= 0)) {
         log_error("%s found resource %d has no backing storage", caller,
                   resource_id);
         if (error) {
@@ -227,8 +520,23 @@ void virtio_gpu_resource_destory(GPUDev *gdev, GPUSimpleResource *res) {
     }
 
     virtio_gpu_cleanup_mapping(gdev, res);
+#ifdef ENABLE_VIRGL
+    if (res->virgl) {
+        virtio_gpu_virgl_unref(gdev, res);
+    }
+#endif
+    for (GPUSimpleResource **p =
+             &gdev->resource_hash[res->resource_id % GPU_RESOURCE_HASH_SIZE];
+         *p; p = &(*p)->hash_next) {
+        if (*p == res) {
+            *p = res->hash_next;
+            break;
+        }
+    }
     TAILQ_REMOVE(&gdev->resource_list, res, next);
     gdev->hostmem -= res->hostmem;
+    gdev->resources--;
+    free(res->shadow.iov_base);
     free(res);
 }
 
@@ -248,16 +556,130 @@ void virtio_gpu_disable_scanout(GPUDev *gdev, int scanout_id) {
     scanout->resource_id = 0;
     scanout->width = 0;
     scanout->height = 0;
+
+    pthread_mutex_lock(&scanout->flip_mutex);
+    scanout->frame_buffers[GPU_BLOB_FRAMEBUFFER].fb_id = 0;
+    scanout->present_res = NULL;
+    pthread_mutex_unlock(&scanout->flip_mutex);
 }
 
 void virtio_gpu_cleanup_mapping(GPUDev *gdev, GPUSimpleResource *res) {
+    // The workers stop copying the resource once it has no backing, and a
+    // copy already started still reads it
+    for (int i = 0; i < gdev->scanouts_num; ++i) {
+        GPUScanout *scanout = &gdev->scanouts[i];
+        pthread_mutex_lock(&scanout->flip_mutex);
+        if (scanout->present_res == res) {
+            scanout->present_res = NULL;
+        }
+        while (scanout->copy_res == res) {
+            pthread_cond_wait(&scanout->flip_cond, &scanout->flip_mutex);
+        }
+        pthread_mutex_unlock(&scanout->flip_mutex);
+    }
+
+#ifdef ENABLE_VIRGL
+    // The renderer keeps the iov of the backing
+    if (res->virgl) {
+        virtio_gpu_virgl_detach(gdev, res);
+    }
+#endif
     if (res->iov) {
         free(res->iov);
         // The memory block corresponding to iov is handled by the guest
     }
 
+    // card0 must not scan out the backing once the guest may reuse it
+    virtio_gpu_release_import(gdev, res);
+    res->contiguous = false;
+
     res->iov = NULL;
     res->iov_cnt = 0;
+
+    // The cursor read from the backing, if any, is gone with it
+    virtio_gpu_cursor_put(res->cursor);
+    res->cursor = NULL;
+}
+
+static uint64_t virtio_gpu_rect_area(const struct virtio_gpu_rect *r) {
+    return (uint64_t)r->width * r->height;
+}
+
+static struct virtio_gpu_rect
+virtio_gpu_rect_union(const struct virtio_gpu_rect *a,
+                      const struct virtio_gpu_rect *b) {
+    struct virtio_gpu_rect u;
+    uint32_t right = MAX(a->x + a->width, b->x + b->width);
+    uint32_t bottom = MAX(a->y + a->height, b->y + b->height);
+
+    u.x = MIN(a->x, b->x);
+    u.y = MIN(a->y, b->y);
+    u.width = right - u.x;
+    u.height = bottom - u.y;
+    return u;
+}
+
+bool virtio_gpu_rect_clip(struct virtio_gpu_rect *r,
+                          const struct virtio_gpu_rect *clip) {
+    uint32_t x = MAX(r->x, clip->x), y = MAX(r->y, clip->y);
+    uint32_t right = MIN(r->x + r->width, clip->x + clip->width);
+    uint32_t bottom = MIN(r->y + r->height, clip->y + clip->height);
+
+    if (right <= x || bottom <= y) {
+        return false;
+    }
+    r->x = x;
+    r->y = y;
+    r->width = right - x;
+    r->height = bottom - y;
+    return true;
+}
+
+static bool virtio_gpu_rect_contains(const struct virtio_gpu_rect *outer,
+                                     const struct virtio_gpu_rect *inner) {
+    return inner->x >= outer->x && inner->y >= outer->y &&
+           inner->x + inner->width <= outer->x + outer->width &&
+           inner->y + inner->height <= outer->y + outer->height;
+}
+
+void virtio_gpu_damage_add(GPUDamage *damage, const struct virtio_gpu_rect *r) {
+    struct virtio_gpu_rect m = *r, u;
+    uint64_t area, waste, least;
+    uint32_t i, best;
+
+    if (r->width == 0 || r->height == 0) {
+        return;
+    }
+again:
+    // Merge with rectangles that overlap or touch m, or that it contains
+    for (i = 0; i < damage->num; ++i) {
+        u = virtio_gpu_rect_union(&damage->rects[i], &m);
+        area = virtio_gpu_rect_area(&damage->rects[i]);
+        if (virtio_gpu_rect_area(&u) <= area + virtio_gpu_rect_area(&m)) {
+            m = u;
+            damage->rects[i] = damage->rects[--damage->num];
+            goto again;
+        }
+    }
+    if (damage->num < GPU_DAMAGE_MAX_RECTS) {
+        damage->rects[damage->num++] = m;
+        return;
+    }
+    // Full, merge with the rectangle whose bounding box grows least
+    least = UINT64_MAX;
+    best = 0;
+    for (i = 0; i < damage->num; ++i) {
+        u = virtio_gpu_rect_union(&damage->rects[i], &m);
+        waste = virtio_gpu_rect_area(&u) -
+                virtio_gpu_rect_area(&damage->rects[i]);
+        if (waste < least) {
+            least = waste;
+            best = i;
+        }
+    }
+    m = virtio_gpu_rect_union(&damage->rects[best], &m);
+    damage->rects[best] = damage->rects[--damage->num];
+    goto again;
 }
 
 void virtio_gpu_resource_flush(VirtIODevice *vdev, GPUCommand *gcmd) {
@@ -268,6 +690,8 @@ void virtio_gpu_resource_flush(VirtIODevice *vdev, GPUCommand *gcmd) {
     GPUSimpleResource *res = NULL;
     GPUScanout *scanout = NULL;
     struct virtio_gpu_resource_flush resource_flush;
+    struct virtio_gpu_rect r;
+    GPUDamage damage = {0};
 
     VIRTIO_GPU_FILL_CMD(gcmd->resp_iov, gcmd->resp_iov_cnt, resource_flush);
 
@@ -292,6 +716,32 @@ void virtio_gpu_resource_flush(VirtIODevice *vdev, GPUCommand *gcmd) {
         return;
     }
 
+#ifdef ENABLE_VIRGL
+    if (res->virgl) {
+        // The guest rendered into the resource, the renderer has the pixels
+        virtio_gpu_virgl_read_back(vdev, res, &resource_flush.r, &gcmd->error);
+        if (gcmd->error) {
+            return;
+        }
+        virtio_gpu_damage_add(&res->damage, &resource_flush.r);
+    }
+#endif
+
+    // Only what was transferred inside the flushed rectangle changes on
+    // screen. Transfers outside of it wait for a later flush.
+    for (uint32_t i = 0; i < res->damage.num;) {
+        struct virtio_gpu_rect *t = &res->damage.rects[i];
+        r = *t;
+        if (virtio_gpu_rect_clip(&r, &resource_flush.r)) {
+            virtio_gpu_damage_add(&damage, &r);
+        }
+        if (virtio_gpu_rect_contains(&resource_flush.r, t)) {
+            res->damage.rects[i] = res->damage.rects[--res->damage.num];
+        } else {
+            i++;
+        }
+    }
+
     for (int i = 0; i < HVISOR_VIRTIO_GPU_MAX_SCANOUTS; ++i) {
         // Traverse the scanouts corresponding to the resource
         if (!(res->scanout_bitmask & (1 << i))) {
@@ -299,197 +749,321 @@ void virtio_gpu_resource_flush(VirtIODevice *vdev, GPUCommand *gcmd) {
         }
         scanout = &gdev->scanouts[i];
 
-        if (!scanout->frame_buffer.enabled) {
-            virtio_gpu_create_drm_framebuffer(scanout, &gcmd->error);
-            if (gcmd->error) {
-                return;
-            }
-
-            virtio_gpu_copy_and_flush(scanout, res, &gcmd->error);
-        } else {
-            // TODO: If the framebuffer has already been allocated once and the
-            // size is not suitable, it needs to be reallocated
-            // TODO: This includes calling munmap and the drm destroy function
-            // TODO: Encapsulate the case where it has not been allocated
-
-            virtio_gpu_copy_and_flush(scanout, res, &gcmd->error);
-        }
+        virtio_gpu_queue_flush(vdev, scanout, res, &damage, gcmd);
     }
 }
 
-void virtio_gpu_create_drm_framebuffer(GPUScanout *scanout, uint32_t *error) {
-    if (scanout->frame_buffer.enabled) {
+void virtio_gpu_create_framebuffer(GPUScanout *scanout, GPUFrameBuffer *fb,
+                                   uint32_t *error) {
+    if (fb->enabled) {
         return;
     }
-
-    // If the scanout's frame_buffer has not been initialized yet
-    GPUFrameBuffer *fb = &scanout->frame_buffer;
-
-    struct drm_mode_create_dumb dumb = {0};
-    struct drm_mode_map_dumb map = {0};
-    dumb.width = fb->width;
-    dumb.height = fb->height;
-    dumb.bpp = fb->bytes_pp * 8;
-    uint32_t offsets[4] = {0};
-    uint32_t fb_id = 0;
-
-    if (drmIoctl(scanout->card0_fd, DRM_IOCTL_MODE_CREATE_DUMB, &dumb) < 0) {
-        log_error("%s failed to create a drm dumb", __func__);
-        *error = VIRTIO_GPU_RESP_ERR_UNSPEC;
-        return;
-    } // Create a dumb object
-
-    map.handle = dumb.handle;
-    // Bind the video memory to the framebuffer, get the offset based on the
-    // handle
-    if (drmIoctl(scanout->card0_fd, DRM_IOCTL_MODE_MAP_DUMB, &map) < 0) {
-        log_error("%s failed to map a drm dumb", __func__);
-        virtio_gpu_remove_drm_framebuffer(scanout);
+    if (scanout->display->create_buffer(scanout, fb) < 0) {
         *error = VIRTIO_GPU_RESP_ERR_UNSPEC;
         return;
     }
+    fb->enabled = true;
+}
 
-    // ! legacy
-    // uint32_t drm_format = VIRTIO_GPU_FORMAT_TO_DRM_FORMAT(fb->format);
-    // if (!drm_format) {
-    //   log_error("%s found drm_framebuffer has an unknown format", __func__);
-    //   *error = VIRTIO_GPU_RESP_ERR_UNSPEC;
-    //   return;
-    // }
-
-    // ! legacy
-    // if (drmModeAddFB2(scanout->card0_fd, dumb.width, dumb.height, drm_format,
-    //                   &dumb.handle, &dumb.pitch, offsets, &fb_id, 0) < 0) {
-    //   log_error("%s failed to add a drm_framebuffer to card0", __func__);
-    //   *error = VIRTIO_GPU_RESP_ERR_UNSPEC;
-    //   return;
-    // }
-
-    if (drmModeAddFB(scanout->card0_fd, dumb.width, dumb.height, 24, 32,
-                     dumb.pitch, dumb.handle, &fb_id) < 0) {
-        log_error("%s failed to add a drm_framebuffer to card0", __func__);
-        *error = VIRTIO_GPU_RESP_ERR_UNSPEC;
-        return;
+// Copy damage into fb from the resource, which holds the latest frame,
+// converting it into the pixels of the device's buffers. Returns the bytes
+// copied.
+static size_t virtio_gpu_copy_damage(GPUScanout *scanout, GPUFrameBuffer *fb,
+                                     GPUSimpleResource *res,
+                                     const GPUDamage *damage) {
+    // 3D resources are copied from what was read back of them
+    const struct iovec *iov = res->virgl ? &res->shadow : res->iov;
+    unsigned int iov_cnt = res->virgl ? 1 : res->iov_cnt;
+    int src_format = gpu_blit_virtio_format(res->format);
+    uint32_t dst_bpp = gpu_blit_bytes_pp(scanout->pixel_format);
+    const struct virtio_gpu_rect *r = NULL;
+    size_t src_offset = 0, dst_offset = 0, s = 0, copied = 0;
+
+    for (uint32_t i = 0; i < damage->num && src_format >= 0; ++i) {
+        r = &damage->rects[i];
+        src_offset =
+            res->offset + (size_t)r->y * res->stride + r->x * fb->bytes_pp;
+        dst_offset = (size_t)r->y * fb->pitch + r->x * dst_bpp;
+        s = gpu_blit_from_iov(fb->fb_addr + dst_offset, fb->pitch,
+                              scanout->pixel_format, iov, iov_cnt,
+                              src_offset, res->stride, src_format, r->width,
+                              r->height);
+        copied += s;
+        log_debug("%s copy %d bytes of (%d, %d) + %d, %d from resource %d",
+                  __func__, s, r->x, r->y, r->width, r->height,
+                  res->resource_id);
     }
+    return copied;
+}
 
-    ///
-    log_debug("%s create a drm_framebuffer with width: %d, height: %d, "
-              "format: %d, handle: %d, fb_id: %d",
-              __func__, dumb.width, dumb.height, fb->format, dumb.handle,
-              fb_id);
-    ///
-
-    void *vaddr = mmap(0, dumb.size, PROT_READ | PROT_WRITE, MAP_SHARED,
-                       scanout->card0_fd, map.offset);
+// Show fb at once, for the first frame or when page flips fail
+static void virtio_gpu_modeset(GPUScanout *scanout, int index) {
+    scanout->display->show(scanout, index);
+    scanout->front = index;
+    scanout->front_fb_id = scanout->frame_buffers[index].fb_id;
+    scanout->modesets++;
+}
 
-    if (!vaddr) {
-        log_error("%s cannot map drm_framebuffer of scanout", __func__);
-        virtio_gpu_remove_drm_framebuffer(scanout);
-        *error = VIRTIO_GPU_RESP_ERR_UNSPEC;
-        return;
+// Queue fb for the next vblank, the page flip event completes it
+static int virtio_gpu_page_flip(GPUScanout *scanout, int index) {
+    if (!scanout->display->flip ||
+        scanout->display->flip(scanout, index) < 0) {
+        scanout->page_flip = false;
+        return -1;
     }
-
-    log_debug("%s map drm_framebuffer to %x with size %d", __func__, vaddr,
-              dumb.size);
-
-    fb->fb_id = fb_id;
-    fb->drm_dumb_handle = dumb.handle;
-    fb->drm_dumb_size = dumb.size;
-    fb->fb_addr = vaddr;
-    fb->enabled = true;
+    scanout->flipping = index;
+    scanout->flipping_fb_id = scanout->frame_buffers[index].fb_id;
+    return 0;
 }
 
-void virtio_gpu_copy_and_flush(GPUScanout *scanout, GPUSimpleResource *res,
-                               uint32_t *error) {
-
-    uint32_t format = 0;
-    uint32_t stride = 0;
-    uint32_t src_offset = 0;
-    uint32_t dst_offset = 0;
-    int bpp = 0;
+// A buffer that is neither on screen nor about to be, -1 if both are busy
+static int virtio_gpu_back_buffer(GPUScanout *scanout) {
+    // A ready blob resource is replaced, it isn't drawn by the device
+    if (scanout->ready >= 0 && scanout->ready < scanout->fb_num) {
+        return scanout->ready;
+    }
+    for (int i = 0; i < scanout->fb_num; ++i) {
+        if (i != scanout->front && i != scanout->flipping) {
+            return i;
+        }
+    }
+    return -1;
+}
 
-    GPUFrameBuffer *fb = &scanout->frame_buffer;
+// Wake the processing thread, which answers the flushes on screen
+void virtio_gpu_kick_handler(GPUDev *gdev) {
+    pthread_mutex_lock(&gdev->queue_mutex);
+    pthread_cond_signal(&gdev->gpu_cond);
+    pthread_mutex_unlock(&gdev->queue_mutex);
+}
 
-    if (!res || !res->iov || res->hostmem <= 0) {
-        log_error("%s found res is not create yet");
-        *error = VIRTIO_GPU_RESP_ERR_UNSPEC;
-        return;
+// Show a drawn framebuffer with the flushes drawn into it, with flip_mutex
+// held
+static void virtio_gpu_present(GPUScanout *scanout, int index) {
+    if (scanout->front < 0 || !scanout->page_flip) {
+        virtio_gpu_modeset(scanout, index);
+        TAILQ_CONCAT(&scanout->done_cmds, &scanout->present_cmds,
+                     flush_next[scanout->id]);
+    } else if (scanout->flipping >= 0) {
+        // Flipped when the one in flight completes
+        scanout->ready = index;
+        TAILQ_CONCAT(&scanout->ready_cmds, &scanout->present_cmds,
+                     flush_next[scanout->id]);
+    } else if (virtio_gpu_page_flip(scanout, index) == 0) {
+        TAILQ_CONCAT(&scanout->flip_cmds, &scanout->present_cmds,
+                     flush_next[scanout->id]);
+    } else {
+        virtio_gpu_modeset(scanout, index);
+        TAILQ_CONCAT(&scanout->done_cmds, &scanout->present_cmds,
+                     flush_next[scanout->id]);
     }
+}
 
-    if (!fb || !fb->enabled || !fb->fb_addr) {
-        log_error("%s found drm_framebuffer is not enabled yet");
-        *error = VIRTIO_GPU_RESP_ERR_UNSPEC;
-        return;
+void virtio_gpu_queue_flush(VirtIODevice *vdev, GPUScanout *scanout,
+                            GPUSimpleResource *res, GPUDamage *damage,
+                            GPUCommand *gcmd) {
+    struct virtio_gpu_rect shown = {scanout->x, scanout->y, scanout->width,
+                                    scanout->height};
+    struct virtio_gpu_rect r;
+    bool changed = false;
+
+    pthread_mutex_lock(&scanout->flip_mutex);
+    if (!scanout->frame_buffers[GPU_BLOB_FRAMEBUFFER].fb_id) {
+        // Every buffer misses this damage, and so does the display until the
+        // next frame
+        for (uint32_t i = 0; i < damage->num; ++i) {
+            r = damage->rects[i];
+            if (!virtio_gpu_rect_clip(&r, &shown)) {
+                continue;
+            }
+            virtio_gpu_damage_add(&scanout->frame_damage, &r);
+            for (int j = 0; j < scanout->fb_num; ++j) {
+                virtio_gpu_damage_add(&scanout->frame_buffers[j].damage, &r);
+            }
+            changed = true;
+        }
+        if (scanout->front >= 0 && !changed) {
+            // Nothing changed on screen
+            pthread_mutex_unlock(&scanout->flip_mutex);
+            return;
+        }
     }
 
-    format = res->format;
-    bpp = 32;
-    stride = res->hostmem / res->height;
+    // Flushes queued while the worker is busy are shown in one frame
+    scanout->present_res = res;
+    if (!TAILQ_EMPTY(&scanout->present_cmds)) {
+        scanout->merged_flushes++;
+    }
+    TAILQ_INSERT_TAIL(&scanout->present_cmds, gcmd, flush_next[scanout->id]);
+    gcmd->presents++;
+    gcmd->deferred = true;
+    pthread_cond_broadcast(&scanout->flip_cond);
+    pthread_mutex_unlock(&scanout->flip_mutex);
+}
 
-    // Copy data from resource to framebuffer
-    if (res->transfer_rect.x || res->transfer_rect.width != res->width) {
-        for (int h = 0; h < res->transfer_rect.height; h++) {
-            src_offset = res->transfer_offset + stride * h;
-            dst_offset = (res->transfer_rect.y + h) * stride +
-                         (res->transfer_rect.x * bpp);
+bool virtio_gpu_present_frame(GPUScanout *scanout) {
+    GPUSimpleResource *res = NULL;
+    GPUCommand *gcmd = NULL;
+    GPUFrameBuffer *fb = NULL;
+    struct virtio_gpu_rect shown = {scanout->x, scanout->y, scanout->width,
+                                    scanout->height};
+    // The flushes and damage of this frame, and those queued during its copy
+    TAILQ_HEAD(, virtio_gpu_control_cmd) frame_cmds, later_cmds;
+    GPUDamage damage, frame_damage, later_damage;
+    uint32_t error = 0;
+    size_t copied;
+    int back;
+
+    if (scanout->frame_buffers[GPU_BLOB_FRAMEBUFFER].fb_id) {
+        // card0 scans out the backing of the blob resource, the guest has
+        // drawn the frame already
+        scanout->frames++;
+        scanout->zero_copy_frames++;
+        virtio_gpu_present(scanout, GPU_BLOB_FRAMEBUFFER);
+        goto out;
+    }
 
-            size_t s = iov_to_buf(res->iov, res->iov_cnt, src_offset,
-                                  fb->fb_addr + dst_offset,
-                                  res->transfer_rect.width * bpp);
+    res = scanout->present_res;
+    if (!res) {
+        // The resource lost its backing or its scanout meanwhile
+        TAILQ_CONCAT(&scanout->done_cmds, &scanout->present_cmds,
+                     flush_next[scanout->id]);
+        goto out;
+    }
 
-            // debug
-            log_debug("%s copy %d bytes from resource %d to drm_framebuffer, "
-                      "src_offset: %d, dst_offset: %d",
-                      __func__, s, res->resource_id, src_offset, dst_offset);
+    // The buffers are created on the first flush
+    for (int i = 0; i < scanout->fb_num && !error; ++i) {
+        virtio_gpu_create_framebuffer(scanout, &scanout->frame_buffers[i],
+                                      &error);
+    }
+    if (error) {
+        TAILQ_FOREACH(gcmd, &scanout->present_cmds, flush_next[scanout->id]) {
+            gcmd->error = error;
         }
-    } else {
-        src_offset = res->transfer_offset;
-        dst_offset = res->transfer_rect.y * stride + res->transfer_rect.x * bpp;
-
-        size_t s = iov_to_buf(res->iov, res->iov_cnt, src_offset,
-                              fb->fb_addr + dst_offset,
-                              stride * res->transfer_rect.height);
-
-        // debug
-        log_debug("%s copy %d bytes from resource %d to drm_framebuffer, "
-                  "src_offset: %d, dst_offset: %d",
-                  __func__, s, res->resource_id, src_offset, dst_offset);
+        TAILQ_CONCAT(&scanout->done_cmds, &scanout->present_cmds,
+                     flush_next[scanout->id]);
+        goto out;
     }
 
-    drmModeModeInfo mode = scanout->connector->modes[0];
-    drmModeSetCrtc(scanout->card0_fd, scanout->crtc->crtc_id, fb->fb_id, 0, 0,
-                   &scanout->connector->connector_id, 1, &mode);
-
-    log_debug("%s flush with card0_fd: %d, crtc_id: %d, fb_id: %d, "
-              "connector_id: %d",
-              __func__, scanout->card0_fd, scanout->crtc->crtc_id, fb->fb_id,
-              scanout->connector->connector_id);
+    // With two buffers, wait until the one in flight reaches the screen. The
+    // scanout may change meanwhile, so the worker starts over then.
+    back = virtio_gpu_back_buffer(scanout);
+    if (back < 0) {
+        pthread_cond_wait(&scanout->flip_cond, &scanout->flip_mutex);
+        return false;
+    }
+    fb = &scanout->frame_buffers[back];
+    TAILQ_INIT(&frame_cmds);
+    if (back == scanout->ready) {
+        // Drawn again before it was flipped, its flushes join this frame
+        scanout->ready = -1;
+        TAILQ_CONCAT(&frame_cmds, &scanout->ready_cmds,
+                     flush_next[scanout->id]);
+    }
+    if (scanout->front < 0) {
+        // The display has nothing of the buffers yet
+        scanout->frame_damage.num = 0;
+        virtio_gpu_damage_add(&scanout->frame_damage, &shown);
+    }
+    TAILQ_CONCAT(&frame_cmds, &scanout->present_cmds, flush_next[scanout->id]);
+    damage = fb->damage;
+    fb->damage.num = 0;
+    frame_damage = scanout->frame_damage;
+    scanout->frame_damage.num = 0;
+
+    // Flushes and page flips go on during the copy. Flushes queued meanwhile
+    // add their damage to every buffer and are shown in the next frame.
+    scanout->copy_res = res;
+    pthread_mutex_unlock(&scanout->flip_mutex);
+    copied = virtio_gpu_copy_damage(scanout, fb, res, &damage);
+    pthread_mutex_lock(&scanout->flip_mutex);
+    scanout->copy_res = NULL;
+    scanout->copied_bytes += copied;
+    scanout->frames++;
+
+    TAILQ_INIT(&later_cmds);
+    TAILQ_CONCAT(&later_cmds, &scanout->present_cmds, flush_next[scanout->id]);
+    TAILQ_CONCAT(&scanout->present_cmds, &frame_cmds, flush_next[scanout->id]);
+    later_damage = scanout->frame_damage;
+    scanout->frame_damage = frame_damage;
+    virtio_gpu_present(scanout, back);
+    TAILQ_CONCAT(&scanout->present_cmds, &later_cmds, flush_next[scanout->id]);
+    scanout->frame_damage = later_damage;
+    pthread_cond_broadcast(&scanout->flip_cond);
+
+out:
+    return !TAILQ_EMPTY(&scanout->done_cmds);
 }
 
-void virtio_gpu_remove_drm_framebuffer(GPUScanout *scanout) {
-    GPUFrameBuffer *fb = &scanout->frame_buffer;
-
-    if (!fb || !fb->enabled || !fb->fb_addr) {
-        log_error("%s found drm_framebuffer is not enabled yet");
-        return;
+void virtio_gpu_flip_done(GPUScanout *scanout) {
+    GPUDev *gdev = scanout->vdev->dev;
+
+    pthread_mutex_lock(&scanout->flip_mutex);
+    scanout->front = scanout->flipping;
+    scanout->front_fb_id = scanout->flipping_fb_id;
+    scanout->flipping = -1;
+    scanout->flipping_fb_id = 0;
+    scanout->flips++;
+    TAILQ_CONCAT(&scanout->done_cmds, &scanout->flip_cmds,
+                 flush_next[scanout->id]);
+
+    if (scanout->ready >= 0) {
+        TAILQ_CONCAT(&scanout->flip_cmds, &scanout->ready_cmds,
+                     flush_next[scanout->id]);
+        if (virtio_gpu_page_flip(scanout, scanout->ready) < 0) {
+            virtio_gpu_modeset(scanout, scanout->ready);
+            TAILQ_CONCAT(&scanout->done_cmds, &scanout->flip_cmds,
+                         flush_next[scanout->id]);
+        }
+        scanout->ready = -1;
     }
+    pthread_cond_broadcast(&scanout->flip_cond);
+    pthread_mutex_unlock(&scanout->flip_mutex);
 
-    struct drm_mode_destroy_dumb destory = {0};
-    destory.handle = fb->drm_dumb_handle;
+    // The processing thread answers the flushes
+    virtio_gpu_kick_handler(gdev);
+}
 
-    drmModeRmFB(scanout->card0_fd, fb->fb_id);
-    if (fb->fb_addr != NULL) {
-        munmap(fb->fb_addr, fb->drm_dumb_size);
+int virtio_gpu_finish_flushes(VirtIODevice *vdev) {
+    GPUDev *gdev = vdev->dev;
+    GPUCommand *gcmd = NULL;
+    int cnt = 0;
+
+    for (int i = 0; i < gdev->scanouts_num; ++i) {
+        GPUScanout *scanout = &gdev->scanouts[i];
+        TAILQ_HEAD(, virtio_gpu_control_cmd) done;
+        TAILQ_INIT(&done);
+
+        pthread_mutex_lock(&scanout->flip_mutex);
+        TAILQ_CONCAT(&done, &scanout->done_cmds, flush_next[i]);
+        pthread_mutex_unlock(&scanout->flip_mutex);
+
+        while (!TAILQ_EMPTY(&done)) {
+            gcmd = TAILQ_FIRST(&done);
+            TAILQ_REMOVE(&done, gcmd, flush_next[i]);
+            // A flush shown on several scanouts waits for all of them
+            if (--gcmd->presents > 0) {
+                continue;
+            }
+            virtio_gpu_ctrl_response_nodata(
+                vdev, gcmd,
+                gcmd->error ? gcmd->error : VIRTIO_GPU_RESP_OK_NODATA);
+            if (!gcmd->held) {
+                free(gcmd->resp_iov);
+                free(gcmd);
+            }
+            cnt++;
+        }
     }
-    drmIoctl(scanout->card0_fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destory);
+    return cnt;
+}
 
-    log_debug("%s destoryed drm_framebuffer with id: %d, handle: %d, size: %d",
-              __func__, fb->fb_id, fb->drm_dumb_handle, fb->drm_dumb_size);
+void virtio_gpu_remove_framebuffer(GPUScanout *scanout, GPUFrameBuffer *fb) {
+    scanout->display->remove_buffer(scanout, fb);
 
     // Reserve others
     fb->fb_id = 0;
-    fb->drm_dumb_handle = 0;
-    fb->drm_dumb_size = 0;
+    fb->pitch = 0;
     fb->fb_addr = NULL;
     fb->enabled = false;
 }
@@ -519,6 +1093,21 @@ void virtio_gpu_set_scanout(VirtIODevice *vdev, GPUCommand *gcmd) {
         return;
     }
 
+    if (res->blob) {
+        log_error("%s found resource %d is a blob, use set_scanout_blob",
+                  __func__, set_scanout.resource_id);
+        gcmd->error = VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER;
+        return;
+    }
+
+    // 3D resources may have formats the device can't convert
+    if (gpu_blit_virtio_format(res->format) < 0) {
+        log_error("%s cannot show resource %d of format %d", __func__,
+                  set_scanout.resource_id, res->format);
+        gcmd->error = VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER;
+        return;
+    }
+
     log_debug("%s setting scanout %d with resource %d", __func__,
               set_scanout.scanout_id, set_scanout.resource_id);
 
@@ -526,7 +1115,7 @@ void virtio_gpu_set_scanout(VirtIODevice *vdev, GPUCommand *gcmd) {
     fb.bytes_pp = 4; // All formats are 4 bytes pp (32 bytes per pixel)
     fb.width = res->width;
     fb.height = res->height;
-    fb.stride = res->hostmem / res->height; // hostmem = height * stride
+    fb.stride = res->stride;
     fb.offset = set_scanout.r.x * fb.bytes_pp + set_scanout.r.y * fb.stride;
     fb.fb_addr = NULL;
     fb.enabled = false;
@@ -535,6 +1124,101 @@ void virtio_gpu_set_scanout(VirtIODevice *vdev, GPUCommand *gcmd) {
                               &set_scanout.r, &gcmd->error);
 }
 
+void virtio_gpu_set_scanout_blob(VirtIODevice *vdev, GPUCommand *gcmd) {
+    log_debug("entering %s", __func__);
+
+    GPUDev *gdev = vdev->dev;
+
+    GPUSimpleResource *res = NULL;
+    GPUFrameBuffer fb = {0};
+    struct virtio_gpu_set_scanout_blob set_scanout;
+    uint32_t drm_format = 0;
+    uint64_t end = 0;
+
+    VIRTIO_GPU_FILL_CMD(gcmd->resp_iov, gcmd->resp_iov_cnt, set_scanout);
+
+    if (set_scanout.scanout_id >= gdev->scanouts_num) {
+        log_error("%s setting invalid scanout with scanout_id %d", __func__,
+                  set_scanout.scanout_id);
+        gcmd->error = VIRTIO_GPU_RESP_ERR_INVALID_SCANOUT_ID;
+        return;
+    }
+
+    if (set_scanout.resource_id == 0) {
+        virtio_gpu_disable_scanout(gdev, set_scanout.scanout_id);
+        return;
+    }
+
+    res = virtio_gpu_check_resource(vdev, set_scanout.resource_id, __func__,
+                                    &gcmd->error);
+    if (!res) {
+        return;
+    }
+
+    // Only the first plane is used, all formats are 4 bytes per pixel
+    drm_format = VIRTIO_GPU_FORMAT_TO_DRM_FORMAT(set_scanout.format);
+    end = set_scanout.offsets[0] +
+          (uint64_t)set_scanout.strides[0] * set_scanout.height;
+    if (!res->blob || !drm_format || set_scanout.width == 0 ||
+        set_scanout.height == 0 ||
+        set_scanout.strides[0] < set_scanout.width * 4 || end > res->hostmem) {
+        log_error("%s found illegal layout of resource %d, %d, %d, format %d, "
+                  "stride %d, offset %d",
+                  __func__, set_scanout.resource_id, set_scanout.width,
+                  set_scanout.height, set_scanout.format,
+                  set_scanout.strides[0], set_scanout.offsets[0]);
+        gcmd->error = VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER;
+        return;
+    }
+
+    if (res->width != set_scanout.width || res->height != set_scanout.height ||
+        res->format != set_scanout.format ||
+        res->stride != set_scanout.strides[0] ||
+        res->offset != set_scanout.offsets[0]) {
+        // The layout of the backing changed, so does its drm_framebuffer
+        virtio_gpu_remove_blob_framebuffer(gdev, res);
+        res->width = set_scanout.width;
+        res->height = set_scanout.height;
+        res->format = set_scanout.format;
+        res->stride = set_scanout.strides[0];
+        res->offset = set_scanout.offsets[0];
+    }
+
+    // Only the kms scanouts show the backing itself
+    if (gdev->scanouts[set_scanout.scanout_id].card0_fd < 0) {
+        log_debug("%s copies resource %d into the buffers of scanout %d",
+                  __func__, res->resource_id, set_scanout.scanout_id);
+    } else if (gdev->zero_copy && res->contiguous && !res->blob_handle) {
+        virtio_gpu_import_blob(vdev, res);
+    }
+    if (res->blob_handle && !res->blob_fb_id) {
+        uint32_t handles[4] = {res->blob_handle};
+        uint32_t pitches[4] = {res->stride};
+        uint32_t offsets[4] = {res->offset};
+        if (drmModeAddFB2(gdev->card0_fd, res->width, res->height, drm_format,
+                          handles, pitches, offsets, &res->blob_fb_id,
+                          0) < 0) {
+            log_warn("%s card0 cannot scan out resource %d, errno is %d, it "
+                     "is copied",
+                     __func__, res->resource_id, errno);
+            res->blob_fb_id = 0;
+        }
+    }
+
+    fb.format = res->format;
+    fb.bytes_pp = 4;
+    fb.width = res->width;
+    fb.height = res->height;
+    fb.stride = res->stride;
+    fb.offset = res->offset + set_scanout.r.x * fb.bytes_pp +
+                set_scanout.r.y * fb.stride;
+    fb.fb_addr = NULL;
+    fb.enabled = false;
+
+    virtio_gpu_do_set_scanout(vdev, set_scanout.scanout_id, &fb, res,
+                              &set_scanout.r, &gcmd->error);
+}
+
 bool virtio_gpu_do_set_scanout(VirtIODevice *vdev, uint32_t scanout_id,
                                GPUFrameBuffer *fb, GPUSimpleResource *res,
                                struct virtio_gpu_rect *r, uint32_t *error) {
@@ -560,14 +1244,57 @@ bool virtio_gpu_do_set_scanout(VirtIODevice *vdev, uint32_t scanout_id,
         "%d, %d",
         __func__, r->x, r->y, r->width, r->height, fb->width, fb->height);
 
-    // TODO: Blob related logic (if VIRTIO_GPU_F_RESOURCE_BLOB feature is
-    // supported)
-
     // Update scanout
     virtio_gpu_update_scanout(vdev, scanout_id, fb, res, r);
     return true;
 }
 
+// Give the buffers of the scanout the geometry of fb, all of them need the
+// shown rectangle of res
+static void virtio_gpu_update_framebuffers(GPUScanout *scanout,
+                                           GPUFrameBuffer *fb,
+                                           GPUSimpleResource *res,
+                                           uint32_t blob_fb_id) {
+    struct virtio_gpu_rect shown = {scanout->x, scanout->y, scanout->width,
+                                    scanout->height};
+    GPUFrameBuffer *old = &scanout->frame_buffers[0];
+    bool resized = old->width != fb->width || old->height != fb->height ||
+                   old->format != fb->format;
+    // A page flip can't change the drm format, which differs between the
+    // device's buffers and the backings of blob resources
+    bool blob_changed =
+        !scanout->frame_buffers[GPU_BLOB_FRAMEBUFFER].fb_id != !blob_fb_id;
+
+    pthread_mutex_lock(&scanout->flip_mutex);
+    // The worker is copying into the buffers
+    while (scanout->copy_res) {
+        pthread_cond_wait(&scanout->flip_cond, &scanout->flip_mutex);
+    }
+    if (resized || blob_changed) {
+        // The new buffers are shown with a modeset once the flips are done
+        while (scanout->flipping >= 0) {
+            pthread_cond_wait(&scanout->flip_cond, &scanout->flip_mutex);
+        }
+        TAILQ_CONCAT(&scanout->done_cmds, &scanout->ready_cmds,
+                     flush_next[scanout->id]);
+        scanout->front = scanout->ready = -1;
+    }
+    if (resized) {
+        for (int i = 0; i < scanout->fb_num; ++i) {
+            virtio_gpu_remove_framebuffer(scanout, &scanout->frame_buffers[i]);
+            scanout->frame_buffers[i] = *fb;
+        }
+    }
+    for (int i = 0; i < scanout->fb_num; ++i) {
+        scanout->frame_buffers[i].damage.num = 0;
+        virtio_gpu_damage_add(&scanout->frame_buffers[i].damage, &shown);
+    }
+    scanout->frame_buffers[GPU_BLOB_FRAMEBUFFER].fb_id = blob_fb_id;
+    scanout->present_res = res;
+    pthread_cond_broadcast(&scanout->flip_cond);
+    pthread_mutex_unlock(&scanout->flip_mutex);
+}
+
 void virtio_gpu_update_scanout(VirtIODevice *vdev, uint32_t scanout_id,
                                GPUFrameBuffer *fb, GPUSimpleResource *res,
                                struct virtio_gpu_rect *r) {
@@ -593,7 +1320,8 @@ void virtio_gpu_update_scanout(VirtIODevice *vdev, uint32_t scanout_id,
     scanout->y = r->y;
     scanout->width = r->width;
     scanout->height = r->height;
-    scanout->frame_buffer = *fb;
+    virtio_gpu_update_framebuffers(
+        scanout, fb, res, scanout->card0_fd >= 0 ? res->blob_fb_id : 0);
 }
 
 void virtio_gpu_transfer_to_host_2d(VirtIODevice *vdev, GPUCommand *gcmd) {
@@ -614,6 +1342,24 @@ void virtio_gpu_transfer_to_host_2d(VirtIODevice *vdev, GPUCommand *gcmd) {
         return;
     }
 
+    // A cursor of the resource is read again on its next update
+    virtio_gpu_cursor_put(res->cursor);
+    res->cursor = NULL;
+
+#ifdef ENABLE_VIRGL
+    if (res->virgl) {
+        virtio_gpu_virgl_transfer_2d(res, &transfer_2d, &gcmd->error);
+        return;
+    }
+#endif
+
+    // The guest may transfer to a blob resource before it has a geometry,
+    // its damage is clipped when flushed
+    if (res->blob && res->width == 0) {
+        virtio_gpu_damage_add(&res->damage, &transfer_2d.r);
+        return;
+    }
+
     if (transfer_2d.r.x > res->width || transfer_2d.r.y > res->height ||
         transfer_2d.r.width > res->width ||
         transfer_2d.r.height > res->height ||
@@ -633,12 +1379,9 @@ void virtio_gpu_transfer_to_host_2d(VirtIODevice *vdev, GPUCommand *gcmd) {
         __func__, transfer_2d.r.x, transfer_2d.r.y, transfer_2d.r.width,
         transfer_2d.r.height, res->resource_id, res->width, res->height);
 
-    // Retain transfer information, and perform the actual copy during flush
-    res->transfer_rect.x = transfer_2d.r.x;
-    res->transfer_rect.y = transfer_2d.r.y;
-    res->transfer_rect.width = transfer_2d.r.width;
-    res->transfer_rect.height = transfer_2d.r.height;
-    res->transfer_offset = transfer_2d.offset;
+    // Retain transfer information, and perform the actual copy during flush.
+    // The backing is linear, so the rectangle also gives the offset.
+    virtio_gpu_damage_add(&res->damage, &transfer_2d.r);
 }
 
 void virtio_gpu_resource_attach_backing(VirtIODevice *vdev, GPUCommand *gcmd) {
@@ -670,19 +1413,25 @@ void virtio_gpu_resource_attach_backing(VirtIODevice *vdev, GPUCommand *gcmd) {
               res->resource_id, vdev->zone_id);
 
     int err = virtio_gpu_create_mapping_iov(vdev, attach_backing.nr_entries,
-                                            sizeof(attach_backing), gcmd,
+                                            sizeof(attach_backing), gcmd, NULL,
                                             &res->iov, &res->iov_cnt);
     if (err != 0) {
         log_error("%s failed to map guest memory to iov", __func__);
         gcmd->error = VIRTIO_GPU_RESP_ERR_UNSPEC;
         return;
     }
+
+#ifdef ENABLE_VIRGL
+    if (res->virgl) {
+        virtio_gpu_virgl_attach(gdev, res, &gcmd->error);
+    }
+#endif
 }
 
 int virtio_gpu_create_mapping_iov(VirtIODevice *vdev, uint32_t nr_entries,
-                                  uint32_t offset,
-                                  GPUCommand *gcmd, /*uint64_t **addr,*/
-                                  struct iovec **iov, uint32_t *niov) {
+                                  uint32_t offset, GPUCommand *gcmd,
+                                  uint64_t **addr, struct iovec **iov,
+                                  uint32_t *niov) {
     log_debug("entering %s", __func__);
     GPUDev *gdev = vdev->dev;
 
@@ -715,9 +1464,9 @@ int virtio_gpu_create_mapping_iov(VirtIODevice *vdev, uint32_t nr_entries,
     }
 
     *iov = NULL;
-    // if (addr) {
-    //   *addr = NULL;
-    // }
+    if (addr) {
+        *addr = NULL;
+    }
 
     for (e = 0, v = 0; e < nr_entries; ++e, ++v) {
         uint64_t e_addr =
@@ -734,27 +1483,35 @@ int virtio_gpu_create_mapping_iov(VirtIODevice *vdev, uint32_t nr_entries,
         // Allocate iov in groups of 16, if not enough, reallocate memory
         if (!(v % 16)) {
             struct iovec *temp = realloc(*iov, (v + 16) * sizeof(struct iovec));
-            if (temp == NULL) {
+            uint64_t *temp_addr =
+                addr ? realloc(*addr, (v + 16) * sizeof(uint64_t)) : NULL;
+            if (temp) {
+                *iov = temp;
+            }
+            if (temp_addr) {
+                *addr = temp_addr;
+            }
+            if (temp == NULL || (addr && temp_addr == NULL)) {
                 // Unable to allocate
                 log_error("%s cannot allocate enough memory for iov", __func__);
                 free(*iov); // Directly free the iov array
                 free(entries);
                 *iov = NULL;
+                if (addr) {
+                    free(*addr);
+                    *addr = NULL;
+                }
                 return -1;
             }
-            *iov = temp;
-            // if (addr) {
-            //   *addr = realloc(*addr, (v * 16) * sizeof(uint64_t));
-            // }
         }
 
         (*iov)[v].iov_base = get_virt_addr((void *)e_addr, vdev->zone_id);
         (*iov)[v].iov_len = e_length;
         log_debug("guest addr %x map to %x with size %d", e_addr,
                   (*iov)[v].iov_base, (*iov)[v].iov_len);
-        // if (addr) {
-        //   (*addr)[v] = e_addr;
-        // }
+        if (addr) {
+            (*addr)[v] = e_addr;
+        }
 
         // Considering that in future changes, the mapping from zonex to zone0
         // may not be direct, but through dma or other methods
@@ -793,16 +1550,185 @@ void virtio_gpu_resource_detach_backing(VirtIODevice *vdev, GPUCommand *gcmd) {
     virtio_gpu_cleanup_mapping(gdev, res);
 }
 
+HvCursor *virtio_gpu_cursor_get(HvCursor *cursor) {
+    if (cursor) {
+        cursor->refcount++;
+    }
+    return cursor;
+}
+
+void virtio_gpu_cursor_put(HvCursor *cursor) {
+    if (cursor && --cursor->refcount == 0) {
+        free(cursor);
+    }
+}
+
+// The image of a resource as a cursor, read once and kept until the resource
+// changes. Drivers draw cursors into dumb buffers, 2D resources or blobs.
+static HvCursor *virtio_gpu_cursor_image(GPUDev *gdev, uint32_t resource_id) {
+    GPUSimpleResource *res = virtio_gpu_find_resource(gdev, resource_id);
+    HvCursor *cursor = NULL;
+    uint32_t format = 0, width = GPU_CURSOR_SIZE, height = GPU_CURSOR_SIZE;
+    uint32_t stride = GPU_CURSOR_SIZE * 4, offset = 0;
+    int src_format = 0;
+
+    if (!res || !res->iov || res->virgl) {
+        log_error("%s found resource %d cannot be a cursor", __func__,
+                  resource_id);
+        return NULL;
+    }
+    if (res->cursor) {
+        return res->cursor;
+    }
+
+    // A blob has no geometry unless it was scanned out, the driver's cursor
+    // blobs are ARGB8888 of GPU_CURSOR_SIZE square
+    format = VIRTIO_GPU_FORMAT_B8G8R8A8_UNORM;
+    if (res->width) {
+        format = res->format;
+        width = MIN(res->width, GPU_CURSOR_SIZE);
+        height = MIN(res->height, GPU_CURSOR_SIZE);
+        stride = res->stride;
+        offset = res->offset;
+    }
+    src_format = gpu_blit_virtio_format(format);
+    if (src_format < 0) {
+        log_error("%s found resource %d has unknown format %d", __func__,
+                  resource_id, format);
+        return NULL;
+    }
+
+    cursor = calloc(1, sizeof(HvCursor) + GPU_CURSOR_SIZE * GPU_CURSOR_SIZE *
+                                              sizeof(uint32_t));
+    if (!cursor) {
+        log_error("%s cannot allocate the cursor of resource %d", __func__,
+                  resource_id);
+        return NULL;
+    }
+    cursor->width = GPU_CURSOR_SIZE;
+    cursor->height = GPU_CURSOR_SIZE;
+    // Converted into BGRA8888, opaque formats get an alpha of 0xff
+    if (gpu_blit_from_iov(cursor->data, GPU_CURSOR_SIZE * sizeof(uint32_t),
+                          GPU_PIXEL_BGRA8888, res->iov, res->iov_cnt, offset,
+                          stride, src_format, width, height) == 0) {
+        log_error("%s found the backing of resource %d is too short",
+                  __func__, resource_id);
+        free(cursor);
+        return NULL;
+    }
+    cursor->refcount = 1;
+    res->cursor = cursor;
+    return cursor;
+}
+
+void virtio_gpu_update_cursor(VirtIODevice *vdev, GPUUpdateCursor *cursor) {
+    log_debug("entering %s", __func__);
+
+    GPUDev *gdev = vdev->dev;
+    GPUScanout *scanout = NULL;
+    bool load = false;
+
+    if (cursor->pos.scanout_id >= (uint32_t)gdev->scanouts_num) {
+        log_error("%s found invalid scanout id %d", __func__,
+                  cursor->pos.scanout_id);
+        return;
+    }
+    scanout = &gdev->scanouts[cursor->pos.scanout_id];
+
+    pthread_mutex_lock(&scanout->cursor_mutex);
+    scanout->cursor.pos = cursor->pos;
+    switch (cursor->hdr.type) {
+    case VIRTIO_GPU_CMD_UPDATE_CURSOR:
+        // Only the processing thread may read the resource
+        scanout->cursor.resource_id = cursor->resource_id;
+        scanout->cursor.hot_x = cursor->hot_x;
+        scanout->cursor.hot_y = cursor->hot_y;
+        scanout->cursor_dirty = true;
+        scanout->cursor_updates++;
+        load = true;
+        break;
+    case VIRTIO_GPU_CMD_MOVE_CURSOR:
+        if (scanout->current_cursor && scanout->display->move_cursor) {
+            scanout->display->move_cursor(scanout, (int32_t)cursor->pos.x,
+                                          (int32_t)cursor->pos.y);
+        }
+        scanout->cursor_moves++;
+        break;
+    default:
+        log_error("%s found unknown request type %d", __func__,
+                  cursor->hdr.type);
+        break;
+    }
+    pthread_mutex_unlock(&scanout->cursor_mutex);
+
+    if (load) {
+        virtio_gpu_kick_handler(gdev);
+    }
+}
+
+void virtio_gpu_load_cursors(VirtIODevice *vdev) {
+    GPUDev *gdev = vdev->dev;
+    HvCursor *cursor = NULL;
+
+    for (int i = 0; i < gdev->scanouts_num; ++i) {
+        GPUScanout *scanout = &gdev->scanouts[i];
+
+        pthread_mutex_lock(&scanout->cursor_mutex);
+        if (!scanout->cursor_dirty) {
+            pthread_mutex_unlock(&scanout->cursor_mutex);
+            continue;
+        }
+        scanout->cursor_dirty = false;
+
+        // Resource 0 hides the cursor, and so does one that can't be read
+        cursor = NULL;
+        if (scanout->cursor.resource_id) {
+            cursor =
+                virtio_gpu_cursor_image(gdev, scanout->cursor.resource_id);
+        }
+        virtio_gpu_cursor_get(cursor);
+        virtio_gpu_cursor_put(scanout->current_cursor);
+        scanout->current_cursor = cursor;
+
+        // At the latest position, moves after the update may have come
+        if (scanout->display->set_cursor) {
+            scanout->display->set_cursor(scanout, cursor,
+                                         scanout->cursor.hot_x,
+                                         scanout->cursor.hot_y);
+            if (cursor) {
+                scanout->display->move_cursor(
+                    scanout, (int32_t)scanout->cursor.pos.x,
+                    (int32_t)scanout->cursor.pos.y);
+            }
+        }
+        pthread_mutex_unlock(&scanout->cursor_mutex);
+    }
+}
+
 void virtio_gpu_simple_process_cmd(GPUCommand *gcmd, VirtIODevice *vdev) {
     log_debug("------ entering %s ------", __func__);
+    GPUDev *gdev = vdev->dev;
 
     gcmd->error = 0;
     gcmd->finished = false;
+    gcmd->deferred = false;
+    gcmd->ordered = false;
+    gcmd->held = false;
+    gcmd->rendering = false;
+    gcmd->presents = 0;
 
     // First fill in the cmd_hdr that each request has
     VIRTIO_GPU_FILL_CMD(gcmd->resp_iov, gcmd->resp_iov_cnt,
                         gcmd->control_header);
 
+    // A fenced request is answered after the fenced requests and flushes
+    // before it, a flush once its frame is on screen
+    if ((gcmd->control_header.flags & VIRTIO_GPU_FLAG_FENCE) ||
+        gcmd->control_header.type == VIRTIO_GPU_CMD_RESOURCE_FLUSH) {
+        TAILQ_INSERT_TAIL(&gdev->fence_cmds, gcmd, fence_next);
+        gcmd->ordered = true;
+    }
+
     // Jump to the corresponding processing function according to the type of
     // cmd_hdr
     /**********************************
@@ -839,12 +1765,48 @@ void virtio_gpu_simple_process_cmd(GPUCommand *gcmd, VirtIODevice *vdev) {
     case VIRTIO_GPU_CMD_RESOURCE_DETACH_BACKING:
         virtio_gpu_resource_detach_backing(vdev, gcmd);
         break;
+    case VIRTIO_GPU_CMD_RESOURCE_CREATE_BLOB:
+        virtio_gpu_resource_create_blob(vdev, gcmd);
+        break;
+    case VIRTIO_GPU_CMD_SET_SCANOUT_BLOB:
+        virtio_gpu_set_scanout_blob(vdev, gcmd);
+        break;
+#ifdef ENABLE_VIRGL
+    case VIRTIO_GPU_CMD_CTX_CREATE:
+    case VIRTIO_GPU_CMD_CTX_DESTROY:
+    case VIRTIO_GPU_CMD_CTX_ATTACH_RESOURCE:
+    case VIRTIO_GPU_CMD_CTX_DETACH_RESOURCE:
+    case VIRTIO_GPU_CMD_RESOURCE_CREATE_3D:
+    case VIRTIO_GPU_CMD_TRANSFER_TO_HOST_3D:
+    case VIRTIO_GPU_CMD_TRANSFER_FROM_HOST_3D:
+    case VIRTIO_GPU_CMD_SUBMIT_3D:
+    case VIRTIO_GPU_CMD_GET_CAPSET_INFO:
+    case VIRTIO_GPU_CMD_GET_CAPSET:
+        virtio_gpu_virgl_process_cmd(vdev, gcmd);
+        break;
+#endif
     default:
         log_error("unknown request type");
         gcmd->error = VIRTIO_GPU_RESP_ERR_UNSPEC;
         break;
     }
 
+#ifdef ENABLE_VIRGL
+    // The fence of a request is passed once the renderer has drawn what the
+    // zone submitted before it
+    if (gdev->virgl && !gcmd->deferred && !gcmd->finished && !gcmd->error &&
+        (gcmd->control_header.flags & VIRTIO_GPU_FLAG_FENCE)) {
+        virtio_gpu_virgl_fence(vdev, gcmd);
+    }
+#endif
+
+    if (gcmd->deferred) {
+        // Answered after the page flip or the fence of the renderer, the iov
+        // is freed then
+        log_debug("------ leaving %s, deferred ------", __func__);
+        return;
+    }
+
     if (!gcmd->finished) {
         // If no response with data is returned directly, check for errors and
         // return a response without data
@@ -858,6 +1820,13 @@ void virtio_gpu_simple_process_cmd(GPUCommand *gcmd, VirtIODevice *vdev) {
             vdev, gcmd, gcmd->error ? gcmd->error : VIRTIO_GPU_RESP_OK_NODATA);
     }
 
+    if (gcmd->held) {
+        // Freed once the fences before it are answered
+        gcmd->deferred = true;
+        log_debug("------ leaving %s, held ------", __func__);
+        return;
+    }
+
     // Processing is complete, no need for iov
     free(gcmd->resp_iov);
 
@@ -21,12 +21,22 @@ void *virtio_gpu_handler(void *dev) {
     GPUCommand *gcmd = NULL;
 
     uint32_t request_cnt = 0;
+    uint32_t from_queue = GPU_CONTROL_QUEUE;
+
+#ifdef ENABLE_VIRGL
+    // The GL context of virglrenderer is current on this thread only, every
+    // 3D command is processed here
+    virtio_gpu_virgl_init(vdev);
+#endif
 
     pthread_mutex_lock(&gdev->queue_mutex);
     for (;;) {
         // Check if the device is closed
         if (gdev->close) {
             pthread_mutex_unlock(&gdev->queue_mutex);
+#ifdef ENABLE_VIRGL
+            virtio_gpu_virgl_close(vdev);
+#endif
             pthread_exit(NULL);
             return NULL;
         }
@@ -43,12 +53,18 @@ void *virtio_gpu_handler(void *dev) {
             virtio_gpu_simple_process_cmd(gcmd, vdev);
             // Notify the frontend and free memory after the command is
             // completed, iov is freed by virtio_gpu_simple_process_cmd
+            // A deferred flush is answered and freed after its page flip
+            from_queue = gcmd->from_queue;
+            if (gcmd->deferred) {
+                pthread_mutex_lock(&gdev->queue_mutex);
+                continue;
+            }
 
             request_cnt++;
 
             if (request_cnt >= VIRTIO_GPU_MAX_REQUEST_BEFORE_KICK) {
                 // Processed a certain number of requests, kick the frontend
-                virtio_inject_irq(&vdev->vqs[gcmd->from_queue]);
+                virtio_inject_irq(&vdev->vqs[from_queue]);
                 request_cnt = 0;
                 // log_info("%s: processed request >= 16, kick frontend",
                 // __func__);
@@ -62,14 +78,59 @@ void *virtio_gpu_handler(void *dev) {
             pthread_mutex_lock(&gdev->queue_mutex);
         }
 
+        // Flushes whose frame reached the screen
+        if (virtio_gpu_finish_flushes(vdev) > 0) {
+            from_queue = GPU_CONTROL_QUEUE;
+            request_cnt++;
+        }
+
+        // Cursor images the zone asked for
+        virtio_gpu_load_cursors(vdev);
+
+#ifdef ENABLE_VIRGL
+        // Fenced requests whose commands the renderer has drawn
+        if (virtio_gpu_virgl_poll(vdev) > 0) {
+            from_queue = GPU_CONTROL_QUEUE;
+            request_cnt++;
+        }
+#endif
+
         if (request_cnt != 0) {
             // Processed requests but the task queue is empty, immediately kick
             // the frontend
-            virtio_inject_irq(&vdev->vqs[gcmd->from_queue]);
+            virtio_inject_irq(&vdev->vqs[from_queue]);
             request_cnt = 0;
             // log_info("%s: request queue empty, kick frontend", __func__);
         }
 
+#ifdef ENABLE_VIRGL
+        virtio_gpu_virgl_wait(gdev);
+#else
         pthread_cond_wait(&gdev->gpu_cond, &gdev->queue_mutex);
+#endif
+    }
+}
+void *virtio_gpu_present_worker(void *arg) {
+    GPUScanout *scanout = (GPUScanout *)arg;
+    GPUDev *gdev = scanout->vdev->dev;
+
+    pthread_mutex_lock(&scanout->flip_mutex);
+    for (;;) {
+        if (scanout->present_stop) {
+            break;
+        }
+        if (TAILQ_EMPTY(&scanout->present_cmds)) {
+            pthread_cond_wait(&scanout->flip_cond, &scanout->flip_mutex);
+            continue;
+        }
+        // Draws the flushes queued so far into one frame, or waits for a
+        // buffer to draw it into
+        if (virtio_gpu_present_frame(scanout)) {
+            pthread_mutex_unlock(&scanout->flip_mutex);
+            virtio_gpu_kick_handler(gdev);
+            pthread_mutex_lock(&scanout->flip_mutex);
+        }
     }
-}
\ No newline at end of file
+    pthread_mutex_unlock(&scanout->flip_mutex);
+    return NULL;
+}
@@ -18,9 +18,8 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
-#include <xf86drm.h>
-#include <xf86drmMode.h>
 
 GPUDev *init_gpu_dev(GPURequestedState *requested_state) {
     log_info("initializing GPUDev");
@@ -42,47 +41,98 @@ GPUDev *init_gpu_dev(GPURequestedState *requested_state) {
 
     memset(gdev, 0, sizeof(GPUDev));
 
+    // Scanout 0, unless json lists the scanouts
+    gdev->scanouts_num = requested_state->scanouts_num;
+    if (gdev->scanouts_num < 1 ||
+        gdev->scanouts_num > HVISOR_VIRTIO_GPU_MAX_SCANOUTS) {
+        gdev->scanouts_num = 1;
+    }
+
     // Initialize config
     gdev->config.events_read = 0;
     gdev->config.events_clear = 0;
-    gdev->config.num_scanouts = HVISOR_VIRTIO_GPU_MAX_SCANOUTS;
+    gdev->config.num_scanouts = gdev->scanouts_num;
     gdev->config.num_capsets = 0;
 
-    // Initialize number of scanouts
-    gdev->scanouts_num = 1;
+    if (requested_state->depth != 16 && requested_state->depth != 24) {
+        log_warn("virtio gpu doesn't support depth %d, using 24",
+                 requested_state->depth);
+    }
 
-    // Initialize scanout 0
-    // TODO: Use JSON initialization or read from device
-    gdev->scanouts[0].width = SCANOUT_DEFAULT_WIDTH;
-    gdev->scanouts[0].height = SCANOUT_DEFAULT_HEIGHT;
+    for (int i = 0; i < gdev->scanouts_num; ++i) {
+        GPUScanout *scanout = &gdev->scanouts[i];
+        GPURequestedState *state = &requested_state[i];
 
-    log_debug("set scanouts[0] width: %d height: %d", gdev->scanouts[0].width,
-              gdev->scanouts[0].height);
+        // TODO: Use JSON initialization or read from device
+        scanout->id = i;
+        scanout->width = SCANOUT_DEFAULT_WIDTH;
+        scanout->height = SCANOUT_DEFAULT_HEIGHT;
 
-    // gdev->scanouts[0].x = 0;
-    // gdev->scanouts[0].y = 0;
-    // gdev->scanouts[0].resource_id = 0;
-    gdev->scanouts[0].current_cursor = NULL;
-    gdev->scanouts[0].card0_fd = -1;
-    gdev->enabled_scanout_bitmask |= (1 << 0); // Enable scanout 0
+        log_debug("set scanouts[%d] width: %d height: %d", i, scanout->width,
+                  scanout->height);
 
-    // The framebuffer of the scanout is set by the driver frontend, see
-    // virtio_gpu_set_scanout
+        scanout->current_cursor = NULL;
+        scanout->card0_fd = -1;
+        gdev->enabled_scanout_bitmask |= (1 << i); // Enable scanout i
 
-    // TODO: Multiple requested_states (need to modify JSON parsing)
-    gdev->requested_states[0].width = requested_state->width;
-    gdev->requested_states[0].height = requested_state->height;
+        // Double buffering unless json asks for triple buffering
+        scanout->fb_num = requested_state->buffers;
+        if (scanout->fb_num < 2 || scanout->fb_num > GPU_MAX_FRAMEBUFFERS) {
+            scanout->fb_num = GPU_DEFAULT_FRAMEBUFFERS;
+        }
+        // Guest formats are converted into the pixels of the device's buffers
+        scanout->pixel_format = requested_state->depth == 16
+                                    ? GPU_PIXEL_RGB565
+                                    : GPU_PIXEL_BGRX8888;
+        scanout->front = -1;
+        scanout->flipping = -1;
+        scanout->ready = -1;
+        TAILQ_INIT(&scanout->present_cmds);
+        TAILQ_INIT(&scanout->flip_cmds);
+        TAILQ_INIT(&scanout->ready_cmds);
+        TAILQ_INIT(&scanout->done_cmds);
+        pthread_mutex_init(&scanout->flip_mutex, NULL);
+        pthread_cond_init(&scanout->flip_cond, NULL);
+        pthread_mutex_init(&scanout->cursor_mutex, NULL);
+
+        // The framebuffer of the scanout is set by the driver frontend, see
+        // virtio_gpu_set_scanout
+
+        gdev->requested_states[i].width = state->width;
+        gdev->requested_states[i].height = state->height;
+        gdev->requested_states[i].display = state->display;
+        memcpy(gdev->requested_states[i].display_path, state->display_path,
+               sizeof(gdev->requested_states[i].display_path));
+        switch (state->display) {
+        case GPU_DISPLAY_SHM:
+            scanout->display = &virtio_gpu_shm_display;
+            break;
+        case GPU_DISPLAY_STREAM:
+            scanout->display = &virtio_gpu_stream_display;
+            break;
+        default:
+            scanout->display = &virtio_gpu_kms_display;
+            break;
+        }
 
-    log_debug("requested state from json, width: %d height: %d",
-              gdev->requested_states[0].width,
-              gdev->requested_states[0].height);
+        log_debug("requested state %d from json, width: %d height: %d", i,
+                  gdev->requested_states[i].width,
+                  gdev->requested_states[i].height);
+    }
+    gdev->card0_fd = -1;
+    gdev->virgl_requested = requested_state->virgl;
+    gdev->virgl_poll_fd = -1;
 
     // Initialize resource list and command queue
     TAILQ_INIT(&gdev->resource_list);
     TAILQ_INIT(&gdev->command_queue);
+    TAILQ_INIT(&gdev->fence_cmds);
 
     // Initialize memory count
     gdev->hostmem = 0;
+    gdev->max_hostmem = requested_state->max_hostmem
+                            ? requested_state->max_hostmem
+                            : VIRTIO_GPU_MAX_HOSTMEM;
 
     // Initialize async part
     gdev->close = false;
@@ -90,6 +140,40 @@ GPUDev *init_gpu_dev(GPURequestedState *requested_state) {
     return gdev;
 }
 
+static void virtio_gpu_stats(VirtIODevice *vdev) {
+    GPUDev *gdev = vdev->dev;
+
+    log_warn("zone %d virtio gpu: %u resources of %llu bytes, budget %llu "
+             "bytes, %llu refused for the budget, %llu allocation failures, "
+             "%u imports, %llu imports released",
+             vdev->zone_id, gdev->resources, gdev->hostmem, gdev->max_hostmem,
+             gdev->hostmem_failures, gdev->alloc_failures, gdev->imports,
+             gdev->import_evictions);
+
+    if (gdev->virgl) {
+        log_warn("zone %d virtio gpu 3d: %llu submissions of %llu bytes, %u "
+                 "fences pending, %llu bytes read back for scanouts",
+                 vdev->zone_id, gdev->virgl_submits, gdev->virgl_submit_bytes,
+                 gdev->virgl_fences, gdev->virgl_read_back_bytes);
+    }
+
+    for (int i = 0; i < gdev->scanouts_num; ++i) {
+        GPUScanout *scanout = &gdev->scanouts[i];
+        log_warn("zone %d virtio gpu scanout %d: %llu frames, %llu page "
+                 "flips, %llu modesets, %llu bytes copied, %llu frames "
+                 "without copies, %llu flushes merged, %llu cursor moves, "
+                 "%llu cursor updates, %llu cursor uploads",
+                 vdev->zone_id, i, scanout->frames, scanout->flips,
+                 scanout->modesets, scanout->copied_bytes,
+                 scanout->zero_copy_frames, scanout->merged_flushes,
+                 scanout->cursor_moves, scanout->cursor_updates,
+                 scanout->cursor_uploads);
+        if (scanout->display->stats) {
+            scanout->display->stats(scanout);
+        }
+    }
+}
+
 int virtio_gpu_init(VirtIODevice *vdev) {
     log_info("entering %s", __func__);
 
@@ -99,118 +183,139 @@ int virtio_gpu_init(VirtIODevice *vdev) {
     // Set the close function for virtio gpu
     vdev->virtio_close = virtio_gpu_close;
 
-    int drm_fd = 0;
-
-    // Open card0
-    drm_fd = open("/dev/dri/card0", O_RDWR | O_CLOEXEC);
-    if (drm_fd < 0) {
-        log_error("%s failed to open /dev/dri/card0", __func__);
-        return -1;
-    }
-
-    // Get drm resources
-    // Need to get the connector, CRTC, encoder, framebuffer of the device
-    drmModeRes *res = drmModeGetResources(drm_fd);
-    if (!res) {
-        log_error("%s cannot get card0 resource", __func__);
-        close(drm_fd);
-        return -1;
-    }
-
-    // Get connector
-    drmModeConnector *connector = NULL;
-    for (int i = 0; i < res->count_connectors; ++i) {
-        connector = drmModeGetConnector(drm_fd, res->connectors[i]);
-        if (connector->connection == DRM_MODE_CONNECTED) {
-            break;
+    for (int i = 0; i < gdev->scanouts_num; ++i) {
+        gdev->scanouts[i].vdev = vdev;
+        if (gdev->scanouts[i].display->init(vdev, &gdev->scanouts[i]) < 0) {
+            log_error("%s failed to open the %s display of scanout %d",
+                      __func__, gdev->scanouts[i].display->name, i);
+            while (--i >= 0) {
+                gdev->scanouts[i].display->close(&gdev->scanouts[i]);
+            }
+            return -1;
         }
-        drmModeFreeConnector(connector);
     }
-
-    if (!connector || connector->connection != DRM_MODE_CONNECTED) {
-        log_error("%s cannot find a connector", __func__);
-        drmModeFreeResources(res);
-        close(drm_fd);
-        return -1;
-    }
-
-    // Get encoder
-    drmModeEncoder *encoder = drmModeGetEncoder(drm_fd, connector->encoder_id);
-    if (!encoder) {
-        log_error("%s cannot get encoder", __func__);
-        drmModeFreeConnector(connector);
-        drmModeFreeResources(res);
-        close(drm_fd);
-        return -1;
+    vdev->virtio_stats = virtio_gpu_stats;
+
+    // Copies into the device's buffers use the fastest kernels of the CPU
+    gpu_blit_init();
+    log_info("virtio gpu of zone %d copies frames with %s kernels",
+             vdev->zone_id, gpu_blit_name());
+
+#ifdef ENABLE_VIRGL
+    // Mesa rasterises on the CPU with llvmpipe, unless the environment asks
+    // for another driver
+    if (gdev->virgl_requested) {
+        setenv("LIBGL_ALWAYS_SOFTWARE", "1", 0);
     }
-
-    // Get CRTC
-    drmModeCrtc *crtc = drmModeGetCrtc(drm_fd, encoder->crtc_id);
-    if (!crtc) {
-        log_error("%s cannot get CRTC", __func__);
-        drmModeFreeEncoder(encoder);
-        drmModeFreeConnector(connector);
-        drmModeFreeResources(res);
-        close(drm_fd);
-        return -1;
-    }
-    // drmModeModeInfo mode = connector->modes[0];
-
-    gdev->scanouts[0].card0_fd = drm_fd;
-    gdev->scanouts[0].crtc = crtc;
-    gdev->scanouts[0].connector = connector;
-    gdev->scanouts[0].encoder = encoder;
-
-    ///
-    log_debug("%s set scanout[0] card0_fd %d", __func__, drm_fd);
-    log_debug("%s set scanout[0] crtc %x with id %d", __func__, crtc,
-              crtc->crtc_id);
-    log_debug("%s set scanout[0] connector %x with id %d", __func__, connector,
-              connector->connector_id);
-    log_debug("%s get scanout[0] connector mode hdisplay: %d, vdisplay: %d",
-              __func__, connector->modes[0].hdisplay,
-              connector->modes[0].vdisplay);
-    log_debug("%s set scanout[0] encoder %x", __func__, encoder);
-    ///
-
-    gdev->scanouts[0].width = connector->modes[0].hdisplay;
-    gdev->scanouts[0].height = connector->modes[0].vdisplay;
+#endif
 
     // async
-    pthread_create(&gdev->gpu_thread, NULL, virtio_gpu_handler, vdev);
     pthread_cond_init(&gdev->gpu_cond, NULL);
     pthread_mutex_init(&gdev->queue_mutex, NULL);
+    pthread_create(&gdev->gpu_thread, NULL, virtio_gpu_handler, vdev);
+
+#ifdef ENABLE_VIRGL
+    // The processing thread starts the renderer, the driver is offered 3D
+    // only if it runs
+    pthread_mutex_lock(&gdev->queue_mutex);
+    while (gdev->virgl_requested && !gdev->virgl_started) {
+        pthread_cond_wait(&gdev->gpu_cond, &gdev->queue_mutex);
+    }
+    pthread_mutex_unlock(&gdev->queue_mutex);
+    if (!gdev->virgl) {
+        vdev->regs.dev_feature &= ~(1ULL << VIRTIO_GPU_F_VIRGL);
+    }
+#endif
+    // Every scanout is drawn by a worker of its own
+    for (int i = 0; i < gdev->scanouts_num; ++i) {
+        pthread_create(&gdev->scanouts[i].present_thread, NULL,
+                       virtio_gpu_present_worker, &gdev->scanouts[i]);
+    }
 
     return 0;
 }
 
-void virtio_gpu_close(VirtIODevice *vdev) {
-    log_info("virtio_gpu close");
+// Free the flushes still waiting for a frame, and the fenced requests
+// waiting for them
+static void virtio_gpu_free_cmds(GPUDev *gdev) {
+    GPUCommand *gcmd = NULL;
 
-    // Reclaim memory related to scanouts
-    GPUDev *gdev = (GPUDev *)vdev->dev;
     for (int i = 0; i < gdev->scanouts_num; ++i) {
-        free(gdev->scanouts[i].current_cursor);
+        GPUScanout *scanout = &gdev->scanouts[i];
+        TAILQ_CONCAT(&scanout->done_cmds, &scanout->present_cmds,
+                     flush_next[i]);
+        TAILQ_CONCAT(&scanout->done_cmds, &scanout->flip_cmds, flush_next[i]);
+        TAILQ_CONCAT(&scanout->done_cmds, &scanout->ready_cmds, flush_next[i]);
+        while (!TAILQ_EMPTY(&scanout->done_cmds)) {
+            gcmd = TAILQ_FIRST(&scanout->done_cmds);
+            TAILQ_REMOVE(&scanout->done_cmds, gcmd, flush_next[i]);
+            // A flush shown on several scanouts is freed by the last one
+            if (--gcmd->presents > 0) {
+                continue;
+            }
+            if (gcmd->ordered) {
+                TAILQ_REMOVE(&gdev->fence_cmds, gcmd, fence_next);
+            }
+            free(gcmd->resp_iov);
+            free(gcmd);
+        }
+    }
+    while (!TAILQ_EMPTY(&gdev->fence_cmds)) {
+        gcmd = TAILQ_FIRST(&gdev->fence_cmds);
+        TAILQ_REMOVE(&gdev->fence_cmds, gcmd, fence_next);
+        free(gcmd->resp_iov);
+        free(gcmd);
+    }
+}
 
-        virtio_gpu_remove_drm_framebuffer(&gdev->scanouts[i]);
+void virtio_gpu_close(VirtIODevice *vdev) {
+    log_info("virtio_gpu close");
 
-        drmModeFreeCrtc(gdev->scanouts[i].crtc);
-        drmModeFreeEncoder(gdev->scanouts[i].encoder);
-        drmModeFreeConnector(gdev->scanouts[i].connector);
+    GPUDev *gdev = (GPUDev *)vdev->dev;
 
-        // Release card0_fd
-        if (gdev->scanouts[i].card0_fd != -1) {
-            close(gdev->scanouts[i].card0_fd);
-        }
+    // Stop the workers, which copy the resources
+    for (int i = 0; i < gdev->scanouts_num; ++i) {
+        GPUScanout *scanout = &gdev->scanouts[i];
+        pthread_mutex_lock(&scanout->flip_mutex);
+        scanout->present_stop = true;
+        pthread_cond_broadcast(&scanout->flip_cond);
+        pthread_mutex_unlock(&scanout->flip_mutex);
+        pthread_join(scanout->present_thread, NULL);
     }
 
-    // Reclaim memory related to resources
+    // Stop the processing thread, which stops the renderer
+    pthread_mutex_lock(&gdev->queue_mutex);
+    gdev->close = true;
+    pthread_cond_signal(&gdev->gpu_cond);
+    pthread_mutex_unlock(&gdev->queue_mutex);
+    pthread_join(gdev->gpu_thread, NULL);
+
+    // Reclaim memory related to resources, before card0 is closed
     while (!TAILQ_EMPTY(&gdev->resource_list)) {
         GPUSimpleResource *temp = TAILQ_FIRST(&gdev->resource_list);
         TAILQ_REMOVE(&gdev->resource_list, temp, next);
+        virtio_gpu_cleanup_mapping(gdev, temp);
+        free(temp->shadow.iov_base);
         free(temp);
     }
 
+    // Reclaim memory related to scanouts
+    virtio_gpu_free_cmds(gdev);
+    for (int i = 0; i < gdev->scanouts_num; ++i) {
+        virtio_gpu_cursor_put(gdev->scanouts[i].current_cursor);
+        gdev->scanouts[i].current_cursor = NULL;
+
+        for (int j = 0; j < gdev->scanouts[i].fb_num; ++j) {
+            virtio_gpu_remove_framebuffer(&gdev->scanouts[i],
+                                          &gdev->scanouts[i].frame_buffers[j]);
+        }
+        pthread_mutex_destroy(&gdev->scanouts[i].flip_mutex);
+        pthread_cond_destroy(&gdev->scanouts[i].flip_cond);
+
+        gdev->scanouts[i].display->close(&gdev->scanouts[i]);
+        pthread_mutex_destroy(&gdev->scanouts[i].cursor_mutex);
+    }
+
     // Reclaim memory related to command queue
     while (!TAILQ_EMPTY(&gdev->command_queue)) {
         GPUCommand *temp = TAILQ_FIRST(&gdev->command_queue);
@@ -219,9 +324,6 @@ void virtio_gpu_close(VirtIODevice *vdev) {
     }
 
     // Reclaim async part
-    gdev->close = true;
-    pthread_cond_signal(&gdev->gpu_cond);
-    pthread_join(gdev->gpu_thread, NULL);
     pthread_cond_destroy(&gdev->gpu_cond);
     pthread_mutex_destroy(&gdev->queue_mutex);
 
@@ -277,7 +379,7 @@ int virtio_gpu_cursor_notify_handler(VirtIODevice *vdev, VirtQueue *vq) {
 
     virtqueue_disable_notify(vq);
     while (!virtqueue_is_empty(vq)) {
-        int err = virtio_gpu_handle_single_request(vdev, vq, GPU_CURSOR_QUEUE);
+        int err = virtio_gpu_handle_cursor_request(vdev, vq);
         if (err < 0) {
             log_error("notify handle failed at zone %d, device %s",
                       vdev->zone_id, virtio_device_type_to_string(vdev->type));
@@ -321,6 +423,13 @@ int virtio_gpu_handle_single_request(VirtIODevice *vdev, VirtQueue *vq,
     memset(gcmd, 0, sizeof(GPUCommand));
     gcmd->resp_iov = iov;
     gcmd->resp_iov_cnt = desc_processed_num;
+    // Requests with data, such as the memory entries of attach_backing or
+    // the commands of submit_3d, span several readable descriptors. The
+    // chain has at least one descriptor here.
+    while (gcmd->req_iov_cnt < (unsigned int)desc_processed_num - 1 &&
+           !(flags[gcmd->req_iov_cnt] & VRING_DESC_F_WRITE)) {
+        gcmd->req_iov_cnt++;
+    }
     gcmd->resp_idx = first_idx_on_chain;
     gcmd->from_queue = from;
 
@@ -333,6 +442,36 @@ int virtio_gpu_handle_single_request(VirtIODevice *vdev, VirtQueue *vq,
     return 0;
 }
 
+int virtio_gpu_handle_cursor_request(VirtIODevice *vdev, VirtQueue *vq) {
+    uint16_t first_idx_on_chain = 0;
+    struct iovec *iov = NULL;
+    uint16_t *flags = NULL;
+    int desc_processed_num = 0;
+    GPUUpdateCursor cursor;
+
+    desc_processed_num = process_descriptor_chain(vq, &first_idx_on_chain, &iov,
+                                                  &flags, 0, true);
+    if (desc_processed_num < 1) {
+        log_debug("no more desc at %s", __func__);
+        return 0;
+    }
+
+    // Cursor requests have no response, and skip the command queue so that
+    // a move never waits for the requests of controlq
+    if (iov_to_buf(iov, desc_processed_num, 0, &cursor, sizeof(cursor)) ==
+        sizeof(cursor)) {
+        virtio_gpu_update_cursor(vdev, &cursor);
+    } else {
+        log_error("%s found a cursor request shorter than %zu bytes",
+                  __func__, sizeof(cursor));
+    }
+    update_used_ring(vq, first_idx_on_chain, 0);
+
+    free(iov);
+    free(flags);
+    return 0;
+}
+
 size_t iov_to_buf_full(const struct iovec *iov, unsigned int iov_cnt,
                        size_t offset, void *buf, size_t bytes_need_copy) {
     size_t done = 0;
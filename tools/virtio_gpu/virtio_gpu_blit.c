@@ -0,0 +1,625 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/**
+ * Copyright (c) 2025 Syswonder
+ *
+ * Syswonder Website:
+ *      https://www.syswonder.org
+ */
+// Blit kernels of virtio-gpu: the rectangles of a resource, scattered over
+// the pages of the guest, are copied into the device's buffers row by row and
+// converted into their format on the way. A conversion between 32-bit formats
+// moves bytes within each pixel, a conversion from or to RGB565 goes through
+// BGRX8888. Pixels are little-endian on every target.
+#include "virtio_gpu_blit.h"
+#include "log.h"
+#include <linux/virtio_gpu.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#ifdef __aarch64__
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#endif
+
+// Byte of each channel in a 32-bit pixel
+typedef struct gpu_pixel_layout {
+    uint8_t r, g, b, a;
+    bool opaque; // The alpha byte is X
+} GPUPixelLayout;
+
+static const GPUPixelLayout blit_layouts[GPU_PIXEL_RGB565] = {
+    [GPU_PIXEL_BGRA8888] = {2, 1, 0, 3, false},
+    [GPU_PIXEL_BGRX8888] = {2, 1, 0, 3, true},
+    [GPU_PIXEL_ARGB8888] = {1, 2, 3, 0, false},
+    [GPU_PIXEL_XRGB8888] = {1, 2, 3, 0, true},
+    [GPU_PIXEL_RGBA8888] = {0, 1, 2, 3, false},
+    [GPU_PIXEL_RGBX8888] = {0, 1, 2, 3, true},
+    [GPU_PIXEL_ABGR8888] = {3, 2, 1, 0, false},
+    [GPU_PIXEL_XBGR8888] = {3, 2, 1, 0, true},
+};
+
+static GPUBlitOp blit_ops[GPU_PIXEL_FORMATS][GPU_PIXEL_FORMATS];
+static const GPUBlitKernels *blit_kernels;
+
+/*********************************************************************
+    Scalar kernels
+ */
+static inline uint32_t blit_swizzle_pixel(uint32_t x, const GPUBlitOp *op) {
+    uint32_t out = op->fill, t;
+
+    for (int i = 0; i < op->terms; i++) {
+        t = x & op->mask[i];
+        out |= op->shift[i] >= 0 ? t << op->shift[i] : t >> -op->shift[i];
+    }
+    return out;
+}
+
+// From BGRX8888
+static inline uint16_t blit_pack_pixel(uint32_t x) {
+    return ((x >> 8) & 0xf800) | ((x >> 5) & 0x07e0) | ((x >> 3) & 0x001f);
+}
+
+// To BGRA8888, the low bits of each channel repeat its high bits
+static inline uint32_t blit_unpack_pixel(uint16_t x) {
+    uint32_t r = (x >> 11) & 0x1f, g = (x >> 5) & 0x3f, b = x & 0x1f;
+
+    return 0xff000000 | ((r << 3 | r >> 2) << 16) | ((g << 2 | g >> 4) << 8) |
+           (b << 3 | b >> 2);
+}
+
+static void blit_swizzle_scalar(uint8_t *dst, const uint8_t *src, uint32_t n,
+                                const GPUBlitOp *op) {
+    uint32_t x;
+
+    for (uint32_t i = 0; i < n; i++) {
+        memcpy(&x, src + i * 4, 4);
+        x = blit_swizzle_pixel(x, op);
+        memcpy(dst + i * 4, &x, 4);
+    }
+}
+
+static void blit_pack565_scalar(uint8_t *dst, const uint8_t *src, uint32_t n,
+                                const GPUBlitOp *op) {
+    uint32_t x;
+    uint16_t y;
+
+    for (uint32_t i = 0; i < n; i++) {
+        memcpy(&x, src + i * 4, 4);
+        y = blit_pack_pixel(blit_swizzle_pixel(x, op));
+        memcpy(dst + i * 2, &y, 2);
+    }
+}
+
+static void blit_unpack565_scalar(uint8_t *dst, const uint8_t *src,
+                                  uint32_t n, const GPUBlitOp *op) {
+    uint32_t x;
+    uint16_t y;
+
+    for (uint32_t i = 0; i < n; i++) {
+        memcpy(&y, src + i * 2, 2);
+        x = blit_swizzle_pixel(blit_unpack_pixel(y), op);
+        memcpy(dst + i * 4, &x, 4);
+    }
+}
+
+static bool blit_scalar_supported(void) { return true; }
+
+static const GPUBlitKernels blit_scalar = {
+    .name = "scalar",
+    .supported = blit_scalar_supported,
+    .swizzle = blit_swizzle_scalar,
+    .pack565 = blit_pack565_scalar,
+    .unpack565 = blit_unpack565_scalar,
+};
+
+#if defined(__x86_64__) || defined(__i386__)
+/*********************************************************************
+    SSE2 kernels, 4 pixels at a time. SSE2 has no byte shuffle, pixels are
+    moved with the masks and shifts of op.
+ */
+#define SSE2 __attribute__((target("sse2")))
+
+static inline SSE2 __m128i blit_swizzle_sse2_px(__m128i x, const GPUBlitOp *op,
+                                                __m128i fill) {
+    __m128i out = fill, t;
+
+    for (int i = 0; i < op->terms; i++) {
+        t = _mm_and_si128(x, _mm_set1_epi32(op->mask[i]));
+        if (op->shift[i] >= 0)
+            t = _mm_sll_epi32(t, _mm_cvtsi32_si128(op->shift[i]));
+        else
+            t = _mm_srl_epi32(t, _mm_cvtsi32_si128(-op->shift[i]));
+        out = _mm_or_si128(out, t);
+    }
+    return out;
+}
+
+static inline SSE2 __m128i blit_pack_sse2_px(__m128i x) {
+    __m128i r = _mm_and_si128(_mm_srli_epi32(x, 8), _mm_set1_epi32(0xf800));
+    __m128i g = _mm_and_si128(_mm_srli_epi32(x, 5), _mm_set1_epi32(0x07e0));
+    __m128i b = _mm_and_si128(_mm_srli_epi32(x, 3), _mm_set1_epi32(0x001f));
+
+    x = _mm_or_si128(_mm_or_si128(r, g), b);
+    // Sign extend, so that the signed saturation of packs keeps the bits
+    return _mm_srai_epi32(_mm_slli_epi32(x, 16), 16);
+}
+
+static inline SSE2 __m128i blit_unpack_sse2_px(__m128i x) {
+    __m128i r = _mm_and_si128(_mm_srli_epi32(x, 11), _mm_set1_epi32(0x1f));
+    __m128i g = _mm_and_si128(_mm_srli_epi32(x, 5), _mm_set1_epi32(0x3f));
+    __m128i b = _mm_and_si128(x, _mm_set1_epi32(0x1f));
+
+    r = _mm_or_si128(_mm_slli_epi32(r, 3), _mm_srli_epi32(r, 2));
+    g = _mm_or_si128(_mm_slli_epi32(g, 2), _mm_srli_epi32(g, 4));
+    b = _mm_or_si128(_mm_slli_epi32(b, 3), _mm_srli_epi32(b, 2));
+    x = _mm_or_si128(_mm_slli_epi32(r, 16), _mm_slli_epi32(g, 8));
+    return _mm_or_si128(_mm_or_si128(x, b), _mm_set1_epi32(0xff000000));
+}
+
+static SSE2 void blit_swizzle_sse2(uint8_t *dst, const uint8_t *src,
+                                   uint32_t n, const GPUBlitOp *op) {
+    __m128i fill = _mm_set1_epi32(op->fill), x;
+    uint32_t i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        x = _mm_loadu_si128((const __m128i *)(src + i * 4));
+        x = blit_swizzle_sse2_px(x, op, fill);
+        _mm_storeu_si128((__m128i *)(dst + i * 4), x);
+    }
+    blit_swizzle_scalar(dst + i * 4, src + i * 4, n - i, op);
+}
+
+static SSE2 void blit_pack565_sse2(uint8_t *dst, const uint8_t *src,
+                                   uint32_t n, const GPUBlitOp *op) {
+    __m128i fill = _mm_set1_epi32(op->fill), lo, hi;
+    uint32_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        lo = _mm_loadu_si128((const __m128i *)(src + i * 4));
+        hi = _mm_loadu_si128((const __m128i *)(src + i * 4 + 16));
+        lo = blit_pack_sse2_px(blit_swizzle_sse2_px(lo, op, fill));
+        hi = blit_pack_sse2_px(blit_swizzle_sse2_px(hi, op, fill));
+        _mm_storeu_si128((__m128i *)(dst + i * 2), _mm_packs_epi32(lo, hi));
+    }
+    blit_pack565_scalar(dst + i * 2, src + i * 4, n - i, op);
+}
+
+static SSE2 void blit_unpack565_sse2(uint8_t *dst, const uint8_t *src,
+                                     uint32_t n, const GPUBlitOp *op) {
+    __m128i fill = _mm_set1_epi32(op->fill), zero = _mm_setzero_si128(), x,
+            lo, hi;
+    uint32_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        x = _mm_loadu_si128((const __m128i *)(src + i * 2));
+        lo = blit_unpack_sse2_px(_mm_unpacklo_epi16(x, zero));
+        hi = blit_unpack_sse2_px(_mm_unpackhi_epi16(x, zero));
+        _mm_storeu_si128((__m128i *)(dst + i * 4),
+                         blit_swizzle_sse2_px(lo, op, fill));
+        _mm_storeu_si128((__m128i *)(dst + i * 4 + 16),
+                         blit_swizzle_sse2_px(hi, op, fill));
+    }
+    blit_unpack565_scalar(dst + i * 4, src + i * 2, n - i, op);
+}
+
+static bool blit_sse2_supported(void) {
+    return __builtin_cpu_supports("sse2");
+}
+
+static const GPUBlitKernels blit_sse2 = {
+    .name = "sse2",
+    .supported = blit_sse2_supported,
+    .swizzle = blit_swizzle_sse2,
+    .pack565 = blit_pack565_sse2,
+    .unpack565 = blit_unpack565_sse2,
+};
+
+/*********************************************************************
+    AVX2 kernels, 8 pixels at a time
+ */
+#define AVX2 __attribute__((target("avx2")))
+
+static inline AVX2 __m256i blit_pack_avx2_px(__m256i x) {
+    __m256i r =
+        _mm256_and_si256(_mm256_srli_epi32(x, 8), _mm256_set1_epi32(0xf800));
+    __m256i g =
+        _mm256_and_si256(_mm256_srli_epi32(x, 5), _mm256_set1_epi32(0x07e0));
+    __m256i b =
+        _mm256_and_si256(_mm256_srli_epi32(x, 3), _mm256_set1_epi32(0x001f));
+
+    return _mm256_or_si256(_mm256_or_si256(r, g), b);
+}
+
+static inline AVX2 __m256i blit_unpack_avx2_px(__m256i x) {
+    __m256i r =
+        _mm256_and_si256(_mm256_srli_epi32(x, 11), _mm256_set1_epi32(0x1f));
+    __m256i g =
+        _mm256_and_si256(_mm256_srli_epi32(x, 5), _mm256_set1_epi32(0x3f));
+    __m256i b = _mm256_and_si256(x, _mm256_set1_epi32(0x1f));
+
+    r = _mm256_or_si256(_mm256_slli_epi32(r, 3), _mm256_srli_epi32(r, 2));
+    g = _mm256_or_si256(_mm256_slli_epi32(g, 2), _mm256_srli_epi32(g, 4));
+    b = _mm256_or_si256(_mm256_slli_epi32(b, 3), _mm256_srli_epi32(b, 2));
+    x = _mm256_or_si256(_mm256_slli_epi32(r, 16), _mm256_slli_epi32(g, 8));
+    return _mm256_or_si256(_mm256_or_si256(x, b),
+                           _mm256_set1_epi32(0xff000000));
+}
+
+static AVX2 void blit_swizzle_avx2(uint8_t *dst, const uint8_t *src,
+                                   uint32_t n, const GPUBlitOp *op) {
+    __m256i shuf = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128((const __m128i *)op->shuf));
+    __m256i fill = _mm256_set1_epi32(op->fill), x;
+    uint32_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        x = _mm256_loadu_si256((const __m256i *)(src + i * 4));
+        x = _mm256_or_si256(_mm256_shuffle_epi8(x, shuf), fill);
+        _mm256_storeu_si256((__m256i *)(dst + i * 4), x);
+    }
+    blit_swizzle_scalar(dst + i * 4, src + i * 4, n - i, op);
+}
+
+static AVX2 void blit_pack565_avx2(uint8_t *dst, const uint8_t *src,
+                                   uint32_t n, const GPUBlitOp *op) {
+    __m256i shuf = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128((const __m128i *)op->shuf));
+    __m256i fill = _mm256_set1_epi32(op->fill), x;
+    uint32_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        x = _mm256_loadu_si256((const __m256i *)(src + i * 4));
+        x = _mm256_or_si256(_mm256_shuffle_epi8(x, shuf), fill);
+        // packus works within each 128-bit lane, gather the halves after it
+        x = blit_pack_avx2_px(x);
+        x = _mm256_packus_epi32(x, x);
+        x = _mm256_permute4x64_epi64(x, 0x08);
+        _mm_storeu_si128((__m128i *)(dst + i * 2), _mm256_castsi256_si128(x));
+    }
+    blit_pack565_scalar(dst + i * 2, src + i * 4, n - i, op);
+}
+
+static AVX2 void blit_unpack565_avx2(uint8_t *dst, const uint8_t *src,
+                                     uint32_t n, const GPUBlitOp *op) {
+    __m256i shuf = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128((const __m128i *)op->shuf));
+    __m256i fill = _mm256_set1_epi32(op->fill), x;
+    uint32_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        x = _mm256_cvtepu16_epi32(
+            _mm_loadu_si128((const __m128i *)(src + i * 2)));
+        x = blit_unpack_avx2_px(x);
+        x = _mm256_or_si256(_mm256_shuffle_epi8(x, shuf), fill);
+        _mm256_storeu_si256((__m256i *)(dst + i * 4), x);
+    }
+    blit_unpack565_scalar(dst + i * 4, src + i * 2, n - i, op);
+}
+
+static bool blit_avx2_supported(void) {
+    return __builtin_cpu_supports("avx2");
+}
+
+static const GPUBlitKernels blit_avx2 = {
+    .name = "avx2",
+    .supported = blit_avx2_supported,
+    .swizzle = blit_swizzle_avx2,
+    .pack565 = blit_pack565_avx2,
+    .unpack565 = blit_unpack565_avx2,
+};
+#endif
+
+#ifdef __aarch64__
+/*********************************************************************
+    NEON kernels, 4 pixels per register
+ */
+static inline uint32x4_t blit_pack_neon_px(uint32x4_t x) {
+    uint32x4_t r = vandq_u32(vshrq_n_u32(x, 8), vdupq_n_u32(0xf800));
+    uint32x4_t g = vandq_u32(vshrq_n_u32(x, 5), vdupq_n_u32(0x07e0));
+    uint32x4_t b = vandq_u32(vshrq_n_u32(x, 3), vdupq_n_u32(0x001f));
+
+    return vorrq_u32(vorrq_u32(r, g), b);
+}
+
+static inline uint32x4_t blit_unpack_neon_px(uint32x4_t x) {
+    uint32x4_t r = vandq_u32(vshrq_n_u32(x, 11), vdupq_n_u32(0x1f));
+    uint32x4_t g = vandq_u32(vshrq_n_u32(x, 5), vdupq_n_u32(0x3f));
+    uint32x4_t b = vandq_u32(x, vdupq_n_u32(0x1f));
+
+    r = vorrq_u32(vshlq_n_u32(r, 3), vshrq_n_u32(r, 2));
+    g = vorrq_u32(vshlq_n_u32(g, 2), vshrq_n_u32(g, 4));
+    b = vorrq_u32(vshlq_n_u32(b, 3), vshrq_n_u32(b, 2));
+    x = vorrq_u32(vshlq_n_u32(r, 16), vshlq_n_u32(g, 8));
+    return vorrq_u32(vorrq_u32(x, b), vdupq_n_u32(0xff000000));
+}
+
+// Indexes out of the table, like 0x80, read as 0
+static inline uint32x4_t blit_swizzle_neon_px(uint32x4_t x, uint8x16_t shuf,
+                                              uint32x4_t fill) {
+    uint8x16_t y = vqtbl1q_u8(vreinterpretq_u8_u32(x), shuf);
+
+    return vorrq_u32(vreinterpretq_u32_u8(y), fill);
+}
+
+static void blit_swizzle_neon(uint8_t *dst, const uint8_t *src, uint32_t n,
+                              const GPUBlitOp *op) {
+    uint8x16_t shuf = vld1q_u8(op->shuf);
+    uint32x4_t fill = vdupq_n_u32(op->fill), x, y;
+    uint32_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        x = vreinterpretq_u32_u8(vld1q_u8(src + i * 4));
+        y = vreinterpretq_u32_u8(vld1q_u8(src + i * 4 + 16));
+        vst1q_u8(dst + i * 4,
+                 vreinterpretq_u8_u32(blit_swizzle_neon_px(x, shuf, fill)));
+        vst1q_u8(dst + i * 4 + 16,
+                 vreinterpretq_u8_u32(blit_swizzle_neon_px(y, shuf, fill)));
+    }
+    blit_swizzle_scalar(dst + i * 4, src + i * 4, n - i, op);
+}
+
+static void blit_pack565_neon(uint8_t *dst, const uint8_t *src, uint32_t n,
+                              const GPUBlitOp *op) {
+    uint8x16_t shuf = vld1q_u8(op->shuf);
+    uint32x4_t fill = vdupq_n_u32(op->fill), x, y;
+    uint16x8_t z;
+    uint32_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        x = vreinterpretq_u32_u8(vld1q_u8(src + i * 4));
+        y = vreinterpretq_u32_u8(vld1q_u8(src + i * 4 + 16));
+        x = blit_pack_neon_px(blit_swizzle_neon_px(x, shuf, fill));
+        y = blit_pack_neon_px(blit_swizzle_neon_px(y, shuf, fill));
+        z = vcombine_u16(vmovn_u32(x), vmovn_u32(y));
+        vst1q_u8(dst + i * 2, vreinterpretq_u8_u16(z));
+    }
+    blit_pack565_scalar(dst + i * 2, src + i * 4, n - i, op);
+}
+
+static void blit_unpack565_neon(uint8_t *dst, const uint8_t *src, uint32_t n,
+                                const GPUBlitOp *op) {
+    uint8x16_t shuf = vld1q_u8(op->shuf);
+    uint32x4_t fill = vdupq_n_u32(op->fill), x, y;
+    uint16x8_t z;
+    uint32_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        z = vreinterpretq_u16_u8(vld1q_u8(src + i * 2));
+        x = blit_unpack_neon_px(vmovl_u16(vget_low_u16(z)));
+        y = blit_unpack_neon_px(vmovl_high_u16(z));
+        vst1q_u8(dst + i * 4,
+                 vreinterpretq_u8_u32(blit_swizzle_neon_px(x, shuf, fill)));
+        vst1q_u8(dst + i * 4 + 16,
+                 vreinterpretq_u8_u32(blit_swizzle_neon_px(y, shuf, fill)));
+    }
+    blit_unpack565_scalar(dst + i * 4, src + i * 2, n - i, op);
+}
+
+static bool blit_neon_supported(void) {
+    return getauxval(AT_HWCAP) & HWCAP_ASIMD;
+}
+
+static const GPUBlitKernels blit_neon = {
+    .name = "neon",
+    .supported = blit_neon_supported,
+    .swizzle = blit_swizzle_neon,
+    .pack565 = blit_pack565_neon,
+    .unpack565 = blit_unpack565_neon,
+};
+#endif
+
+// From the slowest to the fastest
+static const GPUBlitKernels *const blit_all[] = {
+    &blit_scalar,
+#if defined(__x86_64__) || defined(__i386__)
+    &blit_sse2,
+    &blit_avx2,
+#endif
+#ifdef __aarch64__
+    &blit_neon,
+#endif
+    NULL,
+};
+
+/*********************************************************************
+    Conversions
+ */
+// Fill op with the moves from a pixel laid out as from to one laid out as to
+static void blit_make_op(GPUBlitOp *op, const GPUPixelLayout *from,
+                         const GPUPixelLayout *to) {
+    uint8_t shuf[4] = {0x80, 0x80, 0x80, 0x80};
+    int i, t;
+
+    memset(op, 0, sizeof(GPUBlitOp));
+    shuf[to->r] = from->r;
+    shuf[to->g] = from->g;
+    shuf[to->b] = from->b;
+    // X bytes read as 0xff, and are kept when both formats have them
+    if (from->opaque && !to->opaque)
+        op->fill = 0xffU << (to->a * 8);
+    else
+        shuf[to->a] = from->a;
+
+    op->copy = !op->fill;
+    for (i = 0; i < 4; i++) {
+        op->copy = op->copy && shuf[i] == i;
+        for (int p = 0; p < 4; p++)
+            op->shuf[p * 4 + i] = shuf[i] == 0x80 ? 0x80 : p * 4 + shuf[i];
+        if (shuf[i] == 0x80)
+            continue;
+        // Bytes moving the same distance share a term
+        for (t = 0; t < op->terms; t++) {
+            if (op->shift[t] == (i - shuf[i]) * 8)
+                break;
+        }
+        if (t == op->terms) {
+            op->shift[t] = (i - shuf[i]) * 8;
+            op->terms++;
+        }
+        op->mask[t] |= 0xffU << (shuf[i] * 8);
+    }
+}
+
+void gpu_blit_init(void) {
+    // BGRX8888, the pixels of RGB565 pass through on the way
+    const GPUPixelLayout *bgrx = &blit_layouts[GPU_PIXEL_BGRX8888];
+    const GPUPixelLayout *bgra = &blit_layouts[GPU_PIXEL_BGRA8888];
+
+    if (blit_kernels)
+        return;
+    for (int s = 0; s < GPU_PIXEL_RGB565; s++) {
+        for (int d = 0; d < GPU_PIXEL_RGB565; d++)
+            blit_make_op(&blit_ops[s][d], &blit_layouts[s], &blit_layouts[d]);
+        blit_make_op(&blit_ops[s][GPU_PIXEL_RGB565], &blit_layouts[s], bgrx);
+        blit_make_op(&blit_ops[GPU_PIXEL_RGB565][s], bgra, &blit_layouts[s]);
+        blit_ops[s][GPU_PIXEL_RGB565].copy = false;
+        blit_ops[GPU_PIXEL_RGB565][s].copy = false;
+    }
+    blit_ops[GPU_PIXEL_RGB565][GPU_PIXEL_RGB565].copy = true;
+
+    for (int i = 0; blit_all[i]; i++) {
+        if (blit_all[i]->supported())
+            blit_kernels = blit_all[i];
+    }
+}
+
+int gpu_blit_use(const char *name) {
+    gpu_blit_init();
+    for (int i = 0; blit_all[i]; i++) {
+        if (!strcmp(blit_all[i]->name, name) && blit_all[i]->supported()) {
+            blit_kernels = blit_all[i];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+const char *gpu_blit_name(void) {
+    return blit_kernels ? blit_kernels->name : "none";
+}
+
+const GPUBlitKernels *const *gpu_blit_all(void) { return blit_all; }
+
+int gpu_blit_virtio_format(uint32_t virtio_format) {
+    switch (virtio_format) {
+    case VIRTIO_GPU_FORMAT_B8G8R8A8_UNORM:
+        return GPU_PIXEL_BGRA8888;
+    case VIRTIO_GPU_FORMAT_B8G8R8X8_UNORM:
+        return GPU_PIXEL_BGRX8888;
+    case VIRTIO_GPU_FORMAT_A8R8G8B8_UNORM:
+        return GPU_PIXEL_ARGB8888;
+    case VIRTIO_GPU_FORMAT_X8R8G8B8_UNORM:
+        return GPU_PIXEL_XRGB8888;
+    case VIRTIO_GPU_FORMAT_R8G8B8A8_UNORM:
+        return GPU_PIXEL_RGBA8888;
+    case VIRTIO_GPU_FORMAT_X8B8G8R8_UNORM:
+        return GPU_PIXEL_XBGR8888;
+    case VIRTIO_GPU_FORMAT_A8B8G8R8_UNORM:
+        return GPU_PIXEL_ABGR8888;
+    case VIRTIO_GPU_FORMAT_R8G8B8X8_UNORM:
+        return GPU_PIXEL_RGBX8888;
+    default:
+        return -1;
+    }
+}
+
+uint32_t gpu_blit_bytes_pp(GPUPixelFormat format) {
+    return format == GPU_PIXEL_RGB565 ? 2 : 4;
+}
+
+static void blit_convert(uint8_t *dst, GPUPixelFormat dst_format,
+                         const uint8_t *src, GPUPixelFormat src_format,
+                         uint32_t n, const GPUBlitOp *op) {
+    if (op->copy)
+        memcpy(dst, src, (size_t)n * gpu_blit_bytes_pp(src_format));
+    else if (src_format == GPU_PIXEL_RGB565)
+        blit_kernels->unpack565(dst, src, n, op);
+    else if (dst_format == GPU_PIXEL_RGB565)
+        blit_kernels->pack565(dst, src, n, op);
+    else
+        blit_kernels->swizzle(dst, src, n, op);
+}
+
+void gpu_blit_row(void *dst, GPUPixelFormat dst_format, const void *src,
+                  GPUPixelFormat src_format, uint32_t n) {
+    blit_convert(dst, dst_format, src, src_format, n,
+                 &blit_ops[src_format][dst_format]);
+}
+
+// Copy len bytes starting at offset of iov[0]
+static size_t blit_gather(uint8_t *dst, const struct iovec *iov,
+                          unsigned int iov_cnt, size_t offset, size_t len) {
+    size_t done = 0, s;
+
+    for (unsigned int i = 0; i < iov_cnt && done < len; i++) {
+        s = iov[i].iov_len - offset;
+        if (s > len - done)
+            s = len - done;
+        memcpy(dst + done, (uint8_t *)iov[i].iov_base + offset, s);
+        done += s;
+        offset = 0;
+    }
+    return done;
+}
+
+size_t gpu_blit_from_iov(void *dst, uint32_t pitch, GPUPixelFormat dst_format,
+                         const struct iovec *iov, unsigned int iov_cnt,
+                         size_t offset, uint32_t stride,
+                         GPUPixelFormat src_format, uint32_t width,
+                         uint32_t height) {
+    const GPUBlitOp *op = &blit_ops[src_format][dst_format];
+    size_t src_len = (size_t)width * gpu_blit_bytes_pp(src_format);
+    size_t dst_len = (size_t)width * gpu_blit_bytes_pp(dst_format);
+    size_t base = 0, row; // Offsets of iov[i] and of the row in the source
+    uint8_t *out, *bounce = NULL;
+    unsigned int i = 0;
+    uint32_t h;
+
+    if (op->copy && src_len == stride && stride == pitch) {
+        // Whole rows, copy them at once
+        while (i < iov_cnt && offset >= base + iov[i].iov_len)
+            base += iov[i++].iov_len;
+        if (blit_gather(dst, iov + i, iov_cnt - i, offset - base,
+                        src_len * height) < src_len * height) {
+            log_error("%s found the source is too short", __func__);
+            return 0;
+        }
+        return dst_len * height;
+    }
+
+    for (h = 0; h < height; h++) {
+        row = offset + (size_t)stride * h;
+        out = (uint8_t *)dst + (size_t)pitch * h;
+        // Rows only move forward, the search goes on from the last fragment
+        while (i < iov_cnt && row >= base + iov[i].iov_len)
+            base += iov[i++].iov_len;
+        if (i == iov_cnt)
+            break;
+        if (row + src_len <= base + iov[i].iov_len) {
+            blit_convert(out, dst_format,
+                         (uint8_t *)iov[i].iov_base + (row - base), src_format,
+                         width, op);
+        } else if (op->copy) {
+            // The row crosses fragments, copy it piece by piece
+            if (blit_gather(out, iov + i, iov_cnt - i, row - base, src_len) <
+                src_len)
+                break;
+        } else {
+            // Gather the row before converting it
+            if (!bounce)
+                bounce = malloc(src_len);
+            if (blit_gather(bounce, iov + i, iov_cnt - i, row - base,
+                            src_len) < src_len)
+                break;
+            blit_convert(out, dst_format, bounce, src_format, width, op);
+        }
+    }
+    free(bounce);
+    if (h < height) {
+        log_error("%s found the source is too short", __func__);
+        return 0;
+    }
+    return dst_len * height;
+}
@@ -0,0 +1,474 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/**
+ * Copyright (c) 2025 Syswonder
+ *
+ * Syswonder Website:
+ *      https://www.syswonder.org
+ */
+// The kms display: frames are shown on a connected output of /dev/dri/card0,
+// in drm dumb buffers presented with page flips. The cursor is shown on the
+// cursor plane of the CRTC.
+#include "event_monitor.h"
+#include "log.h"
+#include "virtio.h"
+#include "virtio_gpu.h"
+#include <drm/drm.h>
+#include <drm/drm_mode.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+static void kms_page_flip_handler(int fd, unsigned int sequence,
+                                  unsigned int tv_sec, unsigned int tv_usec,
+                                  void *user_data) {
+    (void)fd;
+    (void)sequence;
+    (void)tv_sec;
+    (void)tv_usec;
+    virtio_gpu_flip_done(user_data);
+}
+
+static void kms_event_handler(int fd, int epoll_type, void *param) {
+    (void)epoll_type;
+    (void)param;
+    drmEventContext evctx = {
+        .version = 2,
+        .page_flip_handler = kms_page_flip_handler,
+    };
+
+    if (drmHandleEvent(fd, &evctx) < 0) {
+        log_error("%s failed to read drm events", __func__);
+    }
+}
+
+// Whether an earlier kms scanout drives crtc_id
+static bool kms_crtc_used(GPUDev *gdev, GPUScanout *scanout, uint32_t crtc_id) {
+    for (int i = 0; i < scanout->id; ++i) {
+        if (gdev->scanouts[i].crtc &&
+            gdev->scanouts[i].crtc->crtc_id == crtc_id) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// The CRTC driving the encoder, or a free one it can be driven by
+static drmModeCrtc *kms_get_crtc(GPUDev *gdev, GPUScanout *scanout, int drm_fd,
+                                 drmModeRes *res, drmModeEncoder *encoder) {
+    if (encoder->crtc_id && !kms_crtc_used(gdev, scanout, encoder->crtc_id)) {
+        return drmModeGetCrtc(drm_fd, encoder->crtc_id);
+    }
+    for (int i = 0; i < res->count_crtcs; ++i) {
+        if ((encoder->possible_crtcs & (1 << i)) &&
+            !kms_crtc_used(gdev, scanout, res->crtcs[i])) {
+            return drmModeGetCrtc(drm_fd, res->crtcs[i]);
+        }
+    }
+    return NULL;
+}
+
+static int kms_init(VirtIODevice *vdev, GPUScanout *scanout) {
+    GPUDev *gdev = vdev->dev;
+    GPUScanout *first = NULL;
+    int drm_fd = 0;
+    int skip = 0;
+
+    // The kms scanouts share card0, the n-th one shows the n-th connected
+    // output. Page flip events are read by the first one.
+    for (int i = 0; i < scanout->id; ++i) {
+        if (gdev->scanouts[i].card0_fd >= 0) {
+            first = first ? first : &gdev->scanouts[i];
+            skip++;
+        }
+    }
+
+    // Open card0
+    drm_fd = first ? fcntl(gdev->card0_fd, F_DUPFD_CLOEXEC, 0)
+                   : open("/dev/dri/card0", O_RDWR | O_CLOEXEC);
+    if (drm_fd < 0) {
+        log_error("%s failed to open /dev/dri/card0", __func__);
+        return -1;
+    }
+
+    // Get drm resources
+    // Need to get the connector, CRTC, encoder, framebuffer of the device
+    drmModeRes *res = drmModeGetResources(drm_fd);
+    if (!res) {
+        log_error("%s cannot get card0 resource", __func__);
+        close(drm_fd);
+        return -1;
+    }
+
+    // Get connector
+    drmModeConnector *connector = NULL;
+    for (int i = 0; i < res->count_connectors; ++i) {
+        connector = drmModeGetConnector(drm_fd, res->connectors[i]);
+        if (connector->connection == DRM_MODE_CONNECTED && skip-- == 0) {
+            break;
+        }
+        drmModeFreeConnector(connector);
+        connector = NULL;
+    }
+
+    if (!connector) {
+        log_error("%s cannot find a connector for scanout %d", __func__,
+                  scanout->id);
+        drmModeFreeResources(res);
+        close(drm_fd);
+        return -1;
+    }
+
+    // Get encoder, an output that isn't lit yet has none
+    drmModeEncoder *encoder = drmModeGetEncoder(
+        drm_fd, connector->encoder_id ? connector->encoder_id
+                                      : connector->encoders[0]);
+    if (!encoder) {
+        log_error("%s cannot get encoder", __func__);
+        drmModeFreeConnector(connector);
+        drmModeFreeResources(res);
+        close(drm_fd);
+        return -1;
+    }
+
+    // Get CRTC
+    drmModeCrtc *crtc = kms_get_crtc(gdev, scanout, drm_fd, res, encoder);
+    drmModeFreeResources(res);
+    if (!crtc) {
+        log_error("%s cannot get CRTC", __func__);
+        drmModeFreeEncoder(encoder);
+        drmModeFreeConnector(connector);
+        close(drm_fd);
+        return -1;
+    }
+
+    scanout->card0_fd = drm_fd;
+    scanout->crtc = crtc;
+    scanout->connector = connector;
+    scanout->encoder = encoder;
+
+    ///
+    log_debug("%s set scanout card0_fd %d", __func__, drm_fd);
+    log_debug("%s set scanout crtc %x with id %d", __func__, crtc,
+              crtc->crtc_id);
+    log_debug("%s set scanout connector %x with id %d", __func__, connector,
+              connector->connector_id);
+    log_debug("%s get scanout connector mode hdisplay: %d, vdisplay: %d",
+              __func__, connector->modes[0].hdisplay,
+              connector->modes[0].vdisplay);
+    log_debug("%s set scanout encoder %x", __func__, encoder);
+    ///
+
+    scanout->width = connector->modes[0].hdisplay;
+    scanout->height = connector->modes[0].vdisplay;
+
+    // Cursor buffers have the size card0 prefers, the image fills the top
+    // left corner
+    uint64_t cap = 0;
+    scanout->cursor_width = GPU_CURSOR_SIZE;
+    scanout->cursor_height = GPU_CURSOR_SIZE;
+    if (drmGetCap(drm_fd, DRM_CAP_CURSOR_WIDTH, &cap) == 0 &&
+        cap > GPU_CURSOR_SIZE) {
+        scanout->cursor_width = cap;
+    }
+    if (drmGetCap(drm_fd, DRM_CAP_CURSOR_HEIGHT, &cap) == 0 &&
+        cap > GPU_CURSOR_SIZE) {
+        scanout->cursor_height = cap;
+    }
+
+    if (first) {
+        scanout->page_flip = first->page_flip;
+        return 0;
+    }
+    gdev->card0_fd = drm_fd;
+
+    // Frames are presented with page flips, whose completion events answer
+    // the flushes. Without the events, every frame is a modeset.
+    scanout->event = add_event(drm_fd, EPOLLIN, kms_event_handler, scanout);
+    scanout->page_flip = scanout->event != NULL;
+    if (!scanout->page_flip) {
+        log_warn("%s cannot watch card0 events, page flips are disabled",
+                 __func__);
+    }
+
+    // Blob resources in contiguous guest memory are scanned out directly
+    uint64_t prime = 0;
+    gdev->zero_copy = drmGetCap(drm_fd, DRM_CAP_PRIME, &prime) == 0 &&
+                      (prime & DRM_PRIME_CAP_IMPORT);
+    return 0;
+}
+
+static void kms_remove_cursor_buffer(GPUScanout *scanout,
+                                     GPUCursorBuffer *buf) {
+    struct drm_mode_destroy_dumb destroy = {0};
+
+    if (buf->addr) {
+        munmap(buf->addr, buf->size);
+    }
+    if (buf->handle) {
+        destroy.handle = buf->handle;
+        drmIoctl(scanout->card0_fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+    }
+    virtio_gpu_cursor_put(buf->cursor);
+    memset(buf, 0, sizeof(*buf));
+}
+
+static void kms_close(GPUScanout *scanout) {
+    for (int i = 0; i < GPU_CURSOR_BUFFERS; ++i) {
+        kms_remove_cursor_buffer(scanout, &scanout->cursor_buffers[i]);
+    }
+    // The event monitor is stopped, no page flip completes any more
+    free(scanout->event);
+    drmModeFreeCrtc(scanout->crtc);
+    drmModeFreeEncoder(scanout->encoder);
+    drmModeFreeConnector(scanout->connector);
+
+    // Release card0_fd
+    if (scanout->card0_fd != -1) {
+        GPUDev *gdev = scanout->vdev->dev;
+        if (gdev->card0_fd == scanout->card0_fd) {
+            gdev->card0_fd = -1;
+        }
+        close(scanout->card0_fd);
+    }
+}
+
+static void kms_remove_buffer(GPUScanout *scanout, GPUFrameBuffer *fb) {
+    if (!fb || !fb->drm_dumb_handle) {
+        log_debug("%s found drm_framebuffer is not created yet", __func__);
+        return;
+    }
+
+    struct drm_mode_destroy_dumb destory = {0};
+    destory.handle = fb->drm_dumb_handle;
+
+    if (fb->fb_id) {
+        drmModeRmFB(scanout->card0_fd, fb->fb_id);
+    }
+    if (fb->fb_addr != NULL) {
+        munmap(fb->fb_addr, fb->drm_dumb_size);
+    }
+    drmIoctl(scanout->card0_fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destory);
+
+    log_debug("%s destoryed drm_framebuffer with id: %d, handle: %d, size: %d",
+              __func__, fb->fb_id, fb->drm_dumb_handle, fb->drm_dumb_size);
+
+    fb->fb_id = 0;
+    fb->fb_addr = NULL;
+    fb->drm_dumb_handle = 0;
+    fb->drm_dumb_size = 0;
+}
+
+static int kms_create_buffer(GPUScanout *scanout, GPUFrameBuffer *fb) {
+    struct drm_mode_create_dumb dumb = {0};
+    struct drm_mode_map_dumb map = {0};
+    dumb.width = fb->width;
+    dumb.height = fb->height;
+    dumb.bpp = gpu_blit_bytes_pp(scanout->pixel_format) * 8;
+    uint32_t fb_id = 0;
+
+    if (drmIoctl(scanout->card0_fd, DRM_IOCTL_MODE_CREATE_DUMB, &dumb) < 0) {
+        log_error("%s failed to create a drm dumb", __func__);
+        return -1;
+    } // Create a dumb object
+
+    // Keep the handle, so that a failure below can free the dumb object
+    fb->drm_dumb_handle = dumb.handle;
+    fb->drm_dumb_size = dumb.size;
+
+    map.handle = dumb.handle;
+    // Bind the video memory to the framebuffer, get the offset based on the
+    // handle
+    if (drmIoctl(scanout->card0_fd, DRM_IOCTL_MODE_MAP_DUMB, &map) < 0) {
+        log_error("%s failed to map a drm dumb", __func__);
+        kms_remove_buffer(scanout, fb);
+        return -1;
+    }
+
+    // XRGB8888 or RGB565
+    if (drmModeAddFB(scanout->card0_fd, dumb.width, dumb.height,
+                     dumb.bpp == 16 ? 16 : 24, dumb.bpp, dumb.pitch,
+                     dumb.handle, &fb_id) < 0) {
+        log_error("%s failed to add a drm_framebuffer to card0", __func__);
+        kms_remove_buffer(scanout, fb);
+        return -1;
+    }
+    fb->fb_id = fb_id;
+
+    ///
+    log_debug("%s create a drm_framebuffer with width: %d, height: %d, "
+              "format: %d, handle: %d, fb_id: %d",
+              __func__, dumb.width, dumb.height, fb->format, dumb.handle,
+              fb_id);
+    ///
+
+    void *vaddr = mmap(0, dumb.size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                       scanout->card0_fd, map.offset);
+
+    if (vaddr == MAP_FAILED) {
+        log_error("%s cannot map drm_framebuffer of scanout", __func__);
+        kms_remove_buffer(scanout, fb);
+        return -1;
+    }
+
+    log_debug("%s map drm_framebuffer to %x with size %d", __func__, vaddr,
+              dumb.size);
+
+    fb->pitch = dumb.pitch;
+    fb->fb_addr = vaddr;
+    return 0;
+}
+
+static void kms_show(GPUScanout *scanout, int index) {
+    drmModeModeInfo mode = scanout->connector->modes[0];
+
+    if (drmModeSetCrtc(scanout->card0_fd, scanout->crtc->crtc_id,
+                       scanout->frame_buffers[index].fb_id, scanout->x,
+                       scanout->y, &scanout->connector->connector_id, 1,
+                       &mode) < 0) {
+        log_error("%s failed to set crtc %d", __func__, scanout->crtc->crtc_id);
+    }
+
+    log_debug("%s flush with card0_fd: %d, crtc_id: %d, fb_id: %d, "
+              "connector_id: %d",
+              __func__, scanout->card0_fd, scanout->crtc->crtc_id,
+              scanout->frame_buffers[index].fb_id,
+              scanout->connector->connector_id);
+}
+
+static int kms_flip(GPUScanout *scanout, int index) {
+    if (drmModePageFlip(scanout->card0_fd, scanout->crtc->crtc_id,
+                        scanout->frame_buffers[index].fb_id,
+                        DRM_MODE_PAGE_FLIP_EVENT, scanout) < 0) {
+        log_warn("%s page flip failed, errno is %d, using modesets instead",
+                 __func__, errno);
+        return -1;
+    }
+    return 0;
+}
+
+static int kms_create_cursor_buffer(GPUScanout *scanout,
+                                    GPUCursorBuffer *buf) {
+    struct drm_mode_create_dumb dumb = {0};
+    struct drm_mode_map_dumb map = {0};
+    void *vaddr = NULL;
+
+    dumb.width = scanout->cursor_width;
+    dumb.height = scanout->cursor_height;
+    dumb.bpp = 32;
+    if (drmIoctl(scanout->card0_fd, DRM_IOCTL_MODE_CREATE_DUMB, &dumb) < 0) {
+        log_error("%s failed to create a drm dumb, errno is %d", __func__,
+                  errno);
+        return -1;
+    }
+    buf->handle = dumb.handle;
+
+    map.handle = dumb.handle;
+    if (drmIoctl(scanout->card0_fd, DRM_IOCTL_MODE_MAP_DUMB, &map) < 0) {
+        log_error("%s failed to map a drm dumb, errno is %d", __func__, errno);
+        kms_remove_cursor_buffer(scanout, buf);
+        return -1;
+    }
+    vaddr = mmap(0, dumb.size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                 scanout->card0_fd, map.offset);
+    if (vaddr == MAP_FAILED) {
+        log_error("%s cannot map a cursor buffer, errno is %d", __func__,
+                  errno);
+        kms_remove_cursor_buffer(scanout, buf);
+        return -1;
+    }
+    // Dumb buffers start transparent, only the image's corner is written
+    buf->addr = vaddr;
+    buf->size = dumb.size;
+    buf->pitch = dumb.pitch;
+    return 0;
+}
+
+// The buffer holding cursor. A cursor shown lately is still in its buffer,
+// others are uploaded into the buffer shown longest ago.
+static GPUCursorBuffer *kms_cursor_buffer(GPUScanout *scanout,
+                                          HvCursor *cursor) {
+    GPUCursorBuffer *buf = NULL, *oldest = &scanout->cursor_buffers[0];
+
+    for (int i = 0; i < GPU_CURSOR_BUFFERS; ++i) {
+        if (scanout->cursor_buffers[i].cursor == cursor) {
+            buf = &scanout->cursor_buffers[i];
+            break;
+        }
+        if (scanout->cursor_buffers[i].used < oldest->used) {
+            oldest = &scanout->cursor_buffers[i];
+        }
+    }
+
+    if (!buf) {
+        buf = oldest;
+        if (!buf->handle && kms_create_cursor_buffer(scanout, buf) < 0) {
+            return NULL;
+        }
+        for (uint32_t y = 0; y < cursor->height; ++y) {
+            memcpy((uint8_t *)buf->addr + (size_t)buf->pitch * y,
+                   &cursor->data[y * cursor->width],
+                   cursor->width * sizeof(uint32_t));
+        }
+        // Referenced, so that another image never takes its address
+        virtio_gpu_cursor_put(buf->cursor);
+        buf->cursor = virtio_gpu_cursor_get(cursor);
+        scanout->cursor_uploads++;
+    }
+    buf->used = ++scanout->cursor_shows;
+    return buf;
+}
+
+static void kms_set_cursor(GPUScanout *scanout, HvCursor *cursor,
+                           uint32_t hot_x, uint32_t hot_y) {
+    GPUCursorBuffer *buf = NULL;
+    uint32_t crtc_id = scanout->crtc->crtc_id;
+
+    if (scanout->cursor_failed) {
+        return;
+    }
+    if (!cursor) {
+        drmModeSetCursor(scanout->card0_fd, crtc_id, 0, 0, 0);
+        return;
+    }
+
+    buf = kms_cursor_buffer(scanout, cursor);
+    if (!buf) {
+        return;
+    }
+    // The hot spot only matters to virtual drivers, others take the position
+    // as the top left corner, as the zone gives it
+    if (drmModeSetCursor2(scanout->card0_fd, crtc_id, buf->handle,
+                          scanout->cursor_width, scanout->cursor_height, hot_x,
+                          hot_y) < 0 &&
+        drmModeSetCursor(scanout->card0_fd, crtc_id, buf->handle,
+                         scanout->cursor_width, scanout->cursor_height) < 0) {
+        log_warn("%s CRTC %d cannot show cursors, errno is %d, the cursor of "
+                 "scanout %d is hidden",
+                 __func__, crtc_id, errno, scanout->id);
+        scanout->cursor_failed = true;
+    }
+}
+
+static void kms_move_cursor(GPUScanout *scanout, int32_t x, int32_t y) {
+    if (!scanout->cursor_failed) {
+        drmModeMoveCursor(scanout->card0_fd, scanout->crtc->crtc_id, x, y);
+    }
+}
+
+const GPUDisplay virtio_gpu_kms_display = {
+    .name = "kms",
+    .init = kms_init,
+    .close = kms_close,
+    .create_buffer = kms_create_buffer,
+    .remove_buffer = kms_remove_buffer,
+    .show = kms_show,
+    .flip = kms_flip,
+    .set_cursor = kms_set_cursor,
+    .move_cursor = kms_move_cursor,
+};
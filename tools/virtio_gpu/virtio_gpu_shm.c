@@ -0,0 +1,207 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/**
+ * Copyright (c) 2025 Syswonder
+ *
+ * Syswonder Website:
+ *      https://www.syswonder.org
+ */
+// The shm display: the buffers of the scanout live in a POSIX shared memory
+// object, which a viewer maps and reads as virtio_gpu_display.h describes.
+// Needs no display hardware, frames are shown at once.
+#include "log.h"
+#include "virtio.h"
+#include "virtio_gpu.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+typedef struct gpu_shm_display {
+    char name[108];
+    int fd;
+    GPUShmHeader *hdr; // Maps the whole object
+    size_t size;
+    size_t page_size;
+} GPUShmDisplay;
+
+#define SHM_ALIGN(x, a) (((x) + (a)-1) & ~((size_t)(a)-1))
+
+static int shm_map(GPUShmDisplay *shm, size_t size) {
+    void *addr;
+
+    if (ftruncate(shm->fd, size) < 0) {
+        log_error("%s failed to resize %s to %zu bytes, errno is %d",
+                  __func__, shm->name, size, errno);
+        return -1;
+    }
+    addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, shm->fd, 0);
+    if (addr == MAP_FAILED) {
+        log_error("%s failed to map %s, errno is %d", __func__, shm->name,
+                  errno);
+        return -1;
+    }
+    if (shm->hdr) {
+        munmap(shm->hdr, shm->size);
+    }
+    shm->hdr = addr;
+    shm->size = size;
+    return 0;
+}
+
+static int shm_init(VirtIODevice *vdev, GPUScanout *scanout) {
+    GPUDev *gdev = vdev->dev;
+    GPUShmDisplay *shm = calloc(1, sizeof(GPUShmDisplay));
+
+    if (!shm) {
+        log_error("%s failed to allocate the display", __func__);
+        return -1;
+    }
+    shm->page_size = sysconf(_SC_PAGESIZE);
+    if (gdev->requested_states[scanout->id].display_path[0]) {
+        strncpy(shm->name, gdev->requested_states[scanout->id].display_path,
+                sizeof(shm->name) - 1);
+    } else if (scanout->id) {
+        snprintf(shm->name, sizeof(shm->name), "/hvisor-gpu-%d-%d",
+                 vdev->zone_id, scanout->id);
+    } else {
+        snprintf(shm->name, sizeof(shm->name), "/hvisor-gpu-%d",
+                 vdev->zone_id);
+    }
+
+    shm->fd = shm_open(shm->name, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (shm->fd < 0) {
+        log_error("%s failed to open %s, errno is %d", __func__, shm->name,
+                  errno);
+        free(shm);
+        return -1;
+    }
+    // The buffers are laid out on the first flush
+    if (ftruncate(shm->fd, 0) < 0 ||
+        shm_map(shm, SHM_ALIGN(sizeof(GPUShmHeader), shm->page_size)) < 0) {
+        close(shm->fd);
+        shm_unlink(shm->name);
+        free(shm);
+        return -1;
+    }
+    shm->hdr->version = GPU_SHM_VERSION;
+    shm->hdr->format = scanout->pixel_format;
+    write_barrier();
+    shm->hdr->magic = GPU_SHM_MAGIC;
+
+    scanout->display_priv = shm;
+    scanout->page_flip = false;
+    log_info("virtio gpu of zone %d shows frames in shared memory %s",
+             vdev->zone_id, shm->name);
+    return 0;
+}
+
+static void shm_close(GPUScanout *scanout) {
+    GPUShmDisplay *shm = scanout->display_priv;
+
+    if (!shm) {
+        return;
+    }
+    munmap(shm->hdr, shm->size);
+    close(shm->fd);
+    shm_unlink(shm->name);
+    free(shm);
+    scanout->display_priv = NULL;
+}
+
+// Lay the buffers out for fb's geometry, while readers see an odd generation
+static int shm_layout(GPUScanout *scanout, GPUFrameBuffer *fb) {
+    GPUShmDisplay *shm = scanout->display_priv;
+    GPUShmHeader *hdr = shm->hdr;
+    uint32_t pitch = SHM_ALIGN(fb->width * gpu_blit_bytes_pp(hdr->format), 64);
+    size_t offset = SHM_ALIGN(sizeof(GPUShmHeader), shm->page_size);
+    size_t buffer_size = SHM_ALIGN((size_t)pitch * fb->height, shm->page_size);
+    size_t size = offset + buffer_size * scanout->fb_num;
+
+    hdr->generation++;
+    write_barrier();
+    if (size > shm->size && shm_map(shm, size) < 0) {
+        shm->hdr->generation++;
+        return -1;
+    }
+    hdr = shm->hdr;
+    hdr->width = fb->width;
+    hdr->height = fb->height;
+    hdr->pitch = pitch;
+    hdr->buffers = scanout->fb_num;
+    for (int i = 0; i < scanout->fb_num; ++i) {
+        hdr->buffer_offset[i] = offset + buffer_size * i;
+    }
+    hdr->damage_head = 0;
+    write_barrier();
+    hdr->generation++;
+
+    log_debug("%s laid out %d buffers of %dx%d in %zu bytes", __func__,
+              scanout->fb_num, fb->width, fb->height, size);
+    return 0;
+}
+
+static int shm_create_buffer(GPUScanout *scanout, GPUFrameBuffer *fb) {
+    GPUShmDisplay *shm = scanout->display_priv;
+    int index = fb - scanout->frame_buffers;
+
+    if (index >= GPU_SHM_MAX_BUFFERS) {
+        log_error("%s found buffer %d out of the shared memory", __func__,
+                  index);
+        return -1;
+    }
+    if (shm->hdr->width != fb->width || shm->hdr->height != fb->height ||
+        shm->hdr->buffers != (uint32_t)scanout->fb_num) {
+        if (shm_layout(scanout, fb) < 0) {
+            return -1;
+        }
+    }
+    fb->pitch = shm->hdr->pitch;
+    fb->fb_addr = (uint8_t *)shm->hdr + shm->hdr->buffer_offset[index];
+    fb->fb_id = index + 1;
+    return 0;
+}
+
+static void shm_remove_buffer(GPUScanout *scanout, GPUFrameBuffer *fb) {
+    (void)scanout;
+    (void)fb;
+    // The memory is kept for the next layout
+}
+
+static void shm_show(GPUScanout *scanout, int index) {
+    GPUShmDisplay *shm = scanout->display_priv;
+    GPUShmHeader *hdr = shm->hdr;
+    uint64_t frame = hdr->frame + 1;
+    struct virtio_gpu_rect *r;
+    GPUShmDamage *d;
+
+    for (uint32_t i = 0; i < scanout->frame_damage.num; ++i) {
+        r = &scanout->frame_damage.rects[i];
+        d = &hdr->damage[hdr->damage_head % GPU_SHM_DAMAGE_RING];
+        d->frame = frame;
+        d->x = r->x;
+        d->y = r->y;
+        d->width = r->width;
+        d->height = r->height;
+        hdr->damage_head++;
+    }
+    hdr->view_x = scanout->x;
+    hdr->view_y = scanout->y;
+    hdr->view_width = scanout->width;
+    hdr->view_height = scanout->height;
+    hdr->front = index;
+    write_barrier();
+    hdr->frame = frame;
+}
+
+const GPUDisplay virtio_gpu_shm_display = {
+    .name = "shm",
+    .init = shm_init,
+    .close = shm_close,
+    .create_buffer = shm_create_buffer,
+    .remove_buffer = shm_remove_buffer,
+    .show = shm_show,
+};
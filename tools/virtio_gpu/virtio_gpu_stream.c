@@ -0,0 +1,564 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/**
+ * Copyright (c) 2025 Syswonder
+ *
+ * Syswonder Website:
+ *      https://www.syswonder.org
+ */
+// The stream display: frames are kept in memory, and their changed tiles are
+// encoded and sent to the clients of a Unix socket, as virtio_gpu_display.h
+// describes. Needs no display hardware, frames are shown at once and encoded
+// by a thread of their own.
+#define _GNU_SOURCE
+#include "log.h"
+#include "virtio.h"
+#include "virtio_gpu.h"
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#ifdef ENABLE_ZLIB
+#include <zlib.h>
+#endif
+
+#define STREAM_TILE_BYTES (GPU_STREAM_TILE * GPU_STREAM_TILE * 4)
+
+typedef struct gpu_stream_display {
+    char path[108];
+    int listen_fd, wake_fd;
+    int clients[GPU_STREAM_MAX_CLIENTS];
+    pthread_t thread;
+    bool closing;
+    GPUPixelFormat format;
+    uint32_t bytes_pp;
+    // The shown view, copied from the buffers by show under lock
+    pthread_mutex_t lock;
+    uint8_t *shadow;
+    uint32_t width, height, pitch;
+    uint32_t tiles_x, tiles_y;
+    uint8_t *dirty;   // Per tile, changed since the last encoding
+    uint64_t *hashes; // Per tile, of the contents last sent
+    bool refresh;     // Send every tile, a client connected
+    uint64_t frame;   // Shown so far
+    uint8_t *out;     // Message being sent
+    size_t out_size;
+    uint8_t *scratch; // A raw tile
+    // Statistics
+    uint64_t frames_sent, tiles_sent, tiles_skipped, bytes_sent, raw_bytes;
+} GPUStreamDisplay;
+
+static void stream_wake(GPUStreamDisplay *stream) {
+    eventfd_write(stream->wake_fd, 1);
+}
+
+// Resize the shadow to the view, with lock held
+static int stream_resize(GPUStreamDisplay *stream, uint32_t width,
+                         uint32_t height) {
+    uint32_t tiles_x = (width + GPU_STREAM_TILE - 1) / GPU_STREAM_TILE;
+    uint32_t tiles_y = (height + GPU_STREAM_TILE - 1) / GPU_STREAM_TILE;
+    uint32_t pitch = width * stream->bytes_pp;
+
+    free(stream->shadow);
+    free(stream->dirty);
+    free(stream->hashes);
+    stream->shadow = malloc((size_t)pitch * height);
+    stream->dirty = calloc(tiles_x * tiles_y, 1);
+    stream->hashes = calloc(tiles_x * tiles_y, sizeof(uint64_t));
+    if (!stream->shadow || !stream->dirty || !stream->hashes) {
+        log_error("%s failed to allocate a %dx%d view", __func__, width,
+                  height);
+        stream->width = stream->height = 0;
+        stream->tiles_x = stream->tiles_y = 0;
+        return -1;
+    }
+    stream->width = width;
+    stream->height = height;
+    stream->pitch = pitch;
+    stream->tiles_x = tiles_x;
+    stream->tiles_y = tiles_y;
+    stream->refresh = true;
+    return 0;
+}
+
+static uint64_t stream_hash(const uint8_t *data, uint32_t pitch,
+                            uint32_t row_bytes, uint32_t rows) {
+    uint64_t h = 0xcbf29ce484222325ULL, word;
+    uint32_t i;
+
+    for (uint32_t y = 0; y < rows; ++y, data += pitch) {
+        for (i = 0; i + 8 <= row_bytes; i += 8) {
+            memcpy(&word, data + i, 8);
+            h = (h ^ word) * 0x100000001b3ULL;
+        }
+        for (; i < row_bytes; ++i) {
+            h = (h ^ data[i]) * 0x100000001b3ULL;
+        }
+    }
+    return h;
+}
+
+// Runs of a uint16_t count and a pixel. Returns the length, or len if the
+// runs take more room than the raw tile.
+static uint32_t stream_rle(uint8_t *dst, const uint8_t *src, uint32_t len,
+                           uint32_t bytes_pp) {
+    uint32_t n = 0, i = 0;
+    uint16_t count;
+
+    while (i < len) {
+        count = 1;
+        while (i + count * bytes_pp < len &&
+               !memcmp(src + i, src + i + count * bytes_pp, bytes_pp)) {
+            count++;
+        }
+        if (n + 2 + bytes_pp > len) {
+            return len;
+        }
+        memcpy(dst + n, &count, 2);
+        memcpy(dst + n + 2, src + i, bytes_pp);
+        n += 2 + bytes_pp;
+        i += count * bytes_pp;
+    }
+    return n;
+}
+
+// Append a tile to out, with lock held
+static int stream_encode_tile(GPUStreamDisplay *stream, size_t *len,
+                              uint32_t tx, uint32_t ty) {
+    GPUStreamTile tile;
+    uint32_t row_bytes, raw_len;
+    const uint8_t *src;
+    uint8_t *data;
+    size_t need;
+
+    tile.x = tx * GPU_STREAM_TILE;
+    tile.y = ty * GPU_STREAM_TILE;
+    tile.width = MIN(GPU_STREAM_TILE, stream->width - tile.x);
+    tile.height = MIN(GPU_STREAM_TILE, stream->height - tile.y);
+    row_bytes = tile.width * stream->bytes_pp;
+    raw_len = row_bytes * tile.height;
+
+    need = *len + sizeof(tile) + raw_len;
+#ifdef ENABLE_ZLIB
+    need += compressBound(raw_len) - raw_len;
+#endif
+    if (need > stream->out_size) {
+        data = realloc(stream->out, need * 2);
+        if (!data) {
+            log_error("%s failed to grow the message", __func__);
+            return -1;
+        }
+        stream->out = data;
+        stream->out_size = need * 2;
+    }
+
+    src = stream->shadow + (size_t)tile.y * stream->pitch +
+          tile.x * stream->bytes_pp;
+    for (uint32_t y = 0; y < tile.height; ++y) {
+        memcpy(stream->scratch + y * row_bytes, src + y * stream->pitch,
+               row_bytes);
+    }
+
+    data = stream->out + *len + sizeof(tile);
+    tile.encoding = GPU_STREAM_RLE;
+    tile.length = stream_rle(data, stream->scratch, raw_len, stream->bytes_pp);
+#ifdef ENABLE_ZLIB
+    // Worth it for the tiles runs don't shrink
+    if (tile.length > raw_len / 4) {
+        uLongf zlen = compressBound(raw_len);
+        if (compress2(data, &zlen, stream->scratch, raw_len, 1) == Z_OK &&
+            zlen < raw_len) {
+            tile.encoding = GPU_STREAM_ZLIB;
+            tile.length = zlen;
+        } else {
+            tile.length = raw_len;
+        }
+    }
+#endif
+    if (tile.length >= raw_len) {
+        tile.encoding = GPU_STREAM_RAW;
+        tile.length = raw_len;
+        memcpy(data, stream->scratch, raw_len);
+    }
+    memcpy(stream->out + *len, &tile, sizeof(tile));
+    *len += sizeof(tile) + tile.length;
+    stream->raw_bytes += raw_len;
+    return 0;
+}
+
+// Encode the changed tiles into out, with lock held. Returns the length of
+// the message, 0 if nothing changed.
+static size_t stream_encode(GPUStreamDisplay *stream) {
+    GPUStreamFrame frame = {
+        .magic = GPU_STREAM_MAGIC,
+        .format = stream->format,
+        .width = stream->width,
+        .height = stream->height,
+        .frame = stream->frame,
+    };
+    size_t len = sizeof(frame);
+    uint32_t tx, ty, i;
+    const uint8_t *src;
+    uint64_t h;
+
+    if (stream->out_size < len) {
+        stream->out = realloc(stream->out, STREAM_TILE_BYTES);
+        stream->out_size = stream->out ? STREAM_TILE_BYTES : 0;
+        if (!stream->out) {
+            return 0;
+        }
+    }
+    for (ty = 0; ty < stream->tiles_y; ++ty) {
+        for (tx = 0; tx < stream->tiles_x; ++tx) {
+            i = ty * stream->tiles_x + tx;
+            if (!stream->dirty[i] && !stream->refresh) {
+                continue;
+            }
+            stream->dirty[i] = 0;
+            // Guests redraw more than they change
+            src = stream->shadow +
+                  (size_t)ty * GPU_STREAM_TILE * stream->pitch +
+                  tx * GPU_STREAM_TILE * stream->bytes_pp;
+            h = stream_hash(
+                src, stream->pitch,
+                MIN(GPU_STREAM_TILE, stream->width - tx * GPU_STREAM_TILE) *
+                    stream->bytes_pp,
+                MIN(GPU_STREAM_TILE, stream->height - ty * GPU_STREAM_TILE));
+            if (h == stream->hashes[i] && !stream->refresh) {
+                stream->tiles_skipped++;
+                continue;
+            }
+            if (stream_encode_tile(stream, &len, tx, ty) < 0) {
+                // Sent again with the next frame
+                stream->refresh = true;
+                return 0;
+            }
+            stream->hashes[i] = h;
+            frame.tiles++;
+        }
+    }
+    stream->refresh = false;
+    if (!frame.tiles) {
+        return 0;
+    }
+    memcpy(stream->out, &frame, sizeof(frame));
+    stream->frames_sent++;
+    stream->tiles_sent += frame.tiles;
+    return len;
+}
+
+static void stream_accept(GPUStreamDisplay *stream) {
+    struct timeval timeout = {.tv_sec = 1};
+    int fd = accept4(stream->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+
+    if (fd < 0) {
+        return;
+    }
+    for (int i = 0; i < GPU_STREAM_MAX_CLIENTS; ++i) {
+        if (stream->clients[i] < 0) {
+            // A client that stops reading is dropped
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+                       sizeof(timeout));
+            stream->clients[i] = fd;
+            pthread_mutex_lock(&stream->lock);
+            stream->refresh = true;
+            pthread_mutex_unlock(&stream->lock);
+            log_info("virtio gpu stream %s got client %d", stream->path, i);
+            return;
+        }
+    }
+    log_warn("virtio gpu stream %s has too many clients", stream->path);
+    close(fd);
+}
+
+static void stream_drop(GPUStreamDisplay *stream, int i) {
+    log_info("virtio gpu stream %s lost client %d", stream->path, i);
+    close(stream->clients[i]);
+    stream->clients[i] = -1;
+}
+
+static void stream_send(GPUStreamDisplay *stream, size_t len) {
+    ssize_t n;
+
+    for (int i = 0; i < GPU_STREAM_MAX_CLIENTS; ++i) {
+        if (stream->clients[i] < 0) {
+            continue;
+        }
+        for (size_t sent = 0; sent < len; sent += n) {
+            n = send(stream->clients[i], stream->out + sent, len - sent,
+                     MSG_NOSIGNAL);
+            if (n <= 0) {
+                if (n < 0 && errno == EINTR) {
+                    n = 0;
+                    continue;
+                }
+                stream_drop(stream, i);
+                break;
+            }
+        }
+        if (stream->clients[i] >= 0) {
+            stream->bytes_sent += len;
+        }
+    }
+}
+
+/// Encodes the frames shown since the last time, while clients are
+/// connected. Frames shown during a send are merged into the next one.
+static void *stream_thread(void *param) {
+    GPUStreamDisplay *stream = param;
+    struct pollfd fds[2 + GPU_STREAM_MAX_CLIENTS];
+    int client_of[2 + GPU_STREAM_MAX_CLIENTS];
+    bool clients;
+    eventfd_t cnt;
+    size_t len;
+    char buf[64];
+    int nfds;
+
+    while (!stream->closing) {
+        nfds = 0;
+        fds[nfds].fd = stream->wake_fd;
+        fds[nfds].events = POLLIN;
+        client_of[nfds++] = -1;
+        fds[nfds].fd = stream->listen_fd;
+        fds[nfds].events = POLLIN;
+        client_of[nfds++] = -1;
+        for (int i = 0; i < GPU_STREAM_MAX_CLIENTS; ++i) {
+            if (stream->clients[i] < 0) {
+                continue;
+            }
+            fds[nfds].fd = stream->clients[i];
+            fds[nfds].events = POLLIN;
+            client_of[nfds++] = i;
+        }
+        if (poll(fds, nfds, -1) < 0) {
+            if (errno != EINTR) {
+                log_error("virtio gpu stream poll failed, errno is %d", errno);
+            }
+            continue;
+        }
+        for (int i = 0; i < nfds; ++i) {
+            if (fds[i].revents == 0) {
+                continue;
+            }
+            if (fds[i].fd == stream->wake_fd) {
+                eventfd_read(stream->wake_fd, &cnt);
+            } else if (fds[i].fd == stream->listen_fd) {
+                stream_accept(stream);
+            } else if (recv(fds[i].fd, buf, sizeof(buf), MSG_DONTWAIT) <= 0) {
+                // Clients send nothing, this is a hang up
+                stream_drop(stream, client_of[i]);
+            }
+        }
+
+        clients = false;
+        for (int i = 0; i < GPU_STREAM_MAX_CLIENTS; ++i) {
+            clients |= stream->clients[i] >= 0;
+        }
+        pthread_mutex_lock(&stream->lock);
+        len = clients ? stream_encode(stream) : 0;
+        pthread_mutex_unlock(&stream->lock);
+        // out is only touched by this thread
+        if (len) {
+            stream_send(stream, len);
+        }
+    }
+    return NULL;
+}
+
+static int stream_listen(GPUStreamDisplay *stream) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+
+    // path is no longer than sun_path
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", stream->path);
+    unlink(stream->path);
+    stream->listen_fd =
+        socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (stream->listen_fd < 0 ||
+        bind(stream->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(stream->listen_fd, GPU_STREAM_MAX_CLIENTS) < 0) {
+        log_error("%s failed to listen on %s, errno is %d", __func__,
+                  stream->path, errno);
+        return -1;
+    }
+    return 0;
+}
+
+static void stream_close(GPUScanout *scanout) {
+    GPUStreamDisplay *stream = scanout->display_priv;
+
+    if (!stream) {
+        return;
+    }
+    if (stream->thread) {
+        stream->closing = true;
+        stream_wake(stream);
+        pthread_join(stream->thread, NULL);
+    }
+    for (int i = 0; i < GPU_STREAM_MAX_CLIENTS; ++i) {
+        if (stream->clients[i] >= 0) {
+            close(stream->clients[i]);
+        }
+    }
+    if (stream->listen_fd >= 0) {
+        close(stream->listen_fd);
+        unlink(stream->path);
+    }
+    if (stream->wake_fd >= 0) {
+        close(stream->wake_fd);
+    }
+    pthread_mutex_destroy(&stream->lock);
+    free(stream->shadow);
+    free(stream->dirty);
+    free(stream->hashes);
+    free(stream->out);
+    free(stream->scratch);
+    free(stream);
+    scanout->display_priv = NULL;
+}
+
+static int stream_init(VirtIODevice *vdev, GPUScanout *scanout) {
+    GPUDev *gdev = vdev->dev;
+    GPUStreamDisplay *stream = calloc(1, sizeof(GPUStreamDisplay));
+
+    if (!stream) {
+        log_error("%s failed to allocate the display", __func__);
+        return -1;
+    }
+    stream->listen_fd = -1;
+    for (int i = 0; i < GPU_STREAM_MAX_CLIENTS; ++i) {
+        stream->clients[i] = -1;
+    }
+    pthread_mutex_init(&stream->lock, NULL);
+    stream->format = scanout->pixel_format;
+    stream->bytes_pp = gpu_blit_bytes_pp(scanout->pixel_format);
+    if (gdev->requested_states[scanout->id].display_path[0]) {
+        // display_path is no longer than path
+        snprintf(stream->path, sizeof(stream->path), "%s",
+                 gdev->requested_states[scanout->id].display_path);
+    } else if (scanout->id) {
+        snprintf(stream->path, sizeof(stream->path),
+                 "/tmp/hvisor-gpu-%d-%d.sock", vdev->zone_id, scanout->id);
+    } else {
+        snprintf(stream->path, sizeof(stream->path),
+                 "/tmp/hvisor-gpu-%d.sock", vdev->zone_id);
+    }
+    scanout->display_priv = stream;
+
+    stream->scratch = malloc(STREAM_TILE_BYTES);
+    stream->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (!stream->scratch || stream->wake_fd < 0) {
+        log_error("%s failed to create the encoder, errno is %d", __func__,
+                  errno);
+        stream_close(scanout);
+        return -1;
+    }
+    if (stream_listen(stream) < 0 ||
+        pthread_create(&stream->thread, NULL, stream_thread, stream)) {
+        stream_close(scanout);
+        return -1;
+    }
+
+    scanout->page_flip = false;
+    log_info("virtio gpu of zone %d streams frames to %s", vdev->zone_id,
+             stream->path);
+    return 0;
+}
+
+static int stream_create_buffer(GPUScanout *scanout, GPUFrameBuffer *fb) {
+    GPUStreamDisplay *stream = scanout->display_priv;
+    uint32_t pitch = (fb->width * stream->bytes_pp + 63) & ~63;
+    void *addr = NULL;
+
+    if (posix_memalign(&addr, 64, (size_t)pitch * fb->height)) {
+        log_error("%s failed to allocate a %dx%d buffer", __func__, fb->width,
+                  fb->height);
+        return -1;
+    }
+    fb->pitch = pitch;
+    fb->fb_addr = addr;
+    fb->fb_id = fb - scanout->frame_buffers + 1;
+    return 0;
+}
+
+static void stream_remove_buffer(GPUScanout *scanout, GPUFrameBuffer *fb) {
+    (void)scanout;
+    free(fb->fb_addr);
+    fb->fb_addr = NULL;
+}
+
+// Copy r of fb into the shadow and mark its tiles, with lock held
+static void stream_copy(GPUStreamDisplay *stream, GPUScanout *scanout,
+                        GPUFrameBuffer *fb, struct virtio_gpu_rect r) {
+    const uint8_t *src = (uint8_t *)fb->fb_addr + (size_t)r.y * fb->pitch +
+                         r.x * stream->bytes_pp;
+
+    r.x -= scanout->x;
+    r.y -= scanout->y;
+    for (uint32_t y = 0; y < r.height; ++y) {
+        memcpy(stream->shadow + (size_t)(r.y + y) * stream->pitch +
+                   r.x * stream->bytes_pp,
+               src + (size_t)y * fb->pitch, r.width * stream->bytes_pp);
+    }
+    for (uint32_t ty = r.y / GPU_STREAM_TILE;
+         ty <= (r.y + r.height - 1) / GPU_STREAM_TILE; ++ty) {
+        for (uint32_t tx = r.x / GPU_STREAM_TILE;
+             tx <= (r.x + r.width - 1) / GPU_STREAM_TILE; ++tx) {
+            stream->dirty[ty * stream->tiles_x + tx] = 1;
+        }
+    }
+}
+
+static void stream_show(GPUScanout *scanout, int index) {
+    GPUStreamDisplay *stream = scanout->display_priv;
+    GPUFrameBuffer *fb = &scanout->frame_buffers[index];
+    struct virtio_gpu_rect view = {scanout->x, scanout->y, scanout->width,
+                                   scanout->height};
+    struct virtio_gpu_rect r;
+
+    if (!view.width || !view.height) {
+        return;
+    }
+    pthread_mutex_lock(&stream->lock);
+    if (stream->width != view.width || stream->height != view.height) {
+        // A new view is copied whole
+        if (stream_resize(stream, view.width, view.height) == 0) {
+            stream_copy(stream, scanout, fb, view);
+        }
+    } else {
+        for (uint32_t i = 0; i < scanout->frame_damage.num; ++i) {
+            r = scanout->frame_damage.rects[i];
+            if (virtio_gpu_rect_clip(&r, &view)) {
+                stream_copy(stream, scanout, fb, r);
+            }
+        }
+    }
+    stream->frame++;
+    pthread_mutex_unlock(&stream->lock);
+    stream_wake(stream);
+}
+
+static void stream_stats(GPUScanout *scanout) {
+    GPUStreamDisplay *stream = scanout->display_priv;
+
+    pthread_mutex_lock(&stream->lock);
+    log_warn("virtio gpu stream %s: %llu frames sent, %llu tiles sent, %llu "
+             "tiles unchanged, %llu bytes sent for %llu raw bytes",
+             stream->path, stream->frames_sent, stream->tiles_sent,
+             stream->tiles_skipped, stream->bytes_sent, stream->raw_bytes);
+    pthread_mutex_unlock(&stream->lock);
+}
+
+const GPUDisplay virtio_gpu_stream_display = {
+    .name = "stream",
+    .init = stream_init,
+    .close = stream_close,
+    .create_buffer = stream_create_buffer,
+    .remove_buffer = stream_remove_buffer,
+    .show = stream_show,
+    .stats = stream_stats,
+};
@@ -0,0 +1,565 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/**
+ * Copyright (c) 2025 Syswonder
+ *
+ * Syswonder Website:
+ *      https://www.syswonder.org
+ */
+// 3D commands of virtio-gpu, rendered by virglrenderer. It runs on a
+// surfaceless EGL context, which Mesa backs with llvmpipe, so the OpenGL of
+// the zone is rasterised by the cores of Root Linux and needs no GPU.
+// virglrenderer is a single instance whose context is current on the
+// processing thread, every call to it is made there.
+#ifdef ENABLE_VIRGL
+#include "event_monitor.h"
+#include "log.h"
+#include "sys/queue.h"
+#include "virtio.h"
+#include "virtio_gpu.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include <virgl/virglrenderer.h>
+
+// Target of buffers in gallium's enum pipe_texture_target, their width is
+// in bytes
+#define VIRGL_PIPE_BUFFER 0
+
+// How often the renderer is polled for fences when it has no fd for them
+#define VIRGL_POLL_NS 1000000
+
+// The device using the renderer
+static VirtIODevice *virgl_vdev;
+static pthread_mutex_t virgl_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// The renderer passed fence, so the fenced requests up to it are answered
+static void virgl_write_fence(void *cookie, uint32_t fence) {
+    VirtIODevice *vdev = cookie;
+    GPUDev *gdev = vdev->dev;
+    GPUCommand *gcmd = NULL;
+
+again:
+    TAILQ_FOREACH(gcmd, &gdev->fence_cmds, fence_next) {
+        if (!gcmd->rendering ||
+            (uint32_t)gcmd->control_header.fence_id > fence) {
+            continue;
+        }
+        gcmd->rendering = false;
+        gdev->virgl_fences--;
+        gdev->virgl_answered++;
+        virtio_gpu_ctrl_response_nodata(vdev, gcmd, VIRTIO_GPU_RESP_OK_NODATA);
+        if (!gcmd->held) {
+            free(gcmd->resp_iov);
+            free(gcmd);
+        }
+        // The requests held for this one may have been freed
+        goto again;
+    }
+}
+
+static struct virgl_renderer_callbacks virgl_callbacks = {
+    .version = 1,
+    .write_fence = virgl_write_fence,
+};
+
+// The fd of the renderer is readable once it passed a fence
+static void virgl_fence_event(int fd, int epoll_type, void *param) {
+    (void)fd;
+    (void)epoll_type;
+    virtio_gpu_kick_handler(((VirtIODevice *)param)->dev);
+}
+
+void virtio_gpu_virgl_init(VirtIODevice *vdev) {
+    GPUDev *gdev = vdev->dev;
+    uint32_t max_ver = 0, max_size = 0;
+    bool started = false;
+
+    if (!gdev->virgl_requested) {
+        return;
+    }
+
+    pthread_mutex_lock(&virgl_lock);
+    if (virgl_vdev) {
+        log_error("%s found zone %d uses virgl already, zone %d gets no 3D",
+                  __func__, virgl_vdev->zone_id, vdev->zone_id);
+    } else if (virgl_renderer_init(vdev,
+                                   VIRGL_RENDERER_USE_EGL |
+                                       VIRGL_RENDERER_USE_SURFACELESS |
+                                       VIRGL_RENDERER_THREAD_SYNC,
+                                   &virgl_callbacks) != 0) {
+        log_error("%s failed to start virglrenderer, zone %d gets no 3D",
+                  __func__, vdev->zone_id);
+    } else {
+        virgl_vdev = vdev;
+        started = true;
+    }
+    pthread_mutex_unlock(&virgl_lock);
+
+    if (started) {
+        // Without the fd, fences are polled while requests wait for them
+        gdev->virgl_poll_fd = virgl_renderer_get_poll_fd();
+        if (gdev->virgl_poll_fd >= 0) {
+            gdev->virgl_event = add_event(gdev->virgl_poll_fd,
+                                          EPOLLIN | EPOLLET, virgl_fence_event,
+                                          vdev);
+            if (!gdev->virgl_event) {
+                gdev->virgl_poll_fd = -1;
+            }
+        }
+        // VIRGL2 describes the newer hosts, and comes second
+        virgl_renderer_get_cap_set(VIRTIO_GPU_CAPSET_VIRGL2, &max_ver,
+                                   &max_size);
+        gdev->config.num_capsets = max_ver ? 2 : 1;
+        log_info("virtio gpu of zone %d renders 3D with virglrenderer, %d "
+                 "capsets, fences %s",
+                 vdev->zone_id, gdev->config.num_capsets,
+                 gdev->virgl_poll_fd >= 0 ? "signalled" : "polled");
+    }
+
+    pthread_mutex_lock(&gdev->queue_mutex);
+    gdev->virgl = started;
+    gdev->virgl_started = true;
+    pthread_cond_broadcast(&gdev->gpu_cond);
+    pthread_mutex_unlock(&gdev->queue_mutex);
+}
+
+void virtio_gpu_virgl_close(VirtIODevice *vdev) {
+    GPUDev *gdev = vdev->dev;
+
+    if (!gdev->virgl) {
+        return;
+    }
+    // The event monitor is stopped, the fd isn't watched any more
+    free(gdev->virgl_event);
+    gdev->virgl_event = NULL;
+    virgl_renderer_cleanup(vdev);
+    gdev->virgl = false;
+
+    pthread_mutex_lock(&virgl_lock);
+    virgl_vdev = NULL;
+    pthread_mutex_unlock(&virgl_lock);
+}
+
+static void virgl_ctx_create(GPUCommand *gcmd) {
+    struct virtio_gpu_ctx_create ctx_create;
+
+    VIRTIO_GPU_FILL_CMD(gcmd->resp_iov, gcmd->resp_iov_cnt, ctx_create);
+
+    if (virgl_renderer_context_create(
+            ctx_create.hdr.ctx_id,
+            MIN(ctx_create.nlen, sizeof(ctx_create.debug_name)),
+            ctx_create.debug_name) != 0) {
+        log_error("%s cannot create context %d", __func__,
+                  ctx_create.hdr.ctx_id);
+        gcmd->error = VIRTIO_GPU_RESP_ERR_INVALID_CONTEXT_ID;
+    }
+}
+
+static void virgl_ctx_resource(VirtIODevice *vdev, GPUCommand *gcmd,
+                               bool attach) {
+    struct virtio_gpu_ctx_resource ctx_resource;
+
+    VIRTIO_GPU_FILL_CMD(gcmd->resp_iov, gcmd->resp_iov_cnt, ctx_resource);
+
+    if (!virtio_gpu_find_resource(vdev->dev, ctx_resource.resource_id)) {
+        log_error("%s cannot find resource %d", __func__,
+                  ctx_resource.resource_id);
+        gcmd->error = VIRTIO_GPU_RESP_ERR_INVALID_RESOURCE_ID;
+        return;
+    }
+    if (attach) {
+        virgl_renderer_ctx_attach_resource(ctx_resource.hdr.ctx_id,
+                                           ctx_resource.resource_id);
+    } else {
+        virgl_renderer_ctx_detach_resource(ctx_resource.hdr.ctx_id,
+                                           ctx_resource.resource_id);
+    }
+}
+
+static void virgl_resource_create_3d(VirtIODevice *vdev, GPUCommand *gcmd) {
+    GPUDev *gdev = vdev->dev;
+    GPUSimpleResource *res = NULL;
+    struct virtio_gpu_resource_create_3d create_3d;
+    struct virgl_renderer_resource_create_args args;
+    uint64_t size = 0;
+
+    VIRTIO_GPU_FILL_CMD(gcmd->resp_iov, gcmd->resp_iov_cnt, create_3d);
+
+    if (create_3d.resource_id == 0) {
+        log_error("%s trying to create 3d resource with id 0", __func__);
+        gcmd->error = VIRTIO_GPU_RESP_ERR_INVALID_RESOURCE_ID;
+        return;
+    }
+
+    if (virtio_gpu_find_resource(gdev, create_3d.resource_id)) {
+        log_error("%s trying to create an existing resource with id %d",
+                  __func__, create_3d.resource_id);
+        gcmd->error = VIRTIO_GPU_RESP_ERR_INVALID_RESOURCE_ID;
+        return;
+    }
+
+    // The renderer's memory is counted in the budget of the zone, textures
+    // at 4 bytes per texel
+    size = (uint64_t)create_3d.width * MAX(create_3d.height, 1) *
+           MAX(create_3d.depth, 1) * MAX(create_3d.array_size, 1);
+    if (create_3d.target != VIRGL_PIPE_BUFFER) {
+        size *= 4;
+    }
+    if (!virtio_gpu_admit_resource(vdev, create_3d.resource_id, size)) {
+        gcmd->error = VIRTIO_GPU_RESP_ERR_OUT_OF_MEMORY;
+        return;
+    }
+
+    res = calloc(1, sizeof(GPUSimpleResource));
+    if (!res) {
+        log_error("%s cannot allocate resource %d", __func__,
+                  create_3d.resource_id);
+        gdev->alloc_failures++;
+        gcmd->error = VIRTIO_GPU_RESP_ERR_OUT_OF_MEMORY;
+        return;
+    }
+
+    args.handle = create_3d.resource_id;
+    args.target = create_3d.target;
+    args.format = create_3d.format;
+    args.bind = create_3d.bind;
+    args.width = create_3d.width;
+    args.height = create_3d.height;
+    args.depth = create_3d.depth;
+    args.array_size = create_3d.array_size;
+    args.last_level = create_3d.last_level;
+    args.nr_samples = create_3d.nr_samples;
+    args.flags = create_3d.flags;
+    if (virgl_renderer_resource_create(&args, NULL, 0) != 0) {
+        log_error("%s cannot create resource %d, target %d, format %d, %dx%d",
+                  __func__, create_3d.resource_id, create_3d.target,
+                  create_3d.format, create_3d.width, create_3d.height);
+        free(res);
+        gcmd->error = VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER;
+        return;
+    }
+
+    // Formats of 3D resources match virtio_gpu_formats, those of scanouts
+    // are converted when they are copied
+    res->resource_id = create_3d.resource_id;
+    res->width = create_3d.width;
+    res->height = create_3d.height;
+    res->format = create_3d.format;
+    res->hostmem = size;
+    res->stride = calc_image_hostmem(32, create_3d.width, 1);
+    res->dmabuf_fd = -1;
+    res->virgl = true;
+    virtio_gpu_add_resource(gdev, res);
+
+    log_debug("add a 3d resource %d to gpu dev of zone %d, target %d, "
+              "format %d, %dx%dx%d",
+              res->resource_id, vdev->zone_id, create_3d.target,
+              create_3d.format, create_3d.width, create_3d.height,
+              create_3d.depth);
+}
+
+static void virgl_transfer_3d(GPUCommand *gcmd, bool to_host) {
+    struct virtio_gpu_transfer_host_3d transfer_3d;
+    struct virgl_box box;
+    int ret = 0;
+
+    VIRTIO_GPU_FILL_CMD(gcmd->resp_iov, gcmd->resp_iov_cnt, transfer_3d);
+
+    box.x = transfer_3d.box.x;
+    box.y = transfer_3d.box.y;
+    box.z = transfer_3d.box.z;
+    box.w = transfer_3d.box.w;
+    box.h = transfer_3d.box.h;
+    box.d = transfer_3d.box.d;
+
+    // Between the renderer and the backing of the resource
+    if (to_host) {
+        ret = virgl_renderer_transfer_write_iov(
+            transfer_3d.resource_id, transfer_3d.hdr.ctx_id, transfer_3d.level,
+            transfer_3d.stride, transfer_3d.layer_stride, &box,
+            transfer_3d.offset, NULL, 0);
+    } else {
+        ret = virgl_renderer_transfer_read_iov(
+            transfer_3d.resource_id, transfer_3d.hdr.ctx_id, transfer_3d.level,
+            transfer_3d.stride, transfer_3d.layer_stride, &box,
+            transfer_3d.offset, NULL, 0);
+    }
+    if (ret != 0) {
+        log_error("%s failed to transfer resource %d %s the host, error %d",
+                  __func__, transfer_3d.resource_id, to_host ? "to" : "from",
+                  ret);
+        gcmd->error = VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER;
+    }
+}
+
+static void virgl_submit_3d(VirtIODevice *vdev, GPUCommand *gcmd) {
+    GPUDev *gdev = vdev->dev;
+    struct virtio_gpu_cmd_submit submit;
+    size_t request = 0;
+    void *buf = NULL;
+
+    VIRTIO_GPU_FILL_CMD(gcmd->resp_iov, gcmd->resp_iov_cnt, submit);
+
+    // The commands follow the header in the readable descriptors
+    for (unsigned int i = 0; i < gcmd->req_iov_cnt; ++i) {
+        request += gcmd->resp_iov[i].iov_len;
+    }
+    if (submit.size % 4 || request < sizeof(submit) ||
+        submit.size > request - sizeof(submit)) {
+        log_error("%s found %d bytes of commands in a request of %zu bytes",
+                  __func__, submit.size, request);
+        gcmd->error = VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER;
+        return;
+    }
+
+    // Copied, so that the zone can't change them while they are decoded
+    buf = malloc(submit.size);
+    if (!buf) {
+        log_error("%s cannot allocate %d bytes of commands", __func__,
+                  submit.size);
+        gcmd->error = VIRTIO_GPU_RESP_ERR_OUT_OF_MEMORY;
+        return;
+    }
+    iov_to_buf(gcmd->resp_iov, gcmd->resp_iov_cnt, sizeof(submit), buf,
+               submit.size);
+
+    if (virgl_renderer_submit_cmd(buf, submit.hdr.ctx_id, submit.size / 4) !=
+        0) {
+        log_error("%s found bad commands of %d bytes in context %d", __func__,
+                  submit.size, submit.hdr.ctx_id);
+        gcmd->error = VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER;
+    }
+    gdev->virgl_submits++;
+    gdev->virgl_submit_bytes += submit.size;
+    free(buf);
+}
+
+static void virgl_get_capset_info(VirtIODevice *vdev, GPUCommand *gcmd) {
+    GPUDev *gdev = vdev->dev;
+    struct virtio_gpu_get_capset_info get_info;
+    struct virtio_gpu_resp_capset_info info;
+
+    VIRTIO_GPU_FILL_CMD(gcmd->resp_iov, gcmd->resp_iov_cnt, get_info);
+
+    memset(&info, 0, sizeof(info));
+    info.hdr.type = VIRTIO_GPU_RESP_OK_CAPSET_INFO;
+    if (get_info.capset_index < gdev->config.num_capsets) {
+        info.capset_id = get_info.capset_index == 0
+                             ? VIRTIO_GPU_CAPSET_VIRGL
+                             : VIRTIO_GPU_CAPSET_VIRGL2;
+        virgl_renderer_get_cap_set(info.capset_id, &info.capset_max_version,
+                                   &info.capset_max_size);
+    }
+    virtio_gpu_ctrl_response(vdev, gcmd, &info.hdr, sizeof(info));
+}
+
+static void virgl_get_capset(VirtIODevice *vdev, GPUCommand *gcmd) {
+    struct virtio_gpu_get_capset get_capset;
+    struct virtio_gpu_resp_capset *capset = NULL;
+    uint32_t max_ver = 0, max_size = 0;
+
+    VIRTIO_GPU_FILL_CMD(gcmd->resp_iov, gcmd->resp_iov_cnt, get_capset);
+
+    virgl_renderer_get_cap_set(get_capset.capset_id, &max_ver, &max_size);
+    if (max_size == 0 || get_capset.capset_version > max_ver) {
+        log_error("%s found no capset %d of version %d", __func__,
+                  get_capset.capset_id, get_capset.capset_version);
+        gcmd->error = VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER;
+        return;
+    }
+
+    capset = calloc(1, sizeof(*capset) + max_size);
+    if (!capset) {
+        gcmd->error = VIRTIO_GPU_RESP_ERR_OUT_OF_MEMORY;
+        return;
+    }
+    capset->hdr.type = VIRTIO_GPU_RESP_OK_CAPSET;
+    virgl_renderer_fill_caps(get_capset.capset_id, get_capset.capset_version,
+                             capset->capset_data);
+    virtio_gpu_ctrl_response(vdev, gcmd, &capset->hdr,
+                             sizeof(*capset) + max_size);
+    free(capset);
+}
+
+void virtio_gpu_virgl_process_cmd(VirtIODevice *vdev, GPUCommand *gcmd) {
+    log_debug("entering %s", __func__);
+
+    GPUDev *gdev = vdev->dev;
+
+    if (!gdev->virgl ||
+        !(vdev->regs.drv_feature & (1ULL << VIRTIO_GPU_F_VIRGL))) {
+        log_error("%s found 3d commands are not negotiated", __func__);
+        gcmd->error = VIRTIO_GPU_RESP_ERR_UNSPEC;
+        return;
+    }
+
+    switch (gcmd->control_header.type) {
+    case VIRTIO_GPU_CMD_CTX_CREATE:
+        virgl_ctx_create(gcmd);
+        break;
+    case VIRTIO_GPU_CMD_CTX_DESTROY:
+        virgl_renderer_context_destroy(gcmd->control_header.ctx_id);
+        break;
+    case VIRTIO_GPU_CMD_CTX_ATTACH_RESOURCE:
+        virgl_ctx_resource(vdev, gcmd, true);
+        break;
+    case VIRTIO_GPU_CMD_CTX_DETACH_RESOURCE:
+        virgl_ctx_resource(vdev, gcmd, false);
+        break;
+    case VIRTIO_GPU_CMD_RESOURCE_CREATE_3D:
+        virgl_resource_create_3d(vdev, gcmd);
+        break;
+    case VIRTIO_GPU_CMD_TRANSFER_TO_HOST_3D:
+        virgl_transfer_3d(gcmd, true);
+        break;
+    case VIRTIO_GPU_CMD_TRANSFER_FROM_HOST_3D:
+        virgl_transfer_3d(gcmd, false);
+        break;
+    case VIRTIO_GPU_CMD_SUBMIT_3D:
+        virgl_submit_3d(vdev, gcmd);
+        break;
+    case VIRTIO_GPU_CMD_GET_CAPSET_INFO:
+        virgl_get_capset_info(vdev, gcmd);
+        break;
+    case VIRTIO_GPU_CMD_GET_CAPSET:
+        virgl_get_capset(vdev, gcmd);
+        break;
+    default:
+        gcmd->error = VIRTIO_GPU_RESP_ERR_UNSPEC;
+        break;
+    }
+}
+
+void virtio_gpu_virgl_fence(VirtIODevice *vdev, GPUCommand *gcmd) {
+    GPUDev *gdev = vdev->dev;
+
+    if (virgl_renderer_create_fence(gcmd->control_header.fence_id,
+                                    gcmd->control_header.ctx_id) != 0) {
+        log_error("%s cannot create fence %llu, answering at once", __func__,
+                  gcmd->control_header.fence_id);
+        return;
+    }
+    gcmd->rendering = true;
+    gcmd->deferred = true;
+    gdev->virgl_fences++;
+}
+
+int virtio_gpu_virgl_poll(VirtIODevice *vdev) {
+    GPUDev *gdev = vdev->dev;
+
+    if (!gdev->virgl || !gdev->virgl_fences) {
+        return 0;
+    }
+    gdev->virgl_answered = 0;
+    virgl_renderer_poll();
+    return gdev->virgl_answered;
+}
+
+void virtio_gpu_virgl_wait(GPUDev *gdev) {
+    struct timespec ts;
+
+    if (!gdev->virgl_fences || gdev->virgl_poll_fd >= 0) {
+        pthread_cond_wait(&gdev->gpu_cond, &gdev->queue_mutex);
+        return;
+    }
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += VIRGL_POLL_NS;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&gdev->gpu_cond, &gdev->queue_mutex, &ts);
+}
+
+void virtio_gpu_virgl_attach(GPUDev *gdev, GPUSimpleResource *res,
+                             uint32_t *error) {
+    if (!gdev->virgl) {
+        return;
+    }
+    if (virgl_renderer_resource_attach_iov(res->resource_id, res->iov,
+                                           res->iov_cnt) != 0) {
+        log_error("%s cannot give resource %d its backing", __func__,
+                  res->resource_id);
+        free(res->iov);
+        res->iov = NULL;
+        res->iov_cnt = 0;
+        *error = VIRTIO_GPU_RESP_ERR_UNSPEC;
+    }
+}
+
+void virtio_gpu_virgl_detach(GPUDev *gdev, GPUSimpleResource *res) {
+    if (gdev->virgl && res->iov) {
+        virgl_renderer_resource_detach_iov(res->resource_id, NULL, NULL);
+    }
+}
+
+void virtio_gpu_virgl_unref(GPUDev *gdev, GPUSimpleResource *res) {
+    if (gdev->virgl) {
+        virgl_renderer_resource_unref(res->resource_id);
+    }
+}
+
+void virtio_gpu_virgl_transfer_2d(
+    GPUSimpleResource *res, struct virtio_gpu_transfer_to_host_2d *transfer_2d,
+    uint32_t *error) {
+    struct virgl_box box = {
+        .x = transfer_2d->r.x,
+        .y = transfer_2d->r.y,
+        .w = transfer_2d->r.width,
+        .h = transfer_2d->r.height,
+        .d = 1,
+    };
+
+    if (virgl_renderer_transfer_write_iov(res->resource_id, 0, 0, 0, 0, &box,
+                                          transfer_2d->offset, NULL, 0) != 0) {
+        log_error("%s failed to transfer (%d, %d) + %d, %d to resource %d",
+                  __func__, box.x, box.y, box.w, box.h, res->resource_id);
+        *error = VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER;
+    }
+}
+
+void virtio_gpu_virgl_read_back(VirtIODevice *vdev, GPUSimpleResource *res,
+                                const struct virtio_gpu_rect *r,
+                                uint32_t *error) {
+    GPUDev *gdev = vdev->dev;
+    size_t size = (size_t)res->stride * res->height;
+    struct virgl_box box = {
+        .x = r->x,
+        .y = r->y,
+        .w = r->width,
+        .h = r->height,
+        .d = 1,
+    };
+
+    // The shadow is made on the first flush, in the budget of the zone
+    if (!res->shadow.iov_base) {
+        if (!virtio_gpu_admit_resource(vdev, res->resource_id, size)) {
+            *error = VIRTIO_GPU_RESP_ERR_OUT_OF_MEMORY;
+            return;
+        }
+        res->shadow.iov_base = malloc(size);
+        if (!res->shadow.iov_base) {
+            log_error("%s cannot allocate the shadow of resource %d",
+                      __func__, res->resource_id);
+            gdev->alloc_failures++;
+            *error = VIRTIO_GPU_RESP_ERR_OUT_OF_MEMORY;
+            return;
+        }
+        res->shadow.iov_len = size;
+        res->hostmem += size;
+        gdev->hostmem += size;
+    }
+
+    if (virgl_renderer_transfer_read_iov(
+            res->resource_id, 0, 0, res->stride, 0, &box,
+            (uint64_t)r->y * res->stride + r->x * 4, &res->shadow, 1) != 0) {
+        log_error("%s failed to read (%d, %d) + %d, %d of resource %d back",
+                  __func__, r->x, r->y, r->width, r->height, res->resource_id);
+        *error = VIRTIO_GPU_RESP_ERR_UNSPEC;
+        return;
+    }
+    gdev->virgl_read_back_bytes += (uint64_t)r->width * r->height * 4;
+}
+#endif
@@ -0,0 +1,119 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/**
+ * Copyright (c) 2025 Syswonder
+ *
+ * Syswonder Website:
+ *      https://www.syswonder.org
+ */
+// Throughput of the virtio-gpu blit kernels. A frame scattered over pages,
+// like the backing of a resource in the RAM of a zone, is copied into a
+// linear buffer with every kernel set the CPU supports, for each pair of
+// formats. The output of each kernel set is checked against the scalar one.
+//
+// Usage: gpu_blit_bench [width height [frames]]
+#include "log.h"
+#include "virtio_gpu_blit.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static const struct {
+    const char *name;
+    GPUPixelFormat format;
+} formats[] = {
+    {"BGRA8888", GPU_PIXEL_BGRA8888},
+    {"RGBA8888", GPU_PIXEL_RGBA8888},
+    {"XRGB8888", GPU_PIXEL_XRGB8888},
+    {"RGB565", GPU_PIXEL_RGB565},
+};
+#define FORMATS (sizeof(formats) / sizeof(formats[0]))
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+    uint32_t width = 1280, height = 800, frames = 200;
+    const GPUBlitKernels *const *all = gpu_blit_all();
+    long page_size = sysconf(_SC_PAGESIZE);
+    struct iovec *iov;
+    unsigned int iov_cnt;
+    uint8_t *dst, *expected;
+    uint32_t stride, pitch;
+    double start, secs;
+    int ret = 0;
+
+    if (argc >= 3) {
+        width = atoi(argv[1]);
+        height = atoi(argv[2]);
+    }
+    if (argc >= 4)
+        frames = atoi(argv[3]);
+    if (!width || !height || !frames) {
+        fprintf(stderr, "usage: %s [width height [frames]]\n", argv[0]);
+        return 1;
+    }
+    log_set_level(LOG_WARN);
+
+    // Each page of the source is a separate allocation, rows cross them
+    stride = width * 4;
+    pitch = (width * 4 + 63) & ~63;
+    iov_cnt = ((size_t)stride * height + page_size - 1) / page_size;
+    iov = calloc(iov_cnt, sizeof(struct iovec));
+    for (unsigned int i = 0; i < iov_cnt; i++) {
+        iov[i].iov_base = malloc(page_size);
+        iov[i].iov_len = page_size;
+        for (long j = 0; j < page_size; j++)
+            ((uint8_t *)iov[i].iov_base)[j] = rand();
+    }
+    dst = malloc((size_t)pitch * height);
+    expected = malloc((size_t)pitch * height);
+
+    gpu_blit_init();
+    printf("%ux%u, %u frames, %u fragments, %s kernels by default\n", width,
+           height, frames, iov_cnt, gpu_blit_name());
+    printf("%-8s %-9s %-9s %10s %10s\n", "kernels", "from", "to", "Mpixel/s",
+           "MiB/s");
+    for (unsigned int s = 0; s < FORMATS; s++) {
+        for (unsigned int d = 0; d < FORMATS; d++) {
+            GPUPixelFormat from = formats[s].format, to = formats[d].format;
+
+            gpu_blit_use("scalar");
+            memset(expected, 0, (size_t)pitch * height);
+            gpu_blit_from_iov(expected, pitch, to, iov, iov_cnt, 0, stride,
+                              from, width, height);
+            for (int k = 0; all[k]; k++) {
+                if (gpu_blit_use(all[k]->name))
+                    continue;
+                memset(dst, 0, (size_t)pitch * height);
+                start = now();
+                for (uint32_t f = 0; f < frames; f++)
+                    gpu_blit_from_iov(dst, pitch, to, iov, iov_cnt, 0, stride,
+                                      from, width, height);
+                secs = now() - start;
+                printf("%-8s %-9s %-9s %10.1f %10.1f\n", all[k]->name,
+                       formats[s].name, formats[d].name,
+                       (double)width * height * frames / secs / 1e6,
+                       (double)width * height * gpu_blit_bytes_pp(from) *
+                           frames / secs / (1 << 20));
+                if (memcmp(dst, expected, (size_t)pitch * height)) {
+                    printf("%s kernels differ from the scalar ones\n",
+                           all[k]->name);
+                    ret = 1;
+                }
+            }
+        }
+    }
+
+    for (unsigned int i = 0; i < iov_cnt; i++)
+        free(iov[i].iov_base);
+    free(iov);
+    free(dst);
+    free(expected);
+    return ret;
+}
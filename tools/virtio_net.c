@@ -12,6 +12,10 @@
 #include "event_monitor.h"
 #include "log.h"
 #include "virtio.h"
+#include "virtio_net_shaper.h"
+#include "virtio_net_switch.h"
+#include "virtio_net_vhost.h"
+#include "virtio_net_xdp.h"
 #include <errno.h>
 #include <fcntl.h>
 #include <linux/if_tun.h>
@@ -19,6 +23,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/param.h>
 #include <sys/uio.h>
 #include <unistd.h>
 // The max bytes of a packet in data link layer is 1518 bytes.
@@ -36,11 +41,18 @@ NetDev *init_net_dev(uint8_t mac[]) {
     dev->tapfd = -1;
     dev->rx_ready = 0;
     dev->event = NULL;
+    dev->backend = NET_BACKEND_TAP;
+    dev->backend_priv = NULL;
+    dev->shaper = NULL;
+    dev->rx_packets = dev->rx_bytes = dev->tx_packets = dev->tx_bytes = 0;
+    pthread_mutex_init(&dev->filter.lock, NULL);
+    virtio_net_rx_filter_reset(&dev->filter, 0);
     return dev;
 }
 
-// open tap device
-static int open_tap(char *devname) {
+// open tap device. With vnet_hdr, every frame read from or written to the tap
+// starts with a virtio net header.
+int open_tap(char *devname, bool vnet_hdr) {
     log_info("virtio net tap open");
     int tunfd;
     struct ifreq ifr;
@@ -51,7 +63,7 @@ static int open_tap(char *devname) {
     }
     memset(&ifr, 0, sizeof(ifr));
     // IFF_NO_PI tells kernel do not provide message header
-    ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+    ifr.ifr_flags = IFF_TAP | IFF_NO_PI | (vnet_hdr ? IFF_VNET_HDR : 0);
     strncpy(ifr.ifr_name, devname, IFNAMSIZ);
     ifr.ifr_name[IFNAMSIZ - 1] = '\0';
     if (ioctl(tunfd, TUNSETIFF, (void *)&ifr) < 0) {
@@ -59,6 +71,14 @@ static int open_tap(char *devname) {
         close(tunfd);
         return -1;
     }
+    if (vnet_hdr) {
+        int hdr_len = sizeof(NetHdr);
+        if (ioctl(tunfd, TUNSETVNETHDRSZ, &hdr_len) < 0) {
+            log_error("set vnet header size of tap %s fail", devname);
+            close(tunfd);
+            return -1;
+        }
+    }
     log_info("open virtio net tap succeed");
     return tunfd;
 }
@@ -95,6 +115,31 @@ static inline struct iovec *rm_iov_header(struct iovec *iov, int *niov,
     }
 }
 
+/// Read a frame from the tap into iov and check it against the rx filter.
+/// The chain belongs to the device until it is in the used ring, so a frame
+/// is read straight into it and a dropped one is simply overwritten by the
+/// next. Only the headers the filter looks at are gathered.
+static ssize_t tap_read_filtered(NetDev *net, struct iovec *iov, int n,
+                                 bool *accepted) {
+    uint8_t hdr[NET_RX_FILTER_LEN];
+    size_t want, hlen = 0, chunk;
+    ssize_t len;
+    int i;
+
+    *accepted = true;
+    len = readv(net->tapfd, iov, n);
+    if (len < 0 || net->filter.promisc)
+        return len;
+    want = MIN((size_t)len, sizeof(hdr));
+    for (i = 0; i < n && hlen < want; i++) {
+        chunk = MIN(iov[i].iov_len, want - hlen);
+        memcpy(hdr + hlen, iov[i].iov_base, chunk);
+        hlen += chunk;
+    }
+    *accepted = virtio_net_rx_accept(net, hdr, hlen);
+    return len;
+}
+
 /// Called when tap device received packets
 void virtio_net_event_handler(int fd, int epoll_type, void *param) {
     log_debug("virtio_net_event_handler");
@@ -103,7 +148,8 @@ void virtio_net_event_handler(int fd, int epoll_type, void *param) {
     struct iovec *iov, *iov_packet;
     NetDev *net = vdev->dev;
     VirtQueue *vq = &vdev->vqs[NET_QUEUE_RX];
-    int n, len;
+    int n, len, delivered = 0;
+    bool accepted;
     uint16_t idx;
     if (fd != net->tapfd || epoll_type != EPOLLIN) {
         log_error("invalid event");
@@ -126,6 +172,8 @@ void virtio_net_event_handler(int fd, int epoll_type, void *param) {
         return;
     }
     while (!virtqueue_is_empty(vq)) {
+        if (net->shaper && !net_shaper_rx_admit(net))
+            break;
         n = process_descriptor_chain(vq, &idx, &iov, NULL, 0, false);
         if (n < 1 || n > VIRTQUEUE_NET_MAX_SIZE) {
             log_error("process_descriptor_chain failed");
@@ -136,7 +184,7 @@ void virtio_net_event_handler(int fd, int epoll_type, void *param) {
         if (iov_packet == NULL)
             goto free_iov;
         // Read a packet from tap device
-        len = readv(net->tapfd, iov_packet, n);
+        len = tap_read_filtered(net, iov_packet, n, &accepted);
 
         if (len < 0 && errno == EWOULDBLOCK) {
             // No more packets from tapfd, restore last_avail_idx.
@@ -145,36 +193,37 @@ void virtio_net_event_handler(int fd, int epoll_type, void *param) {
             free(iov);
             break;
         }
+        if (!accepted) {
+            // Filtered out, the chain is still free for the next packet
+            vq->last_avail_idx--;
+            free(iov);
+            continue;
+        }
 
         memset(vnet_header, 0, sizeof(NetHdr));
         vnet_header->num_buffers = 1;
 
         update_used_ring(vq, idx, len + sizeof(NetHdr));
         free(iov);
+        delivered++;
+        net->rx_packets++;
+        net->rx_bytes += len;
+        if (net->shaper)
+            net_shaper_rx_charge(net, len);
     }
 
-    virtio_inject_irq(vq);
+    if (delivered)
+        virtio_inject_irq(vq);
     return;
 free_iov:
     free(iov);
 }
 
-static void virtq_tx_handle_one_request(NetDev *net, VirtQueue *vq) {
-    struct iovec *iov = NULL;
-    int i, n;
+int virtio_net_tap_xmit(NetDev *net, struct iovec *iov, int n) {
+    int i;
     int packet_len, all_len; // all_len include the header length.
-    uint16_t idx;
     static char pad[64];
     ssize_t len;
-    if (net->tapfd == -1) {
-        log_error("tap device is invalid");
-        return;
-    }
-
-    n = process_descriptor_chain(vq, &idx, &iov, NULL, 1, false);
-    if (n < 1) {
-        return;
-    }
 
     for (i = 0, all_len = 0; i < n; i++)
         all_len += iov[i].iov_len;
@@ -193,13 +242,40 @@ static void virtq_tx_handle_one_request(NetDev *net, VirtQueue *vq) {
     len = writev(net->tapfd, iov, n);
     if (len < 0) {
         log_error("write tap failed, errno %d", errno);
+    } else {
+        net->tx_packets++;
+        net->tx_bytes += packet_len;
+    }
+    return all_len;
+}
+
+static void virtq_tx_handle_one_request(NetDev *net, VirtQueue *vq) {
+    struct iovec *iov = NULL;
+    int n, all_len;
+    uint16_t idx;
+    if (net->tapfd == -1) {
+        log_error("tap device is invalid");
+        return;
+    }
+
+    n = process_descriptor_chain(vq, &idx, &iov, NULL, 1, false);
+    if (n < 1) {
+        return;
     }
+    all_len = virtio_net_tap_xmit(net, iov, n);
     update_used_ring(vq, idx, all_len);
     free(iov);
 }
 
 int virtio_net_txq_notify_handler(VirtIODevice *vdev, VirtQueue *vq) {
     log_debug("virtio_net_txq_notify_handler");
+    NetDev *net = vdev->dev;
+    if (net->backend == NET_BACKEND_XDP)
+        return virtio_net_xdp_tx(vdev, vq);
+    if (net->backend == NET_BACKEND_SWITCH)
+        return virtio_net_switch_tx(vdev, vq);
+    if (net->shaper && net->shaper->tx.rate)
+        return net_shaper_tx(vdev, vq);
     virtqueue_disable_notify(vq);
     while (!virtqueue_is_empty(vq)) {
         virtq_tx_handle_one_request(vdev->dev, vq);
@@ -211,11 +287,46 @@ int virtio_net_txq_notify_handler(VirtIODevice *vdev, VirtQueue *vq) {
     return 0;
 }
 
-int virtio_net_init(VirtIODevice *vdev, char *devname) {
+/// The driver negotiated features and set DRIVER_OK, or the device is reset.
+static void virtio_net_activate(VirtIODevice *vdev, bool activate) {
+    NetDev *net = vdev->dev;
+    if (activate)
+        virtio_net_rx_filter_reset(&net->filter, vdev->regs.drv_feature);
+    else if (net->shaper)
+        net_shaper_reset(net);
+    if (net->backend == NET_BACKEND_VHOST)
+        virtio_net_vhost_activate(vdev, activate);
+}
+
+static void virtio_net_stats(VirtIODevice *vdev) {
+    NetDev *net = vdev->dev;
+    log_warn("zone %d virtio net: rx %llu packets %llu bytes, tx %llu packets "
+             "%llu bytes",
+             vdev->zone_id, net->rx_packets, net->rx_bytes, net->tx_packets,
+             net->tx_bytes);
+    if (net->shaper)
+        net_shaper_stats(net);
+    if (net->backend == NET_BACKEND_XDP)
+        virtio_net_xdp_stats(net);
+}
+
+int virtio_net_init(VirtIODevice *vdev, NetRequestedState *req) {
     log_info("virtio net init");
     NetDev *net = vdev->dev;
+    NetRateLimit *limit = &req->rate_limit;
+    net->backend = req->backend;
+    vdev->virtio_close = virtio_net_close;
+    vdev->virtio_activate = virtio_net_activate;
+    if ((limit->tx_rate || limit->rx_rate) && req->backend != NET_BACKEND_TAP)
+        log_warn("rate limit is only supported by the tap backend, ignored");
+    if (req->backend == NET_BACKEND_XDP)
+        return virtio_net_xdp_init(vdev, req);
+    if (req->backend == NET_BACKEND_SWITCH)
+        return virtio_net_switch_init(vdev, req);
+    if (req->backend == NET_BACKEND_VHOST)
+        return virtio_net_vhost_init(vdev, req);
     // open tap device
-    net->tapfd = open_tap(devname);
+    net->tapfd = open_tap(req->ifname, false);
     if (net->tapfd == -1) {
         log_error("open tap device failed");
         return -1;
@@ -234,13 +345,23 @@ int virtio_net_init(VirtIODevice *vdev, char *devname) {
         net->tapfd = -1;
         return -1;
     }
-    vdev->virtio_close = virtio_net_close;
+    vdev->virtio_stats = virtio_net_stats;
+    if (limit->tx_rate || limit->rx_rate)
+        return net_shaper_init(vdev, limit);
     return 0;
 }
 
 void virtio_net_close(VirtIODevice *vdev) {
     NetDev *dev = vdev->dev;
-    close(dev->tapfd);
+    net_shaper_close(dev);
+    if (dev->backend == NET_BACKEND_XDP)
+        virtio_net_xdp_close(dev);
+    else if (dev->backend == NET_BACKEND_SWITCH)
+        virtio_net_switch_close(dev);
+    else if (dev->backend == NET_BACKEND_VHOST)
+        virtio_net_vhost_close(dev);
+    else
+        close(dev->tapfd);
     free(dev->event);
     free(dev);
     free(vdev->vqs);
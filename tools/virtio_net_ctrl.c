@@ -0,0 +1,289 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/**
+ * Copyright (c) 2025 Syswonder
+ *
+ * Syswonder Website:
+ *      https://www.syswonder.org
+ */
+// Control queue and rx filter of virtio-net.
+// The driver tells the device through the control queue which frames it
+// wants: rx modes (promiscuous, all multicast, ...), a table of unicast and
+// multicast MACs and the VLANs it is a member of. The backends ask
+// virtio_net_rx_accept() before taking an rx descriptor chain, so unwanted
+// frames cost the zone neither a buffer nor an interrupt.
+#include "log.h"
+#include "virtio.h"
+#include "virtio_net.h"
+#include <stdlib.h>
+#include <string.h>
+
+static const uint8_t bcast_mac[ETH_ALEN] = {0xff, 0xff, 0xff,
+                                            0xff, 0xff, 0xff};
+
+static inline uint32_t mac_hash(const uint8_t *mac) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < ETH_ALEN; i++)
+        h = (h ^ mac[i]) * 16777619u;
+    return h & (NET_MAC_HASH_SIZE - 1);
+}
+
+/// The table holds at most NET_MAC_TABLE_ENTRIES MACs in twice as many slots,
+/// so a lookup stops at an empty slot after a few probes.
+static bool mac_table_lookup(NetRxFilter *filter, const uint8_t *mac) {
+    uint32_t h = mac_hash(mac);
+    for (int i = 0; i < NET_MAC_HASH_SIZE; i++) {
+        NetMacEntry *e = &filter->macs[(h + i) & (NET_MAC_HASH_SIZE - 1)];
+        if (!e->used)
+            return false;
+        if (memcmp(e->mac, mac, ETH_ALEN) == 0)
+            return true;
+    }
+    return false;
+}
+
+static void mac_table_insert(NetRxFilter *filter, const uint8_t *mac) {
+    uint32_t h = mac_hash(mac);
+    for (int i = 0; i < NET_MAC_HASH_SIZE; i++) {
+        NetMacEntry *e = &filter->macs[(h + i) & (NET_MAC_HASH_SIZE - 1)];
+        if (!e->used) {
+            memcpy(e->mac, mac, ETH_ALEN);
+            e->used = true;
+            filter->mac_count++;
+            return;
+        }
+        if (memcmp(e->mac, mac, ETH_ALEN) == 0)
+            return;
+    }
+}
+
+void virtio_net_rx_filter_reset(NetRxFilter *filter, uint64_t features) {
+    pthread_mutex_lock(&filter->lock);
+    filter->promisc = true;
+    filter->allmulti = filter->alluni = false;
+    filter->nomulti = filter->nouni = filter->nobcast = false;
+    filter->uni_overflow = filter->multi_overflow = false;
+    filter->mac_count = 0;
+    memset(filter->macs, 0, sizeof(filter->macs));
+    // Without VLAN filtering every VLAN is accepted
+    memset(filter->vlans,
+           (features & (1ULL << VIRTIO_NET_F_CTRL_VLAN)) ? 0 : 0xff,
+           sizeof(filter->vlans));
+    pthread_mutex_unlock(&filter->lock);
+}
+
+static bool rx_filter_match(NetDev *net, const uint8_t *hdr, size_t len) {
+    NetRxFilter *filter = &net->filter;
+    uint16_t vid;
+
+    if (len >= NET_RX_FILTER_LEN && hdr[2 * ETH_ALEN] == (ETH_P_8021Q >> 8) &&
+        hdr[2 * ETH_ALEN + 1] == (ETH_P_8021Q & 0xff)) {
+        vid = ((hdr[ETH_HLEN] << 8) | hdr[ETH_HLEN + 1]) & (NET_MAX_VLAN - 1);
+        if (!(filter->vlans[vid >> 5] & (1U << (vid & 31))))
+            return false;
+    }
+
+    if (hdr[0] & 1) {
+        if (memcmp(hdr, bcast_mac, ETH_ALEN) == 0)
+            return !filter->nobcast;
+        if (filter->nomulti)
+            return false;
+        if (filter->allmulti || filter->multi_overflow)
+            return true;
+    } else {
+        if (filter->nouni)
+            return false;
+        if (filter->alluni || filter->uni_overflow)
+            return true;
+        if (memcmp(hdr, net->config.mac, ETH_ALEN) == 0)
+            return true;
+    }
+    return mac_table_lookup(filter, hdr);
+}
+
+bool virtio_net_rx_accept(NetDev *net, const uint8_t *hdr, size_t len) {
+    NetRxFilter *filter = &net->filter;
+    bool accept;
+
+    // Promiscuous mode is the common case and needs no lock
+    if (filter->promisc)
+        return true;
+    if (len < ETH_HLEN)
+        return false;
+    pthread_mutex_lock(&filter->lock);
+    accept = filter->promisc || rx_filter_match(net, hdr, len);
+    pthread_mutex_unlock(&filter->lock);
+    return accept;
+}
+
+/*********************************************************************
+    Control queue
+ */
+static uint8_t net_ctrl_rx(NetRxFilter *filter, uint8_t cmd,
+                           const uint8_t *data, size_t len) {
+    bool on;
+    if (len != 1)
+        return VIRTIO_NET_ERR;
+    on = data[0] != 0;
+    switch (cmd) {
+    case VIRTIO_NET_CTRL_RX_PROMISC:
+        filter->promisc = on;
+        break;
+    case VIRTIO_NET_CTRL_RX_ALLMULTI:
+        filter->allmulti = on;
+        break;
+    case VIRTIO_NET_CTRL_RX_ALLUNI:
+        filter->alluni = on;
+        break;
+    case VIRTIO_NET_CTRL_RX_NOMULTI:
+        filter->nomulti = on;
+        break;
+    case VIRTIO_NET_CTRL_RX_NOUNI:
+        filter->nouni = on;
+        break;
+    case VIRTIO_NET_CTRL_RX_NOBCAST:
+        filter->nobcast = on;
+        break;
+    default:
+        return VIRTIO_NET_ERR;
+    }
+    return VIRTIO_NET_OK;
+}
+
+/// data holds two struct virtio_net_ctrl_mac, unicast MACs first.
+static uint8_t net_ctrl_mac_table(NetRxFilter *filter, const uint8_t *data,
+                                  size_t len) {
+    uint32_t entries[2];
+    const uint8_t *macs[2];
+    size_t off = 0;
+
+    for (int i = 0; i < 2; i++) {
+        if (len - off < sizeof(uint32_t))
+            return VIRTIO_NET_ERR;
+        memcpy(&entries[i], data + off, sizeof(uint32_t));
+        off += sizeof(uint32_t);
+        if ((len - off) / ETH_ALEN < entries[i])
+            return VIRTIO_NET_ERR;
+        macs[i] = data + off;
+        off += (size_t)entries[i] * ETH_ALEN;
+    }
+
+    filter->mac_count = 0;
+    memset(filter->macs, 0, sizeof(filter->macs));
+    filter->uni_overflow = entries[0] > NET_MAC_TABLE_ENTRIES;
+    filter->multi_overflow =
+        entries[0] + entries[1] > NET_MAC_TABLE_ENTRIES;
+    for (int i = 0; i < 2; i++) {
+        for (uint32_t j = 0; j < entries[i]; j++) {
+            if (filter->mac_count == NET_MAC_TABLE_ENTRIES)
+                break;
+            mac_table_insert(filter, macs[i] + j * ETH_ALEN);
+        }
+    }
+    log_debug("rx filter: %u unicast, %u multicast MACs", entries[0],
+              entries[1]);
+    return VIRTIO_NET_OK;
+}
+
+static uint8_t net_ctrl_mac(NetDev *net, uint8_t cmd, const uint8_t *data,
+                            size_t len) {
+    switch (cmd) {
+    case VIRTIO_NET_CTRL_MAC_TABLE_SET:
+        return net_ctrl_mac_table(&net->filter, data, len);
+    case VIRTIO_NET_CTRL_MAC_ADDR_SET:
+        if (len != ETH_ALEN)
+            return VIRTIO_NET_ERR;
+        memcpy(net->config.mac, data, ETH_ALEN);
+        log_info("mac address set to %02x:%02x:%02x:%02x:%02x:%02x", data[0],
+                 data[1], data[2], data[3], data[4], data[5]);
+        return VIRTIO_NET_OK;
+    default:
+        return VIRTIO_NET_ERR;
+    }
+}
+
+static uint8_t net_ctrl_vlan(NetRxFilter *filter, uint8_t cmd,
+                             const uint8_t *data, size_t len) {
+    uint16_t vid;
+    if (len != sizeof(vid))
+        return VIRTIO_NET_ERR;
+    memcpy(&vid, data, sizeof(vid));
+    if (vid >= NET_MAX_VLAN)
+        return VIRTIO_NET_ERR;
+    if (cmd == VIRTIO_NET_CTRL_VLAN_ADD)
+        filter->vlans[vid >> 5] |= 1U << (vid & 31);
+    else if (cmd == VIRTIO_NET_CTRL_VLAN_DEL)
+        filter->vlans[vid >> 5] &= ~(1U << (vid & 31));
+    else
+        return VIRTIO_NET_ERR;
+    return VIRTIO_NET_OK;
+}
+
+/// A request is a struct virtio_net_ctrl_hdr and the command's data in
+/// readable buffers, then a writable byte for the ack.
+static void virtq_ctrl_handle_one_request(VirtIODevice *vdev, VirtQueue *vq) {
+    NetDev *net = vdev->dev;
+    struct virtio_net_ctrl_hdr *hdr;
+    struct iovec *iov = NULL;
+    uint16_t *flags = NULL;
+    uint8_t *buf, ack = VIRTIO_NET_ERR;
+    size_t len = 0, off = 0;
+    uint16_t idx;
+    int i, n;
+
+    n = process_descriptor_chain(vq, &idx, &iov, &flags, 0, true);
+    if (n < 1)
+        goto out;
+    if (n < 2 || !(flags[n - 1] & VRING_DESC_F_WRITE) ||
+        iov[n - 1].iov_len < 1) {
+        log_error("invalid net ctrl descriptor chain");
+        update_used_ring(vq, idx, 0);
+        goto out;
+    }
+    for (i = 0; i < n - 1; i++)
+        len += iov[i].iov_len;
+    buf = malloc(len);
+    for (i = 0; i < n - 1; i++) {
+        memcpy(buf + off, iov[i].iov_base, iov[i].iov_len);
+        off += iov[i].iov_len;
+    }
+
+    hdr = (struct virtio_net_ctrl_hdr *)buf;
+    if (len >= sizeof(*hdr)) {
+        uint8_t *data = buf + sizeof(*hdr);
+        len -= sizeof(*hdr);
+        pthread_mutex_lock(&net->filter.lock);
+        switch (hdr->class) {
+        case VIRTIO_NET_CTRL_RX:
+            ack = net_ctrl_rx(&net->filter, hdr->cmd, data, len);
+            break;
+        case VIRTIO_NET_CTRL_MAC:
+            ack = net_ctrl_mac(net, hdr->cmd, data, len);
+            break;
+        case VIRTIO_NET_CTRL_VLAN:
+            ack = net_ctrl_vlan(&net->filter, hdr->cmd, data, len);
+            break;
+        default:
+            log_warn("unsupported net ctrl class %d", hdr->class);
+            break;
+        }
+        pthread_mutex_unlock(&net->filter.lock);
+    }
+    free(buf);
+    *(uint8_t *)iov[n - 1].iov_base = ack;
+    update_used_ring(vq, idx, 1);
+out:
+    free(iov);
+    free(flags);
+}
+
+int virtio_net_ctrlq_notify_handler(VirtIODevice *vdev, VirtQueue *vq) {
+    log_debug("virtio_net_ctrlq_notify_handler");
+    while (!virtqueue_is_empty(vq)) {
+        virtqueue_disable_notify(vq);
+        while (!virtqueue_is_empty(vq))
+            virtq_ctrl_handle_one_request(vdev, vq);
+        virtqueue_enable_notify(vq);
+    }
+    virtio_inject_irq(vq);
+    return 0;
+}
@@ -0,0 +1,357 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/**
+ * Copyright (c) 2025 Syswonder
+ *
+ * Syswonder Website:
+ *      https://www.syswonder.org
+ */
+// Rate limiting of the tap backend of virtio-net.
+// Each direction has a token bucket. Tx chains are taken from the ring into
+// priority bands and sent from the highest band while there are tokens. Rx
+// stops reading the tap while the rx bucket is empty, so the kernel queues or
+// drops the frames. In both cases a timerfd in the event loop resumes the
+// work when enough tokens have come back, nothing spins.
+#include "virtio_net_shaper.h"
+#include "log.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NSEC_PER_SEC 1000000000ULL
+// Longest idle time accounted for in one refill, keeps the math in 64 bits
+#define NET_SHAPER_MAX_IDLE_NS (10 * NSEC_PER_SEC)
+// Highest rate in bytes per second, about 147 Gbit/s. Keeps the fraction of
+// a token in 64 bits.
+#define NET_SHAPER_MAX_RATE (UINT64_MAX / NSEC_PER_SEC - 1)
+
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static void tb_init(NetTokenBucket *tb, uint64_t rate, uint64_t burst) {
+    tb->rate = MIN(rate, NET_SHAPER_MAX_RATE);
+    // Default to 20ms worth of traffic, but at least two full frames
+    tb->burst = burst ? burst : MAX(rate / 50, 2 * 1518);
+    tb->tokens = tb->burst;
+    tb->frac = 0;
+    tb->last_ns = now_ns();
+}
+
+static void tb_refill(NetTokenBucket *tb, uint64_t now) {
+    uint64_t elapsed = MIN(now - tb->last_ns, NET_SHAPER_MAX_IDLE_NS);
+    tb->last_ns = now;
+    // Carry the fraction of a token over to the next refill, otherwise
+    // frequent refills deliver less than the rate
+    tb->frac += elapsed % NSEC_PER_SEC * tb->rate;
+    tb->tokens += elapsed / NSEC_PER_SEC * tb->rate + tb->frac / NSEC_PER_SEC;
+    tb->frac %= NSEC_PER_SEC;
+    if (tb->tokens > (int64_t)tb->burst) {
+        tb->tokens = tb->burst;
+        tb->frac = 0;
+    }
+}
+
+/// Nanoseconds until tokens becomes positive
+static inline uint64_t tb_wait_ns(NetTokenBucket *tb) {
+    if (tb->tokens > 0)
+        return 0;
+    return (1 - tb->tokens) * NSEC_PER_SEC / tb->rate + 1;
+}
+
+static void shaper_arm(NetShaper *s, uint64_t deadline) {
+    struct itimerspec its = {0};
+    if (s->deadline_ns != 0 && s->deadline_ns <= deadline)
+        return;
+    its.it_value.tv_sec = deadline / NSEC_PER_SEC;
+    its.it_value.tv_nsec = deadline % NSEC_PER_SEC;
+    if (timerfd_settime(s->timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+        log_error("failed to arm net shaper timer, errno is %d", errno);
+        return;
+    }
+    s->deadline_ns = deadline;
+}
+
+/*********************************************************************
+    Tx
+ */
+/// Copy bytes [off, off + len) of iov to buf, return bytes copied.
+static size_t iov_peek(const struct iovec *iov, int n, size_t off, uint8_t *buf,
+                       size_t len) {
+    size_t done = 0, chunk;
+    for (int i = 0; i < n && done < len; i++) {
+        if (iov[i].iov_len <= off) {
+            off -= iov[i].iov_len;
+            continue;
+        }
+        chunk = MIN(iov[i].iov_len - off, len - done);
+        memcpy(buf + done, (uint8_t *)iov[i].iov_base + off, chunk);
+        done += chunk;
+        off = 0;
+    }
+    return done;
+}
+
+/// Band of a frame: the top bits of its PCP or DSCP, 0 if it has none.
+static int shaper_classify(NetShaper *s, const struct iovec *iov, int n) {
+    // Ethernet header, a VLAN tag and the first two bytes of the IP header
+    uint8_t h[ETH_HLEN + 4 + 2];
+    size_t len, l3 = ETH_HLEN;
+    uint16_t proto;
+    uint8_t dscp;
+
+    if (s->prio == NET_PRIO_NONE)
+        return 0;
+    len = iov_peek(iov, n, sizeof(NetHdr), h, sizeof(h));
+    if (len < ETH_HLEN + 2)
+        return 0;
+    proto = (h[12] << 8) | h[13];
+    if (proto == ETH_P_8021Q) {
+        if (s->prio == NET_PRIO_PCP)
+            return (h[14] >> 5) >> 1;
+        if (len < sizeof(h))
+            return 0;
+        proto = (h[16] << 8) | h[17];
+        l3 += 4;
+    }
+    if (s->prio != NET_PRIO_DSCP)
+        return 0;
+    if (proto == ETH_P_IP)
+        dscp = h[l3 + 1] >> 2;
+    else if (proto == ETH_P_IPV6)
+        dscp = (((h[l3] & 0x0f) << 4) | (h[l3 + 1] >> 4)) >> 2;
+    else
+        return 0;
+    return dscp >> 4;
+}
+
+static bool shaper_tx_pending(NetShaper *s) {
+    for (int i = 0; i < NET_SHAPER_BANDS; i++)
+        if (s->bands[i].count)
+            return true;
+    return false;
+}
+
+/// Move every chain the driver has made available into the bands.
+static void shaper_tx_fetch(NetShaper *s, VirtQueue *vq) {
+    NetTxFrame *f;
+    NetTxBand *band;
+    struct iovec *iov;
+    uint16_t idx;
+    int n;
+
+    while (!virtqueue_is_empty(vq)) {
+        n = process_descriptor_chain(vq, &idx, &iov, NULL, 1, false);
+        if (n < 1)
+            break;
+        band = &s->bands[shaper_classify(s, iov, n)];
+        // A band can hold the whole ring, so this only guards a bad ring size
+        if (band->count == VIRTQUEUE_NET_MAX_SIZE) {
+            vq->last_avail_idx--;
+            free(iov);
+            break;
+        }
+        f = &band->frames[(band->head + band->count++) %
+                          VIRTQUEUE_NET_MAX_SIZE];
+        f->iov = iov;
+        f->n = n;
+        f->idx = idx;
+    }
+}
+
+static NetTxFrame *shaper_tx_pop(NetShaper *s, int *prio) {
+    NetTxBand *band;
+    NetTxFrame *f;
+    for (int i = NET_SHAPER_BANDS - 1; i >= 0; i--) {
+        band = &s->bands[i];
+        if (band->count == 0)
+            continue;
+        f = &band->frames[band->head];
+        band->head = (band->head + 1) % VIRTQUEUE_NET_MAX_SIZE;
+        band->count--;
+        *prio = i;
+        return f;
+    }
+    return NULL;
+}
+
+/// Must be called with the shaper locked.
+static void shaper_tx_locked(NetShaper *s, VirtQueue *vq) {
+    NetDev *net = s->vdev->dev;
+    NetTxFrame *f;
+    int len, prio, sent = 0;
+    uint64_t now;
+
+    virtqueue_disable_notify(vq);
+    for (;;) {
+        shaper_tx_fetch(s, vq);
+        now = now_ns();
+        tb_refill(&s->tx, now);
+        while (s->tx.tokens > 0 && (f = shaper_tx_pop(s, &prio)) != NULL) {
+            len = virtio_net_tap_xmit(net, f->iov, f->n);
+            update_used_ring(vq, f->idx, len);
+            free(f->iov);
+            s->tx.tokens -= len - (int)sizeof(NetHdr);
+            s->band_packets[prio]++;
+            sent++;
+        }
+        if (shaper_tx_pending(s)) {
+            // Out of tokens. The driver isn't notified of used buffers it is
+            // waiting for until the timer sends the rest.
+            s->tx_deferred++;
+            shaper_arm(s, now + tb_wait_ns(&s->tx));
+            break;
+        }
+        virtqueue_enable_notify(vq);
+        if (virtqueue_is_empty(vq))
+            break;
+        virtqueue_disable_notify(vq);
+    }
+    // The driver stops its queue when the ring is full and waits for an
+    // interrupt, which can happen here unlike in the unshaped path.
+    if (sent)
+        virtio_inject_irq(vq);
+}
+
+int net_shaper_tx(VirtIODevice *vdev, VirtQueue *vq) {
+    NetDev *net = vdev->dev;
+    NetShaper *s = net->shaper;
+    pthread_mutex_lock(&s->lock);
+    shaper_tx_locked(s, vq);
+    pthread_mutex_unlock(&s->lock);
+    return 0;
+}
+
+/*********************************************************************
+    Rx
+ */
+bool net_shaper_rx_admit(NetDev *net) {
+    NetShaper *s = net->shaper;
+    uint64_t now;
+    bool admit;
+
+    if (s->rx.rate == 0)
+        return true;
+    pthread_mutex_lock(&s->lock);
+    now = now_ns();
+    tb_refill(&s->rx, now);
+    admit = s->rx.tokens > 0;
+    if (!admit && !s->rx_paused) {
+        set_event_active(net->event, false);
+        s->rx_paused = true;
+        s->rx_deferred++;
+        shaper_arm(s, now + tb_wait_ns(&s->rx));
+    }
+    pthread_mutex_unlock(&s->lock);
+    return admit;
+}
+
+void net_shaper_rx_charge(NetDev *net, size_t len) {
+    NetShaper *s = net->shaper;
+    if (s->rx.rate == 0)
+        return;
+    pthread_mutex_lock(&s->lock);
+    s->rx.tokens -= len;
+    pthread_mutex_unlock(&s->lock);
+}
+
+/*********************************************************************
+    Timer
+ */
+static void net_shaper_timer_handler(int fd, int epoll_type, void *param) {
+    NetShaper *s = param;
+    VirtIODevice *vdev = s->vdev;
+    NetDev *net = vdev->dev;
+    uint64_t expirations, now;
+
+    if (epoll_type != EPOLLIN) {
+        log_error("invalid event");
+        return;
+    }
+    if (read(fd, &expirations, sizeof(expirations)) < 0)
+        return;
+
+    pthread_mutex_lock(&s->lock);
+    s->deadline_ns = 0;
+    if (s->rx_paused) {
+        now = now_ns();
+        tb_refill(&s->rx, now);
+        if (s->rx.tokens > 0) {
+            s->rx_paused = false;
+            set_event_active(net->event, true);
+        } else {
+            shaper_arm(s, now + tb_wait_ns(&s->rx));
+        }
+    }
+    if (vdev->activated && shaper_tx_pending(s))
+        shaper_tx_locked(s, &vdev->vqs[NET_QUEUE_TX]);
+    pthread_mutex_unlock(&s->lock);
+}
+
+int net_shaper_init(VirtIODevice *vdev, NetRateLimit *limit) {
+    NetDev *net = vdev->dev;
+    NetShaper *s = calloc(1, sizeof(NetShaper));
+
+    pthread_mutex_init(&s->lock, NULL);
+    s->vdev = vdev;
+    s->prio = limit->prio;
+    tb_init(&s->tx, limit->tx_rate, limit->tx_burst);
+    tb_init(&s->rx, limit->rx_rate, limit->rx_burst);
+    s->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (s->timer_fd < 0) {
+        log_error("failed to create net shaper timer, errno is %d", errno);
+        free(s);
+        return -1;
+    }
+    s->timer_event =
+        add_event(s->timer_fd, EPOLLIN, net_shaper_timer_handler, s);
+    if (s->timer_event == NULL) {
+        log_error("Can't register net shaper timer event");
+        close(s->timer_fd);
+        free(s);
+        return -1;
+    }
+    net->shaper = s;
+    log_info("zone %d net rate limit: tx %llu B/s burst %llu, rx %llu B/s "
+             "burst %llu",
+             vdev->zone_id, s->tx.rate, s->tx.burst, s->rx.rate, s->rx.burst);
+    return 0;
+}
+
+void net_shaper_reset(NetDev *net) {
+    NetShaper *s = net->shaper;
+    NetTxFrame *f;
+    int prio;
+    pthread_mutex_lock(&s->lock);
+    while ((f = shaper_tx_pop(s, &prio)) != NULL)
+        free(f->iov);
+    pthread_mutex_unlock(&s->lock);
+}
+
+void net_shaper_close(NetDev *net) {
+    NetShaper *s = net->shaper;
+    if (s == NULL)
+        return;
+    net_shaper_reset(net);
+    close(s->timer_fd);
+    free(s->timer_event);
+    free(s);
+    net->shaper = NULL;
+}
+
+void net_shaper_stats(NetDev *net) {
+    NetShaper *s = net->shaper;
+    pthread_mutex_lock(&s->lock);
+    log_warn("  shaper: tx deferred %llu times, tokens %lld; rx deferred %llu "
+             "times, tokens %lld",
+             s->tx_deferred, s->tx.tokens, s->rx_deferred, s->rx.tokens);
+    log_warn("  shaper: tx packets per band %llu %llu %llu %llu",
+             s->band_packets[0], s->band_packets[1], s->band_packets[2],
+             s->band_packets[3]);
+    pthread_mutex_unlock(&s->lock);
+}
@@ -0,0 +1,491 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/**
+ * Copyright (c) 2025 Syswonder
+ *
+ * Syswonder Website:
+ *      https://www.syswonder.org
+ */
+// Learning L2 switch inside the virtio daemon.
+// Zones on the same board exchange frames through it without going through
+// a host bridge: a frame is copied once, from the sender's tx descriptor
+// chain straight into the receiver's rx buffers. Each zone port is an access
+// port of one VLAN. An optional uplink port connects the switch to a tap
+// device for external traffic and carries 802.1Q tags for non-zero VLANs.
+#include "virtio_net_switch.h"
+#include "log.h"
+#include "virtio.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define ETH_ALEN 6
+#define ETH_HLEN 14
+#define ETH_P_8021Q 0x8100
+#define VLAN_HLEN 4
+#define VLAN_VID_MASK 0x0fff
+
+// Maximum number of iovs describing a frame inside the switch
+#define NET_SWITCH_MAX_IOV (VIRTQUEUE_NET_MAX_SIZE + 2)
+
+static NetSwitch *switches[NET_SWITCH_MAX_SWITCHES];
+static pthread_mutex_t switches_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static NetSwitch *net_switch_get(const char *name) {
+    NetSwitch *sw = NULL;
+    int i;
+    pthread_mutex_lock(&switches_lock);
+    for (i = 0; i < NET_SWITCH_MAX_SWITCHES && switches[i]; i++) {
+        if (strcmp(switches[i]->name, name) == 0) {
+            sw = switches[i];
+            goto out;
+        }
+    }
+    if (i == NET_SWITCH_MAX_SWITCHES) {
+        log_error("switch num exceed max limit");
+        goto out;
+    }
+    sw = calloc(1, sizeof(NetSwitch));
+    strncpy(sw->name, name, sizeof(sw->name) - 1);
+    pthread_mutex_init(&sw->lock, NULL);
+    sw->uplink_fd = -1;
+    switches[i] = sw;
+    log_info("create switch %s", name);
+out:
+    pthread_mutex_unlock(&switches_lock);
+    return sw;
+}
+
+static NetSwitchPort *net_switch_alloc_port(NetSwitch *sw) {
+    for (int i = 0; i < NET_SWITCH_MAX_PORTS; i++) {
+        if (!sw->ports[i].in_use) {
+            memset(&sw->ports[i], 0, sizeof(NetSwitchPort));
+            sw->ports[i].sw = sw;
+            sw->ports[i].in_use = true;
+            return &sw->ports[i];
+        }
+    }
+    log_error("switch %s has no free port", sw->name);
+    return NULL;
+}
+
+/*********************************************************************
+    MAC table
+ */
+static inline uint32_t fdb_hash(const uint8_t *mac, uint16_t vlan) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < ETH_ALEN; i++)
+        h = (h ^ mac[i]) * 16777619u;
+    h = (h ^ vlan) * 16777619u;
+    return h & (NET_SWITCH_FDB_SIZE - 1);
+}
+
+static inline bool fdb_entry_alive(NetSwitchFdbEntry *e, time_t now) {
+    return e->port != NULL && e->port->in_use &&
+           now - e->last_seen < NET_SWITCH_AGEING_TIME;
+}
+
+static NetSwitchPort *fdb_lookup(NetSwitch *sw, const uint8_t *mac,
+                                 uint16_t vlan, time_t now) {
+    uint32_t h = fdb_hash(mac, vlan);
+    for (int i = 0; i < NET_SWITCH_FDB_PROBE; i++) {
+        NetSwitchFdbEntry *e = &sw->fdb[(h + i) & (NET_SWITCH_FDB_SIZE - 1)];
+        if (e->port == NULL)
+            return NULL;
+        if (e->vlan == vlan && memcmp(e->mac, mac, ETH_ALEN) == 0)
+            return fdb_entry_alive(e, now) ? e->port : NULL;
+    }
+    return NULL;
+}
+
+static void fdb_learn(NetSwitch *sw, const uint8_t *mac, uint16_t vlan,
+                      NetSwitchPort *port, time_t now) {
+    uint32_t h = fdb_hash(mac, vlan);
+    NetSwitchFdbEntry *e, *victim = NULL;
+    // Group addresses are never used as source
+    if (mac[0] & 1)
+        return;
+    for (int i = 0; i < NET_SWITCH_FDB_PROBE; i++) {
+        e = &sw->fdb[(h + i) & (NET_SWITCH_FDB_SIZE - 1)];
+        if (e->port == NULL ||
+            (e->vlan == vlan && memcmp(e->mac, mac, ETH_ALEN) == 0)) {
+            victim = e;
+            break;
+        }
+        // Replace a stale entry, or the oldest one if all are alive
+        if (victim == NULL || !fdb_entry_alive(e, now) ||
+            (fdb_entry_alive(victim, now) &&
+             e->last_seen < victim->last_seen))
+            victim = e;
+    }
+    if (victim->port != port)
+        log_debug("switch %s learned %02x:%02x:%02x:%02x:%02x:%02x vlan %d",
+                  sw->name, mac[0], mac[1], mac[2], mac[3], mac[4], mac[5],
+                  vlan);
+    memcpy(victim->mac, mac, ETH_ALEN);
+    victim->vlan = vlan;
+    victim->port = port;
+    victim->last_seen = now;
+}
+
+/*********************************************************************
+    Frame helpers
+ */
+/// Copy len bytes starting at offset off of src into buf.
+static size_t iov_gather(const struct iovec *src, int nsrc, size_t off,
+                         void *buf, size_t len) {
+    size_t done = 0, chunk;
+    for (int i = 0; i < nsrc && done < len; i++) {
+        if (src[i].iov_len <= off) {
+            off -= src[i].iov_len;
+            continue;
+        }
+        chunk = MIN(src[i].iov_len - off, len - done);
+        memcpy((char *)buf + done, (char *)src[i].iov_base + off, chunk);
+        done += chunk;
+        off = 0;
+    }
+    return done;
+}
+
+/// Describe bytes [off, off + len) of src with iovs appended to dst. Return
+/// the number of iovs appended.
+static int iov_slice(const struct iovec *src, int nsrc, size_t off,
+                     size_t len, struct iovec *dst, int ndst) {
+    int n = 0;
+    for (int i = 0; i < nsrc && len > 0 && n < ndst; i++) {
+        if (src[i].iov_len <= off) {
+            off -= src[i].iov_len;
+            continue;
+        }
+        dst[n].iov_base = (char *)src[i].iov_base + off;
+        dst[n].iov_len = MIN(src[i].iov_len - off, len);
+        len -= dst[n].iov_len;
+        off = 0;
+        n++;
+    }
+    return n;
+}
+
+/// Copy a frame into dst starting at offset dst_off. Return bytes copied.
+static size_t iov_copy(const struct iovec *dst, int ndst, size_t dst_off,
+                       const struct iovec *src, int nsrc, size_t len) {
+    size_t done = 0, chunk;
+    int i = 0, j = 0;
+    size_t src_off = 0;
+    while (i < ndst && dst[i].iov_len <= dst_off)
+        dst_off -= dst[i++].iov_len;
+    while (i < ndst && j < nsrc && done < len) {
+        chunk = MIN(dst[i].iov_len - dst_off, src[j].iov_len - src_off);
+        chunk = MIN(chunk, len - done);
+        memcpy((char *)dst[i].iov_base + dst_off,
+               (char *)src[j].iov_base + src_off, chunk);
+        done += chunk;
+        dst_off += chunk;
+        src_off += chunk;
+        if (dst_off == dst[i].iov_len)
+            i++, dst_off = 0;
+        if (src_off == src[j].iov_len)
+            j++, src_off = 0;
+    }
+    return done;
+}
+
+/*********************************************************************
+    Forwarding
+ */
+/// Deliver an untagged frame to a zone port: one copy into its rx buffers.
+static void port_output_zone(NetSwitchPort *port, const struct iovec *frame,
+                             int nframe, size_t len) {
+    VirtIODevice *vdev = port->vdev;
+    NetDev *net = vdev->dev;
+    VirtQueue *vq = &vdev->vqs[NET_QUEUE_RX];
+    struct iovec *iov = NULL;
+    NetHdr *vnet_header;
+    uint8_t hdr[NET_RX_FILTER_LEN];
+    size_t copied;
+    uint16_t idx;
+    int n;
+
+    if (!virtio_net_rx_accept(net, hdr,
+                              iov_gather(frame, nframe, 0, hdr,
+                                         MIN(len, sizeof(hdr))))) {
+        port->filtered++;
+        return;
+    }
+    if (net->rx_ready <= 0 || virtqueue_is_empty(vq)) {
+        port->dropped++;
+        return;
+    }
+    n = process_descriptor_chain(vq, &idx, &iov, NULL, 0, false);
+    if (n < 1 || iov[0].iov_len < sizeof(NetHdr)) {
+        log_error("invalid net rx descriptor chain");
+        free(iov);
+        port->dropped++;
+        return;
+    }
+    vnet_header = iov[0].iov_base;
+    memset(vnet_header, 0, sizeof(NetHdr));
+    vnet_header->num_buffers = 1;
+    copied = iov_copy(iov, n, sizeof(NetHdr), frame, nframe, len);
+    if (copied < len)
+        log_warn("net rx buffer too small, frame truncated from %d to %d",
+                 len, copied);
+    update_used_ring(vq, idx, copied + sizeof(NetHdr));
+    free(iov);
+    port->rx_packets++;
+    port->need_irq = true;
+}
+
+/// Send a frame to the tap device of the uplink, tagging it if needed.
+static void port_output_uplink(NetSwitchPort *port, const struct iovec *frame,
+                               int nframe, size_t len, uint16_t vlan) {
+    NetSwitch *sw = port->sw;
+    struct iovec iov[NET_SWITCH_MAX_IOV + 2];
+    static uint8_t pad[64];
+    uint8_t tag[VLAN_HLEN];
+    int n = 0;
+
+    if (vlan == 0) {
+        n = iov_slice(frame, nframe, 0, len, iov, NET_SWITCH_MAX_IOV);
+    } else {
+        tag[0] = ETH_P_8021Q >> 8;
+        tag[1] = ETH_P_8021Q & 0xff;
+        tag[2] = vlan >> 8;
+        tag[3] = vlan & 0xff;
+        n = iov_slice(frame, nframe, 0, 2 * ETH_ALEN, iov, NET_SWITCH_MAX_IOV);
+        iov[n].iov_base = tag;
+        iov[n++].iov_len = VLAN_HLEN;
+        n += iov_slice(frame, nframe, 2 * ETH_ALEN, len - 2 * ETH_ALEN,
+                       &iov[n], NET_SWITCH_MAX_IOV - n);
+        len += VLAN_HLEN;
+    }
+    // The mininum packet for data link layer is 64 bytes.
+    if (len < 64) {
+        iov[n].iov_base = pad;
+        iov[n++].iov_len = 64 - len;
+    }
+    if (writev(sw->uplink_fd, iov, n) < 0) {
+        log_error("write uplink tap failed, errno %d", errno);
+        port->dropped++;
+        return;
+    }
+    port->rx_packets++;
+}
+
+static void port_output(NetSwitchPort *port, const struct iovec *frame,
+                        int nframe, size_t len, uint16_t vlan) {
+    if (port->vdev == NULL)
+        port_output_uplink(port, frame, nframe, len, vlan);
+    else if (port->vlan == vlan)
+        port_output_zone(port, frame, nframe, len);
+}
+
+/// Forward an untagged frame of VLAN vlan that entered the switch from in.
+/// Must be called with the switch locked.
+static void net_switch_forward(NetSwitch *sw, NetSwitchPort *in,
+                               const struct iovec *frame, int nframe,
+                               size_t len, uint16_t vlan) {
+    uint8_t eth[2 * ETH_ALEN];
+    NetSwitchPort *out;
+    time_t now = time(NULL);
+
+    if (len < ETH_HLEN ||
+        iov_gather(frame, nframe, 0, eth, sizeof(eth)) < sizeof(eth)) {
+        in->dropped++;
+        return;
+    }
+    in->tx_packets++;
+    fdb_learn(sw, eth + ETH_ALEN, vlan, in, now);
+
+    // Known unicast goes to one port, everything else is flooded in the VLAN
+    if (!(eth[0] & 1) && (out = fdb_lookup(sw, eth, vlan, now)) != NULL) {
+        if (out != in)
+            port_output(out, frame, nframe, len, vlan);
+        return;
+    }
+    for (int i = 0; i < NET_SWITCH_MAX_PORTS; i++) {
+        out = &sw->ports[i];
+        if (out->in_use && out != in)
+            port_output(out, frame, nframe, len, vlan);
+    }
+}
+
+/// Kick the zones whose rx queues were filled by the switch.
+static void net_switch_flush_irqs(NetSwitch *sw) {
+    for (int i = 0; i < NET_SWITCH_MAX_PORTS; i++) {
+        NetSwitchPort *port = &sw->ports[i];
+        if (port->in_use && port->need_irq) {
+            port->need_irq = false;
+            virtio_inject_irq(&port->vdev->vqs[NET_QUEUE_RX]);
+        }
+    }
+}
+
+int virtio_net_switch_tx(VirtIODevice *vdev, VirtQueue *vq) {
+    NetDev *net = vdev->dev;
+    NetSwitchPort *port = net->backend_priv;
+    NetSwitch *sw = port->sw;
+    struct iovec *iov = NULL, frame[NET_SWITCH_MAX_IOV];
+    size_t all_len;
+    uint16_t idx;
+    int i, n, nframe;
+
+    pthread_mutex_lock(&sw->lock);
+    virtqueue_disable_notify(vq);
+    while (!virtqueue_is_empty(vq)) {
+        n = process_descriptor_chain(vq, &idx, &iov, NULL, 0, false);
+        if (n < 1)
+            break;
+        for (i = 0, all_len = 0; i < n; i++)
+            all_len += iov[i].iov_len;
+        if (all_len > sizeof(NetHdr)) {
+            nframe = iov_slice(iov, n, sizeof(NetHdr),
+                               all_len - sizeof(NetHdr), frame,
+                               NET_SWITCH_MAX_IOV);
+            net_switch_forward(sw, port, frame, nframe,
+                               all_len - sizeof(NetHdr), port->vlan);
+        }
+        update_used_ring(vq, idx, all_len);
+        free(iov);
+    }
+    virtqueue_enable_notify(vq);
+    net_switch_flush_irqs(sw);
+    pthread_mutex_unlock(&sw->lock);
+    return 0;
+}
+
+/// Called when the uplink tap device received frames
+static void net_switch_uplink_handler(int fd, int epoll_type, void *param) {
+    NetSwitch *sw = param;
+    uint8_t *buf = sw->uplink_buf;
+    struct iovec frame[2];
+    uint16_t vlan;
+    ssize_t len;
+
+    if (fd != sw->uplink_fd || epoll_type != EPOLLIN) {
+        log_error("invalid event");
+        return;
+    }
+    pthread_mutex_lock(&sw->lock);
+    while ((len = read(sw->uplink_fd, buf, NET_SWITCH_MAX_FRAME)) > 0) {
+        if (len < ETH_HLEN)
+            continue;
+        frame[0].iov_base = buf;
+        // Strip the 802.1Q tag, zone ports are always untagged
+        if (((buf[12] << 8) | buf[13]) == ETH_P_8021Q &&
+            len >= ETH_HLEN + VLAN_HLEN) {
+            vlan = ((buf[14] << 8) | buf[15]) & VLAN_VID_MASK;
+            frame[0].iov_len = 2 * ETH_ALEN;
+            frame[1].iov_base = buf + 2 * ETH_ALEN + VLAN_HLEN;
+            frame[1].iov_len = len - 2 * ETH_ALEN - VLAN_HLEN;
+            net_switch_forward(sw, sw->uplink, frame, 2, len - VLAN_HLEN,
+                               vlan);
+        } else {
+            frame[0].iov_len = len;
+            net_switch_forward(sw, sw->uplink, frame, 1, len, 0);
+        }
+    }
+    if (len < 0 && errno != EWOULDBLOCK)
+        log_error("read uplink tap failed, errno %d", errno);
+    net_switch_flush_irqs(sw);
+    pthread_mutex_unlock(&sw->lock);
+}
+
+/*********************************************************************
+    Init and close
+ */
+int net_switch_add_uplink(const char *name, char *tap) {
+    NetSwitch *sw = net_switch_get(name);
+    if (sw == NULL)
+        return -1;
+    if (sw->uplink != NULL) {
+        log_error("switch %s already has an uplink", name);
+        return -1;
+    }
+    sw->uplink_fd = open_tap(tap, false);
+    if (sw->uplink_fd < 0)
+        return -1;
+    if (set_nonblocking(sw->uplink_fd) < 0)
+        goto err;
+    pthread_mutex_lock(&sw->lock);
+    sw->uplink = net_switch_alloc_port(sw);
+    pthread_mutex_unlock(&sw->lock);
+    if (sw->uplink == NULL)
+        goto err;
+    sw->uplink_event =
+        add_event(sw->uplink_fd, EPOLLIN, net_switch_uplink_handler, sw);
+    if (sw->uplink_event == NULL) {
+        log_error("Can't register switch uplink event");
+        sw->uplink->in_use = false;
+        sw->uplink = NULL;
+        goto err;
+    }
+    log_info("switch %s uplink is %s", name, tap);
+    return 0;
+err:
+    close(sw->uplink_fd);
+    sw->uplink_fd = -1;
+    return -1;
+}
+
+int virtio_net_switch_init(VirtIODevice *vdev, NetRequestedState *req) {
+    NetDev *net = vdev->dev;
+    NetSwitch *sw;
+    NetSwitchPort *port;
+
+    if (req->vlan > VLAN_VID_MASK) {
+        log_error("invalid vlan %d", req->vlan);
+        return -1;
+    }
+    sw = net_switch_get(req->switch_name);
+    if (sw == NULL)
+        return -1;
+    pthread_mutex_lock(&sw->lock);
+    port = net_switch_alloc_port(sw);
+    if (port != NULL) {
+        port->vdev = vdev;
+        port->vlan = req->vlan;
+    }
+    pthread_mutex_unlock(&sw->lock);
+    if (port == NULL)
+        return -1;
+    net->backend_priv = port;
+    log_info("zone %d joined switch %s, vlan %d", vdev->zone_id, sw->name,
+             req->vlan);
+    return 0;
+}
+
+void virtio_net_switch_close(NetDev *net) {
+    NetSwitchPort *port = net->backend_priv;
+    NetSwitch *sw;
+    bool last = true;
+    if (port == NULL)
+        return;
+    sw = port->sw;
+    pthread_mutex_lock(&sw->lock);
+    log_info("switch %s port of zone %d: rx %llu, tx %llu, dropped %llu",
+             sw->name, port->vdev->zone_id, port->rx_packets,
+             port->tx_packets, port->dropped);
+    port->in_use = false;
+    port->vdev = NULL;
+    for (int i = 0; i < NET_SWITCH_MAX_PORTS; i++)
+        if (sw->ports[i].in_use && &sw->ports[i] != sw->uplink)
+            last = false;
+    // The uplink goes away with the last zone port
+    if (last && sw->uplink != NULL) {
+        log_info("switch %s uplink: rx %llu, tx %llu, dropped %llu",
+                 sw->name, sw->uplink->rx_packets, sw->uplink->tx_packets,
+                 sw->uplink->dropped);
+        sw->uplink->in_use = false;
+        sw->uplink = NULL;
+        close(sw->uplink_fd);
+        sw->uplink_fd = -1;
+        free(sw->uplink_event);
+        sw->uplink_event = NULL;
+    }
+    pthread_mutex_unlock(&sw->lock);
+    net->backend_priv = NULL;
+}
@@ -0,0 +1,225 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/**
+ * Copyright (c) 2025 Syswonder
+ *
+ * Syswonder Website:
+ *      https://www.syswonder.org
+ */
+// vhost-net backend of virtio-net.
+// The rx and tx virtqueues are handed to the Linux vhost-net driver, which
+// moves frames between the zone's memory and a tap device inside the kernel.
+// The daemon only sets the device up when the driver sets DRIVER_OK,
+// forwards QUEUE_NOTIFY to vhost through kick eventfds, and turns vhost's
+// call eventfds into interrupts for the zone.
+#include "virtio_net_vhost.h"
+#include "log.h"
+#include "virtio.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/vhost.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+// Features that are implemented by the daemon rather than by vhost-net
+#define VHOST_NET_DAEMON_FEATURES                                              \
+    ((1ULL << VIRTIO_NET_F_MAC) | (1ULL << VIRTIO_NET_F_STATUS))
+
+static int virtio_net_vhost_kick(VirtIODevice *vdev, VirtQueue *vq) {
+    NetDev *net = vdev->dev;
+    VhostNet *vhost = net->backend_priv;
+    if (vq->vq_idx == NET_QUEUE_RX)
+        net->rx_ready = 1;
+    if (!vhost->started)
+        return 0;
+    if (eventfd_write(vhost->kick_fd[vq->vq_idx], 1) < 0)
+        log_error("failed to kick vhost-net, errno is %d", errno);
+    return 0;
+}
+
+/// Called when vhost-net has updated a used ring
+static void virtio_net_vhost_call_handler(int fd, int epoll_type,
+                                          void *param) {
+    VirtQueue *vq = param;
+    eventfd_t cnt;
+    if (epoll_type != EPOLLIN) {
+        log_error("invalid event");
+        return;
+    }
+    if (eventfd_read(fd, &cnt) < 0)
+        return;
+    virtio_inject_irq(vq);
+}
+
+static int vhost_set_mem_table(VirtIODevice *vdev, VhostNet *vhost) {
+    ZoneMemRegion regions[VHOST_NET_MAX_MEM_REGIONS];
+    struct vhost_memory *mem;
+    int n, ret;
+
+    n = get_zone_mem_regions(vdev->zone_id, regions,
+                             VHOST_NET_MAX_MEM_REGIONS);
+    mem = calloc(1, sizeof(struct vhost_memory) +
+                        n * sizeof(struct vhost_memory_region));
+    mem->nregions = n;
+    for (int i = 0; i < n; i++) {
+        mem->regions[i].guest_phys_addr = regions[i].zonex_ipa;
+        mem->regions[i].memory_size = regions[i].size;
+        mem->regions[i].userspace_addr = (uint64_t)regions[i].virt_addr;
+    }
+    ret = ioctl(vhost->vhost_fd, VHOST_SET_MEM_TABLE, mem);
+    free(mem);
+    return ret;
+}
+
+static int vhost_start_vring(VhostNet *vhost, VirtQueue *vq) {
+    unsigned int idx = vq->vq_idx;
+    struct vhost_vring_state state = {.index = idx};
+    struct vhost_vring_addr addr = {.index = idx};
+    struct vhost_vring_file file = {.index = idx};
+
+    state.num = vq->num;
+    if (ioctl(vhost->vhost_fd, VHOST_SET_VRING_NUM, &state) < 0)
+        return -1;
+    state.num = vq->last_avail_idx;
+    if (ioctl(vhost->vhost_fd, VHOST_SET_VRING_BASE, &state) < 0)
+        return -1;
+    addr.desc_user_addr = (uint64_t)vq->desc_table;
+    addr.avail_user_addr = (uint64_t)vq->avail_ring;
+    addr.used_user_addr = (uint64_t)vq->used_ring;
+    if (ioctl(vhost->vhost_fd, VHOST_SET_VRING_ADDR, &addr) < 0)
+        return -1;
+    file.fd = vhost->kick_fd[idx];
+    if (ioctl(vhost->vhost_fd, VHOST_SET_VRING_KICK, &file) < 0)
+        return -1;
+    file.fd = vhost->call_fd[idx];
+    if (ioctl(vhost->vhost_fd, VHOST_SET_VRING_CALL, &file) < 0)
+        return -1;
+    file.fd = vhost->tapfd;
+    if (ioctl(vhost->vhost_fd, VHOST_NET_SET_BACKEND, &file) < 0)
+        return -1;
+    return 0;
+}
+
+static void vhost_stop(VhostNet *vhost) {
+    struct vhost_vring_file file = {.fd = -1};
+    struct vhost_vring_state state;
+    for (unsigned int i = 0; i < NET_DATA_QUEUES; i++) {
+        file.index = i;
+        ioctl(vhost->vhost_fd, VHOST_NET_SET_BACKEND, &file);
+        state.index = i;
+        ioctl(vhost->vhost_fd, VHOST_GET_VRING_BASE, &state);
+    }
+    vhost->started = false;
+}
+
+/// Hand the virtqueues to vhost-net when the driver is ready, take them back
+/// when the device is reset.
+void virtio_net_vhost_activate(VirtIODevice *vdev, bool activate) {
+    NetDev *net = vdev->dev;
+    VhostNet *vhost = net->backend_priv;
+    uint64_t features;
+
+    if (!activate) {
+        if (vhost->started)
+            vhost_stop(vhost);
+        log_info("zone %d vhost-net stopped", vdev->zone_id);
+        return;
+    }
+
+    features = vdev->regs.drv_feature & vhost->features;
+    if (ioctl(vhost->vhost_fd, VHOST_SET_FEATURES, &features) < 0) {
+        log_error("failed to set vhost-net features, errno is %d", errno);
+        return;
+    }
+    if (vhost_set_mem_table(vdev, vhost) < 0) {
+        log_error("failed to set vhost-net mem table, errno is %d", errno);
+        return;
+    }
+    for (uint32_t i = 0; i < NET_DATA_QUEUES; i++) {
+        if (vhost_start_vring(vhost, &vdev->vqs[i]) < 0) {
+            log_error("failed to start vhost-net vring %d, errno is %d", i,
+                      errno);
+            vhost_stop(vhost);
+            return;
+        }
+    }
+    vhost->started = true;
+    // Let vhost pick up buffers the driver added before DRIVER_OK
+    for (int i = 0; i < NET_DATA_QUEUES; i++)
+        eventfd_write(vhost->kick_fd[i], 1);
+    log_info("zone %d vhost-net started, features %#llx", vdev->zone_id,
+             features);
+}
+
+int virtio_net_vhost_init(VirtIODevice *vdev, NetRequestedState *req) {
+    NetDev *net = vdev->dev;
+    VhostNet *vhost = calloc(1, sizeof(VhostNet));
+    int i;
+
+    log_info("virtio net vhost init, tap %s", req->ifname);
+    vhost->vhost_fd = vhost->tapfd = -1;
+    for (i = 0; i < NET_DATA_QUEUES; i++)
+        vhost->kick_fd[i] = vhost->call_fd[i] = -1;
+    net->backend_priv = vhost;
+
+    // vhost-net expects the tap to carry virtio net headers
+    vhost->tapfd = open_tap(req->ifname, true);
+    if (vhost->tapfd < 0)
+        goto err;
+    vhost->vhost_fd = open("/dev/vhost-net", O_RDWR);
+    if (vhost->vhost_fd < 0) {
+        log_error("failed to open /dev/vhost-net, errno is %d", errno);
+        goto err;
+    }
+    if (ioctl(vhost->vhost_fd, VHOST_SET_OWNER, NULL) < 0 ||
+        ioctl(vhost->vhost_fd, VHOST_GET_FEATURES, &vhost->features) < 0) {
+        log_error("failed to set up vhost-net, errno is %d", errno);
+        goto err;
+    }
+    // Only offer what both the daemon and vhost-net can do
+    vdev->regs.dev_feature &= vhost->features | VHOST_NET_DAEMON_FEATURES;
+
+    for (i = 0; i < NET_DATA_QUEUES; i++) {
+        vhost->kick_fd[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        vhost->call_fd[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (vhost->kick_fd[i] < 0 || vhost->call_fd[i] < 0) {
+            log_error("failed to create eventfd, errno is %d", errno);
+            goto err;
+        }
+        vhost->call_event[i] =
+            add_event(vhost->call_fd[i], EPOLLIN,
+                      virtio_net_vhost_call_handler, &vdev->vqs[i]);
+        if (vhost->call_event[i] == NULL) {
+            log_error("Can't register vhost-net call event");
+            goto err;
+        }
+        vdev->vqs[i].notify_handler = virtio_net_vhost_kick;
+    }
+    return 0;
+err:
+    virtio_net_vhost_close(net);
+    return -1;
+}
+
+void virtio_net_vhost_close(NetDev *net) {
+    VhostNet *vhost = net->backend_priv;
+    if (vhost == NULL)
+        return;
+    if (vhost->started)
+        vhost_stop(vhost);
+    for (int i = 0; i < NET_DATA_QUEUES; i++) {
+        if (vhost->kick_fd[i] >= 0)
+            close(vhost->kick_fd[i]);
+        if (vhost->call_fd[i] >= 0)
+            close(vhost->call_fd[i]);
+        free(vhost->call_event[i]);
+    }
+    if (vhost->vhost_fd >= 0)
+        close(vhost->vhost_fd);
+    if (vhost->tapfd >= 0)
+        close(vhost->tapfd);
+    free(vhost);
+    net->backend_priv = NULL;
+}
@@ -0,0 +1,734 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/**
+ * Copyright (c) 2025 Syswonder
+ *
+ * Syswonder Website:
+ *      https://www.syswonder.org
+ */
+// AF_XDP backend of virtio-net.
+// Frames are exchanged with the NIC through a UMEM area shared with the
+// kernel. An XDP program attached to the NIC redirects frames whose
+// destination is the zone's MAC (plus broadcast/multicast) into the XSK bound
+// to the rx queue; everything else continues up the host stack. The program
+// is assembled here and loaded with the bpf syscall directly, so no libbpf is
+// needed. Drivers without zero-copy support fall back to copy mode, which
+// also works on veth pairs and on the generic XDP path.
+#include "virtio_net_xdp.h"
+#include "event_monitor.h"
+#include "log.h"
+#include "virtio.h"
+#include <errno.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <net/if.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+// Entries of a device's XSKMAP, indexed by NIC rx queue. Each device loads
+// its own program and map and fills only the entry of its queue.
+#define XDP_MAX_QUEUES 64
+
+// Number of times tx waits for the completion ring before dropping a frame
+#define XDP_TX_RECLAIM_RETRIES 32
+
+static inline int sys_bpf(int cmd, union bpf_attr *attr) {
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+/*********************************************************************
+    XSK rings
+ */
+static inline uint32_t xsk_load_acquire(uint32_t *p) {
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline void xsk_store_release(uint32_t *p, uint32_t v) {
+    __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+/// Return the number of free entries of a producer ring, at most nb.
+static uint32_t xsk_prod_nb_free(XskRing *r, uint32_t nb) {
+    uint32_t free_entries = r->cached_cons - r->cached_prod;
+    if (free_entries >= nb)
+        return free_entries;
+    // The consumer of a producer ring is shifted by size so that free_entries
+    // can be computed without a branch.
+    r->cached_cons = xsk_load_acquire(r->consumer) + r->size;
+    return r->cached_cons - r->cached_prod;
+}
+
+/// Return the number of available entries of a consumer ring, at most nb.
+static uint32_t xsk_cons_nb_avail(XskRing *r, uint32_t nb) {
+    uint32_t entries = r->cached_prod - r->cached_cons;
+    if (entries == 0) {
+        r->cached_prod = xsk_load_acquire(r->producer);
+        entries = r->cached_prod - r->cached_cons;
+    }
+    return entries > nb ? nb : entries;
+}
+
+static inline uint64_t *xsk_ring_addr(XskRing *r, uint32_t idx) {
+    return &((uint64_t *)r->ring)[idx & r->mask];
+}
+
+static inline struct xdp_desc *xsk_ring_desc(XskRing *r, uint32_t idx) {
+    return &((struct xdp_desc *)r->ring)[idx & r->mask];
+}
+
+/// Make the entries written up to cached_prod visible to the kernel.
+static inline void xsk_prod_publish(XskRing *r) {
+    xsk_store_release(r->producer, r->cached_prod);
+}
+
+static inline void xsk_prod_submit(XskRing *r, uint32_t nb) {
+    r->cached_prod += nb;
+    xsk_prod_publish(r);
+}
+
+static inline void xsk_cons_release(XskRing *r, uint32_t nb) {
+    r->cached_cons += nb;
+    xsk_store_release(r->consumer, r->cached_cons);
+}
+
+static inline bool xsk_ring_needs_wakeup(XskRing *r) {
+    return *(volatile uint32_t *)r->flags & XDP_RING_NEED_WAKEUP;
+}
+
+static int xsk_map_ring(int fd, XskRing *r, struct xdp_ring_offset *off,
+                        uint32_t entry_size, off_t pgoff, bool producer) {
+    r->map_len = off->desc + XDP_RING_SIZE * entry_size;
+    r->map = mmap(NULL, r->map_len, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, fd, pgoff);
+    if (r->map == MAP_FAILED) {
+        log_error("failed to mmap xsk ring, errno is %d", errno);
+        r->map = NULL;
+        return -1;
+    }
+    r->producer = (uint32_t *)((char *)r->map + off->producer);
+    r->consumer = (uint32_t *)((char *)r->map + off->consumer);
+    r->flags = (uint32_t *)((char *)r->map + off->flags);
+    r->ring = (char *)r->map + off->desc;
+    r->size = XDP_RING_SIZE;
+    r->mask = XDP_RING_SIZE - 1;
+    r->cached_prod = *r->producer;
+    r->cached_cons = *r->consumer;
+    if (producer)
+        r->cached_cons += r->size;
+    return 0;
+}
+
+static void xsk_unmap_ring(XskRing *r) {
+    if (r->map)
+        munmap(r->map, r->map_len);
+    r->map = NULL;
+}
+
+/*********************************************************************
+    XDP program
+ */
+#define XDP_INSN(CODE, DST, SRC, OFF, IMM)                                     \
+    ((struct bpf_insn){                                                        \
+        .code = (CODE), .dst_reg = (DST), .src_reg = (SRC), .off = (OFF),     \
+        .imm = (IMM)})
+
+/// Load the steering program. Frames whose destination MAC equals mac, or
+/// that have the group bit set, are redirected to the XSK of the rx queue
+/// they arrived on. Everything else is passed to the host stack. If no XSK is
+/// registered for the queue, bpf_redirect_map falls back to XDP_PASS.
+static int xdp_load_prog(int map_fd, const uint8_t mac[6]) {
+    uint32_t mac_lo;
+    uint16_t mac_hi;
+    union bpf_attr attr;
+    char log_buf[4096];
+    int fd;
+
+    // Loads below are in host byte order, so compare against the MAC bytes
+    // reinterpreted the same way.
+    memcpy(&mac_lo, mac, sizeof(mac_lo));
+    memcpy(&mac_hi, mac + 4, sizeof(mac_hi));
+
+    struct bpf_insn prog[] = {
+        // 0: r6 = ctx
+        XDP_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0),
+        // 1-2: r2 = ctx->data, r3 = ctx->data_end
+        XDP_INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_1,
+                 offsetof(struct xdp_md, data), 0),
+        XDP_INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_1,
+                 offsetof(struct xdp_md, data_end), 0),
+        // 3-5: if (data + 6 > data_end) goto pass
+        XDP_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0),
+        XDP_INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, 6),
+        XDP_INSN(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, 13, 0),
+        // 6-8: if (dst[0] & 1) goto redirect
+        XDP_INSN(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_5, BPF_REG_2, 0, 0),
+        XDP_INSN(BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_5, 0, 0, 1),
+        XDP_INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, 4, 0),
+        // 9-12: if (dst != mac) goto pass
+        XDP_INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_5, BPF_REG_2, 0, 0),
+        XDP_INSN(BPF_JMP32 | BPF_JNE | BPF_K, BPF_REG_5, 0, 8, (int)mac_lo),
+        XDP_INSN(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_5, BPF_REG_2, 4, 0),
+        XDP_INSN(BPF_JMP32 | BPF_JNE | BPF_K, BPF_REG_5, 0, 6, mac_hi),
+        // 13: redirect: r2 = ctx->rx_queue_index
+        XDP_INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6,
+                 offsetof(struct xdp_md, rx_queue_index), 0),
+        // 14-15: r1 = xsks_map
+        XDP_INSN(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0,
+                 map_fd),
+        XDP_INSN(0, 0, 0, 0, 0),
+        // 16-18: return bpf_redirect_map(xsks_map, queue, XDP_PASS)
+        XDP_INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, XDP_PASS),
+        XDP_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map),
+        XDP_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+        // 19-20: pass: return XDP_PASS
+        XDP_INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_PASS),
+        XDP_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+    };
+
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.insns = (uint64_t)(unsigned long)prog;
+    attr.insn_cnt = sizeof(prog) / sizeof(prog[0]);
+    attr.license = (uint64_t)(unsigned long)"GPL";
+    fd = sys_bpf(BPF_PROG_LOAD, &attr);
+    if (fd >= 0)
+        return fd;
+
+    // Load again with the verifier log enabled to report why it failed
+    attr.log_buf = (uint64_t)(unsigned long)log_buf;
+    attr.log_size = sizeof(log_buf);
+    attr.log_level = 1;
+    log_buf[0] = '\0';
+    fd = sys_bpf(BPF_PROG_LOAD, &attr);
+    log_error("failed to load xdp program, errno is %d, verifier: %s", errno,
+              log_buf);
+    if (fd >= 0)
+        close(fd);
+    return -1;
+}
+
+static int xdp_create_xskmap(void) {
+    union bpf_attr attr;
+    int fd;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = sizeof(int);
+    attr.max_entries = XDP_MAX_QUEUES;
+    fd = sys_bpf(BPF_MAP_CREATE, &attr);
+    if (fd < 0)
+        log_error("failed to create xskmap, errno is %d", errno);
+    return fd;
+}
+
+static int xdp_update_xskmap(int map_fd, uint32_t queue_id, int xsk_fd) {
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = map_fd;
+    attr.key = (uint64_t)(unsigned long)&queue_id;
+    attr.value = (uint64_t)(unsigned long)&xsk_fd;
+    attr.flags = BPF_ANY;
+    return sys_bpf(BPF_MAP_UPDATE_ELEM, &attr);
+}
+
+/// Attach (prog_fd >= 0) or detach (prog_fd == -1) the XDP program of an
+/// interface through rtnetlink.
+static int xdp_set_link(int ifindex, int prog_fd, uint32_t flags) {
+    struct {
+        struct nlmsghdr nh;
+        struct ifinfomsg ifi;
+        char attrbuf[64];
+    } req;
+    struct {
+        struct nlmsghdr nh;
+        struct nlmsgerr err;
+    } resp;
+    struct sockaddr_nl sa = {.nl_family = AF_NETLINK};
+    struct rtattr *nest, *rta;
+    int sock, ret = -1;
+
+    sock = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (sock < 0) {
+        log_error("failed to open netlink socket, errno is %d", errno);
+        return -1;
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+    req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+    req.nh.nlmsg_type = RTM_SETLINK;
+    req.ifi.ifi_family = AF_UNSPEC;
+    req.ifi.ifi_index = ifindex;
+
+    nest = (struct rtattr *)((char *)&req + NLMSG_ALIGN(req.nh.nlmsg_len));
+    nest->rta_type = NLA_F_NESTED | IFLA_XDP;
+    nest->rta_len = RTA_LENGTH(0);
+
+    rta = (struct rtattr *)((char *)nest + nest->rta_len);
+    rta->rta_type = IFLA_XDP_FD;
+    rta->rta_len = RTA_LENGTH(sizeof(int));
+    memcpy(RTA_DATA(rta), &prog_fd, sizeof(int));
+    nest->rta_len += RTA_ALIGN(rta->rta_len);
+
+    rta = (struct rtattr *)((char *)nest + nest->rta_len);
+    rta->rta_type = IFLA_XDP_FLAGS;
+    rta->rta_len = RTA_LENGTH(sizeof(uint32_t));
+    memcpy(RTA_DATA(rta), &flags, sizeof(uint32_t));
+    nest->rta_len += RTA_ALIGN(rta->rta_len);
+
+    req.nh.nlmsg_len = NLMSG_ALIGN(req.nh.nlmsg_len) + nest->rta_len;
+
+    if (sendto(sock, &req, req.nh.nlmsg_len, 0, (struct sockaddr *)&sa,
+               sizeof(sa)) < 0) {
+        log_error("failed to send netlink request, errno is %d", errno);
+        goto out;
+    }
+    if (recv(sock, &resp, sizeof(resp), 0) < 0) {
+        log_error("failed to receive netlink ack, errno is %d", errno);
+        goto out;
+    }
+    if (resp.nh.nlmsg_type == NLMSG_ERROR && resp.err.error != 0) {
+        errno = -resp.err.error;
+        goto out;
+    }
+    ret = 0;
+out:
+    close(sock);
+    return ret;
+}
+
+/*********************************************************************
+    Socket setup
+ */
+static int xsk_setup_umem(XdpSocket *xsk) {
+    struct xdp_umem_reg mr;
+    int ring_size = XDP_RING_SIZE;
+
+    xsk->umem_area =
+        mmap(NULL, (size_t)XDP_NUM_FRAMES * XDP_FRAME_SIZE,
+             PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (xsk->umem_area == MAP_FAILED) {
+        log_error("failed to allocate umem");
+        xsk->umem_area = NULL;
+        return -1;
+    }
+
+    memset(&mr, 0, sizeof(mr));
+    mr.addr = (uint64_t)(unsigned long)xsk->umem_area;
+    mr.len = (uint64_t)XDP_NUM_FRAMES * XDP_FRAME_SIZE;
+    mr.chunk_size = XDP_FRAME_SIZE;
+    mr.headroom = 0;
+    if (setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_REG, &mr, sizeof(mr)) < 0) {
+        log_error("failed to register umem, errno is %d", errno);
+        return -1;
+    }
+    if (setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_FILL_RING, &ring_size,
+                   sizeof(ring_size)) < 0 ||
+        setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &ring_size,
+                   sizeof(ring_size)) < 0 ||
+        setsockopt(xsk->fd, SOL_XDP, XDP_RX_RING, &ring_size,
+                   sizeof(ring_size)) < 0 ||
+        setsockopt(xsk->fd, SOL_XDP, XDP_TX_RING, &ring_size,
+                   sizeof(ring_size)) < 0) {
+        log_error("failed to set xsk ring size, errno is %d", errno);
+        return -1;
+    }
+    return 0;
+}
+
+static int xsk_setup_rings(XdpSocket *xsk) {
+    struct xdp_mmap_offsets off;
+    socklen_t optlen = sizeof(off);
+
+    if (getsockopt(xsk->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) < 0) {
+        log_error("failed to get xsk mmap offsets, errno is %d", errno);
+        return -1;
+    }
+    if (xsk_map_ring(xsk->fd, &xsk->fill, &off.fr, sizeof(uint64_t),
+                     XDP_UMEM_PGOFF_FILL_RING, true) ||
+        xsk_map_ring(xsk->fd, &xsk->comp, &off.cr, sizeof(uint64_t),
+                     XDP_UMEM_PGOFF_COMPLETION_RING, false) ||
+        xsk_map_ring(xsk->fd, &xsk->rx, &off.rx, sizeof(struct xdp_desc),
+                     XDP_PGOFF_RX_RING, false) ||
+        xsk_map_ring(xsk->fd, &xsk->tx, &off.tx, sizeof(struct xdp_desc),
+                     XDP_PGOFF_TX_RING, true))
+        return -1;
+
+    // The first half of the umem is lent to the kernel for rx
+    for (uint32_t i = 0; i < XDP_RING_SIZE; i++)
+        *xsk_ring_addr(&xsk->fill, xsk->fill.cached_prod + i) =
+            (uint64_t)i * XDP_FRAME_SIZE;
+    xsk_prod_submit(&xsk->fill, XDP_RING_SIZE);
+
+    // and the second half is kept for tx
+    for (uint32_t i = 0; i < XDP_RING_SIZE; i++)
+        xsk->tx_frames[i] = (uint64_t)(XDP_RING_SIZE + i) * XDP_FRAME_SIZE;
+    xsk->tx_frames_num = XDP_RING_SIZE;
+    return 0;
+}
+
+/// Bind to the NIC queue, trying zero-copy first and copy mode afterwards.
+static int xsk_bind(XdpSocket *xsk) {
+    struct sockaddr_xdp sxdp;
+    memset(&sxdp, 0, sizeof(sxdp));
+    sxdp.sxdp_family = AF_XDP;
+    sxdp.sxdp_ifindex = xsk->ifindex;
+    sxdp.sxdp_queue_id = xsk->queue_id;
+
+    sxdp.sxdp_flags = XDP_ZEROCOPY | XDP_USE_NEED_WAKEUP;
+    if (bind(xsk->fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) == 0) {
+        xsk->zero_copy = true;
+        return 0;
+    }
+    log_info("zero-copy is not supported by the driver, errno is %d, "
+             "fall back to copy mode",
+             errno);
+    sxdp.sxdp_flags = XDP_COPY | XDP_USE_NEED_WAKEUP;
+    if (bind(xsk->fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) == 0) {
+        xsk->zero_copy = false;
+        return 0;
+    }
+    if (errno == EBUSY)
+        log_error("queue %u is already bound to another xsk, maybe of another "
+                  "xdp device",
+                  xsk->queue_id);
+    else
+        log_error("failed to bind xsk to queue %u, errno is %d",
+                  xsk->queue_id, errno);
+    return -1;
+}
+
+/// Load the steering program and attach it to the NIC, preferring the
+/// driver (native) hook and falling back to the generic one. A NIC holds one
+/// program, so it serves a single xdp device; an existing program is kept.
+static int xdp_attach(XdpSocket *xsk, const uint8_t mac[6], bool generic) {
+    char ifname[IF_NAMESIZE];
+
+    xsk->map_fd = xdp_create_xskmap();
+    if (xsk->map_fd < 0)
+        return -1;
+    xsk->prog_fd = xdp_load_prog(xsk->map_fd, mac);
+    if (xsk->prog_fd < 0)
+        return -1;
+
+    if (!generic) {
+        xsk->attach_flags = XDP_FLAGS_DRV_MODE | XDP_FLAGS_UPDATE_IF_NOEXIST;
+        if (xdp_set_link(xsk->ifindex, xsk->prog_fd, xsk->attach_flags) == 0)
+            return 0;
+        if (errno == EBUSY || errno == EEXIST)
+            goto busy;
+        log_info("native xdp is not supported, errno is %d, use generic xdp",
+                 errno);
+    }
+    xsk->attach_flags = XDP_FLAGS_SKB_MODE | XDP_FLAGS_UPDATE_IF_NOEXIST;
+    if (xdp_set_link(xsk->ifindex, xsk->prog_fd, xsk->attach_flags) == 0)
+        return 0;
+    if (errno == EBUSY || errno == EEXIST)
+        goto busy;
+    log_error("failed to attach xdp program, errno is %d", errno);
+    xsk->attach_flags = 0;
+    return -1;
+busy:
+    log_error("%s already has an xdp program, maybe of another xdp device; a "
+              "NIC can serve only one",
+              if_indextoname(xsk->ifindex, ifname) ? ifname : "the nic");
+    xsk->attach_flags = 0;
+    return -1;
+}
+
+/*********************************************************************
+    Data path
+ */
+/// Copy a frame received from the NIC into one rx descriptor chain.
+static bool xdp_rx_one(VirtQueue *vq, const uint8_t *data, uint32_t len) {
+    struct iovec *iov = NULL;
+    NetHdr *vnet_header;
+    uint32_t copied = 0, off = sizeof(NetHdr), chunk;
+    uint16_t idx;
+    int n, i;
+
+    n = process_descriptor_chain(vq, &idx, &iov, NULL, 0, false);
+    if (n < 1 || iov[0].iov_len < sizeof(NetHdr)) {
+        log_error("invalid net rx descriptor chain");
+        free(iov);
+        return false;
+    }
+    vnet_header = iov[0].iov_base;
+    memset(vnet_header, 0, sizeof(NetHdr));
+    vnet_header->num_buffers = 1;
+
+    for (i = 0; i < n && copied < len; i++, off = 0) {
+        if (iov[i].iov_len <= off)
+            continue;
+        chunk = MIN(iov[i].iov_len - off, len - copied);
+        memcpy((char *)iov[i].iov_base + off, data + copied, chunk);
+        copied += chunk;
+    }
+    if (copied < len)
+        log_warn("net rx buffer too small, frame truncated from %u to %u",
+                 len, copied);
+    update_used_ring(vq, idx, copied + sizeof(NetHdr));
+    free(iov);
+    return true;
+}
+
+/// Called when the rx ring of the xsk has frames
+static void virtio_net_xdp_rx_handler(int fd, int epoll_type, void *param) {
+    VirtIODevice *vdev = param;
+    NetDev *net = vdev->dev;
+    XdpSocket *xsk = net->backend_priv;
+    VirtQueue *vq = &vdev->vqs[NET_QUEUE_RX];
+    uint32_t i, n, delivered = 0;
+    struct xdp_desc *desc;
+    bool starved = false;
+    uint8_t *data;
+
+    if (fd != xsk->fd || epoll_type != EPOLLIN) {
+        log_error("invalid event");
+        return;
+    }
+
+    while ((n = xsk_cons_nb_avail(&xsk->rx, XDP_BATCH_SIZE)) > 0) {
+        // The fill ring has as many entries as there are rx frames, so there
+        // is always room to give the consumed frames back.
+        for (i = 0; i < n; i++) {
+            desc = xsk_ring_desc(&xsk->rx, xsk->rx.cached_cons + i);
+            data = (uint8_t *)xsk->umem_area + desc->addr;
+            // Drop frames the driver filtered out, and all frames while it
+            // has no rx buffers, like the tap backend does.
+            if (!virtio_net_rx_accept(net, data, desc->len)) {
+                xsk->rx_filtered++;
+            } else if (net->rx_ready <= 0 || virtqueue_is_empty(vq)) {
+                starved = net->rx_ready > 0;
+                xsk->rx_no_buffers++;
+            } else if (xdp_rx_one(vq, data, desc->len)) {
+                delivered++;
+                xsk->rx_packets++;
+            } else {
+                xsk->rx_dropped++;
+            }
+            *xsk_ring_addr(&xsk->fill, xsk->fill.cached_prod + i) =
+                desc->addr & ~((uint64_t)XDP_FRAME_SIZE - 1);
+        }
+        xsk_cons_release(&xsk->rx, n);
+        xsk_prod_submit(&xsk->fill, n);
+    }
+
+    if (xsk_ring_needs_wakeup(&xsk->fill))
+        recvfrom(xsk->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+
+    // Also kick a zone that ran out of rx buffers so that it refills them
+    if (delivered || starved)
+        virtio_inject_irq(vq);
+}
+
+/// Move completed tx frames back to the free stack.
+static void xsk_reclaim_tx(XdpSocket *xsk) {
+    uint32_t i, n;
+    n = xsk_cons_nb_avail(&xsk->comp, XDP_RING_SIZE);
+    for (i = 0; i < n; i++)
+        xsk->tx_frames[xsk->tx_frames_num++] =
+            *xsk_ring_addr(&xsk->comp, xsk->comp.cached_cons + i);
+    xsk_cons_release(&xsk->comp, n);
+    xsk->tx_outstanding -= n;
+}
+
+static inline void xsk_kick_tx(XdpSocket *xsk) {
+    if (!xsk_ring_needs_wakeup(&xsk->tx))
+        return;
+    if (sendto(xsk->fd, NULL, 0, MSG_DONTWAIT, NULL, 0) < 0 &&
+        errno != EAGAIN && errno != EBUSY && errno != ENOBUFS)
+        log_error("failed to kick xsk tx, errno is %d", errno);
+}
+
+/// Get a free umem frame and a tx ring slot, kicking the kernel and waiting
+/// for completions if all frames are in flight.
+static bool xsk_get_tx_frame(XdpSocket *xsk, uint64_t *addr) {
+    for (int retry = 0; retry < XDP_TX_RECLAIM_RETRIES; retry++) {
+        if (xsk->tx_frames_num == 0)
+            xsk_reclaim_tx(xsk);
+        if (xsk->tx_frames_num > 0 && xsk_prod_nb_free(&xsk->tx, 1) > 0) {
+            *addr = xsk->tx_frames[--xsk->tx_frames_num];
+            return true;
+        }
+        xsk_prod_publish(&xsk->tx);
+        if (sendto(xsk->fd, NULL, 0, MSG_DONTWAIT, NULL, 0) < 0 &&
+            errno != EAGAIN && errno != EBUSY && errno != ENOBUFS)
+            break;
+    }
+    return false;
+}
+
+int virtio_net_xdp_tx(VirtIODevice *vdev, VirtQueue *vq) {
+    NetDev *net = vdev->dev;
+    XdpSocket *xsk = net->backend_priv;
+    struct iovec *iov = NULL;
+    struct xdp_desc *desc;
+    uint32_t pending = 0, all_len, packet_len, off;
+    uint64_t addr;
+    uint16_t idx;
+    uint8_t *frame;
+    int i, n;
+
+    xsk_reclaim_tx(xsk);
+    virtqueue_disable_notify(vq);
+    while (!virtqueue_is_empty(vq)) {
+        n = process_descriptor_chain(vq, &idx, &iov, NULL, 0, false);
+        if (n < 1)
+            break;
+        for (i = 0, all_len = 0; i < n; i++)
+            all_len += iov[i].iov_len;
+        packet_len = all_len - sizeof(NetHdr);
+
+        if (all_len < sizeof(NetHdr) || packet_len > XDP_FRAME_SIZE ||
+            !xsk_get_tx_frame(xsk, &addr)) {
+            xsk->tx_dropped++;
+            update_used_ring(vq, idx, all_len);
+            free(iov);
+            continue;
+        }
+
+        // Gather the chain into the frame, skipping the virtio net header
+        frame = (uint8_t *)xsk->umem_area + addr;
+        off = sizeof(NetHdr);
+        packet_len = 0;
+        for (i = 0; i < n; i++) {
+            if (iov[i].iov_len <= off) {
+                off -= iov[i].iov_len;
+                continue;
+            }
+            memcpy(frame + packet_len, (char *)iov[i].iov_base + off,
+                   iov[i].iov_len - off);
+            packet_len += iov[i].iov_len - off;
+            off = 0;
+        }
+        // The mininum packet for data link layer is 64 bytes.
+        if (packet_len < 64) {
+            memset(frame + packet_len, 0, 64 - packet_len);
+            packet_len = 64;
+        }
+
+        desc = xsk_ring_desc(&xsk->tx, xsk->tx.cached_prod);
+        desc->addr = addr;
+        desc->len = packet_len;
+        desc->options = 0;
+        xsk->tx.cached_prod++;
+        xsk->tx_outstanding++;
+        xsk->tx_packets++;
+
+        update_used_ring(vq, idx, all_len);
+        free(iov);
+
+        if (++pending == XDP_BATCH_SIZE) {
+            xsk_prod_publish(&xsk->tx);
+            xsk_kick_tx(xsk);
+            pending = 0;
+        }
+    }
+    xsk_prod_publish(&xsk->tx);
+    xsk_kick_tx(xsk);
+    virtqueue_enable_notify(vq);
+    return 0;
+}
+
+/*********************************************************************
+    Init and close
+ */
+int virtio_net_xdp_init(VirtIODevice *vdev, NetRequestedState *req) {
+    NetDev *net = vdev->dev;
+    XdpSocket *xsk;
+
+    log_info("virtio net xdp init, ifname %s, queue %u", req->ifname,
+             req->queue_id);
+    if (req->queue_id >= XDP_MAX_QUEUES) {
+        log_error("xdp queue %u exceeds max limit", req->queue_id);
+        return -1;
+    }
+    xsk = calloc(1, sizeof(XdpSocket));
+    xsk->fd = xsk->prog_fd = xsk->map_fd = -1;
+    xsk->queue_id = req->queue_id;
+    net->backend_priv = xsk;
+
+    xsk->ifindex = if_nametoindex(req->ifname);
+    if (xsk->ifindex == 0) {
+        log_error("can't find interface %s", req->ifname);
+        goto err;
+    }
+    xsk->fd = socket(AF_XDP, SOCK_RAW | SOCK_CLOEXEC, 0);
+    if (xsk->fd < 0) {
+        log_error("failed to create AF_XDP socket, errno is %d", errno);
+        goto err;
+    }
+    if (xsk_setup_umem(xsk) || xsk_setup_rings(xsk) || xsk_bind(xsk))
+        goto err;
+    if (xdp_attach(xsk, net->config.mac, req->xdp_generic))
+        goto err;
+    // The program steers frames by this MAC, so the zone can't change it
+    vdev->regs.dev_feature &= ~(1ULL << VIRTIO_NET_F_CTRL_MAC_ADDR);
+    if (xdp_update_xskmap(xsk->map_fd, xsk->queue_id, xsk->fd) < 0) {
+        log_error("failed to insert xsk to xskmap, errno is %d", errno);
+        goto err;
+    }
+
+    net->event = add_event(xsk->fd, EPOLLIN, virtio_net_xdp_rx_handler, vdev);
+    if (net->event == NULL) {
+        log_error("Can't register net xdp event");
+        goto err;
+    }
+    log_info("virtio net xdp on %s queue %u, %s mode, %s hook", req->ifname,
+             xsk->queue_id, xsk->zero_copy ? "zero-copy" : "copy",
+             (xsk->attach_flags & XDP_FLAGS_SKB_MODE) ? "generic" : "native");
+    return 0;
+err:
+    virtio_net_xdp_close(net);
+    return -1;
+}
+
+void virtio_net_xdp_stats(NetDev *net) {
+    XdpSocket *xsk = net->backend_priv;
+    if (xsk == NULL)
+        return;
+    log_warn("  xdp: rx %llu, dropped %llu (no buffers %llu, filtered %llu), "
+             "tx %llu, dropped %llu",
+             xsk->rx_packets, xsk->rx_dropped + xsk->rx_no_buffers,
+             xsk->rx_no_buffers, xsk->rx_filtered, xsk->tx_packets,
+             xsk->tx_dropped);
+}
+
+void virtio_net_xdp_close(NetDev *net) {
+    XdpSocket *xsk = net->backend_priv;
+    if (xsk == NULL)
+        return;
+    virtio_net_xdp_stats(net);
+    if (xsk->attach_flags)
+        xdp_set_link(xsk->ifindex, -1, xsk->attach_flags &
+                                           ~XDP_FLAGS_UPDATE_IF_NOEXIST);
+    xsk_unmap_ring(&xsk->fill);
+    xsk_unmap_ring(&xsk->comp);
+    xsk_unmap_ring(&xsk->rx);
+    xsk_unmap_ring(&xsk->tx);
+    if (xsk->fd >= 0)
+        close(xsk->fd);
+    if (xsk->prog_fd >= 0)
+        close(xsk->prog_fd);
+    if (xsk->map_fd >= 0)
+        close(xsk->map_fd);
+    if (xsk->umem_area)
+        munmap(xsk->umem_area, (size_t)XDP_NUM_FRAMES * XDP_FRAME_SIZE);
+    free(xsk);
+    net->backend_priv = NULL;
+}
@@ -0,0 +1,365 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/**
+ * Copyright (c) 2025 Syswonder
+ *
+ * Syswonder Website:
+ *      https://www.syswonder.org
+ */
+// virtio-pmem: a host file shown to a zone as persistent memory. The zone
+// maps the region with DAX and reads it with plain loads, so the daemon is
+// only involved in flushes. The region is zone RAM reserved like the regions
+// of memory_region, filled from the file at start. A flush writes the chunks
+// changed since the last one back to the file and syncs it.
+#include "virtio_pmem.h"
+#include "log.h"
+#include "virtio.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Devices of all zones, to refuse regions shared by several zones
+static PmemDev *pmem_devs[MAX_DEVS];
+static pthread_mutex_t pmem_devs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+PmemDev *init_pmem_dev() {
+    PmemDev *dev = (PmemDev *)calloc(1, sizeof(PmemDev));
+    dev->fd = -1;
+    pthread_mutex_init(&dev->mtx, NULL);
+    pthread_cond_init(&dev->cond, NULL);
+    TAILQ_INIT(&dev->procq);
+    return dev;
+}
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+/// A 64-bit hash of a chunk, with four independent lanes so it runs at
+/// memory speed. len is a multiple of the page size.
+static uint64_t pmem_chunk_hash(const uint8_t *chunk, uint64_t len) {
+    const uint64_t p1 = 0x9E3779B185EBCA87ULL, p2 = 0xC2B2AE3D27D4EB4FULL;
+    uint64_t h[4] = {p1 + p2, p2, 0, -p1}, w;
+    for (uint64_t i = 0; i < len; i += 32) {
+        for (int l = 0; l < 4; l++) {
+            memcpy(&w, chunk + i + l * 8, sizeof(w));
+            h[l] = rotl64(h[l] + w * p2, 31) * p1;
+        }
+    }
+    return rotl64(h[0], 1) + rotl64(h[1], 7) + rotl64(h[2], 12) +
+           rotl64(h[3], 18);
+}
+
+/// Write a run of chunks and take their new hashes once it is in the file.
+static int pmem_write_run(PmemDev *dev, uint64_t chunk, uint64_t count) {
+    uint64_t off = chunk * PMEM_CHUNK_SIZE;
+    uint64_t len = MIN(count * PMEM_CHUNK_SIZE, dev->config.size - off);
+    ssize_t n;
+    while (len > 0) {
+        n = pwrite(dev->fd, dev->region + off, len, off);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            log_error("Failed to write pmem file %s, errno is %d", dev->file,
+                      errno);
+            return -1;
+        }
+        off += n;
+        len -= n;
+        dev->written_bytes += n;
+    }
+    memcpy(dev->chunk_hash + chunk, dev->next_hash + chunk,
+           count * sizeof(uint64_t));
+    return 0;
+}
+
+/// Write the chunks that changed since they were last written back, in runs
+/// of consecutive chunks, and sync the file. Chunks that failed to be written
+/// keep their old hash, so the next flush tries them again.
+static int pmem_writeback(PmemDev *dev) {
+    uint64_t start = 0, count = 0, off;
+    int err = 0;
+
+    for (uint64_t c = 0; c < dev->nchunks; c++) {
+        off = c * PMEM_CHUNK_SIZE;
+        dev->next_hash[c] = pmem_chunk_hash(
+            dev->region + off, MIN(PMEM_CHUNK_SIZE, dev->config.size - off));
+        if (dev->next_hash[c] == dev->chunk_hash[c])
+            continue;
+        if (count > 0 && start + count == c) {
+            count++;
+            continue;
+        }
+        if (count > 0 && pmem_write_run(dev, start, count))
+            err = -1;
+        start = c;
+        count = 1;
+    }
+    if (count > 0 && pmem_write_run(dev, start, count))
+        err = -1;
+    if (fdatasync(dev->fd) < 0) {
+        log_error("Failed to sync pmem file %s, errno is %d", dev->file,
+                  errno);
+        err = -1;
+    }
+    dev->flushes++;
+    return err;
+}
+
+/// Write the status of a flush to the writable buffer of its request. The
+/// guest fails the flush on any ret but 0, an errno tells why.
+static void pmem_complete(struct pmem_req *req, uint32_t ret) {
+    struct virtio_pmem_resp resp = {.ret = ret};
+    for (int i = req->iovcnt - 1; i >= 0; i--) {
+        if ((req->flags[i] & VRING_DESC_F_WRITE) &&
+            req->iov[i].iov_len >= sizeof(resp)) {
+            memcpy(req->iov[i].iov_base, &resp, sizeof(resp));
+            update_used_ring(req->vq, req->idx, sizeof(resp));
+            return;
+        }
+    }
+    log_error("pmem request without room for the response");
+    update_used_ring(req->vq, req->idx, 0);
+}
+
+/// Flushes queued while a writeback runs all wait for the next one, which
+/// covers every write they could be ordered after.
+static void *pmem_flush_thread(void *param) {
+    VirtIODevice *vdev = param;
+    PmemDev *dev = vdev->dev;
+    TAILQ_HEAD(, pmem_req) batch;
+    struct virtio_pmem_req preq;
+    struct pmem_req *req;
+    VirtQueue *vq = NULL;
+    uint32_t ret;
+
+    for (;;) {
+        pthread_mutex_lock(&dev->mtx);
+        while (TAILQ_EMPTY(&dev->procq) && !dev->close)
+            pthread_cond_wait(&dev->cond, &dev->mtx);
+        if (dev->close) {
+            pthread_mutex_unlock(&dev->mtx);
+            break;
+        }
+        TAILQ_INIT(&batch);
+        TAILQ_CONCAT(&batch, &dev->procq, link);
+        pthread_mutex_unlock(&dev->mtx);
+
+        ret = dev->readonly ? 0 : (pmem_writeback(dev) ? EIO : 0);
+        while ((req = TAILQ_FIRST(&batch))) {
+            TAILQ_REMOVE(&batch, req, link);
+            if (req->iov[0].iov_len < sizeof(preq) ||
+                (req->flags[0] & VRING_DESC_F_WRITE)) {
+                pmem_complete(req, EINVAL);
+            } else {
+                memcpy(&preq, req->iov[0].iov_base, sizeof(preq));
+                pmem_complete(req, preq.type == VIRTIO_PMEM_REQ_TYPE_FLUSH
+                                       ? ret
+                                       : EINVAL);
+            }
+            vq = req->vq;
+            free(req->iov);
+            free(req->flags);
+            free(req);
+        }
+        virtio_inject_irq(vq);
+    }
+    return NULL;
+}
+
+int virtio_pmem_notify_handler(VirtIODevice *vdev, VirtQueue *vq) {
+    PmemDev *dev = vdev->dev;
+    struct pmem_req *req;
+    int n;
+
+    while (!virtqueue_is_empty(vq)) {
+        virtqueue_disable_notify(vq);
+        while (!virtqueue_is_empty(vq)) {
+            req = (struct pmem_req *)calloc(1, sizeof(struct pmem_req));
+            n = process_descriptor_chain(vq, &req->idx, &req->iov,
+                                         &req->flags, 0, true);
+            if (n < 1) {
+                free(req);
+                break;
+            }
+            req->vq = vq;
+            req->iovcnt = n;
+            pthread_mutex_lock(&dev->mtx);
+            TAILQ_INSERT_TAIL(&dev->procq, req, link);
+            pthread_cond_signal(&dev->cond);
+            pthread_mutex_unlock(&dev->mtx);
+        }
+        virtqueue_enable_notify(vq);
+    }
+    return 0;
+}
+
+/// Fill the region from the file. A writable file grows to the size of the
+/// region, a read-only one leaves the rest of the region zeroed.
+static int pmem_load(PmemDev *dev) {
+    struct stat st;
+    uint64_t off = 0;
+    ssize_t n;
+
+    if (fstat(dev->fd, &st) < 0)
+        return -1;
+    if ((uint64_t)st.st_size > dev->config.size) {
+        log_error("pmem file %s is larger than its region", dev->file);
+        return -1;
+    }
+    if (!dev->readonly && (uint64_t)st.st_size < dev->config.size &&
+        ftruncate(dev->fd, dev->config.size) < 0) {
+        log_error("Failed to extend pmem file %s, errno is %d", dev->file,
+                  errno);
+        return -1;
+    }
+    while (off < (uint64_t)st.st_size) {
+        n = pread(dev->fd, dev->region + off, st.st_size - off, off);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            log_error("Failed to read pmem file %s, errno is %d", dev->file,
+                      errno);
+            return -1;
+        }
+        off += n;
+    }
+    memset(dev->region + off, 0, dev->config.size - off);
+    return 0;
+}
+
+/// Refuse a region overlapping the one of another device. Stage-2 maps the
+/// region as RAM, so even a read-only device can't keep a zone from writing
+/// into what another zone reads.
+static int pmem_check_overlap(PmemDev *dev) {
+    PmemDev *other;
+    for (int i = 0; i < MAX_DEVS; i++) {
+        other = pmem_devs[i];
+        if (other == NULL ||
+            other->zone0_ipa >= dev->zone0_ipa + dev->config.size ||
+            dev->zone0_ipa >= other->zone0_ipa + other->config.size)
+            continue;
+        log_error("pmem region %#llx overlaps the one of another device",
+                  (unsigned long long)dev->zone0_ipa);
+        return -1;
+    }
+    return 0;
+}
+
+static void virtio_pmem_stats(VirtIODevice *vdev) {
+    PmemDev *dev = vdev->dev;
+    log_warn("zone %d virtio pmem %s: %llu flushes, %llu bytes written back",
+             vdev->zone_id, dev->file, dev->flushes, dev->written_bytes);
+}
+
+int virtio_pmem_init(VirtIODevice *vdev, PmemRequestedState *req) {
+    PmemDev *dev = vdev->dev;
+    int err;
+
+    vdev->virtio_close = virtio_pmem_close;
+    vdev->virtio_stats = virtio_pmem_stats;
+    if (req == NULL || req->file[0] == '\0' || req->size == 0 ||
+        req->size % PMEM_PAGE_SIZE || req->zonex_ipa % PMEM_PAGE_SIZE) {
+        log_error("pmem needs a file and a page aligned region");
+        return -1;
+    }
+    if (req->size % PMEM_ALIGN || req->zonex_ipa % PMEM_ALIGN)
+        log_warn("pmem region %#llx isn't 2 MiB aligned, the guest may not "
+                 "map it with DAX",
+                 (unsigned long long)req->zonex_ipa);
+    if (snprintf(dev->file, sizeof(dev->file), "%s", req->file) >=
+        (int)sizeof(dev->file)) {
+        log_error("pmem file %s is too long", req->file);
+        return -1;
+    }
+    dev->readonly = req->readonly;
+    dev->zone0_ipa = req->zone0_ipa;
+    dev->config.start = req->zonex_ipa;
+    dev->config.size = req->size;
+
+    dev->fd = open(dev->file, (dev->readonly ? O_RDONLY : O_RDWR) | O_CLOEXEC);
+    if (dev->fd < 0) {
+        log_error("Failed to open pmem file %s, errno is %d", dev->file,
+                  errno);
+        return -1;
+    }
+    // Also zone RAM, for guest buffers in the region, e.g. O_DIRECT I/O on a
+    // DAX mapped file
+    dev->region = map_zone_mem(vdev->zone_id, req->zone0_ipa, req->zonex_ipa,
+                               req->size);
+    if (dev->region == NULL)
+        return -1;
+
+    pthread_mutex_lock(&pmem_devs_lock);
+    err = pmem_check_overlap(dev);
+    if (!err)
+        err = pmem_load(dev);
+    for (int i = 0; !err && i < MAX_DEVS; i++) {
+        if (pmem_devs[i] == NULL) {
+            pmem_devs[i] = dev;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pmem_devs_lock);
+    if (err)
+        return -1;
+
+    if (!dev->readonly) {
+        dev->nchunks = (req->size + PMEM_CHUNK_SIZE - 1) / PMEM_CHUNK_SIZE;
+        dev->chunk_hash = malloc(dev->nchunks * sizeof(uint64_t));
+        dev->next_hash = malloc(dev->nchunks * sizeof(uint64_t));
+        for (uint64_t c = 0; c < dev->nchunks; c++)
+            dev->chunk_hash[c] = pmem_chunk_hash(
+                dev->region + c * PMEM_CHUNK_SIZE,
+                MIN(PMEM_CHUNK_SIZE, req->size - c * PMEM_CHUNK_SIZE));
+    }
+    if (pthread_create(&dev->flush_thread, NULL, pmem_flush_thread, vdev)) {
+        log_error("Failed to create pmem flush thread");
+        return -1;
+    }
+    log_info("pmem %s at %#llx, %llu MiB%s", dev->file,
+             (unsigned long long)dev->config.start,
+             (unsigned long long)(dev->config.size >> 20),
+             dev->readonly ? ", read-only" : "");
+    return 0;
+}
+
+void virtio_pmem_close(VirtIODevice *vdev) {
+    PmemDev *dev = vdev->dev;
+    struct pmem_req *req;
+
+    if (dev->flush_thread) {
+        pthread_mutex_lock(&dev->mtx);
+        dev->close = 1;
+        pthread_cond_broadcast(&dev->cond);
+        pthread_mutex_unlock(&dev->mtx);
+        pthread_join(dev->flush_thread, NULL);
+    }
+    while ((req = TAILQ_FIRST(&dev->procq))) {
+        TAILQ_REMOVE(&dev->procq, req, link);
+        free(req->iov);
+        free(req->flags);
+        free(req);
+    }
+    // Keep what the zone wrote even if it never flushed. The region itself
+    // is unmapped with the rest of the zone's RAM.
+    if (dev->chunk_hash) {
+        pmem_writeback(dev);
+        free(dev->chunk_hash);
+        free(dev->next_hash);
+    }
+    pthread_mutex_lock(&pmem_devs_lock);
+    for (int i = 0; i < MAX_DEVS; i++)
+        if (pmem_devs[i] == dev)
+            pmem_devs[i] = NULL;
+    pthread_mutex_unlock(&pmem_devs_lock);
+    if (dev->fd >= 0)
+        close(dev->fd);
+    free(dev);
+    free(vdev->vqs);
+    free(vdev);
+}
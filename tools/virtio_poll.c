@@ -0,0 +1,237 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/**
+ * Copyright (c) 2025 Syswonder
+ *
+ * Syswonder Website:
+ *      https://www.syswonder.org
+ */
+// Polled virtqueues: a thread pinned to a dedicated CPU watches the avail
+// rings of a device in zone memory and runs the notify handlers itself. While
+// it polls, notifications of its queues stay suppressed, so a request costs
+// the guest no exit into hvisor and no signal to the daemon. After idle_us
+// without new buffers it enables notifications again and sleeps until the
+// next QUEUE_NOTIFY.
+#define _GNU_SOURCE
+#include "virtio_poll.h"
+#include "log.h"
+#include "virtio.h"
+#include "virtio_net.h"
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static bool virtio_poll_queue(VirtioPoller *p, VirtQueue *vq) {
+    return (p->req.queues & (1ULL << vq->vq_idx)) && vq->ready &&
+           vq->avail_ring != NULL;
+}
+
+/// Suppress or enable notifications of the polled queues.
+static void virtio_poll_suppress(VirtioPoller *p, bool suppress) {
+    VirtIODevice *vdev = p->vdev;
+
+    for (uint32_t i = 0; i < vdev->vqs_len; i++) {
+        VirtQueue *vq = &vdev->vqs[i];
+        if (!virtio_poll_queue(p, vq))
+            continue;
+        if (suppress) {
+            vq->polled = 1;
+            virtqueue_disable_notify(vq);
+        } else {
+            vq->polled = 0;
+            virtqueue_enable_notify(vq);
+        }
+    }
+}
+
+/// Run the notify handler of every polled queue with new buffers.
+static bool virtio_poll_pass(VirtioPoller *p) {
+    VirtIODevice *vdev = p->vdev;
+    bool busy = false;
+
+    for (uint32_t i = 0; i < vdev->vqs_len; i++) {
+        VirtQueue *vq = &vdev->vqs[i];
+        if (!vq->polled || vq->last_avail_idx == vq->avail_ring->idx)
+            continue;
+        vq->notify_handler(vdev, vq);
+        busy = true;
+    }
+    return busy;
+}
+
+static bool virtio_poll_pending(VirtioPoller *p) {
+    VirtIODevice *vdev = p->vdev;
+
+    for (uint32_t i = 0; i < vdev->vqs_len; i++) {
+        VirtQueue *vq = &vdev->vqs[i];
+        if (virtio_poll_queue(p, vq) &&
+            vq->last_avail_idx != vq->avail_ring->idx)
+            return true;
+    }
+    return false;
+}
+
+static uint64_t virtio_poll_elapsed_us(struct timespec *from,
+                                       struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) * 1000000ULL +
+           (to->tv_nsec - from->tv_nsec) / 1000;
+}
+
+static void *virtio_poll_thread(void *arg) {
+    VirtioPoller *p = arg;
+    struct timespec last_busy, now;
+    bool busy;
+
+    pthread_mutex_lock(&p->mtx);
+    for (;;) {
+        while (!p->close && !(p->active && (p->polling || p->kicked)))
+            pthread_cond_wait(&p->cond, &p->mtx);
+        if (p->close)
+            break;
+        if (!p->polling) {
+            virtio_poll_suppress(p, true);
+            p->polling = true;
+            clock_gettime(CLOCK_MONOTONIC, &last_busy);
+        }
+        p->kicked = false;
+        p->in_pass = true;
+        pthread_mutex_unlock(&p->mtx);
+
+        busy = virtio_poll_pass(p);
+
+        pthread_mutex_lock(&p->mtx);
+        p->in_pass = false;
+        p->passes++;
+        if (busy) {
+            p->busy_passes++;
+            clock_gettime(CLOCK_MONOTONIC, &last_busy);
+        } else if (p->req.idle_us && p->active) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (virtio_poll_elapsed_us(&last_busy, &now) >= p->req.idle_us) {
+                virtio_poll_suppress(p, false);
+                p->polling = false;
+                p->fallbacks++;
+                // The guest may have added buffers before it saw the
+                // notifications enabled, without a kick
+                rw_barrier();
+                if (virtio_poll_pending(p))
+                    p->kicked = true;
+            }
+        }
+        // Wake a reset waiting for the pass
+        pthread_cond_broadcast(&p->cond);
+    }
+    pthread_mutex_unlock(&p->mtx);
+    return NULL;
+}
+
+int virtio_poll_init(VirtIODevice *vdev, PollRequestedState *req) {
+    VirtioPoller *p;
+    cpu_set_t cpus;
+    int err;
+
+    if (req->queues >> vdev->vqs_len) {
+        log_error("zone %d %s has only %d queues to poll", vdev->zone_id,
+                  virtio_device_type_to_string(vdev->type), vdev->vqs_len);
+        return -1;
+    }
+    p = calloc(1, sizeof(VirtioPoller));
+    p->vdev = vdev;
+    p->req = *req;
+    // The receive queue of virtio-net is refilled ahead of time, it always
+    // has buffers
+    if (!p->req.queues)
+        p->req.queues = vdev->type == VirtioTNet ? 1ULL << NET_QUEUE_TX
+                                                 : (1ULL << vdev->vqs_len) - 1;
+    pthread_mutex_init(&p->mtx, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    err = pthread_create(&p->tid, NULL, virtio_poll_thread, p);
+    if (err) {
+        log_error("failed to create poller, errno is %d", err);
+        goto err_create;
+    }
+    if (req->cpu >= 0) {
+        CPU_ZERO(&cpus);
+        CPU_SET(req->cpu, &cpus);
+        err = pthread_setaffinity_np(p->tid, sizeof(cpus), &cpus);
+        if (err) {
+            log_error("failed to pin poller to cpu %d, errno is %d", req->cpu,
+                      err);
+            goto err_pin;
+        }
+    }
+    vdev->poller = p;
+    log_info("zone %d %s polls queues %#llx on cpu %d, idle %u us",
+             vdev->zone_id, virtio_device_type_to_string(vdev->type),
+             p->req.queues, req->cpu, req->idle_us);
+    return 0;
+
+err_pin:
+    pthread_mutex_lock(&p->mtx);
+    p->close = true;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->mtx);
+    pthread_join(p->tid, NULL);
+err_create:
+    pthread_mutex_destroy(&p->mtx);
+    pthread_cond_destroy(&p->cond);
+    free(p);
+    return -1;
+}
+
+bool virtio_poll_kick(VirtIODevice *vdev, uint32_t idx) {
+    VirtioPoller *p = vdev->poller;
+
+    if (!(p->req.queues & (1ULL << idx)))
+        return false;
+    pthread_mutex_lock(&p->mtx);
+    p->kicked = true;
+    p->kicks++;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->mtx);
+    return true;
+}
+
+void virtio_poll_activate(VirtIODevice *vdev, bool activate) {
+    VirtioPoller *p = vdev->poller;
+
+    pthread_mutex_lock(&p->mtx);
+    p->active = activate;
+    if (activate) {
+        // Buffers may have been added before DRIVER_OK
+        p->kicked = true;
+        pthread_cond_broadcast(&p->cond);
+    } else {
+        while (p->in_pass)
+            pthread_cond_wait(&p->cond, &p->mtx);
+        // The queues are reset next, leave the rings alone
+        for (uint32_t i = 0; i < vdev->vqs_len; i++)
+            vdev->vqs[i].polled = 0;
+        p->polling = p->kicked = false;
+    }
+    pthread_mutex_unlock(&p->mtx);
+}
+
+void virtio_poll_stats(VirtIODevice *vdev) {
+    VirtioPoller *p = vdev->poller;
+
+    log_warn("zone %d %s poller: %llu passes, %llu busy, %llu kicks, %llu "
+             "fallbacks to notifications",
+             vdev->zone_id, virtio_device_type_to_string(vdev->type),
+             p->passes, p->busy_passes, p->kicks, p->fallbacks);
+}
+
+void virtio_poll_close(VirtIODevice *vdev) {
+    VirtioPoller *p = vdev->poller;
+
+    pthread_mutex_lock(&p->mtx);
+    p->close = true;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->mtx);
+    pthread_join(p->tid, NULL);
+    pthread_mutex_destroy(&p->mtx);
+    pthread_cond_destroy(&p->cond);
+    vdev->poller = NULL;
+    free(p);
+}
@@ -0,0 +1,611 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/**
+ * Copyright (c) 2025 Syswonder
+ *
+ * Syswonder Website:
+ *      https://www.syswonder.org
+ */
+// Supervisor mode: instead of hosting every device, the daemon forks worker
+// processes, one per zone or per device, each with its own CPUs and
+// scheduling policy. The daemon keeps receiving the MMIO requests from
+// hvisor and routes each one to the worker of its device through a ring in
+// shared memory. Workers answer the requests and inject interrupts through
+// virtio_bridge themselves. A worker that crashes, or leaves its ring full
+// for SUPERVISOR_DISPATCH_TIMEOUT and is killed, has its devices answered as
+// missing ones. Until then, requests of the other zones wait as well.
+//
+// The daemon stays the only consumer of the bridge ring. Still, the module
+// signals the eventfd of a worker for the requests of its zone and MMIO
+// windows, so the worker wakes up while the supervisor routes the request.
+#define _GNU_SOURCE
+#include "virtio_supervisor.h"
+#include "event_monitor.h"
+#include "log.h"
+#include "virtio.h"
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+extern int ko_fd;
+extern volatile struct virtio_bridge *virtio_bridge;
+extern pthread_mutex_t *res_mutex;
+
+static enum supervisor_isolation isolation;
+static SupervisorShm *shm;
+static SupervisorWorker workers[SUPERVISOR_MAX_WORKERS];
+static int nworkers;
+static SupervisorRoute routes[MAX_DEVS];
+static int nroutes;
+// The worker this process is, -1 in the supervisor
+static int current_worker = -1;
+static pid_t supervisor_pid;
+// Signalled by the module for every request, wakes the supervisor
+static int irq_efd = -1;
+
+bool supervisor_active(void) {
+    return isolation != ISOLATION_NONE && current_worker < 0;
+}
+
+bool supervisor_owns_zone(int zone_id) {
+    return current_worker < 0 || workers[current_worker].zone_id == zone_id;
+}
+
+bool supervisor_owns_device(int zone_id, int index) {
+    return current_worker < 0 ||
+           (workers[current_worker].zone_id == zone_id &&
+            (workers[current_worker].devices & (1ULL << index)));
+}
+
+bool supervisor_owns_switch(int index) {
+    return current_worker < 0 ||
+           (workers[current_worker].switches & (1U << index));
+}
+
+/*********************************************************************
+    Planning the workers from the json
+ */
+int supervisor_read_isolation(char *json_path) {
+    u_int64_t file_size;
+    char *buffer = read_file(json_path, &file_size);
+    cJSON *root, *item;
+    int ret = ISOLATION_NONE;
+
+    buffer[file_size] = '\0';
+    root = SAFE_CJSON_PARSE(buffer);
+    item = cJSON_GetObjectItem(root, "isolation");
+    if (item == NULL || strcmp(item->valuestring, "none") == 0)
+        ret = ISOLATION_NONE;
+    else if (strcmp(item->valuestring, "zone") == 0)
+        ret = ISOLATION_ZONE;
+    else if (strcmp(item->valuestring, "device") == 0)
+        ret = ISOLATION_DEVICE;
+    else {
+        log_error("unknown isolation %s", item->valuestring);
+        ret = -1;
+    }
+    cJSON_Delete(root);
+    free(buffer);
+    if (ret >= 0)
+        isolation = ret;
+    return ret;
+}
+
+static int supervisor_parse_sched(cJSON *json, SupervisorSched *sched) {
+    cJSON *item;
+    int min, max;
+
+    if (json == NULL)
+        return 0;
+    item = cJSON_GetObjectItem(json, "cpus");
+    for (int i = 0; i < cJSON_GetArraySize(item); i++) {
+        int cpu = cJSON_GetArrayItem(item, i)->valueint;
+        if (cpu < 0 || cpu >= 64) {
+            log_error("invalid worker cpu %d", cpu);
+            return -1;
+        }
+        sched->cpus |= 1ULL << cpu;
+    }
+    item = cJSON_GetObjectItem(json, "policy");
+    if (item == NULL || strcmp(item->valuestring, "other") == 0)
+        sched->policy = SCHED_OTHER;
+    else if (strcmp(item->valuestring, "fifo") == 0)
+        sched->policy = SCHED_FIFO;
+    else if (strcmp(item->valuestring, "rr") == 0)
+        sched->policy = SCHED_RR;
+    else {
+        log_error("unknown worker policy %s", item->valuestring);
+        return -1;
+    }
+    item = cJSON_GetObjectItem(json, "priority");
+    sched->priority = item ? item->valueint : 0;
+    min = sched_get_priority_min(sched->policy);
+    max = sched_get_priority_max(sched->policy);
+    if (sched->policy != SCHED_OTHER && item == NULL)
+        sched->priority = min;
+    if (sched->priority < min || sched->priority > max) {
+        log_error("worker priority %d is out of [%d, %d]", sched->priority, min,
+                  max);
+        return -1;
+    }
+    return 0;
+}
+
+static int supervisor_add_worker(int zone_id, SupervisorSched *sched) {
+    SupervisorWorker *w;
+    if (nworkers == SUPERVISOR_MAX_WORKERS) {
+        log_error("too many workers");
+        return -1;
+    }
+    w = &workers[nworkers];
+    w->zone_id = zone_id;
+    w->sched = *sched;
+    w->efd = -1;
+    return nworkers++;
+}
+
+/// Index of a switch in "switches", -1 if it has no entry there.
+static int supervisor_switch_index(cJSON *switches_json, const char *name) {
+    for (int i = 0; i < cJSON_GetArraySize(switches_json); i++) {
+        cJSON *item = cJSON_GetObjectItem(
+            cJSON_GetArrayItem(switches_json, i), "name");
+        if (item && strcmp(item->valuestring, name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/// Give every enabled device a worker, and note the MMIO region to route.
+static int supervisor_plan(cJSON *root) {
+    cJSON *zones_json = SAFE_CJSON_GET_OBJECT_ITEM(root, "zones");
+    cJSON *switches_json = cJSON_GetObjectItem(root, "switches");
+    int switch_owner[32];
+
+    memset(switch_owner, -1, sizeof(switch_owner));
+    for (int i = 0; i < cJSON_GetArraySize(zones_json); i++) {
+        cJSON *zone_json = SAFE_CJSON_GET_ARRAY_ITEM(zones_json, i);
+        cJSON *devices_json = SAFE_CJSON_GET_OBJECT_ITEM(zone_json, "devices");
+        int zone_id = SAFE_CJSON_GET_OBJECT_ITEM(zone_json, "id")->valueint;
+        SupervisorSched zone_sched = {0};
+        int zone_worker = -1;
+
+        if (supervisor_parse_sched(cJSON_GetObjectItem(zone_json, "worker"),
+                                   &zone_sched) < 0)
+            return -1;
+        for (int j = 0; j < cJSON_GetArraySize(devices_json); j++) {
+            cJSON *device = SAFE_CJSON_GET_ARRAY_ITEM(devices_json, j);
+            cJSON *worker_json = cJSON_GetObjectItem(device, "worker");
+            cJSON *item;
+            SupervisorSched sched = zone_sched;
+            int w, k;
+
+            if (strcmp(SAFE_CJSON_GET_OBJECT_ITEM(device, "status")
+                           ->valuestring,
+                       "disable") == 0)
+                continue;
+            if (j >= 64 || nroutes == MAX_DEVS) {
+                log_error("too many devices");
+                return -1;
+            }
+            // A device with its own "worker" always gets a worker of its own
+            if (worker_json == NULL && isolation == ISOLATION_ZONE &&
+                zone_worker >= 0) {
+                w = zone_worker;
+            } else {
+                if (worker_json)
+                    memset(&sched, 0, sizeof(sched));
+                if (supervisor_parse_sched(worker_json, &sched) < 0)
+                    return -1;
+                w = supervisor_add_worker(zone_id, &sched);
+                if (w < 0)
+                    return -1;
+                if (worker_json == NULL && isolation == ISOLATION_ZONE)
+                    zone_worker = w;
+            }
+            workers[w].devices |= 1ULL << j;
+            routes[nroutes].zone_id = zone_id;
+            routes[nroutes].base_addr = strtoull(
+                SAFE_CJSON_GET_OBJECT_ITEM(device, "addr")->valuestring, NULL,
+                16);
+            routes[nroutes].len = strtoull(
+                SAFE_CJSON_GET_OBJECT_ITEM(device, "len")->valuestring, NULL,
+                16);
+            routes[nroutes++].worker = w;
+
+            // The ports of a switch must live in one worker, which also
+            // opens its uplink
+            item = cJSON_GetObjectItem(device, "backend");
+            if (item == NULL || strcmp(item->valuestring, "switch") != 0)
+                continue;
+            k = supervisor_switch_index(
+                switches_json,
+                SAFE_CJSON_GET_OBJECT_ITEM(device, "switch")->valuestring);
+            if (k < 0 || k >= 32)
+                continue;
+            if (switch_owner[k] >= 0 && switch_owner[k] != w) {
+                log_error("switch %d has ports in two workers", k);
+                return -1;
+            }
+            switch_owner[k] = w;
+            workers[w].switches |= 1U << k;
+        }
+    }
+    return 0;
+}
+
+/*********************************************************************
+    Workers
+ */
+static int supervisor_apply_sched(SupervisorSched *sched) {
+    struct sched_param param = {.sched_priority = sched->priority};
+    cpu_set_t cpus;
+
+    if (sched->cpus) {
+        CPU_ZERO(&cpus);
+        for (int i = 0; i < 64; i++)
+            if (sched->cpus & (1ULL << i))
+                CPU_SET(i, &cpus);
+        if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0) {
+            log_error("failed to pin worker, errno is %d", errno);
+            return -1;
+        }
+    }
+    // Threads the devices create later inherit both
+    if (sched_setscheduler(0, sched->policy, &param) < 0) {
+        log_error("failed to set worker policy, errno is %d", errno);
+        return -1;
+    }
+    return 0;
+}
+
+/// Handle the requests in the ring, in order.
+static void supervisor_worker_drain(SupervisorRing *ring,
+                                    SupervisorWorker *w) {
+    struct device_req req;
+    uint32_t front = ring->front;
+
+    while (front != ring->rear) {
+        read_barrier();
+        req = ring->reqs[front % SUPERVISOR_RING_SIZE];
+        virtio_handle_req(&req);
+        ring->front = ++front;
+        w->requests++;
+    }
+}
+
+/// Wait a little for the supervisor to route the request the module woke the
+/// worker for. need_wakeup stays clear, so the supervisor doesn't signal the
+/// worker again.
+static void supervisor_worker_await(SupervisorRing *ring) {
+    struct timespec start, now;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (ring->front == ring->rear) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if ((now.tv_sec - start.tv_sec) * 1000000 +
+                (now.tv_nsec - start.tv_nsec) / 1000 >=
+            SUPERVISOR_EARLY_WAKE_US)
+            break;
+        sched_yield();
+    }
+}
+
+static void supervisor_worker_main(int index, char *json_path) {
+    SupervisorWorker *w = &workers[index];
+    SupervisorRing *ring = &shm->rings[index];
+    struct signalfd_siginfo info;
+    struct pollfd pfds[2];
+    char name[16];
+    sigset_t mask;
+    eventfd_t cnt;
+
+    current_worker = index;
+    snprintf(name, sizeof(name), "hvisor-zone%d", w->zone_id);
+    prctl(PR_SET_NAME, name, 0, 0, 0);
+    // Don't outlive the supervisor
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() != supervisor_pid)
+        _exit(1);
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    pfds[0].fd = w->efd;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = signalfd(-1, &mask, SFD_CLOEXEC);
+    pfds[1].events = POLLIN;
+
+    if (pfds[1].fd < 0 || supervisor_apply_sched(&w->sched) < 0 ||
+        initialize_event_monitor() < 0 ||
+        virtio_start_from_json(json_path) < 0) {
+        log_error("worker of zone %d failed to start", w->zone_id);
+        shm->state[index] = WORKER_FAILED;
+        _exit(1);
+    }
+    log_info("worker %d of zone %d started, pid %d", index, w->zone_id,
+             getpid());
+    write_barrier();
+    shm->state[index] = WORKER_READY;
+
+    for (;;) {
+        supervisor_worker_drain(ring, w);
+        // Ask for a wakeup, then check for a request queued meanwhile
+        ring->need_wakeup = 1;
+        rw_barrier();
+        if (ring->front != ring->rear) {
+            ring->need_wakeup = 0;
+            continue;
+        }
+        if (poll(pfds, 2, -1) < 0 && errno != EINTR)
+            log_error("worker poll failed, errno is %d", errno);
+        ring->need_wakeup = 0;
+        if (pfds[0].revents & POLLIN) {
+            eventfd_read(w->efd, &cnt);
+            w->wakeups++;
+            supervisor_worker_await(ring);
+        }
+        if ((pfds[1].revents & POLLIN) &&
+            read(pfds[1].fd, &info, sizeof(info)) == sizeof(info)) {
+            if (info.ssi_signo == SIGTERM)
+                break;
+            log_warn("worker %d of zone %d: %llu requests, %llu wakeups",
+                     index, w->zone_id, w->requests, w->wakeups);
+            virtio_dump_stats();
+        }
+    }
+    virtio_close();
+    _exit(0);
+}
+
+/// Answer the requests a dead worker left, as for a missing device.
+static void supervisor_flush_ring(int index) {
+    SupervisorRing *ring = &shm->rings[index];
+    while (ring->front != ring->rear) {
+        virtio_handle_req(&ring->reqs[ring->front % SUPERVISOR_RING_SIZE]);
+        ring->front++;
+    }
+}
+
+void supervisor_reap(void) {
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (int i = 0; i < nworkers; i++) {
+            if (workers[i].pid != pid)
+                continue;
+            if (WIFSIGNALED(status))
+                log_error("worker %d of zone %d killed by signal %d", i,
+                          workers[i].zone_id, WTERMSIG(status));
+            else
+                log_error("worker %d of zone %d exited with %d", i,
+                          workers[i].zone_id, WEXITSTATUS(status));
+            shm->state[i] = WORKER_DEAD;
+            supervisor_flush_ring(i);
+        }
+    }
+}
+
+/// Wait for room in the ring of a worker. A worker that doesn't take a
+/// request for SUPERVISOR_DISPATCH_TIMEOUT is hung, it is killed so that the
+/// other zones stop waiting for it.
+static void supervisor_wait_ring(int w) {
+    SupervisorRing *ring = &shm->rings[w];
+    struct timespec start, now;
+    int spins = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (ring->rear - ring->front >= SUPERVISOR_RING_SIZE &&
+           shm->state[w] == WORKER_READY) {
+        if (++spins % 1000 == 0) {
+            supervisor_reap();
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if ((now.tv_sec - start.tv_sec) * 1000 +
+                    (now.tv_nsec - start.tv_nsec) / 1000000 >=
+                SUPERVISOR_DISPATCH_TIMEOUT) {
+                log_error("worker %d of zone %d is hung, killing it", w,
+                          workers[w].zone_id);
+                shm->state[w] = WORKER_FAILED;
+                kill(workers[w].pid, SIGKILL);
+            }
+        }
+        sched_yield();
+    }
+}
+
+int supervisor_dispatch_req(volatile struct device_req *req) {
+    SupervisorRing *ring;
+    int i, w;
+
+    for (i = 0; i < nroutes; i++)
+        if (req->src_zone == (uint32_t)routes[i].zone_id &&
+            in_range(req->address, routes[i].base_addr, routes[i].len))
+            break;
+    if (i == nroutes)
+        return virtio_handle_req(req);
+    w = routes[i].worker;
+    ring = &shm->rings[w];
+    supervisor_wait_ring(w);
+    // The requests left in the ring are answered once the worker is reaped
+    if (shm->state[w] != WORKER_READY)
+        return virtio_handle_req(req);
+
+    ring->reqs[ring->rear % SUPERVISOR_RING_SIZE] = *req;
+    write_barrier();
+    ring->rear++;
+    rw_barrier();
+    if (ring->need_wakeup) {
+        workers[w].wakeups++;
+        eventfd_write(workers[w].efd, 1);
+    }
+    workers[w].requests++;
+    return 0;
+}
+
+/// Register the eventfd of each worker for its zone and the MMIO windows of
+/// its devices, and one more for the supervisor. The module signals the
+/// supervisor's for every request, as it no longer wakes the readers of
+/// /dev/hvisor for requests a filter matches.
+static void supervisor_register_eventfds(void) {
+    eventfd_args_t args = {0};
+    struct hvisor_eventfd_filter *filter;
+
+    if (nroutes + 1 > HVISOR_MAX_EVENTFDS) {
+        log_info("%d devices are too many for eventfds of the workers",
+                 nroutes);
+        return;
+    }
+    irq_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (irq_efd < 0) {
+        log_error("failed to create eventfd, errno is %d", errno);
+        return;
+    }
+    for (int i = 0; i < nroutes; i++) {
+        filter = &args.filters[i];
+        filter->fd = workers[routes[i].worker].efd;
+        filter->zone_id = routes[i].zone_id;
+        filter->mmio_start = routes[i].base_addr;
+        filter->mmio_size = routes[i].len;
+    }
+    filter = &args.filters[nroutes];
+    filter->fd = irq_efd;
+    filter->zone_id = HVISOR_ANY_ZONE;
+    args.num = nroutes + 1;
+    // Older modules have no eventfds, the supervisor polls /dev/hvisor
+    if (ioctl(ko_fd, HVISOR_SET_EVENTFDS, &args) < 0) {
+        log_info("hvisor module has no eventfds, errno is %d", errno);
+        close(irq_efd);
+        irq_efd = -1;
+    }
+}
+
+int supervisor_irq_fd(void) {
+    return irq_efd;
+}
+
+int supervisor_start(char *json_path) {
+    u_int64_t file_size;
+    char *buffer = read_file(json_path, &file_size);
+    pthread_mutexattr_t attr;
+    cJSON *root;
+    int err, ready;
+
+    buffer[file_size] = '\0';
+    root = SAFE_CJSON_PARSE(buffer);
+    err = supervisor_plan(root);
+    cJSON_Delete(root);
+    free(buffer);
+    if (err)
+        return -1;
+
+    shm = mmap(NULL, sizeof(SupervisorShm), PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shm == MAP_FAILED) {
+        log_error("failed to map supervisor memory");
+        shm = NULL;
+        return -1;
+    }
+    // Workers of all zones push interrupts to the same res list. One may die
+    // holding the lock.
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&shm->res_mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    res_mutex = &shm->res_mutex;
+
+    for (int i = 0; i < nworkers; i++) {
+        workers[i].efd = eventfd(0, EFD_CLOEXEC);
+        if (workers[i].efd < 0) {
+            log_error("failed to create eventfd, errno is %d", errno);
+            return -1;
+        }
+    }
+    supervisor_pid = getpid();
+    for (int i = 0; i < nworkers; i++) {
+        workers[i].pid = fork();
+        if (workers[i].pid < 0) {
+            log_error("failed to fork worker, errno is %d", errno);
+            shm->state[i] = WORKER_DEAD;
+            return -1;
+        }
+        if (workers[i].pid == 0)
+            supervisor_worker_main(i, json_path);
+    }
+
+    // Wait for all workers to create their devices
+    for (int t = 0; t < SUPERVISOR_START_TIMEOUT * 100; t++) {
+        supervisor_reap();
+        ready = 0;
+        for (int i = 0; i < nworkers; i++) {
+            if (shm->state[i] == WORKER_FAILED ||
+                shm->state[i] == WORKER_DEAD) {
+                log_error("worker %d of zone %d failed", i,
+                          workers[i].zone_id);
+                return -1;
+            }
+            ready += shm->state[i] == WORKER_READY;
+        }
+        if (ready == nworkers)
+            break;
+        usleep(10000);
+    }
+    if (ready != nworkers) {
+        log_error("workers didn't start in %d seconds",
+                  SUPERVISOR_START_TIMEOUT);
+        return -1;
+    }
+
+    for (int i = 0; i < nroutes; i++)
+        virtio_bridge->mmio_addrs[i] = routes[i].base_addr;
+    supervisor_register_eventfds();
+    log_warn("supervisor started %d workers for %d devices", nworkers,
+             nroutes);
+    return 0;
+}
+
+void supervisor_dump_stats(void) {
+    static const char *states[] = {"starting", "ready", "failed", "dead"};
+    for (int i = 0; i < nworkers; i++) {
+        log_warn("worker %d of zone %d, pid %d: %s, %llu requests, "
+                 "%llu wakeups",
+                 i, workers[i].zone_id, workers[i].pid, states[shm->state[i]],
+                 workers[i].requests, workers[i].wakeups);
+        if (shm->state[i] == WORKER_READY)
+            kill(workers[i].pid, SIGUSR2);
+    }
+}
+
+/// Stop the workers, which close their devices.
+void supervisor_close(void) {
+    eventfd_args_t args = {0};
+
+    if (shm == NULL)
+        return;
+    if (irq_efd >= 0) {
+        ioctl(ko_fd, HVISOR_SET_EVENTFDS, &args);
+        close(irq_efd);
+        irq_efd = -1;
+    }
+    for (int i = 0; i < nworkers; i++)
+        if (workers[i].pid > 0 && shm->state[i] != WORKER_DEAD)
+            kill(workers[i].pid, SIGTERM);
+    for (int i = 0; i < nworkers; i++) {
+        if (workers[i].pid > 0 && shm->state[i] != WORKER_DEAD)
+            waitpid(workers[i].pid, NULL, 0);
+        if (workers[i].efd >= 0)
+            close(workers[i].efd);
+    }
+    munmap(shm, sizeof(SupervisorShm));
+    shm = NULL;
+}
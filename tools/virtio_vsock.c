@@ -0,0 +1,804 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/**
+ * Copyright (c) 2025 Syswonder
+ *
+ * Syswonder Website:
+ *      https://www.syswonder.org
+ */
+// virtio-vsock with the host side on AF_UNIX sockets, as firecracker does.
+// A guest connecting to port P of the host (CID 2) reaches the socket
+// listening on <uds_path>_<P>. A host program connects to <uds_path>, writes
+// "CONNECT <P>\n" and, once the guest accepted, reads "OK <local port>\n" and
+// then talks to port P of the guest.
+// Both directions use the credit of the virtio-vsock protocol: the guest
+// never has more than VSOCK_CONN_BUF_SIZE bytes in flight per connection,
+// and the device never reads more from a socket than the guest has room for.
+#define _GNU_SOURCE
+
+#include "virtio_vsock.h"
+#include "log.h"
+#include "virtio.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// The wake fd, the listening socket and the connections
+#define VSOCK_MAX_POLLFDS (2 + VSOCK_MAX_CONNS)
+
+VsockDev *init_vsock_dev() {
+    VsockDev *dev = (VsockDev *)calloc(1, sizeof(VsockDev));
+    dev->listen_fd = dev->wake_fd = -1;
+    dev->next_port = VSOCK_HOST_PORT_BASE;
+    pthread_mutex_init(&dev->lock, NULL);
+    return dev;
+}
+
+static inline void vsock_wake(VsockDev *dev) {
+    eventfd_write(dev->wake_fd, 1);
+}
+
+/// Copy len bytes at offset off of the iovec into buf.
+static size_t vsock_iov_to_buf(const struct iovec *iov, int n, size_t off,
+                               void *buf, size_t len) {
+    size_t done = 0, chunk;
+    for (int i = 0; i < n && done < len; i++) {
+        if (off >= iov[i].iov_len) {
+            off -= iov[i].iov_len;
+            continue;
+        }
+        chunk = MIN(len - done, iov[i].iov_len - off);
+        memcpy((uint8_t *)buf + done, (uint8_t *)iov[i].iov_base + off, chunk);
+        done += chunk;
+        off = 0;
+    }
+    return done;
+}
+
+static size_t vsock_iov_from_buf(const struct iovec *iov, int n,
+                                 const void *buf, size_t len) {
+    size_t done = 0, chunk;
+    for (int i = 0; i < n && done < len; i++) {
+        chunk = MIN(len - done, iov[i].iov_len);
+        memcpy(iov[i].iov_base, (const uint8_t *)buf + done, chunk);
+        done += chunk;
+    }
+    return done;
+}
+
+/// Make out describe at most len bytes of iov after its first off bytes.
+/// Return the number of entries of out.
+static int vsock_iov_slice(const struct iovec *iov, int n, size_t off,
+                           size_t len, struct iovec *out) {
+    int m = 0;
+    for (int i = 0; i < n && len > 0; i++) {
+        if (off >= iov[i].iov_len) {
+            off -= iov[i].iov_len;
+            continue;
+        }
+        out[m].iov_base = (uint8_t *)iov[i].iov_base + off;
+        out[m].iov_len = MIN(len, iov[i].iov_len - off);
+        len -= out[m].iov_len;
+        off = 0;
+        m++;
+    }
+    return m;
+}
+
+/*********************************************************************
+    Connection table
+ */
+static inline uint32_t conn_hash(uint32_t local_port, uint32_t peer_port) {
+    return (local_port * 2654435761u ^ peer_port) & (VSOCK_CONN_HASH_SIZE - 1);
+}
+
+static VsockConn *conn_find(VsockDev *dev, uint32_t local_port,
+                            uint32_t peer_port) {
+    VsockConn *c = dev->hash[conn_hash(local_port, peer_port)];
+    while (c && (c->local_port != local_port || c->peer_port != peer_port))
+        c = c->next;
+    return c;
+}
+
+static void conn_hash_add(VsockDev *dev, VsockConn *c) {
+    uint32_t h = conn_hash(c->local_port, c->peer_port);
+    c->next = dev->hash[h];
+    dev->hash[h] = c;
+}
+
+/// Connections of host programs join the hash once they named the port.
+static VsockConn *conn_new(VsockDev *dev, int fd, uint32_t local_port,
+                           uint32_t peer_port, VsockConnState state) {
+    VsockConn *c;
+    if (dev->nconns == VSOCK_MAX_CONNS) {
+        log_warn("too many vsock connections");
+        return NULL;
+    }
+    c = (VsockConn *)calloc(1, sizeof(VsockConn));
+    c->buf = malloc(VSOCK_CONN_BUF_SIZE);
+    c->fd = fd;
+    c->local_port = local_port;
+    c->peer_port = peer_port;
+    c->state = state;
+    dev->conns[dev->nconns++] = c;
+    if (state != VSOCK_CONN_HANDSHAKE)
+        conn_hash_add(dev, c);
+    dev->connections++;
+    return c;
+}
+
+static void conn_free(VsockDev *dev, VsockConn *c) {
+    VsockConn **p;
+    if (c->state != VSOCK_CONN_HANDSHAKE) {
+        p = &dev->hash[conn_hash(c->local_port, c->peer_port)];
+        while (*p != c)
+            p = &(*p)->next;
+        *p = c->next;
+    }
+    for (int i = 0; i < dev->nconns; i++) {
+        if (dev->conns[i] == c) {
+            dev->conns[i] = dev->conns[--dev->nconns];
+            break;
+        }
+    }
+    close(c->fd);
+    free(c->buf);
+    free(c);
+}
+
+static bool conn_valid(VsockDev *dev, VsockConn *c) {
+    for (int i = 0; i < dev->nconns; i++)
+        if (dev->conns[i] == c)
+            return true;
+    return false;
+}
+
+/// Credit the guest has for data from the host.
+static inline uint32_t conn_peer_credit(VsockConn *c) {
+    uint32_t in_flight = c->rx_cnt - c->peer_fwd_cnt;
+    return in_flight < c->peer_buf_alloc ? c->peer_buf_alloc - in_flight : 0;
+}
+
+/*********************************************************************
+    Packets to the guest
+ */
+static void vsock_ctrl_queue(VsockDev *dev, uint32_t local_port,
+                             uint32_t peer_port, uint16_t op,
+                             uint32_t flags) {
+    VsockCtrl *ctrl;
+    if (dev->ctrl_count == VSOCK_MAX_CTRL) {
+        log_warn("vsock control queue full, op %d to port %u dropped", op,
+                 peer_port);
+        return;
+    }
+    ctrl = &dev->ctrl[(dev->ctrl_head + dev->ctrl_count++) % VSOCK_MAX_CTRL];
+    ctrl->local_port = local_port;
+    ctrl->peer_port = peer_port;
+    ctrl->op = op;
+    ctrl->flags = flags;
+}
+
+/// Reset a connection, the guest gets an RST.
+static void vsock_conn_reset(VsockDev *dev, VsockConn *c) {
+    if (c->state != VSOCK_CONN_HANDSHAKE)
+        vsock_ctrl_queue(dev, c->local_port, c->peer_port,
+                         VIRTIO_VSOCK_OP_RST, 0);
+    dev->resets++;
+    conn_free(dev, c);
+}
+
+static void vsock_credit_update(VsockDev *dev, VsockConn *c, bool force) {
+    if (c->credit_pending ||
+        (!force && c->fwd_cnt - c->fwd_cnt_sent < VSOCK_CONN_BUF_SIZE / 2))
+        return;
+    c->credit_pending = true;
+    vsock_ctrl_queue(dev, c->local_port, c->peer_port,
+                     VIRTIO_VSOCK_OP_CREDIT_UPDATE, 0);
+}
+
+/// Every packet tells the guest how much of its data was consumed.
+static void vsock_fill_hdr(VsockDev *dev, struct virtio_vsock_hdr *hdr,
+                           VsockConn *c, uint32_t local_port,
+                           uint32_t peer_port, uint16_t op, uint32_t flags,
+                           uint32_t len) {
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->src_cid = VSOCK_HOST_CID;
+    hdr->dst_cid = dev->config.guest_cid;
+    hdr->src_port = local_port;
+    hdr->dst_port = peer_port;
+    hdr->len = len;
+    hdr->type = VIRTIO_VSOCK_TYPE_STREAM;
+    hdr->op = op;
+    hdr->flags = flags;
+    hdr->buf_alloc = VSOCK_CONN_BUF_SIZE;
+    if (c) {
+        hdr->fwd_cnt = c->fwd_cnt;
+        c->fwd_cnt_sent = c->fwd_cnt;
+        if (op == VIRTIO_VSOCK_OP_CREDIT_UPDATE)
+            c->credit_pending = false;
+    }
+}
+
+/// A connection with data for the guest, taken in turns.
+static VsockConn *vsock_next_readable(VsockDev *dev, int *start) {
+    for (int i = 0; i < dev->nconns; i++) {
+        VsockConn *c = dev->conns[(*start + i) % dev->nconns];
+        if (c->state == VSOCK_CONN_ESTABLISHED && c->readable && !c->eof &&
+            conn_peer_credit(c) > 0) {
+            *start = (*start + i + 1) % dev->nconns;
+            return c;
+        }
+    }
+    return NULL;
+}
+
+static void vsock_conn_eof(VsockDev *dev, VsockConn *c) {
+    c->eof = true;
+    c->readable = false;
+    vsock_ctrl_queue(dev, c->local_port, c->peer_port,
+                     VIRTIO_VSOCK_OP_SHUTDOWN,
+                     VIRTIO_VSOCK_SHUTDOWN_RCV | VIRTIO_VSOCK_SHUTDOWN_SEND);
+}
+
+/// Fill rx buffers with control packets first, then with data read from the
+/// sockets straight into guest memory. The caller holds the lock.
+static void vsock_rx(VirtIODevice *vdev) {
+    VsockDev *dev = vdev->dev;
+    VirtQueue *vq = &vdev->vqs[VSOCK_QUEUE_RX];
+    struct virtio_vsock_hdr hdr;
+    struct iovec *iov = NULL;
+    VsockConn *c;
+    VsockCtrl *ctrl;
+    ssize_t len;
+    uint16_t idx;
+    int n, m, start = 0;
+    bool used = false;
+
+    while (dev->rx_ready && !virtqueue_is_empty(vq)) {
+        if (dev->ctrl_count > 0) {
+            n = process_descriptor_chain(vq, &idx, &iov, NULL, 0, false);
+            if (n < 1)
+                break;
+            ctrl = &dev->ctrl[dev->ctrl_head];
+            dev->ctrl_head = (dev->ctrl_head + 1) % VSOCK_MAX_CTRL;
+            dev->ctrl_count--;
+            vsock_fill_hdr(dev, &hdr,
+                           conn_find(dev, ctrl->local_port, ctrl->peer_port),
+                           ctrl->local_port, ctrl->peer_port, ctrl->op,
+                           ctrl->flags, 0);
+            len = vsock_iov_from_buf(iov, n, &hdr, sizeof(hdr));
+            update_used_ring(vq, idx, len);
+            free(iov);
+            used = true;
+            continue;
+        }
+
+        c = vsock_next_readable(dev, &start);
+        if (c == NULL)
+            break;
+        n = process_descriptor_chain(vq, &idx, &iov, NULL, 0, false);
+        if (n < 1)
+            break;
+        {
+            struct iovec data[n];
+            m = vsock_iov_slice(iov, n, sizeof(hdr), conn_peer_credit(c),
+                                data);
+            len = m > 0 ? readv(c->fd, data, m) : -1;
+        }
+        if (len <= 0) {
+            vq->last_avail_idx--;
+            c->readable = false;
+            if (len == 0 || (m > 0 && errno != EAGAIN &&
+                             errno != EWOULDBLOCK && errno != EINTR))
+                vsock_conn_eof(dev, c);
+            else if (m == 0)
+                log_error("vsock rx buffer too small");
+            free(iov);
+            if (m == 0)
+                break;
+            continue;
+        }
+        vsock_fill_hdr(dev, &hdr, c, c->local_port, c->peer_port,
+                       VIRTIO_VSOCK_OP_RW, 0, len);
+        vsock_iov_from_buf(iov, n, &hdr, sizeof(hdr));
+        update_used_ring(vq, idx, sizeof(hdr) + len);
+        free(iov);
+        c->rx_cnt += len;
+        dev->rx_bytes += len;
+        used = true;
+    }
+    if (used)
+        virtio_inject_irq(vq);
+}
+
+/*********************************************************************
+    Packets from the guest
+ */
+/// Write buffered guest data to the socket, and finish a shutdown of the
+/// guest once everything is written.
+static void vsock_conn_flush(VsockDev *dev, VsockConn *c) {
+    uint32_t off, len;
+    ssize_t written;
+
+    while (c->buf_tail != c->buf_head) {
+        off = c->buf_tail & (VSOCK_CONN_BUF_SIZE - 1);
+        len = MIN(c->buf_head - c->buf_tail, VSOCK_CONN_BUF_SIZE - off);
+        written = write(c->fd, c->buf + off, len);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            vsock_conn_reset(dev, c);
+            return;
+        }
+        c->buf_tail += written;
+        c->fwd_cnt += written;
+    }
+    vsock_credit_update(dev, c, false);
+    if (c->buf_tail != c->buf_head)
+        return;
+    if ((c->peer_shutdown & VIRTIO_VSOCK_SHUTDOWN_SEND) && !c->shut_wr) {
+        shutdown(c->fd, SHUT_WR);
+        c->shut_wr = true;
+    }
+    // The guest closed its socket and waits for our RST
+    if (c->peer_shutdown ==
+        (VIRTIO_VSOCK_SHUTDOWN_RCV | VIRTIO_VSOCK_SHUTDOWN_SEND))
+        vsock_conn_reset(dev, c);
+}
+
+/// Hand guest data to the socket. What the socket takes right away is
+/// written from guest memory, only the rest is copied.
+static void vsock_conn_tx(VsockDev *dev, VsockConn *c, struct iovec *iov,
+                          int n, uint32_t len) {
+    size_t off = sizeof(struct virtio_vsock_hdr), chunk;
+    ssize_t written;
+    uint32_t pos;
+
+    if (c->buf_head - c->buf_tail + len > VSOCK_CONN_BUF_SIZE) {
+        log_warn("vsock guest port %u sent beyond its credit", c->peer_port);
+        vsock_conn_reset(dev, c);
+        return;
+    }
+    dev->tx_bytes += len;
+    if (c->buf_head == c->buf_tail) {
+        struct iovec data[n];
+        int m = vsock_iov_slice(iov, n, off, len, data);
+        written = m > 0 ? writev(c->fd, data, m) : 0;
+        if (written < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            vsock_conn_reset(dev, c);
+            return;
+        }
+        if (written > 0) {
+            off += written;
+            len -= written;
+            c->fwd_cnt += written;
+        }
+    }
+    while (len > 0) {
+        pos = c->buf_head & (VSOCK_CONN_BUF_SIZE - 1);
+        chunk = MIN(len, VSOCK_CONN_BUF_SIZE - pos);
+        chunk = vsock_iov_to_buf(iov, n, off, c->buf + pos, chunk);
+        if (chunk == 0)
+            break;
+        c->buf_head += chunk;
+        off += chunk;
+        len -= chunk;
+    }
+    vsock_credit_update(dev, c, false);
+}
+
+static void vsock_connect(VsockDev *dev, struct virtio_vsock_hdr *hdr) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    VsockConn *c;
+    int fd;
+
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s_%u", dev->uds_path,
+             hdr->dst_port);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        log_info("vsock connection to %s refused, errno is %d", addr.sun_path,
+                 errno);
+        if (fd >= 0)
+            close(fd);
+        vsock_ctrl_queue(dev, hdr->dst_port, hdr->src_port,
+                         VIRTIO_VSOCK_OP_RST, 0);
+        return;
+    }
+    c = conn_new(dev, fd, hdr->dst_port, hdr->src_port,
+                 VSOCK_CONN_ESTABLISHED);
+    if (c == NULL) {
+        close(fd);
+        vsock_ctrl_queue(dev, hdr->dst_port, hdr->src_port,
+                         VIRTIO_VSOCK_OP_RST, 0);
+        return;
+    }
+    c->peer_buf_alloc = hdr->buf_alloc;
+    c->peer_fwd_cnt = hdr->fwd_cnt;
+    vsock_ctrl_queue(dev, c->local_port, c->peer_port,
+                     VIRTIO_VSOCK_OP_RESPONSE, 0);
+    log_info("vsock guest port %u connected to %s", c->peer_port,
+             addr.sun_path);
+}
+
+/// The guest accepted the connection of a host program.
+static void vsock_accepted(VsockDev *dev, VsockConn *c) {
+    char line[32];
+    int len = snprintf(line, sizeof(line), "OK %u\n", c->local_port);
+    if (write(c->fd, line, len) != len) {
+        vsock_conn_reset(dev, c);
+        return;
+    }
+    c->state = VSOCK_CONN_ESTABLISHED;
+}
+
+static void vsock_handle_packet(VsockDev *dev, struct virtio_vsock_hdr *hdr,
+                                struct iovec *iov, int n) {
+    VsockConn *c;
+
+    if (hdr->src_cid != dev->config.guest_cid ||
+        hdr->dst_cid != VSOCK_HOST_CID) {
+        log_warn("vsock packet from cid %llu to cid %llu dropped",
+                 (unsigned long long)hdr->src_cid,
+                 (unsigned long long)hdr->dst_cid);
+        return;
+    }
+    c = conn_find(dev, hdr->dst_port, hdr->src_port);
+    if (hdr->type != VIRTIO_VSOCK_TYPE_STREAM) {
+        if (hdr->op != VIRTIO_VSOCK_OP_RST)
+            vsock_ctrl_queue(dev, hdr->dst_port, hdr->src_port,
+                             VIRTIO_VSOCK_OP_RST, 0);
+        return;
+    }
+    if (c) {
+        c->peer_buf_alloc = hdr->buf_alloc;
+        c->peer_fwd_cnt = hdr->fwd_cnt;
+    }
+
+    switch (hdr->op) {
+    case VIRTIO_VSOCK_OP_REQUEST:
+        if (c)
+            vsock_conn_reset(dev, c);
+        else
+            vsock_connect(dev, hdr);
+        return;
+    case VIRTIO_VSOCK_OP_RST:
+        if (c)
+            conn_free(dev, c);
+        return;
+    default:
+        break;
+    }
+
+    // Everything else needs a connection
+    if (c == NULL) {
+        vsock_ctrl_queue(dev, hdr->dst_port, hdr->src_port,
+                         VIRTIO_VSOCK_OP_RST, 0);
+        return;
+    }
+    switch (hdr->op) {
+    case VIRTIO_VSOCK_OP_RESPONSE:
+        if (c->state == VSOCK_CONN_CONNECTING)
+            vsock_accepted(dev, c);
+        else
+            vsock_conn_reset(dev, c);
+        break;
+    case VIRTIO_VSOCK_OP_RW:
+        if (c->state == VSOCK_CONN_ESTABLISHED)
+            vsock_conn_tx(dev, c, iov, n, hdr->len);
+        else
+            vsock_conn_reset(dev, c);
+        break;
+    case VIRTIO_VSOCK_OP_SHUTDOWN:
+        c->peer_shutdown |=
+            hdr->flags &
+            (VIRTIO_VSOCK_SHUTDOWN_RCV | VIRTIO_VSOCK_SHUTDOWN_SEND);
+        vsock_conn_flush(dev, c);
+        break;
+    case VIRTIO_VSOCK_OP_CREDIT_UPDATE:
+        // The guest made room, the socket may be read again
+        break;
+    case VIRTIO_VSOCK_OP_CREDIT_REQUEST:
+        vsock_credit_update(dev, c, true);
+        break;
+    default:
+        log_warn("unsupported vsock op %d", hdr->op);
+        vsock_conn_reset(dev, c);
+        break;
+    }
+}
+
+static void virtq_tx_handle_one_request(VsockDev *dev, VirtQueue *vq) {
+    struct virtio_vsock_hdr hdr;
+    struct iovec *iov = NULL;
+    uint16_t idx;
+    int n;
+
+    n = process_descriptor_chain(vq, &idx, &iov, NULL, 0, false);
+    if (n < 1)
+        return;
+    if (vsock_iov_to_buf(iov, n, 0, &hdr, sizeof(hdr)) == sizeof(hdr))
+        vsock_handle_packet(dev, &hdr, iov, n);
+    else
+        log_error("short vsock packet");
+    update_used_ring(vq, idx, 0);
+    free(iov);
+}
+
+int virtio_vsock_txq_notify_handler(VirtIODevice *vdev, VirtQueue *vq) {
+    VsockDev *dev = vdev->dev;
+    pthread_mutex_lock(&dev->lock);
+    while (!virtqueue_is_empty(vq)) {
+        virtqueue_disable_notify(vq);
+        while (!virtqueue_is_empty(vq))
+            virtq_tx_handle_one_request(dev, vq);
+        virtqueue_enable_notify(vq);
+    }
+    // Replies and freed credit go out right away
+    vsock_rx(vdev);
+    pthread_mutex_unlock(&dev->lock);
+    virtio_inject_irq(vq);
+    vsock_wake(dev);
+    return 0;
+}
+
+int virtio_vsock_rxq_notify_handler(VirtIODevice *vdev, VirtQueue *vq) {
+    VsockDev *dev = vdev->dev;
+    (void)vq;
+    pthread_mutex_lock(&dev->lock);
+    dev->rx_ready = true;
+    vsock_rx(vdev);
+    pthread_mutex_unlock(&dev->lock);
+    vsock_wake(dev);
+    return 0;
+}
+
+int virtio_vsock_evq_notify_handler(VirtIODevice *vdev, VirtQueue *vq) {
+    // The buffers are kept for VIRTIO_VSOCK_EVENT_TRANSPORT_RESET, which is
+    // never needed since connections don't outlive a device reset.
+    (void)vdev;
+    (void)vq;
+    return 0;
+}
+
+/*********************************************************************
+    Host programs
+ */
+static void vsock_accept(VsockDev *dev) {
+    int fd = accept4(dev->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0)
+        return;
+    if (conn_new(dev, fd, dev->next_port, 0, VSOCK_CONN_HANDSHAKE) == NULL) {
+        close(fd);
+        return;
+    }
+    if (++dev->next_port == 0)
+        dev->next_port = VSOCK_HOST_PORT_BASE;
+}
+
+/// Read "CONNECT <port>\n". Data after the line is left in the socket for
+/// the guest.
+static void vsock_handshake(VsockDev *dev, VsockConn *c) {
+    char *start = c->line + c->line_len, *nl;
+    unsigned int port;
+    ssize_t len;
+
+    len = recv(c->fd, start, sizeof(c->line) - 1 - c->line_len, MSG_PEEK);
+    if (len <= 0) {
+        if (len == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+            conn_free(dev, c);
+        return;
+    }
+    nl = memchr(start, '\n', len);
+    if (nl)
+        len = nl - start + 1;
+    len = recv(c->fd, start, len, 0);
+    c->line_len += len;
+    if (nl == NULL) {
+        if (c->line_len == sizeof(c->line) - 1) {
+            log_warn("vsock host connection sent no CONNECT line");
+            conn_free(dev, c);
+        }
+        return;
+    }
+    c->line[c->line_len] = '\0';
+    if (sscanf(c->line, "CONNECT %u", &port) != 1) {
+        log_warn("vsock host connection sent a bad CONNECT line");
+        conn_free(dev, c);
+        return;
+    }
+    c->peer_port = port;
+    c->state = VSOCK_CONN_CONNECTING;
+    conn_hash_add(dev, c);
+    vsock_ctrl_queue(dev, c->local_port, c->peer_port, VIRTIO_VSOCK_OP_REQUEST,
+                     0);
+}
+
+/*********************************************************************
+    Io thread
+ */
+static void *vsock_io_thread(void *param) {
+    VirtIODevice *vdev = param;
+    VsockDev *dev = vdev->dev;
+    struct pollfd fds[VSOCK_MAX_POLLFDS];
+    VsockConn *conns[VSOCK_MAX_POLLFDS];
+    VsockConn *c;
+    eventfd_t cnt;
+    bool rx_room;
+    short events;
+    int nfds, i;
+
+    while (!dev->closing) {
+        pthread_mutex_lock(&dev->lock);
+        vsock_rx(vdev);
+        // Sockets are only read while the guest has buffers and credit, so
+        // the data waits in the kernel otherwise.
+        rx_room = dev->rx_ready &&
+                  !virtqueue_is_empty(&vdev->vqs[VSOCK_QUEUE_RX]);
+        nfds = 0;
+        fds[nfds].fd = dev->wake_fd;
+        fds[nfds].events = POLLIN;
+        conns[nfds++] = NULL;
+        if (dev->listen_fd >= 0) {
+            fds[nfds].fd = dev->listen_fd;
+            fds[nfds].events = POLLIN;
+            conns[nfds++] = NULL;
+        }
+        for (i = 0; i < dev->nconns; i++) {
+            c = dev->conns[i];
+            events = 0;
+            if (c->state == VSOCK_CONN_HANDSHAKE) {
+                events = POLLIN;
+            } else if (c->state == VSOCK_CONN_ESTABLISHED) {
+                if (rx_room && !c->readable && !c->eof &&
+                    conn_peer_credit(c) > 0)
+                    events |= POLLIN;
+                if (c->buf_head != c->buf_tail)
+                    events |= POLLOUT;
+            }
+            if (events == 0)
+                continue;
+            fds[nfds].fd = c->fd;
+            fds[nfds].events = events;
+            conns[nfds++] = c;
+        }
+        pthread_mutex_unlock(&dev->lock);
+
+        if (poll(fds, nfds, -1) < 0) {
+            if (errno != EINTR)
+                log_error("vsock poll failed, errno is %d", errno);
+            continue;
+        }
+
+        pthread_mutex_lock(&dev->lock);
+        for (i = 0; i < nfds; i++) {
+            c = conns[i];
+            if (fds[i].revents == 0)
+                continue;
+            if (fds[i].fd == dev->wake_fd) {
+                eventfd_read(dev->wake_fd, &cnt);
+                continue;
+            }
+            if (c == NULL) {
+                vsock_accept(dev);
+                continue;
+            }
+            // The tx handler may have closed it in the meantime
+            if (!conn_valid(dev, c) || c->fd != fds[i].fd)
+                continue;
+            if (c->state == VSOCK_CONN_HANDSHAKE) {
+                vsock_handshake(dev, c);
+                continue;
+            }
+            if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+                c->readable = true;
+            if (fds[i].revents & POLLOUT)
+                vsock_conn_flush(dev, c);
+        }
+        pthread_mutex_unlock(&dev->lock);
+    }
+    return NULL;
+}
+
+/*********************************************************************
+    Setup
+ */
+static int vsock_listen(VsockDev *dev) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    // uds_path is shorter than sun_path
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", dev->uds_path);
+    unlink(dev->uds_path);
+    dev->listen_fd =
+        socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (dev->listen_fd < 0 ||
+        bind(dev->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(dev->listen_fd, SOMAXCONN) < 0) {
+        log_error("Failed to listen on vsock socket %s, errno is %d",
+                  dev->uds_path, errno);
+        return -1;
+    }
+    log_info("vsock of cid %llu listening on %s",
+             (unsigned long long)dev->config.guest_cid, dev->uds_path);
+    return 0;
+}
+
+/// The driver set DRIVER_OK, or the device is reset.
+static void virtio_vsock_activate(VirtIODevice *vdev, bool activate) {
+    VsockDev *dev = vdev->dev;
+    if (activate)
+        return;
+    pthread_mutex_lock(&dev->lock);
+    while (dev->nconns > 0)
+        conn_free(dev, dev->conns[0]);
+    dev->ctrl_head = dev->ctrl_count = 0;
+    dev->rx_ready = false;
+    pthread_mutex_unlock(&dev->lock);
+}
+
+static void virtio_vsock_stats(VirtIODevice *vdev) {
+    VsockDev *dev = vdev->dev;
+    log_warn("zone %d virtio vsock cid %llu: %d connections open, %llu "
+             "total, %llu reset, tx %llu bytes, rx %llu bytes",
+             vdev->zone_id, (unsigned long long)dev->config.guest_cid,
+             dev->nconns, dev->connections, dev->resets, dev->tx_bytes,
+             dev->rx_bytes);
+}
+
+int virtio_vsock_init(VirtIODevice *vdev, VsockRequestedState *req) {
+    VsockDev *dev = vdev->dev;
+
+    vdev->virtio_close = virtio_vsock_close;
+    vdev->virtio_activate = virtio_vsock_activate;
+    vdev->virtio_stats = virtio_vsock_stats;
+    // CIDs 0 to 2 are reserved for the hypervisor and the host
+    if (req == NULL || req->guest_cid <= VSOCK_HOST_CID ||
+        req->guest_cid >= UINT32_MAX || req->uds_path[0] == '\0') {
+        log_error("vsock needs a guest_cid above 2 and a uds_path");
+        return -1;
+    }
+    dev->config.guest_cid = req->guest_cid;
+    if (snprintf(dev->uds_path, sizeof(dev->uds_path), "%s", req->uds_path) >=
+        (int)sizeof(dev->uds_path)) {
+        log_error("vsock uds_path %s is too long", req->uds_path);
+        return -1;
+    }
+    dev->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (dev->wake_fd < 0) {
+        log_error("Failed to create eventfd, errno is %d", errno);
+        return -1;
+    }
+    if (vsock_listen(dev) < 0)
+        return -1;
+    if (pthread_create(&dev->io_thread, NULL, vsock_io_thread, vdev)) {
+        log_error("Failed to create vsock io thread");
+        return -1;
+    }
+    return 0;
+}
+
+void virtio_vsock_close(VirtIODevice *vdev) {
+    VsockDev *dev = vdev->dev;
+    if (dev->io_thread) {
+        dev->closing = true;
+        vsock_wake(dev);
+        pthread_join(dev->io_thread, NULL);
+    }
+    while (dev->nconns > 0)
+        conn_free(dev, dev->conns[0]);
+    if (dev->listen_fd >= 0) {
+        close(dev->listen_fd);
+        unlink(dev->uds_path);
+    }
+    if (dev->wake_fd >= 0)
+        close(dev->wake_fd);
+    free(dev);
+    free(vdev->vqs);
+    free(vdev);
+}